@@ -25,22 +25,62 @@
 */
 
 #include "vtx.h"
+#include "vtx_ring.c"
+#include "vtx_loop.c"
+#include "vtx_meta.c"
 
+//  Ring size for sockets that get rings without asking for them
+#define VTX_AUTO_RING       1024
+
+
+//  Sockets are looked up by pointer in an open-addressed table, which
+//  threads can read without locking. A closed socket leaves a tombstone,
+//  which keeps lookups going and which a new socket can take over. The
+//  socket is stored last, so a reader that finds it sees the entry.
+#define VTX_HANDLES         (VTX_MAX_SOCKETS * 2)
+#define VTX_HANDLE_CLOSED   ((void *) 1)
+
+typedef struct {
+    void *socket;           //  0MQ socket, NULL if free, or tombstone
+    void *vtx_socket;       //  Its vtx_socket_t
+} vtx_handle_t;
+
+//  Each thread that sends in thread-safe mode has an owner, which its
+//  lanes point to. When the thread exits, the owner goes dead and another
+//  thread can take over its lanes. The owner is freed when neither the
+//  thread nor any lane holds it.
+typedef struct {
+    uint refs;              //  Thread and lanes holding the owner
+    Bool alive;             //  Thread is still running
+} vtx_owner_t;
+
+//  Thread-specific key for lane owners, created once per process
+static pthread_key_t s_owner_key;
+static pthread_once_t s_owner_once = PTHREAD_ONCE_INIT;
 
 //  ---------------------------------------------------------------------
 //  Structure of our class
-//  Not threadsafe, do not access from multiple threads
+//  Not threadsafe unless you call vtx_set_threadsafe
 
 struct _vtx_t {
     zctx_t *ctx;            //  Our CZMQ context
     zhash_t *drivers;       //  Registered drivers
     zhash_t *sockets;       //  All active sockets
+    vtx_handle_t *handles;  //  Socket lookup table, by socket pointer
+    zhash_t *requests;      //  Driver requests, indexed by token
+    uint token;             //  Last request token we issued
+    vtx_loop_t *loop;       //  Reactor for embedded drivers, if any
+    Bool threadsafe;        //  Many threads may use us?
+    pthread_mutex_t mutex;  //  Serialises control calls, if threadsafe
 };
 
 //  This structure instantiates a single VTX driver
 typedef struct {
+    vtx_t *vtx;             //  Parent VTX object
     char *protocol;         //  Registered protocol name
     void *commands;         //  Command pipe to driver
+    zlist_t *inflight;      //  Requests sent, in order, awaiting reply
+    Bool embedded;          //  Driver runs in our reactor
 } vtx_driver_t;
 
 //  This structure instantiates a single VTX socket
@@ -49,20 +89,76 @@ typedef struct {
     int type;               //  Desired socket type
     vtx_driver_t *driver;   //  VTX driver, if known
     char *address;          //  Bind/connect address
+    zlist_t *pending;       //  Commands waiting for a driver
+    vtx_ring_t *outring;    //  Messages to driver, if VTX_OPT_RING
+    vtx_ring_t *inring;     //  Messages from driver, if VTX_OPT_RING
+    uint ring_limit;        //  Size of rings
+    //  In thread-safe mode, each sending thread has its own lane, which
+    //  is a ring to the driver; the first lane is the outring
+    vtx_ring_t *lanes [VTX_MAX_LANES];
+    vtx_owner_t *lane_owner [VTX_MAX_LANES];
+    uint lane_count;        //  Lanes made so far
 } vtx_socket_t;
 
+//  This structure holds one request to a driver, from when we send it
+//  until the caller collects the reply with vtx_wait
+typedef struct {
+    char key [12];          //  Token, as hash key
+    vtx_driver_t *driver;   //  Driver that will reply
+    Bool done;              //  Driver has replied
+    int status;             //  Reply status, 0 = OK
+    char *value;            //  Reply value, for GETMETA
+    void *closing;          //  Socket to forget when driver replies
+} vtx_request_t;
+
 //  Driver & socket manipulation
+static int
+    s_driver_call_unlocked (vtx_t *self, void *socket, int command,
+                            char **endpoints, int count);
 static vtx_driver_t *
     s_driver_new (vtx_t *vtx, char *protocol,
                   zthread_attached_fn *driver_fn, Bool verbose);
 static void
     s_driver_destroy (void *argument);
+static int
+    s_driver_send (vtx_driver_t *driver, int command, int type,
+                   char *socket_key, zmsg_t **args_p);
+static vtx_request_t *
+    s_driver_recv (vtx_driver_t *driver);
+static int
+    s_request_collect (vtx_t *vtx, int token, char **value_p);
+static void
+    s_request_destroy (void *argument);
 static vtx_socket_t *
     s_socket_new (vtx_t *vtx, void *socket, int type, char *socket_key);
 static void
     s_socket_destroy (void *argument);
+static void
+    s_socket_forget (vtx_t *vtx, void *socket);
 static char *
     s_socket_key (void *self);
+static vtx_socket_t *
+    s_socket_lookup (vtx_t *vtx, void *socket);
+static uint
+    s_socket_hash (void *socket);
+static int
+    s_socket_rings (vtx_t *self, void *socket, int limit);
+static int
+    s_embedded_wait (vtx_t *self, void *socket, vtx_ring_t *ring);
+static vtx_ring_t *
+    s_socket_lane (vtx_t *self, void *socket, vtx_socket_t *vtx_socket);
+static vtx_owner_t *
+    s_owner_self (void);
+static void
+    s_owner_key_create (void);
+static void
+    s_owner_exit (void *argument);
+static void
+    s_owner_release (vtx_owner_t *owner);
+static void
+    s_lock (vtx_t *self);
+static void
+    s_unlock (vtx_t *self);
 
 
 //  ---------------------------------------------------------------------
@@ -78,6 +174,9 @@ vtx_new (zctx_t *ctx)
     self->ctx = ctx;
     self->drivers = zhash_new ();
     self->sockets = zhash_new ();
+    self->requests = zhash_new ();
+    self->handles = (vtx_handle_t *) zmalloc (
+        VTX_HANDLES * sizeof (vtx_handle_t));
     return self;
 }
 
@@ -92,7 +191,12 @@ vtx_destroy (vtx_t **self_p)
     if (*self_p) {
         vtx_t *self = *self_p;
         zhash_destroy (&self->drivers);
+        zhash_destroy (&self->requests);
         zhash_destroy (&self->sockets);
+        vtx_loop_destroy (&self->loop);
+        free (self->handles);
+        if (self->threadsafe)
+            pthread_mutex_destroy (&self->mutex);
         free (self);
         *self_p = NULL;
     }
@@ -101,7 +205,8 @@ vtx_destroy (vtx_t **self_p)
 
 //  ---------------------------------------------------------------------
 //  Register a transport driver
-//  Creates a driver thread and registers it in the driver hash table
+//  Creates a driver thread, or an embedded driver, and registers it in
+//  the driver hash table
 
 int
 vtx_register (vtx_t *self, char *scheme, zthread_attached_fn *driver_fn, Bool verbose)
@@ -112,6 +217,7 @@ vtx_register (vtx_t *self, char *scheme, zthread_attached_fn *driver_fn, Bool ve
 
     //  Driver scheme cannot already exist
     int rc = 0;
+    s_lock (self);
     vtx_driver_t *driver = (vtx_driver_t *) zhash_lookup (self->drivers, scheme);
     if (!driver)
         driver = s_driver_new (self, scheme, driver_fn, verbose);
@@ -119,10 +225,107 @@ vtx_register (vtx_t *self, char *scheme, zthread_attached_fn *driver_fn, Bool ve
         rc = -1;
         errno = ENOTUNIQ;
     }
+    s_unlock (self);
     return rc;
 }
 
 
+//  ---------------------------------------------------------------------
+//  Run drivers embedded in the calling thread, rather than each in its
+//  own thread. Messages then go straight from the caller to the network,
+//  with no thread switch. The caller must run the drivers with
+//  vtx_process, unless it is blocked in a VTX call, and must use vtx_send
+//  and vtx_recv for all messages. Call this before registering drivers;
+//  returns -1 if drivers are already registered.
+
+int
+vtx_set_embedded (vtx_t *self, Bool embedded)
+{
+    assert (self);
+    if (zhash_size (self->drivers) || (embedded && self->threadsafe)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (embedded && !self->loop)
+        self->loop = vtx_loop_new ();
+    else
+    if (!embedded)
+        vtx_loop_destroy (&self->loop);
+    return 0;
+}
+
+
+//  ---------------------------------------------------------------------
+//  Let many threads use this VTX instance at once. Control calls are
+//  serialised by a lock. Up to VTX_MAX_LANES threads can send on the
+//  same socket; each thread gets its own lane to the driver, so senders
+//  don't contend, and the driver takes from all lanes in turn. Only one thread
+//  may receive from a socket. Sockets always use rings in this mode.
+//  Call this before creating sockets; returns -1 if sockets exist, or if
+//  drivers are embedded, since those run in one thread.
+
+int
+vtx_set_threadsafe (vtx_t *self, Bool threadsafe)
+{
+    assert (self);
+    if (zhash_size (self->sockets) || (threadsafe && self->loop)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (threadsafe && !self->threadsafe) {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init (&attr);
+        pthread_mutexattr_settype (&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init (&self->mutex, &attr);
+        pthread_mutexattr_destroy (&attr);
+    }
+    else
+    if (!threadsafe && self->threadsafe)
+        pthread_mutex_destroy (&self->mutex);
+    self->threadsafe = threadsafe;
+    return 0;
+}
+
+
+//  ---------------------------------------------------------------------
+//  Run embedded drivers for one pass, waiting up to timeout msecs for
+//  activity, or forever if timeout is -1. Returns 0 if OK, -1 if we
+//  were interrupted.
+
+int
+vtx_process (vtx_t *self, int timeout)
+{
+    assert (self);
+    if (!self->loop)
+        return 0;
+    return vtx_loop_process (self->loop, timeout);
+}
+
+
+//  ---------------------------------------------------------------------
+//  Return the items that embedded drivers wait on, so the caller can
+//  poll them in its own event loop, together with its own items. Sets
+//  the poll timeout, in msecs, until the drivers next need to run, or
+//  -1 if they only need to run on activity. When any item is ready, or
+//  the timeout expires, the caller runs vtx_process with timeout 0. The
+//  items change as drivers add and remove peerings, so the caller must
+//  fetch them again before each poll.
+
+zmq_pollitem_t *
+vtx_poll (vtx_t *self, uint *size_p, int *timeout_p)
+{
+    assert (self);
+    assert (size_p);
+    if (!self->loop) {
+        *size_p = 0;
+        if (timeout_p)
+            *timeout_p = -1;
+        return NULL;
+    }
+    return vtx_loop_pollset (self->loop, size_p, timeout_p);
+}
+
+
 //  ---------------------------------------------------------------------
 //  Create a new socket. At this stage we're not yet talking to a driver,
 //  so we bind the socket to our VTX endpoint and store the emulated
@@ -134,7 +337,12 @@ vtx_socket (vtx_t *self, int type)
     //  Create socket frontend for caller and bind it
     assert (self);
 
-    void *socket = zsocket_new (self->ctx, ZMQ_DEALER);
+    s_lock (self);
+    void *socket = NULL;
+    if (zhash_size (self->sockets) < VTX_MAX_SOCKETS)
+        socket = zsocket_new (self->ctx, ZMQ_DEALER);
+    else
+        errno = EMFILE;
     //  Socket may be null if we're shutting down 0MQ
     if (socket) {
         //  Bind socket to our side of pipe
@@ -144,77 +352,123 @@ vtx_socket (vtx_t *self, int type)
         s_socket_new (self, socket, type, socket_key);
         free (socket_key);
     }
+    s_unlock (self);
     return socket;
 }
 
 
-//  Send a command to a driver. We send four-frame request to
-//  driver command pipe:
-//
-//  [command]   BIND, CONNECT, or CLOSE
-//  [socktype]  0MQ type for the socket, as string
-//  [vtxname]   VTX name for the socket
-//  [address]   Address for command
-//
-//  Reply is one frame with numeric status code, 0 = OK
+//  Resolve the driver for a socket from its endpoints, if any, and send
+//  the driver a command, with the addresses as arguments. All endpoints
+//  must use the same protocol. Options and subscriptions set before the
+//  socket had a driver are sent first, so they're in force before any
+//  bind or connect. Returns request token, or -1 if the command could
+//  not be sent.
 
 static int
-s_driver_call (vtx_t *self, void *socket, char *command, char *endpoint)
+s_driver_call (vtx_t *self, void *socket, int command,
+               char **endpoints, int count)
 {
-    char *socket_key = s_socket_key (socket);
-    vtx_socket_t *vtx_socket
-        = (vtx_socket_t *) zhash_lookup (self->sockets, socket_key);
+    s_lock (self);
+    int rc = s_driver_call_unlocked (self, socket, command, endpoints, count);
+    s_unlock (self);
+    return rc;
+}
+
+//  Does the work of s_driver_call, with the lock held
+static int
+s_driver_call_unlocked (vtx_t *self, void *socket, int command,
+                        char **endpoints, int count)
+{
+    vtx_socket_t *vtx_socket = s_socket_lookup (self, socket);
 
     //  VTX socket must exist
     if (!vtx_socket) {
         errno = EINVAL;
         return -1;
     }
-    //  Resolve endpoint if provided
-    char *protocol = NULL;
-    char *address = "";
-    if (endpoint) {
-        //  Take a copy because we modify this string
-        protocol = strdup (endpoint);
-        char *scheme_end = strstr (protocol, "://");
+    //  Resolve endpoints if provided
+    zmsg_t *args = zmsg_new ();
+    vtx_driver_t *driver = NULL;
+    int index;
+    for (index = 0; index < count; index++) {
+        char *scheme_end = strstr (endpoints [index], "://");
         if (!scheme_end) {
+            zmsg_destroy (&args);
             errno = EINVAL;
             return -1;
         }
-        //  Split address from protocol
-        *scheme_end = 0;
-        address = scheme_end + 3;
-
-        //  Look up driver by protocol
-        vtx_driver_t *driver =
-            (vtx_driver_t *) zhash_lookup (self->drivers, protocol);
+        //  Look up driver by protocol, the first time
+        size_t scheme_size = scheme_end - endpoints [index];
         if (!driver) {
-            free (protocol);
-            errno = ENOPROTOOPT;
-            return -1;
+            char protocol [32];
+            if (scheme_size >= sizeof (protocol))
+                scheme_size = sizeof (protocol) - 1;
+            memcpy (protocol, endpoints [index], scheme_size);
+            protocol [scheme_size] = 0;
+            driver = (vtx_driver_t *) zhash_lookup (self->drivers, protocol);
+            if (!driver) {
+                zmsg_destroy (&args);
+                errno = ENOPROTOOPT;
+                return -1;
+            }
         }
-        //  Don't allow multiple drivers per socket
-        if (vtx_socket->driver && vtx_socket->driver != driver) {
+        //  Don't allow mixed protocols, or multiple drivers per socket
+        if (strlen (driver->protocol) != scheme_size
+        ||  memcmp (driver->protocol, endpoints [index], scheme_size)
+        ||  (vtx_socket->driver && vtx_socket->driver != driver)) {
+            zmsg_destroy (&args);
             errno = ENOTSUP;
             return -1;
         }
+        zmsg_addstr (args, "%s", scheme_end + 3);
+    }
+    //  Sockets of embedded drivers always talk to them over rings, which
+    //  the drivers read from without a thread switch; so do all sockets
+    //  in thread-safe mode, which send on per-thread lanes
+    if (driver && (driver->embedded || self->threadsafe)
+    &&  !vtx_socket->driver && !vtx_socket->outring)
+        s_socket_rings (self, socket, VTX_AUTO_RING);
+    if (driver)
         vtx_socket->driver = driver;
+
+    //  We can only talk to a driver once we know which one it is. A
+    //  socket that never had one has nothing to close in a driver.
+    if (!vtx_socket->driver) {
+        zmsg_destroy (&args);
+        if (command == VTX_CMD_CLOSE)
+            s_socket_forget (self, socket);
+        errno = ENOTCONN;
+        return -1;
     }
-    zmsg_t *request = zmsg_new ();
-    zmsg_addstr (request, command);
-    zmsg_addstr (request, "%d", vtx_socket->type);
-    zmsg_addstr (request, "%s", socket_key);
-    zmsg_addstr (request, address);
-    zmsg_send (&request, vtx_socket->driver->commands);
-    free (socket_key);
+    char *socket_key = s_socket_key (socket);
 
-    char *reply = zstr_recv (vtx_socket->driver->commands);
+    //  Flush any commands that were waiting for the driver
     int rc = 0;
-    if (reply) {
-        rc = atoi (reply);
-        free (reply);
+    while (rc == 0 && zlist_size (vtx_socket->pending)) {
+        zmsg_t *pending = (zmsg_t *) zlist_pop (vtx_socket->pending);
+        zframe_t *frame = zmsg_pop (pending);
+        int token = s_driver_send (vtx_socket->driver, *zframe_data (frame),
+                                   vtx_socket->type, socket_key, &pending);
+        zframe_destroy (&frame);
+        if (s_request_collect (self, token, NULL)) {
+            errno = EINVAL;
+            rc = -1;
+        }
+    }
+    if (rc == 0)
+        rc = s_driver_send (vtx_socket->driver, command, vtx_socket->type,
+                            socket_key, &args);
+    //  We forget a closed socket only once the driver is done with it,
+    //  since the driver reads from the socket's rings until then
+    if (rc > 0 && command == VTX_CMD_CLOSE) {
+        char key [12];
+        snprintf (key, sizeof (key), "%x", (uint) rc);
+        vtx_request_t *request = (vtx_request_t *)
+            zhash_lookup (self->requests, key);
+        request->closing = socket;
     }
-    free (protocol);
+    zmsg_destroy (&args);
+    free (socket_key);
     return rc;
 }
 
@@ -236,7 +490,9 @@ vtx_bind (vtx_t *self, void *socket, const char *format, ...)
     vsnprintf (endpoint, 256, format, argptr);
     va_end (argptr);
 
-    return s_driver_call (self, socket, "BIND", endpoint);
+    char *endpoints [] = { endpoint };
+    int token = s_driver_call (self, socket, VTX_CMD_BIND, endpoints, 1);
+    return token < 0? token: vtx_wait (self, token);
 }
 
 
@@ -257,7 +513,448 @@ vtx_connect (vtx_t *self, void *socket, const char *format, ...)
     vsnprintf (endpoint, 256, format, argptr);
     va_end (argptr);
 
-    return s_driver_call (self, socket, "CONNECT", endpoint);
+    char *endpoints [] = { endpoint };
+    int token = s_driver_call (self, socket, VTX_CMD_CONNECT, endpoints, 1);
+    return token < 0? token: vtx_wait (self, token);
+}
+
+
+//  ---------------------------------------------------------------------
+//  Bind socket without waiting for the driver. Returns a token that the
+//  caller passes to vtx_wait to get the result, or -1 if the request
+//  could not be sent.
+
+int
+vtx_bind_async (vtx_t *self, void *socket, const char *format, ...)
+{
+    assert (self);
+    assert (socket);
+    assert (format);
+
+    char endpoint [256];
+    va_list argptr;
+    va_start (argptr, format);
+    vsnprintf (endpoint, 256, format, argptr);
+    va_end (argptr);
+
+    char *endpoints [] = { endpoint };
+    return s_driver_call (self, socket, VTX_CMD_BIND, endpoints, 1);
+}
+
+
+//  ---------------------------------------------------------------------
+//  Connect socket without waiting for the driver. Returns a token that
+//  the caller passes to vtx_wait to get the result, or -1 if the request
+//  could not be sent.
+
+int
+vtx_connect_async (vtx_t *self, void *socket, const char *format, ...)
+{
+    assert (self);
+    assert (socket);
+    assert (format);
+
+    char endpoint [256];
+    va_list argptr;
+    va_start (argptr, format);
+    vsnprintf (endpoint, 256, format, argptr);
+    va_end (argptr);
+
+    char *endpoints [] = { endpoint };
+    return s_driver_call (self, socket, VTX_CMD_CONNECT, endpoints, 1);
+}
+
+
+//  ---------------------------------------------------------------------
+//  Bind socket to a set of endpoints in one request to the driver. The
+//  endpoints must all use the same protocol. Returns a token for
+//  vtx_wait, whose result is the number of endpoints that failed.
+
+int
+vtx_bind_bulk (vtx_t *self, void *socket, char **endpoints, int count)
+{
+    assert (self);
+    assert (socket);
+    assert (endpoints);
+    return s_driver_call (self, socket, VTX_CMD_BIND, endpoints, count);
+}
+
+
+//  ---------------------------------------------------------------------
+//  Connect socket to a set of endpoints in one request to the driver.
+//  The endpoints must all use the same protocol. Returns a token for
+//  vtx_wait, whose result is the number of endpoints that failed.
+
+int
+vtx_connect_bulk (vtx_t *self, void *socket, char **endpoints, int count)
+{
+    assert (self);
+    assert (socket);
+    assert (endpoints);
+    return s_driver_call (self, socket, VTX_CMD_CONNECT, endpoints, count);
+}
+
+
+//  ---------------------------------------------------------------------
+//  Wait for the driver to complete an asynchronous request, and return
+//  its result, 0 if OK. Each token can be waited for once. Returns -1
+//  if the token is unknown.
+
+int
+vtx_wait (vtx_t *self, int token)
+{
+    assert (self);
+    return s_request_collect (self, token, NULL);
+}
+
+
+//  Send a command to the socket's driver and wait for the reply, or if
+//  the socket is not yet bound or connected, hold the command until it
+//  is. Takes ownership of the arguments.
+
+static int
+s_driver_post (vtx_t *self, void *socket, int command, zmsg_t *args)
+{
+    s_lock (self);
+    vtx_socket_t *vtx_socket = s_socket_lookup (self, socket);
+    int rc = 0;
+    if (vtx_socket) {
+        if (vtx_socket->driver) {
+            char *socket_key = s_socket_key (socket);
+            int token = s_driver_send (vtx_socket->driver, command,
+                                       vtx_socket->type, socket_key, &args);
+            rc = s_request_collect (self, token, NULL);
+            free (socket_key);
+        }
+        else {
+            byte command_byte = (byte) command;
+            zmsg_pushmem (args, &command_byte, 1);
+            zlist_append (vtx_socket->pending, args);
+            args = NULL;
+        }
+    }
+    else {
+        errno = EINVAL;
+        rc = -1;
+    }
+    zmsg_destroy (&args);
+    s_unlock (self);
+    return rc;
+}
+
+
+//  ---------------------------------------------------------------------
+//  Set socket option. If the socket is not yet bound or connected, we
+//  hold the option and pass it to the driver at the first bind/connect.
+//  Returns 0 if OK, or non-zero if the driver rejected the option.
+
+int
+vtx_setopt (vtx_t *self, void *socket, int option, int value)
+{
+    assert (self);
+    assert (socket);
+
+    if (option == VTX_OPT_RING)
+        return s_socket_rings (self, socket, value);
+
+    byte setting [8];
+    setting [0] = (byte) (option >> 24);
+    setting [1] = (byte) (option >> 16);
+    setting [2] = (byte) (option >> 8);
+    setting [3] = (byte) (option);
+    setting [4] = (byte) (value >> 24);
+    setting [5] = (byte) (value >> 16);
+    setting [6] = (byte) (value >> 8);
+    setting [7] = (byte) (value);
+    zmsg_t *args = zmsg_new ();
+    zmsg_addmem (args, setting, sizeof (setting));
+    return s_driver_post (self, socket, VTX_CMD_SETOPT, args);
+}
+
+
+//  ---------------------------------------------------------------------
+//  Get socket option from the socket's driver, so the socket must be
+//  bound or connected. Returns 0 if OK, or non-zero if the socket has
+//  no driver yet or the driver doesn't know the option.
+
+int
+vtx_getopt (vtx_t *self, void *socket, int option, int *value_p)
+{
+    assert (self);
+    assert (socket);
+    assert (value_p);
+
+    s_lock (self);
+    vtx_socket_t *vtx_socket = s_socket_lookup (self, socket);
+    int rc = -1;
+    if (!vtx_socket)
+        errno = EINVAL;
+    else
+    if (option == VTX_OPT_RING) {
+        *value_p = vtx_socket->ring_limit;
+        rc = 0;
+    }
+    else
+    if (vtx_socket->driver) {
+        byte setting [4];
+        setting [0] = (byte) (option >> 24);
+        setting [1] = (byte) (option >> 16);
+        setting [2] = (byte) (option >> 8);
+        setting [3] = (byte) (option);
+        zmsg_t *args = zmsg_new ();
+        zmsg_addmem (args, setting, sizeof (setting));
+        char *socket_key = s_socket_key (socket);
+        int token = s_driver_send (vtx_socket->driver, VTX_CMD_GETOPT,
+                                   vtx_socket->type, socket_key, &args);
+        free (socket_key);
+
+        char *value = NULL;
+        rc = s_request_collect (self, token, &value);
+        if (rc == 0 && value)
+            *value_p = atoi (value);
+        free (value);
+    }
+    else
+        errno = ENOTCONN;
+    s_unlock (self);
+    return rc;
+}
+
+
+//  Give socket a pair of rings to its driver, holding up to limit messages
+//  each way. Must be done before the socket is bound or connected.
+
+static int
+s_socket_rings (vtx_t *self, void *socket, int limit)
+{
+    s_lock (self);
+    vtx_socket_t *vtx_socket = s_socket_lookup (self, socket);
+    int rc = 0;
+    if (!vtx_socket || vtx_socket->driver || vtx_socket->outring
+    ||  limit < 0) {
+        errno = EINVAL;
+        rc = -1;
+    }
+    else
+    if (limit > 0) {            //  Else keep using the socket
+        vtx_socket->outring = vtx_ring_new (limit);
+        vtx_socket->inring = vtx_ring_new (limit);
+        vtx_socket->ring_limit = limit;
+        vtx_ring_t *rings [2] = { vtx_socket->outring, vtx_socket->inring };
+        zmsg_t *args = zmsg_new ();
+        zmsg_addmem (args, rings, sizeof (rings));
+        rc = s_driver_post (self, socket, VTX_CMD_RINGS, args);
+    }
+    s_unlock (self);
+    return rc;
+}
+
+
+//  ---------------------------------------------------------------------
+//  Send message to socket, and destroy message after sending. If the
+//  socket has rings, we pass the message pointer to the driver without
+//  copying; if the ring is full we return -1 with errno set to EAGAIN,
+//  and the caller still owns the message.
+
+int
+vtx_send (vtx_t *self, void *socket, zmsg_t **msg_p)
+{
+    assert (self);
+    assert (socket);
+    assert (msg_p);
+
+    vtx_socket_t *vtx_socket = s_socket_lookup (self, socket);
+    if (vtx_socket && vtx_socket->outring) {
+        Bool embedded = vtx_socket->driver && vtx_socket->driver->embedded;
+        vtx_ring_t *ring = s_socket_lane (self, socket, vtx_socket);
+        if (!ring)
+            return -1;
+        if (vtx_ring_push (ring, *msg_p)) {
+            //  An embedded driver can empty the ring right now
+            if (!embedded
+            ||  vtx_loop_process (self->loop, 0)
+            ||  vtx_ring_push (ring, *msg_p)) {
+                errno = EAGAIN;
+                return -1;
+            }
+        }
+        *msg_p = NULL;
+        //  Let an embedded driver send the message at once
+        if (embedded)
+            vtx_loop_process (self->loop, 0);
+        return 0;
+    }
+    if (self->threadsafe) {
+        errno = ENOTCONN;       //  No rings until bound or connected
+        return -1;
+    }
+    return zmsg_send (msg_p, socket);
+}
+
+
+//  ---------------------------------------------------------------------
+//  Receive message from socket, returns NULL if interrupted. If the
+//  socket has rings, we wait on the driver's ring and take the message
+//  pointer off it.
+
+zmsg_t *
+vtx_recv (vtx_t *self, void *socket)
+{
+    assert (self);
+    assert (socket);
+
+    vtx_socket_t *vtx_socket = s_socket_lookup (self, socket);
+    if (vtx_socket && vtx_socket->inring) {
+        zmsg_t *msg = vtx_ring_pop (vtx_socket->inring);
+        if (vtx_socket->driver && vtx_socket->driver->embedded) {
+            //  Run embedded driver until it delivers a message
+            while (!msg && s_embedded_wait (self, NULL, vtx_socket->inring) == 0)
+                msg = vtx_ring_pop (vtx_socket->inring);
+        }
+        else
+            while (!msg && vtx_ring_wait (vtx_socket->inring, -1) == 0)
+                msg = vtx_ring_pop (vtx_socket->inring);
+        return msg;
+    }
+    return zmsg_recv (socket);
+}
+
+
+//  ---------------------------------------------------------------------
+//  Receive message from socket if one is ready, else return NULL at once.
+//  Runs embedded drivers for one pass if the socket has no message yet.
+
+zmsg_t *
+vtx_recv_nowait (vtx_t *self, void *socket)
+{
+    assert (self);
+    assert (socket);
+
+    vtx_socket_t *vtx_socket = s_socket_lookup (self, socket);
+    if (vtx_socket && vtx_socket->inring) {
+        zmsg_t *msg = vtx_ring_pop (vtx_socket->inring);
+        if (!msg && vtx_socket->driver && vtx_socket->driver->embedded
+        &&  vtx_loop_process (self->loop, 0) == 0)
+            msg = vtx_ring_pop (vtx_socket->inring);
+        return msg;
+    }
+    zmq_pollitem_t item = { socket, 0, ZMQ_POLLIN };
+    if (zmq_poll (&item, 1, 0) == 1)
+        return zmsg_recv (socket);
+    return NULL;
+}
+
+
+//  ---------------------------------------------------------------------
+//  Send array of messages to socket, in order, and destroy each message
+//  after sending. Returns the number of messages sent, which may be less
+//  than count if the socket's ring fills up; the caller still owns the
+//  rest. On a ring, we pass the whole batch to the driver at once.
+
+int
+vtx_send_batch (vtx_t *self, void *socket, zmsg_t **msgs, int count)
+{
+    assert (self);
+    assert (socket);
+    assert (msgs);
+
+    int sent = 0;
+    vtx_socket_t *vtx_socket = s_socket_lookup (self, socket);
+    if (vtx_socket && vtx_socket->outring) {
+        Bool embedded = vtx_socket->driver && vtx_socket->driver->embedded;
+        vtx_ring_t *ring = s_socket_lane (self, socket, vtx_socket);
+        if (!ring)
+            return 0;
+        sent = vtx_ring_push_batch (ring, msgs, count);
+        //  An embedded driver can empty the ring right now
+        if (sent < count && embedded
+        &&  vtx_loop_process (self->loop, 0) == 0)
+            sent += vtx_ring_push_batch (ring, msgs + sent, count - sent);
+        memset (msgs, 0, sent * sizeof (zmsg_t *));
+        //  Let an embedded driver send the messages at once
+        if (embedded)
+            vtx_loop_process (self->loop, 0);
+    }
+    else
+    if (self->threadsafe) {
+        errno = ENOTCONN;       //  No rings until bound or connected
+        return 0;
+    }
+    else
+        while (sent < count && zmsg_send (&msgs [sent], socket) == 0)
+            sent++;
+    if (sent < count)
+        errno = EAGAIN;
+    return sent;
+}
+
+
+//  ---------------------------------------------------------------------
+//  Receive up to limit messages from socket into array. Waits for at
+//  least one message, then takes whatever else is waiting. Returns the
+//  number of messages received, or -1 if interrupted.
+
+int
+vtx_recv_batch (vtx_t *self, void *socket, zmsg_t **msgs, int limit)
+{
+    assert (self);
+    assert (socket);
+    assert (msgs);
+    assert (limit > 0);
+
+    vtx_socket_t *vtx_socket = s_socket_lookup (self, socket);
+    if (vtx_socket && vtx_socket->inring) {
+        int recd = vtx_ring_pop_batch (vtx_socket->inring, msgs, limit);
+        if (recd == 0) {
+            //  Wait on ring the same way vtx_recv does
+            msgs [0] = vtx_recv (self, socket);
+            if (!msgs [0])
+                return -1;
+            recd = 1 + vtx_ring_pop_batch (vtx_socket->inring,
+                                           msgs + 1, limit - 1);
+        }
+        return recd;
+    }
+    msgs [0] = zmsg_recv (socket);
+    if (!msgs [0])
+        return -1;
+    int recd = 1;
+    while (recd < limit && (msgs [recd] = vtx_recv_nowait (self, socket)))
+        recd++;
+    return recd;
+}
+
+
+//  ---------------------------------------------------------------------
+//  Subscribe SUB socket to messages whose first frame starts with the
+//  specified topic; an empty topic subscribes to all messages. SUB
+//  sockets receive nothing until they subscribe. Subscriptions are
+//  sent upstream and filtered at the publisher.
+
+int
+vtx_subscribe (vtx_t *self, void *socket, const char *topic)
+{
+    assert (self);
+    assert (socket);
+    assert (topic);
+    zmsg_t *args = zmsg_new ();
+    zmsg_addstr (args, "%s", topic);
+    return s_driver_post (self, socket, VTX_CMD_SUBSCRIBE, args);
+}
+
+
+//  ---------------------------------------------------------------------
+//  Remove a subscription made by vtx_subscribe
+
+int
+vtx_unsubscribe (vtx_t *self, void *socket, const char *topic)
+{
+    assert (self);
+    assert (socket);
+    assert (topic);
+    zmsg_t *args = zmsg_new ();
+    zmsg_addstr (args, "%s", topic);
+    return s_driver_post (self, socket, VTX_CMD_UNSUBSCRIBE, args);
 }
 
 
@@ -269,25 +966,47 @@ char *
 vtx_getmeta (vtx_t *self, void *socket, const char *metaname)
 {
     char *socket_key = s_socket_key (socket);
-    vtx_socket_t *vtx_socket = (vtx_socket_t *)
-        zhash_lookup (self->sockets, socket_key);
+    vtx_socket_t *vtx_socket = s_socket_lookup (self, socket);
 
     assert (vtx_socket);
     assert (vtx_socket->driver);
 
-    zmsg_t *request = zmsg_new ();
-    zmsg_addstr (request, "GETMETA");
-    zmsg_addstr (request, "0");
-    zmsg_addstr (request, "%s", socket_key);
-    zmsg_addstr (request, metaname);
-    zmsg_send (&request, vtx_socket->driver->commands);
+    zmsg_t *args = zmsg_new ();
+    zmsg_addstr (args, "%s", metaname);
+    s_lock (self);
+    int token = s_driver_send (vtx_socket->driver, VTX_CMD_GETMETA, 0,
+                               socket_key, &args);
     free (socket_key);
 
-    char *reply = zstr_recv (vtx_socket->driver->commands);
+    char *reply = NULL;
+    s_request_collect (self, token, &reply);
+    s_unlock (self);
     return reply;
 }
 
 
+//  ---------------------------------------------------------------------
+//  Take metadata frame off a message received with VTX_OPT_METADATA, and
+//  return the sender address, which the caller should free, and the time
+//  we received the message. Either pointer may be null. Returns -1 if
+//  the message does not start with a metadata frame.
+
+int
+vtx_popmeta (zmsg_t *msg, char **sender_p, int64_t *time_p)
+{
+    assert (msg);
+    zframe_t *frame = zmsg_first (msg);
+    if (!frame
+    ||  vtx_meta_decode (zframe_data (frame), zframe_size (frame),
+                         sender_p, time_p))
+        return -1;
+
+    frame = zmsg_pop (msg);
+    zframe_destroy (&frame);
+    return 0;
+}
+
+
 //  ---------------------------------------------------------------------
 //  Close a socket
 
@@ -296,8 +1015,21 @@ vtx_close (vtx_t *self, void *socket)
 {
     assert (self);
     assert (socket);
-    return s_driver_call (self, socket, "CLOSE", NULL);
-    zsocket_destroy (self->ctx, socket);
+    int token = s_driver_call (self, socket, VTX_CMD_CLOSE, NULL, 0);
+    return token < 0? token: vtx_wait (self, token);
+}
+
+
+//  ---------------------------------------------------------------------
+//  Close a socket without waiting for the driver. Returns a token for
+//  vtx_wait, or -1 if the request could not be sent.
+
+int
+vtx_close_async (vtx_t *self, void *socket)
+{
+    assert (self);
+    assert (socket);
+    return s_driver_call (self, socket, VTX_CMD_CLOSE, NULL, 0);
 }
 
 
@@ -308,27 +1040,185 @@ static vtx_driver_t *
 s_driver_new (vtx_t *vtx, char *protocol, zthread_attached_fn *driver_fn, Bool verbose)
 {
     vtx_driver_t *self = (vtx_driver_t *) zmalloc (sizeof (vtx_driver_t));
+    self->vtx = vtx;
     self->protocol = strdup (protocol);
-    self->commands = zthread_fork (vtx->ctx, driver_fn, NULL);
-    zstr_send (self->commands, verbose? "1": "0");
+    self->inflight = zlist_new ();
+    if (vtx->loop) {
+        //  Embedded driver talks to us over a pipe in the same thread,
+        //  and adds itself to our reactor
+        self->embedded = TRUE;
+        self->commands = zsocket_new (vtx->ctx, ZMQ_PAIR);
+        zsocket_bind (self->commands, "inproc://vtx-driver-%p", self);
+        void *pipe = zsocket_new (vtx->ctx, ZMQ_PAIR);
+        zsocket_connect (pipe, "inproc://vtx-driver-%p", self);
+        zstr_send (self->commands, verbose? "1": "0");
+        driver_fn (vtx->loop, vtx->ctx, pipe);
+    }
+    else {
+        self->commands = zthread_fork (vtx->ctx, driver_fn, NULL);
+        zstr_send (self->commands, verbose? "1": "0");
+    }
     zhash_insert (vtx->drivers, protocol, self);
     zhash_freefn (vtx->drivers, protocol, s_driver_destroy);
     return self;
 }
 
-//  Destroy driver object, when driver is removed from vtx->drivers
+//  Destroy driver object, when driver is removed from vtx->drivers. The
+//  driver replies to all requests still in flight before it shuts down.
 static void
 s_driver_destroy (void *argument)
 {
     vtx_driver_t *self = (vtx_driver_t *) argument;
+    int token = s_driver_send (self, VTX_CMD_SHUTDOWN, 0, NULL, NULL);
+    s_request_collect (self->vtx, token, NULL);
+    if (self->embedded)
+        zsocket_destroy (self->vtx->ctx, self->commands);
+    zlist_destroy (&self->inflight);
+    free (self->protocol);
+    free (self);
+}
+
+//  Send a request to a driver, and return its token. The request is a
+//  binary header, the socket key if any, and the arguments, which we
+//  take ownership of. We don't wait for the reply.
+
+static int
+s_driver_send (vtx_driver_t *self, int command, int type,
+               char *socket_key, zmsg_t **args_p)
+{
+    vtx_t *vtx = self->vtx;
+    if (++vtx->token > 0x7FFFFFFF)
+        vtx->token = 1;
+    uint token = vtx->token;
+
+    byte header [VTX_CMD_HEADER];
+    header [0] = (byte) command;
+    header [1] = (byte) type;
+    header [2] = 0;
+    header [3] = 0;
+    header [4] = (byte) (token >> 24);
+    header [5] = (byte) (token >> 16);
+    header [6] = (byte) (token >> 8);
+    header [7] = (byte) (token);
+
     zmsg_t *request = zmsg_new ();
-    zmsg_addstr (request, "SHUTDOWN");
+    zmsg_addmem (request, header, VTX_CMD_HEADER);
+    if (socket_key) {
+        zmsg_addstr (request, "%s", socket_key);
+        if (args_p && *args_p) {
+            zframe_t *frame;
+            while ((frame = zmsg_pop (*args_p)))
+                zmsg_add (request, frame);
+        }
+    }
+    if (args_p)
+        zmsg_destroy (args_p);
     zmsg_send (&request, self->commands);
-    free (zstr_recv (self->commands));
-    free (self->protocol);
+
+    vtx_request_t *pending = (vtx_request_t *) zmalloc (sizeof (vtx_request_t));
+    snprintf (pending->key, sizeof (pending->key), "%x", token);
+    pending->driver = self;
+    zhash_insert (vtx->requests, pending->key, pending);
+    zhash_freefn (vtx->requests, pending->key, s_request_destroy);
+    zlist_append (self->inflight, pending);
+    return (int) token;
+}
+
+//  Receive next reply from driver. The driver replies in order, so the
+//  reply is for the oldest request in flight. Returns the request, or
+//  NULL if we were interrupted.
+
+static vtx_request_t *
+s_driver_recv (vtx_driver_t *self)
+{
+    //  An embedded driver only replies when we run it
+    if (self->embedded
+    &&  s_embedded_wait (self->vtx, self->commands, NULL))
+        return NULL;
+    zmsg_t *reply = zmsg_recv (self->commands);
+    if (!reply)
+        return NULL;
+
+    vtx_request_t *request = (vtx_request_t *) zlist_pop (self->inflight);
+    assert (request);
+    zframe_t *frame = zmsg_pop (reply);
+    assert (frame && zframe_size (frame) == VTX_CMD_REPLY);
+    byte *data = zframe_data (frame);
+    uint token = (data [0] << 24) + (data [1] << 16) + (data [2] << 8) + data [3];
+    assert (token == strtoul (request->key, NULL, 16));
+    request->status = (int) ((data [4] << 24) + (data [5] << 16)
+                           + (data [6] << 8) + data [7]);
+    request->value = zmsg_popstr (reply);
+    request->done = TRUE;
+    if (request->closing)
+        s_socket_forget (self->vtx, request->closing);
+    zframe_destroy (&frame);
+    zmsg_destroy (&reply);
+    return request;
+}
+
+//  Wait for reply to request and return its status, and its value if
+//  value_p is not null. Takes the request off the table of requests, so
+//  each token can only be collected once. Returns -1 if the token is
+//  unknown or we were interrupted.
+
+static int
+s_request_collect (vtx_t *vtx, int token, char **value_p)
+{
+    char key [12];
+    snprintf (key, sizeof (key), "%x", (uint) token);
+    s_lock (vtx);
+    vtx_request_t *request = (vtx_request_t *) zhash_lookup (vtx->requests, key);
+    int status = -1;
+    if (!request)
+        errno = EINVAL;
+    else {
+        while (!request->done)
+            if (!s_driver_recv (request->driver))
+                break;
+        if (request->done) {
+            status = request->status;
+            if (value_p) {
+                *value_p = request->value;
+                request->value = NULL;
+            }
+            zhash_delete (vtx->requests, key);
+        }
+        else
+            errno = EINTR;
+    }
+    s_unlock (vtx);
+    return status;
+}
+
+//  Destroy request, when request is removed from vtx->requests
+static void
+s_request_destroy (void *argument)
+{
+    vtx_request_t *self = (vtx_request_t *) argument;
+    free (self->value);
     free (self);
 }
 
+//  Run embedded drivers until socket has input, or ring has a message.
+//  Returns 0 if OK, -1 if we were interrupted.
+
+static int
+s_embedded_wait (vtx_t *self, void *socket, vtx_ring_t *ring)
+{
+    while (TRUE) {
+        if (ring && vtx_ring_wait (ring, 0) == 0)
+            return 0;
+        if (socket) {
+            zmq_pollitem_t item = { socket, 0, ZMQ_POLLIN };
+            if (zmq_poll (&item, 1, 0) == 1)
+                return 0;
+        }
+        if (vtx_loop_process (self->loop, -1) == -1)
+            return -1;
+    }
+}
+
 //  Socket methods
 
 static vtx_socket_t *
@@ -337,8 +1227,17 @@ s_socket_new (vtx_t *vtx, void *socket, int type, char *socket_key)
     vtx_socket_t *self = (vtx_socket_t *) zmalloc (sizeof (vtx_socket_t));
     self->socket = socket;
     self->type = type;
+    self->pending = zlist_new ();
     zhash_insert (vtx->sockets, socket_key, self);
     zhash_freefn (vtx->sockets, socket_key, s_socket_destroy);
+
+    //  Add socket to lookup table, which always has free slots
+    uint index = s_socket_hash (socket);
+    while (vtx->handles [index].socket
+    &&     vtx->handles [index].socket != VTX_HANDLE_CLOSED)
+        index = (index + 1) % VTX_HANDLES;
+    vtx->handles [index].vtx_socket = self;
+    __atomic_store_n (&vtx->handles [index].socket, socket, __ATOMIC_RELEASE);
     return self;
 }
 
@@ -347,9 +1246,198 @@ static void
 s_socket_destroy (void *argument)
 {
     vtx_socket_t *self = (vtx_socket_t *) argument;
+    while (zlist_size (self->pending)) {
+        zmsg_t *pending = (zmsg_t *) zlist_pop (self->pending);
+        zmsg_destroy (&pending);
+    }
+    zlist_destroy (&self->pending);
+    vtx_ring_destroy (&self->outring);
+    vtx_ring_destroy (&self->inring);
+    //  The first lane is the outring, which we already destroyed
+    uint index;
+    for (index = 0; index < self->lane_count; index++) {
+        if (index > 0)
+            vtx_ring_destroy (&self->lanes [index]);
+        s_owner_release (self->lane_owner [index]);
+    }
     free (self);
 }
 
+//  Forget a closed socket: leave a tombstone in the lookup table, destroy
+//  the vtx_socket and its rings, and close the 0MQ socket
+
+static void
+s_socket_forget (vtx_t *vtx, void *socket)
+{
+    uint index = s_socket_hash (socket);
+    uint probes;
+    for (probes = 0; probes < VTX_HANDLES; probes++) {
+        if (vtx->handles [index].socket == socket) {
+            __atomic_store_n (&vtx->handles [index].socket,
+                              VTX_HANDLE_CLOSED, __ATOMIC_RELEASE);
+            vtx->handles [index].vtx_socket = NULL;
+            break;
+        }
+        if (vtx->handles [index].socket == NULL)
+            break;
+        index = (index + 1) % VTX_HANDLES;
+    }
+    char *socket_key = s_socket_key (socket);
+    zhash_delete (vtx->sockets, socket_key);
+    free (socket_key);
+    zsocket_destroy (vtx->ctx, socket);
+}
+
+//  Find vtx_socket for socket, in the lookup table. This needs no lock,
+//  so any thread can send without waiting for the others.
+
+static vtx_socket_t *
+s_socket_lookup (vtx_t *vtx, void *socket)
+{
+    uint index = s_socket_hash (socket);
+    uint probes;
+    for (probes = 0; probes < VTX_HANDLES; probes++) {
+        void *found = __atomic_load_n (&vtx->handles [index].socket,
+                                       __ATOMIC_ACQUIRE);
+        if (found == socket)
+            return (vtx_socket_t *) vtx->handles [index].vtx_socket;
+        if (found == NULL)
+            break;
+        index = (index + 1) % VTX_HANDLES;
+    }
+    return NULL;
+}
+
+//  Return the calling thread's lane for sending on socket. Outside
+//  thread-safe mode, that's the outring. Each new sending thread takes
+//  over a lane whose thread has exited, if there is one; else the outring
+//  if it's free, else we make a new lane and pass it to the driver.
+//  Returns NULL if the socket has too many live sending threads.
+
+static vtx_ring_t *
+s_socket_lane (vtx_t *self, void *socket, vtx_socket_t *vtx_socket)
+{
+    if (!self->threadsafe)
+        return vtx_socket->outring;
+
+    vtx_owner_t *owner = s_owner_self ();
+    if (!owner)
+        return NULL;
+    uint count = __atomic_load_n (&vtx_socket->lane_count, __ATOMIC_ACQUIRE);
+    uint index;
+    for (index = 0; index < count; index++)
+        if (__atomic_load_n (&vtx_socket->lane_owner [index],
+                             __ATOMIC_ACQUIRE) == owner)
+            return vtx_socket->lanes [index];
+
+    s_lock (self);
+    vtx_ring_t *lane = NULL;
+    //  The dead thread's last sends happen before its owner goes dead,
+    //  so we can carry on from where it left off in the ring
+    for (index = 0; index < vtx_socket->lane_count; index++) {
+        vtx_owner_t *previous = vtx_socket->lane_owner [index];
+        if (!__atomic_load_n (&previous->alive, __ATOMIC_ACQUIRE)) {
+            lane = vtx_socket->lanes [index];
+            s_owner_release (previous);
+            break;
+        }
+    }
+    if (!lane) {
+        index = vtx_socket->lane_count;
+        if (index == 0)
+            lane = vtx_socket->outring;
+        else
+        if (index < VTX_MAX_LANES) {
+            lane = vtx_ring_new (vtx_socket->ring_limit);
+            zmsg_t *args = zmsg_new ();
+            zmsg_addmem (args, &lane, sizeof (lane));
+            if (s_driver_post (self, socket, VTX_CMD_LANE, args))
+                vtx_ring_destroy (&lane);
+        }
+        if (lane) {
+            vtx_socket->lanes [index] = lane;
+            __atomic_store_n (&vtx_socket->lane_count, index + 1,
+                              __ATOMIC_RELEASE);
+        }
+    }
+    if (lane) {
+        __atomic_add_fetch (&owner->refs, 1, __ATOMIC_RELAXED);
+        __atomic_store_n (&vtx_socket->lane_owner [index], owner,
+                          __ATOMIC_RELEASE);
+    }
+    else
+        errno = ENOBUFS;
+    s_unlock (self);
+    return lane;
+}
+
+//  Return the calling thread's lane owner, creating it the first time.
+//  Returns NULL if the thread can't have one.
+
+static vtx_owner_t *
+s_owner_self (void)
+{
+    pthread_once (&s_owner_once, s_owner_key_create);
+    vtx_owner_t *owner = (vtx_owner_t *) pthread_getspecific (s_owner_key);
+    if (!owner) {
+        owner = (vtx_owner_t *) zmalloc (sizeof (vtx_owner_t));
+        owner->refs = 1;
+        owner->alive = TRUE;
+        if (pthread_setspecific (s_owner_key, owner)) {
+            free (owner);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+    return owner;
+}
+
+//  Create key for lane owners, with a destructor that runs at thread exit
+static void
+s_owner_key_create (void)
+{
+    pthread_key_create (&s_owner_key, s_owner_exit);
+}
+
+//  Called as a sending thread exits; its lanes are free for other threads
+static void
+s_owner_exit (void *argument)
+{
+    vtx_owner_t *owner = (vtx_owner_t *) argument;
+    __atomic_store_n (&owner->alive, FALSE, __ATOMIC_RELEASE);
+    s_owner_release (owner);
+}
+
+//  Drop a hold on owner, and free it when nothing holds it
+static void
+s_owner_release (vtx_owner_t *owner)
+{
+    if (owner && __atomic_sub_fetch (&owner->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free (owner);
+}
+
+//  Return slot in lookup table where we start looking for socket
+static uint
+s_socket_hash (void *socket)
+{
+    return (uint) (((size_t) socket >> 4) * 2654435761U) % VTX_HANDLES;
+}
+
+//  Serialise control calls, in thread-safe mode
+static void
+s_lock (vtx_t *self)
+{
+    if (self->threadsafe)
+        pthread_mutex_lock (&self->mutex);
+}
+
+static void
+s_unlock (vtx_t *self)
+{
+    if (self->threadsafe)
+        pthread_mutex_unlock (&self->mutex);
+}
+
 //  Return formatted socket key
 static char *
 s_socket_key (void *self)
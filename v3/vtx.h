@@ -37,8 +37,101 @@
 #define VTX_ROUTING_ROUTER      4       //  Explicit routing by identity
 #define VTX_ROUTING_PUBLISH     5       //  Copy to each peering
 #define VTX_ROUTING_SINGLE      6       //  Precisely one peering allowed
+#define VTX_ROUTING_HASH        7       //  Consistent hash on key frame
 
 #define VTX_MAX_PEERINGS        512     //  Safety limit per vocket
+#define VTX_MAX_SOCKETS         1024    //  Safety limit per VTX instance
+#define VTX_MAX_LANES           64      //  Sending threads per socket
+#define VTX_HASH_REPLICAS       100     //  Virtual nodes per peering
+#define VTX_HASH_MAXKEY         8       //  Key frame must be lower than this
+
+//  Subscription matching engines for PUB sockets
+#define VTX_MATCH_PREFIX        1       //  Topic prefix of first frame
+
+//  Input steering across bindings that share an address. CPU steering
+//  is for TCP; set VTX_OPT_SHARD on each shard, and bind them in order,
+//  since the kernel numbers shards by bind order. The shard index also
+//  pins the driver thread, and so every vocket on that driver, to that
+//  CPU. Embedded drivers are never pinned, nor is a driver pinned twice.
+#define VTX_STEER_HASH          0       //  Kernel flow hash
+#define VTX_STEER_CPU           1       //  Shard matching receiving CPU
+#define VTX_MAX_SHARDS          256     //  Safety limit per address
+
+//  Codec algorithms; peers use an algorithm only if both offer it
+#define VTX_CODEC_ZMTP          0       //  Plain ZMTP framing
+#define VTX_CODEC_LZ            1       //  LZ block compression
+#define VTX_CODEC_LZDICT        2       //  LZ with built-in dictionary
+
+//  Message framing; peers use NOM-2 framing only if both offer it
+#define VTX_FRAMING_ZMTP        0       //  ZMTP 1.0 variable headers
+#define VTX_FRAMING_NOM2        1       //  Fixed headers, runs of small frames
+
+//  Socket options, set using vtx_setopt
+#define VTX_OPT_ROUTING         1       //  Routing mechanism, VTX_ROUTING_xxx
+#define VTX_OPT_HASHKEY         2       //  Index of frame to hash on, 0..n
+#define VTX_OPT_MATCHING        3       //  Matching engine, VTX_MATCH_xxx
+#define VTX_OPT_REUSEPORT       4       //  Shards per bound address, 0 = off
+#define VTX_OPT_STEERING        5       //  Shard steering, VTX_STEER_xxx
+#define VTX_OPT_BUDGET          6       //  Vocket codec memory in KB, 0 = no limit
+#define VTX_OPT_DRIVER_BUDGET   7       //  Driver codec memory in KB, 0 = no limit
+#define VTX_OPT_CODEC           8       //  Codec algorithm, VTX_CODEC_xxx
+#define VTX_OPT_FRAMING         9       //  Message framing, VTX_FRAMING_xxx
+#define VTX_OPT_RING            10      //  Pointer ring to driver, 0 = off
+#define VTX_OPT_METADATA        11      //  Metadata frame on messages, 0/1
+
+//  Tuning options, set using vtx_setopt and read using vtx_getopt. Each
+//  driver accepts the ones that apply to its transport. Kernel buffer
+//  sizes of 0 leave the system default.
+#define VTX_OPT_INBUF_MAX       12      //  Input codec limit, in messages
+#define VTX_OPT_OUTBUF_MAX      13      //  Output codec limit, in messages
+#define VTX_OPT_SNDBUF          14      //  Kernel send buffer, in bytes
+#define VTX_OPT_RCVBUF          15      //  Kernel receive buffer, in bytes
+#define VTX_OPT_BACKLOG         16      //  Connections waiting on a binding
+#define VTX_OPT_MSGMAX          17      //  Largest datagram sent, in bytes
+#define VTX_OPT_TIMEOUT         18      //  Silence before peer is dead, msecs
+#define VTX_OPT_RESEND_IVL      19      //  Interval between resends, msecs
+#define VTX_OPT_PROFILE         20      //  Socket profile, VTX_PROFILE_xxx
+#define VTX_OPT_SHARD           21      //  Shard index, pins driver thread to CPU
+
+//  Socket profiles, which tune a transport for latency or for throughput
+#define VTX_PROFILE_DEFAULT     0       //  Transport and system defaults
+#define VTX_PROFILE_LATENCY     1       //  Send at once, small buffers, busy-poll
+#define VTX_PROFILE_THROUGHPUT  2       //  Corked batches, buffers sized to BDP
+
+//  Metadata frame, first in each message that the application receives
+//  when VTX_OPT_METADATA is on: a version byte, the receive time in msecs
+//  as 8 bytes in network order, and the sender's host address. Use
+//  vtx_popmeta to take it off the message.
+#define VTX_META_VERSION        1
+#define VTX_META_HEADER         9       //  Version and receive time
+#define VTX_META_MAX            (VTX_META_HEADER + 255)
+
+//  ROUTER identity frame: the schemed peer address, a null octet, and a
+//  route handle that lets the driver find the peering without parsing
+//  the address. The handle is the route slot and a tag, both 2 bytes in
+//  network order. Treated as a string, the frame reads as the address;
+//  an identity without a valid handle is routed by address.
+#define VTX_ROUTE_HANDLE        5       //  Null octet and route handle
+
+//  Driver commands. Each request to a driver is a header frame, the VTX
+//  name of the socket, and zero or more argument frames. The header is
+//  the command, the socket type, two spare bytes, and a token that the
+//  driver returns in its reply. The reply is a frame holding the token
+//  and a status (0 = OK), both in network order, and for GETMETA and
+//  GETOPT, the value as a second frame.
+#define VTX_CMD_BIND            1       //  Addresses to bind to
+#define VTX_CMD_CONNECT         2       //  Addresses to connect to
+#define VTX_CMD_SETOPT          3       //  Option and value, as 2 x int32
+#define VTX_CMD_RINGS           4       //  Outgoing and incoming ring
+#define VTX_CMD_SUBSCRIBE       5       //  Topic
+#define VTX_CMD_UNSUBSCRIBE     6       //  Topic
+#define VTX_CMD_GETMETA         7       //  Meta name
+#define VTX_CMD_CLOSE           8       //  No arguments
+#define VTX_CMD_SHUTDOWN        9       //  No arguments or VTX name
+#define VTX_CMD_LANE            10      //  Extra outgoing ring
+#define VTX_CMD_GETOPT          11      //  Option, as int32
+#define VTX_CMD_HEADER          8       //  Size of header frame
+#define VTX_CMD_REPLY           8       //  Size of reply status frame
 
 #ifdef __cplusplus
 extern "C" {
@@ -58,10 +151,50 @@ int
     vtx_bind (vtx_t *self, void *socket, const char *format, ...);
 int
     vtx_connect (vtx_t *self, void *socket, const char *format, ...);
+int
+    vtx_bind_async (vtx_t *self, void *socket, const char *format, ...);
+int
+    vtx_connect_async (vtx_t *self, void *socket, const char *format, ...);
+int
+    vtx_bind_bulk (vtx_t *self, void *socket, char **endpoints, int count);
+int
+    vtx_connect_bulk (vtx_t *self, void *socket, char **endpoints, int count);
+int
+    vtx_close_async (vtx_t *self, void *socket);
+int
+    vtx_wait (vtx_t *self, int token);
+int
+    vtx_setopt (vtx_t *self, void *socket, int option, int value);
+int
+    vtx_getopt (vtx_t *self, void *socket, int option, int *value_p);
+int
+    vtx_send (vtx_t *self, void *socket, zmsg_t **msg_p);
+zmsg_t *
+    vtx_recv (vtx_t *self, void *socket);
+zmsg_t *
+    vtx_recv_nowait (vtx_t *self, void *socket);
+int
+    vtx_send_batch (vtx_t *self, void *socket, zmsg_t **msgs, int count);
+int
+    vtx_recv_batch (vtx_t *self, void *socket, zmsg_t **msgs, int limit);
+int
+    vtx_subscribe (vtx_t *self, void *socket, const char *topic);
+int
+    vtx_unsubscribe (vtx_t *self, void *socket, const char *topic);
 char *
     vtx_getmeta (vtx_t *self, void *socket, const char *metaname);
+int
+    vtx_popmeta (zmsg_t *msg, char **sender_p, int64_t *time_p);
 int
     vtx_close (vtx_t *self, void *socket);
+int
+    vtx_set_embedded (vtx_t *self, Bool embedded);
+int
+    vtx_set_threadsafe (vtx_t *self, Bool threadsafe);
+int
+    vtx_process (vtx_t *self, int timeout);
+zmq_pollitem_t *
+    vtx_poll (vtx_t *self, uint *size_p, int *timeout_p);
 
 //  Driver program interface (DPI)
 int
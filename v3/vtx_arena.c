@@ -0,0 +1,264 @@
+/*  =====================================================================
+    vtx_arena - 0MQ virtual transport interface - driver object arena
+
+    Allocates the small objects that a driver creates and destroys as
+    peerings come and go (vockets, bindings, peerings, and the strings
+    they own). Memory is carved from large chunks and recycled through
+    free lists per size class, so churn doesn't fragment the heap and
+    objects created together sit close together. An arena belongs to a
+    single driver thread and is not thread safe.
+
+    ---------------------------------------------------------------------
+    Copyright (c) 1991-2011 iMatix Corporation <www.imatix.com>
+    Copyright other contributors as noted in the AUTHORS file.
+
+    This file is part of VTX, the 0MQ virtual transport interface:
+    http://vtx.zeromq.org.
+
+    This is free software; you can redistribute it and/or modify it under
+    the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or (at
+    your option) any later version.
+
+    This software is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this program. If not, see
+    <http://www.gnu.org/licenses/>.
+    =====================================================================
+*/
+
+#ifndef __VTX_ARENA_INCLUDED__
+#define __VTX_ARENA_INCLUDED__
+
+#include "czmq.h"
+
+#define VTX_ARENA_CHUNK     65536   //  Bytes we carve up at a time
+#define VTX_ARENA_CLASSES   7       //  Size classes, 16 to 1024 bytes
+#define VTX_ARENA_HEADER    16      //  Block header, keeps alignment
+#define VTX_ARENA_LARGE     0xFF    //  Class of blocks we malloc directly
+
+typedef struct _vtx_arena_t vtx_arena_t;
+
+//  Each block starts with a header that says what class it is, so that
+//  we can free it without knowing its size. Free blocks are linked
+//  through their first bytes after the header.
+typedef struct {
+    byte size_class;            //  Size class index, or VTX_ARENA_LARGE
+} block_t;
+
+//  Chunks are linked together so we can free them all at the end
+typedef struct _chunk_t chunk_t;
+struct _chunk_t {
+    chunk_t *next;              //  Next chunk in arena
+};
+
+//  This is the structure of our object
+struct _vtx_arena_t {
+    void *free_list [VTX_ARENA_CLASSES];
+    chunk_t *chunks;            //  All chunks we've allocated
+    byte *carve;                //  Next free byte in current chunk
+    size_t carve_left;          //  Bytes left in current chunk
+    size_t live;                //  Blocks currently allocated
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Create new arena
+static vtx_arena_t *
+    vtx_arena_new (void);
+
+//  Destroy arena and all memory it holds
+static void
+    vtx_arena_destroy (vtx_arena_t **self_p);
+
+//  Allocate zeroed block of memory, like zmalloc
+static void *
+    vtx_arena_alloc (vtx_arena_t *self, size_t size);
+
+//  Return block of memory to arena; block may be null
+static void
+    vtx_arena_free (vtx_arena_t *self, void *data);
+
+//  Copy string into arena
+static char *
+    vtx_arena_strdup (vtx_arena_t *self, const char *string);
+
+//  Selftest of arena class
+static void
+    vtx_arena_selftest (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+//  -------------------------------------------------------------------------
+//  Create new arena
+
+static vtx_arena_t *
+vtx_arena_new (void)
+{
+    vtx_arena_t *self = (vtx_arena_t *) zmalloc (sizeof (vtx_arena_t));
+    return self;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Destroy arena and all memory it holds. Large blocks that were not freed
+//  are not tracked and will leak.
+
+static void
+vtx_arena_destroy (vtx_arena_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        vtx_arena_t *self = *self_p;
+        while (self->chunks) {
+            chunk_t *next = self->chunks->next;
+            free (self->chunks);
+            self->chunks = next;
+        }
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  -------------------------------------------------------------------------
+//  Allocate zeroed block of memory. Takes the block off the free list for
+//  its size class if possible, else carves a new block from the current
+//  chunk.
+
+static void *
+vtx_arena_alloc (vtx_arena_t *self, size_t size)
+{
+    assert (self);
+    byte size_class = 0;
+    while (size_class < VTX_ARENA_CLASSES && (16u << size_class) < size)
+        size_class++;
+
+    block_t *block;
+    if (size_class == VTX_ARENA_CLASSES) {
+        block = (block_t *) malloc (VTX_ARENA_HEADER + size);
+        assert (block);
+        block->size_class = VTX_ARENA_LARGE;
+    }
+    else {
+        size_t block_size = VTX_ARENA_HEADER + (16u << size_class);
+        size = 16u << size_class;
+        if (self->free_list [size_class]) {
+            block = (block_t *) ((byte *) self->free_list [size_class]
+                                 - VTX_ARENA_HEADER);
+            self->free_list [size_class] = *(void **) self->free_list [size_class];
+        }
+        else {
+            if (self->carve_left < block_size) {
+                chunk_t *chunk = (chunk_t *) malloc (VTX_ARENA_CHUNK);
+                assert (chunk);
+                chunk->next = self->chunks;
+                self->chunks = chunk;
+                self->carve = (byte *) chunk + VTX_ARENA_HEADER;
+                self->carve_left = VTX_ARENA_CHUNK - VTX_ARENA_HEADER;
+            }
+            block = (block_t *) self->carve;
+            self->carve += block_size;
+            self->carve_left -= block_size;
+        }
+        block->size_class = size_class;
+    }
+    self->live++;
+    void *data = (byte *) block + VTX_ARENA_HEADER;
+    memset (data, 0, size);
+    return data;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Return block of memory to arena
+
+static void
+vtx_arena_free (vtx_arena_t *self, void *data)
+{
+    assert (self);
+    if (data) {
+        block_t *block = (block_t *) ((byte *) data - VTX_ARENA_HEADER);
+        if (block->size_class == VTX_ARENA_LARGE)
+            free (block);
+        else {
+            assert (block->size_class < VTX_ARENA_CLASSES);
+            *(void **) data = self->free_list [block->size_class];
+            self->free_list [block->size_class] = data;
+        }
+        self->live--;
+    }
+}
+
+
+//  -------------------------------------------------------------------------
+//  Copy string into arena
+
+static char *
+vtx_arena_strdup (vtx_arena_t *self, const char *string)
+{
+    assert (self);
+    assert (string);
+    size_t size = strlen (string) + 1;
+    char *copy = (char *) vtx_arena_alloc (self, size);
+    memcpy (copy, string, size);
+    return copy;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Selftest of arena class
+
+static void
+vtx_arena_selftest (void)
+{
+    vtx_arena_t *arena = vtx_arena_new ();
+
+    //  Allocate a spread of sizes, check they're zeroed and don't overlap
+    #define BLOCKS 5000
+    byte **blocks = (byte **) malloc (BLOCKS * sizeof (byte *));
+    int index;
+    for (index = 0; index < BLOCKS; index++) {
+        size_t size = 1 + index % 1500;
+        blocks [index] = (byte *) vtx_arena_alloc (arena, size);
+        size_t offset;
+        for (offset = 0; offset < size; offset++)
+            assert (blocks [index][offset] == 0);
+        memset (blocks [index], (byte) index, size);
+    }
+    for (index = 0; index < BLOCKS; index++)
+        assert (blocks [index][0] == (byte) index);
+    assert (arena->live == BLOCKS);
+
+    //  Freed blocks are reused for the same size class
+    byte *freed = blocks [100];
+    vtx_arena_free (arena, freed);
+    blocks [100] = (byte *) vtx_arena_alloc (arena, 1 + 100 % 1500);
+    assert (blocks [100] == freed);
+
+    for (index = 0; index < BLOCKS; index++)
+        vtx_arena_free (arena, blocks [index]);
+    assert (arena->live == 0);
+    free (blocks);
+
+    char *string = vtx_arena_strdup (arena, "tcp://127.0.0.1:5555");
+    assert (streq (string, "tcp://127.0.0.1:5555"));
+    vtx_arena_free (arena, string);
+    vtx_arena_free (arena, NULL);
+
+    vtx_arena_destroy (&arena);
+    assert (arena == NULL);
+    printf ("%d blocks allocated and freed\n", BLOCKS);
+    #undef BLOCKS
+}
+
+#endif
@@ -0,0 +1,7 @@
+#include "vtx_arena.c"
+
+int main (void)
+{
+    vtx_arena_selftest ();
+    return 0;
+}
\ No newline at end of file
@@ -5,6 +5,36 @@
     or from the network. It batches small messages together and stores
     references to larger messages to avoid copying.
 
+    The data buffer is a ring mapped twice, back to back, so data that
+    wraps is still one block. That needs memfd_create or shm_open, and
+    mmap. There is no fallback: if the system won't give us the mapping,
+    the codec can't grow and callers see it as full. We count those
+    failures, see vtx_codec_map_failures.
+
+    Serialized data can also pass through a codec algorithm on its way
+    to and from the network, which works on blocks of data and may
+    compress them. Each block goes out with a header:
+
+        block       = kind raw-size packed-size *OCTET
+        kind        = stored / packed
+        stored      = %x00      ; block body is the raw data
+        packed      = %x01      ; block body was packed by the algorithm
+        raw-size    = 2OCTET    ; size of raw data - 1, network order
+        packed-size = 2OCTET    ; size of block body - 1, network order
+
+    Codecs start with ZMTP framing and can switch to NOM-2 framing, which
+    peers use when both agree to it. NOM-2 frames have a fixed header,
+    with explicit flags and a length that counts only the body. Runs of
+    small frames go into one frame, so they share one header:
+
+        frame       = header body
+        header      = flags length
+        flags       = OCTET     ; %x01 = more frames follow, %x02 = run
+        length      = 7OCTET    ; size of body, network order
+        run         = *( small-flags small-length *OCTET )
+        small-flags = OCTET     ; %x01 = more frames follow
+        small-length = OCTET    ; size of small frame body
+
     ---------------------------------------------------------------------
     Copyright (c) 1991-2011 iMatix Corporation <www.imatix.com>
     Copyright other contributors as noted in the AUTHORS file.
@@ -32,15 +62,69 @@
 #define __VTX_CODEC_INCLUDED__
 
 #include "czmq.h"
-
-#define VTX_INDEX_SIZE      sizeof (uint32_t)
-#define VTX_MSG_OBJECT      0xFFFFFFFF
+#include "vtx_lz.c"
+#include <sys/mman.h>
 
 #ifndef ZMQ_MAX_VSM_SIZE
 #define ZMQ_MAX_VSM_SIZE 32
 #endif
 
+//  NOM-2 frame header, flags, and largest frame that can join a run
+#define VTX_NOM2_HEADER         8
+#define VTX_NOM2_MORE           0x01
+#define VTX_NOM2_RUN            0x02
+#define VTX_NOM2_SMALL          255
+
+//  Frames this large are received directly into a message
+#define VTX_CODEC_DIRECT_MIN    4096
+//  Largest frame body we take from a peer, budget or no budget
+#define VTX_CODEC_FRAME_MAX     (256 * 1024 * 1024)
+//  Smallest batch table we allocate; the data buffer is at least a page
+#define VTX_CODEC_BATCH_MIN     16
+
+//  Largest block of raw data an algorithm works on, and block header size
+#define VTX_CODEC_BLOCK         VTX_LZ_BLOCK
+#define VTX_CODEC_BLOCK_HEADER  5
+#define VTX_CODEC_BLOCK_MAX     (VTX_CODEC_BLOCK_HEADER + VTX_CODEC_BLOCK)
+
 typedef struct _vtx_codec_t vtx_codec_t;
+typedef struct _vtx_budget_t vtx_budget_t;
+
+//  A codec algorithm packs blocks of serialized data for the network and
+//  unpacks them again. Each instance keeps state for one direction of one
+//  peering. Algorithms are numbered as in VTX_CODEC_xxx, and peers agree
+//  on an algorithm by name.
+typedef struct {
+    char *name;                 //  Name that peers agree on
+    void *(*new_fn) (void);
+    void (*destroy_fn) (void **state_p);
+    //  Returns packed size, or 0 if the data doesn't pack within limit;
+    //  dest may be the same as data
+    size_t (*pack_fn) (void *state, byte *data, size_t size,
+                       byte *dest, size_t limit);
+    //  Returns 0 and points data_p to raw data, or -1 if block is corrupt
+    int (*unpack_fn) (void *state, byte *data, size_t size,
+                      size_t expected, byte **data_p);
+} vtx_codec_algo_t;
+
+//  A budget limits the memory that a set of codecs may hold in total, and
+//  may itself be part of a larger budget. Past half its limit, a budget
+//  lets codecs grow only up to a fair share, split between the current
+//  holders and one newcomer, so the largest holders are refused first and
+//  new peerings still get in. Owners set the limit and read usage directly.
+struct _vtx_budget_t {
+    size_t limit;               //  Memory allowed, 0 means no limit
+    size_t used;                //  Memory held by codecs now
+    uint holders;               //  Codecs holding memory now
+    vtx_budget_t *parent;       //  Enclosing budget, if any
+};
+
+//  A slice is one decoded frame, still in place in the codec buffer
+typedef struct {
+    byte *data;                 //  Frame body
+    size_t size;                //  Size of frame body
+    Bool more;                  //  More frames follow?
+} vtx_slice_t;
 
 //  We store batches of data, each either a run of collected very small
 //  messages (VSM), or a single large message. Batches are held in a
@@ -60,55 +144,96 @@ typedef struct _vtx_codec_t vtx_codec_t;
 //                                           |                  |
 //                                           +------------------+
 //
-//  The data buffer is also a ring buffer. In both cases, when head = tail,
-//  the buffer is empty, and we add to tail, and remove from head. Batched
-//  VSM data is always contiguous in the data buffer.
-
-//  This is the structure of a single batch
+//  The data buffer is also a ring buffer, whose pages are mapped twice,
+//  back to back, so any run of data in it is contiguous in memory even
+//  when it wraps past the end. Both rings are a power of two in size,
+//  and head and tail are free-running counters that we mask to get an
+//  index. When head = tail, the ring is empty, and we add to tail, and
+//  remove from head. VSM batches follow each other in the data buffer,
+//  so each batch starts where the previous one ended.
+//
+//  We allocate the rings only when data arrives, starting small, and we
+//  double them as needed up to the limits set when creating the codec.
+//  The owner can release them when the codec is empty, so idle codecs
+//  cost just the codec structure.
+//
+//  When we receive a large frame, we allocate its message as soon as we
+//  have the frame header, and serialized data goes straight into the
+//  message body. Once the message is full, we store it as a message
+//  batch, just like msg_put does for large outgoing messages.
+
+//  This is the structure of a single batch. Message references are held
+//  in the batch entry itself, so the batch ring acts as a preallocated
+//  slab and storing a large message costs no heap allocation. libzmq
+//  treats zmq_msg_t as a struct of pointers, so it comes first, where
+//  it's aligned.
 typedef struct {
-    byte *data;                 //  Pointer into data buffer
-    uint size;                  //  Size of this batch in data buffer
-    zmq_msg_t *msg;             //  Or, zmq_msg reference
-    Bool busy;                  //  Batch is being extracted
+    zmq_msg_t msg;              //  zmq_msg reference, if is_msg
+    size_t size;                //  Size of this batch
+    Bool is_msg;                //  Batch is a message reference
 } batch_t;
 
 //  This is the structure of our object
 struct _vtx_codec_t {
     batch_t *batch;             //  Ring buffer of batch entries
-    byte *buffer;               //  Ring buffer for message data
-    uint batch_limit;           //  Allocated size of batch table
-    uint buffer_limit;          //  Allocated size of buffer
+    byte *buffer;               //  Mirrored ring buffer for message data
+    uint batch_limit;           //  Size of batch table, power of 2
+    size_t buffer_limit;        //  Size of data buffer, power of 2
+    uint batch_max;             //  Batch table may grow to this size
+    size_t buffer_max;          //  Data buffer may grow to this size
     uint batch_tail;            //  Where we add a new batch entry
     uint batch_head;            //  Where we take off batch entries
-    uint buffer_tail;           //  Where we store new data
-    uint buffer_head;           //  Where we remove old data
-    batch_t *writer;            //  Current batch (for writing)
-    batch_t *reader;            //  Current batch (for reading)
-    size_t free_space;          //  Size of next available run
+    size_t buffer_tail;         //  Where we store new data
+    size_t buffer_head;         //  Where we remove old data
+    size_t extracted;           //  Amount of head batch already taken
+    size_t scanned;             //  Amount of head batch sliced
+    zmq_msg_t direct;           //  Large frame being received
+    size_t direct_size;         //  Size of direct frame, if any
+    size_t direct_filled;       //  Amount of direct frame received
     size_t active;              //  Total serialized data size
+    Bool nom2;                  //  NOM-2 framing, else ZMTP
+    Bool run_open;              //  Small frames can join last run
+    size_t run_size;            //  Size of last run's body so far
+    size_t inside;              //  Left of run being decoded, if any
+    size_t scan_inside;         //  Same, after sliced frames
+    size_t footprint;           //  Memory held, charged to budget
+    vtx_budget_t *budget;       //  Budget we draw on, if any
+    Bool invalid;               //  Peer sent a frame we can't take
     Bool debug;                 //  Debug mode on codec?
-
-    //  When this is null, we'll start on the next batch
-    byte *extract_data;         //  Data still to extract
-    size_t extract_size;        //  Amount of data still to extract
 };
 
-//  The batch table is full when we can't bump the batch_tail
-#define BATCH_TABLE_FULL \
-    ((self->batch_tail + 1) % self->batch_limit == self->batch_head)
+//  Ring accessors; all counters are masked into the ring on access
+#define BATCH_COUNT     (self->batch_tail - self->batch_head)
+#define BATCH_AT(index) (&self->batch [(index) & (self->batch_limit - 1)])
+#define BATCH_HEAD      BATCH_AT (self->batch_head)
+#define BATCH_LAST      BATCH_AT (self->batch_tail - 1)
+#define BUFFER_USED     (self->buffer_tail - self->buffer_head)
+#define BUFFER_HEAD     (self->buffer + (self->buffer_head & (self->buffer_limit - 1)))
+#define BUFFER_TAIL     (self->buffer + (self->buffer_tail & (self->buffer_limit - 1)))
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-//  Create new codec
+//  Create new codec, which can grow to hold limit batch entries, and
+//  draws memory from the specified budget, if not null
 static vtx_codec_t *
-    vtx_codec_new (size_t limit);
+    vtx_codec_new (size_t limit, vtx_budget_t *budget);
+
+//  Release codec buffers if the codec is empty. They're allocated again
+//  when needed. Returns 0 if released, -1 if the codec is in use.
+static int
+    vtx_codec_release (vtx_codec_t *self);
 
 //  Destroy codec and all messages it holds
 static void
     vtx_codec_destroy (vtx_codec_t **self_p);
 
+//  Switch codec to NOM-2 framing, or back to ZMTP framing, for all data
+//  stored after this
+static void
+    vtx_codec_nom2 (vtx_codec_t *self, Bool nom2);
+
 //  Store 0MQ message into codec, returns 0 if OK, -1 if the store is full
 static int
     vtx_codec_msg_put (vtx_codec_t *self, zmq_msg_t *msg, Bool more);
@@ -119,7 +244,19 @@ static int
 static int
     vtx_codec_msg_get (vtx_codec_t *self, zmq_msg_t *msg, Bool *more_p);
 
-//  Store serialized data into codec
+//  Decode up to limit complete frames from the head of the codec in one
+//  pass, without copying them. Returns number of slices decoded. Slices
+//  stay valid until vtx_codec_slices_drop(), which you must call before
+//  storing more data into the codec.
+static uint
+    vtx_codec_slices_get (vtx_codec_t *self, vtx_slice_t *slices, uint limit);
+
+//  Remove frames returned by the last vtx_codec_slices_get() call
+static void
+    vtx_codec_slices_drop (vtx_codec_t *self);
+
+//  Store serialized data into codec, returns 0 if OK, -1 if the codec
+//  filled up before all the data was stored
 static int
     vtx_codec_bin_put (vtx_codec_t *self, byte *data, size_t size);
 
@@ -133,14 +270,80 @@ static size_t
 static void
     vtx_codec_bin_tick (vtx_codec_t *self, size_t size);
 
+//  Return free space for serialized data and point data_p to it, so the
+//  caller can read straight into the codec. Then call bin_commit() with
+//  the actual amount stored. If the codec holds nothing but the start of
+//  a large frame, this points into the body of the frame's message.
+static size_t
+    vtx_codec_bin_reserve (vtx_codec_t *self, byte **data_p);
+
+//  Update codec with actual amount of data stored into reserved space
+static void
+    vtx_codec_bin_commit (vtx_codec_t *self, size_t size);
+
 //  Return capacity for new input data, 0 means full
 static size_t
     vtx_codec_bin_space (vtx_codec_t *self);
 
+//  Return TRUE if the codec stopped taking input because the peer sent a
+//  frame that is empty in ZMTP framing, or larger than VTX_CODEC_FRAME_MAX.
+//  The peer is broken or hostile, so the caller should drop it.
+static Bool
+    vtx_codec_invalid (vtx_codec_t *self);
+
 //  Return active size of codec (message data plus headers)
 static size_t
     vtx_codec_active (vtx_codec_t *self);
 
+//  Return memory held by codec: buffers and referenced messages
+static size_t
+    vtx_codec_footprint (vtx_codec_t *self);
+
+//  Return codec algorithm by number, or NULL if there is no such
+//  algorithm. Algorithm 0 is plain ZMTP, which has no functions.
+static vtx_codec_algo_t *
+    vtx_codec_algo (int number);
+
+//  Return number of times, across all codecs in the process, that we
+//  could not map a data ring, so a codec could not grow
+static uint
+    vtx_codec_map_failures (void);
+
+//  Take up to VTX_CODEC_BLOCK bytes of serialized data from the codec and
+//  pack them into a block, which must have room for VTX_CODEC_BLOCK_MAX
+//  bytes. Returns size of block, or 0 if the codec is empty.
+static size_t
+    vtx_codec_block_get (vtx_codec_t *self, vtx_codec_algo_t *algo,
+                         void *state, byte *block);
+
+//  Return full size of the block starting at data, or 0 if we don't yet
+//  have all of its header
+static size_t
+    vtx_codec_block_size (byte *data, size_t size);
+
+//  Unpack complete block and point data_p to its raw data. Returns size
+//  of raw data, or -1 if the block is corrupt.
+static ssize_t
+    vtx_codec_block_unpack (vtx_codec_algo_t *algo, void *state,
+                            byte *block, byte **data_p);
+
+//  Encode NOM-2 header for a frame of the specified size at target, and
+//  return header size. If run_p is not null and the frame is small, it
+//  joins the run whose header run_p points to, or starts a new run if
+//  that's null. Other frames end any run, and set run_p to null.
+static size_t
+    vtx_codec_nom2_header (byte *target, byte **run_p, size_t size, Bool more);
+
+//  Encode message into buffer with NOM-2 framing. Returns encoded size,
+//  or limit + 1 if the message doesn't fit.
+static size_t
+    vtx_codec_nom2_encode (zmsg_t *msg, byte *buffer, size_t limit);
+
+//  Decode message from buffer with NOM-2 framing, returns NULL if the
+//  data isn't valid
+static zmsg_t *
+    vtx_codec_nom2_decode (byte *data, size_t size);
+
 //  Consistency check of codec, asserts if there's a fault
 static void
     vtx_codec_check (vtx_codec_t *self, char *text);
@@ -154,58 +357,103 @@ static void
 #endif
 
 //  Helper functions
+static byte *
+    s_ring_map (size_t size);
+static void
+    s_ring_unmap (byte *ring, size_t size);
 static inline int
-    s_batch_start (vtx_codec_t *self);
+    s_batch_fits (vtx_codec_t *self, size_t required, uint batches);
 static inline int
-    s_batch_ready (vtx_codec_t *self, size_t required);
+    s_batch_ready (vtx_codec_t *self, size_t required, uint batches);
+static int
+    s_codec_resize (vtx_codec_t *self, uint batch_limit, size_t buffer_limit);
 static inline void
     s_batch_store (vtx_codec_t *self, byte *data, size_t size);
+static inline void
+    s_batch_drop (vtx_codec_t *self);
+static void
+    s_direct_start (vtx_codec_t *self);
+static int
+    s_codec_charge (vtx_codec_t *self, size_t footprint);
 static inline size_t
     s_put_zmq_header (zmq_msg_t *msg, Bool more, byte *header);
+static int
+    s_nom2_put (vtx_codec_t *self, zmq_msg_t *msg, Bool more);
+static inline size_t
+    s_get_zmq_header (byte *header, size_t size, size_t *frame_size, Bool *more);
 static inline size_t
-    s_get_zmq_header (vtx_codec_t *self, zmq_msg_t *msg, Bool *more, byte *header);
+    s_get_nom2_header (byte *header, size_t size, Bool in_run,
+                       size_t *body_size, Bool *more, Bool *run);
+static inline size_t
+    s_get_header (vtx_codec_t *self, byte *header, size_t size, Bool in_run,
+                  size_t *body_size, Bool *more, Bool *run);
 static int
     s_random (int limit);
+static void *
+    s_lz_new (void);
+static void *
+    s_lz_dict_new (void);
+static void
+    s_lz_destroy (void **state_p);
+static size_t
+    s_lz_pack (void *state, byte *data, size_t size, byte *dest, size_t limit);
+static int
+    s_lz_unpack (void *state, byte *data, size_t size,
+                 size_t expected, byte **data_p);
+
+//  Table of codec algorithms, in VTX_CODEC_xxx order
+static vtx_codec_algo_t
+    s_codec_algos [] = {
+    { "zmtp",  NULL,          NULL,         NULL,      NULL },
+    { "lz",    s_lz_new,      s_lz_destroy, s_lz_pack, s_lz_unpack },
+    { "lzd",   s_lz_dict_new, s_lz_destroy, s_lz_pack, s_lz_unpack }
+};
 
 
 //  -------------------------------------------------------------------------
 //  Create new codec instance, where limit is number of batch entries
 
 static vtx_codec_t *
-vtx_codec_new (size_t limit)
+vtx_codec_new (size_t limit, vtx_budget_t *budget)
 {
     vtx_codec_t *self = (vtx_codec_t *) zmalloc (sizeof (vtx_codec_t));
     assert (limit);
+    self->budget = budget;
 
-    //  Ring buffer always has one empty slot
-    self->batch_limit = limit + 1;
+    //  Round both limits up to a power of 2; the data buffer is mapped
+    //  in whole pages so it's at least one page
+    self->batch_max = VTX_CODEC_BATCH_MIN;
+    while (self->batch_max < limit)
+        self->batch_max <<= 1;
     //  Heuristic to get a decent size for the data buffer
-    self->buffer_limit = limit * ZMQ_MAX_VSM_SIZE * 10 / 8;
-    self->batch = malloc (sizeof (batch_t) * self->batch_limit);
-    self->buffer = malloc (self->buffer_limit);
-    //  Start new batch at beginning of buffer
-    self->batch_tail = 0;
-    self->batch_head = self->batch_tail;
-    self->buffer_tail = 0;
-
-    s_batch_start (self);
+    size_t buffer_max = limit * ZMQ_MAX_VSM_SIZE * 10 / 8;
+    self->buffer_max = sysconf (_SC_PAGESIZE);
+    while (self->buffer_max < buffer_max)
+        self->buffer_max <<= 1;
     return self;
 }
 
-//  Start a new writer
-static inline int
-s_batch_start (vtx_codec_t *self)
+
+//  -------------------------------------------------------------------------
+//  Release codec buffers if the codec is empty
+
+static int
+vtx_codec_release (vtx_codec_t *self)
 {
-    if (BATCH_TABLE_FULL)
-        return -1;          //  Batch table full
-    if (self->debug)
-        printf ("start batch at=%d\n", self->batch_tail);
-    self->writer = &self->batch [self->batch_tail];
-    self->writer->size = 0;
-    self->writer->data = self->buffer + self->buffer_tail;
-    self->writer->msg = NULL;
-    self->writer->busy = FALSE;
-    self->batch_tail = (self->batch_tail + 1) % self->batch_limit;
+    assert (self);
+    if (BATCH_COUNT || self->direct_size)
+        return -1;
+    if (self->batch) {
+        free (self->batch);
+        s_ring_unmap (self->buffer, self->buffer_limit);
+        self->batch = NULL;
+        self->buffer = NULL;
+        self->batch_limit = 0;
+        self->buffer_limit = 0;
+        self->batch_head = self->batch_tail = 0;
+        self->buffer_head = self->buffer_tail = 0;
+        s_codec_charge (self, 0);
+    }
     return 0;
 }
 
@@ -219,22 +467,33 @@ vtx_codec_destroy (vtx_codec_t **self_p)
     assert (self_p);
     if (*self_p) {
         vtx_codec_t *self = *self_p;
-        while (self->batch_head != self->batch_tail) {
-            batch_t *batch = &self->batch [self->batch_head];
-            if (batch->msg) {
-                zmq_msg_close (batch->msg);
-                free (batch->msg);
-            }
-            self->batch_head = (self->batch_head + 1) % self->batch_limit;
-        }
+        while (BATCH_COUNT)
+            s_batch_drop (self);
+        if (self->direct_size)
+            zmq_msg_close (&self->direct);
         free (self->batch);
-        free (self->buffer);
+        s_ring_unmap (self->buffer, self->buffer_limit);
+        s_codec_charge (self, 0);
         free (self);
         *self_p = NULL;
     }
 }
 
 
+//  -------------------------------------------------------------------------
+//  Switch codec framing. Data already in the codec stays as it is, so
+//  switch when the peer expects new framing from this point on.
+
+static void
+vtx_codec_nom2 (vtx_codec_t *self, Bool nom2)
+{
+    assert (self);
+    self->nom2 = nom2;
+    self->run_open = FALSE;
+    self->inside = 0;
+}
+
+
 //  -------------------------------------------------------------------------
 //  Store 0MQ message into codec, returns 0 if OK, -1 if the store is full
 
@@ -246,43 +505,84 @@ vtx_codec_msg_put (vtx_codec_t *self, zmq_msg_t *msg, Bool more)
 
     //  Encode message header
     byte header [16];
-    uint header_size = s_put_zmq_header (msg, more, header);
-    uint msg_size = zmq_msg_size (msg);
+    size_t header_size;
+    size_t msg_size = zmq_msg_size (msg);
     if (self->debug)
-        printf ("msg_put size=%d\n", msg_size);
+        printf ("msg_put size=%zd\n", msg_size);
+
+    if (self->nom2)
+        return s_nom2_put (self, msg, more);
 
+    header_size = s_put_zmq_header (msg, more, header);
     if (msg_size < ZMQ_MAX_VSM_SIZE) {
-        //  Check sufficient space and prepare to write
-        if (s_batch_ready (self, header_size + msg_size))
+        //  Store header and data together in current VSM batch
+        if (s_batch_ready (self, header_size + msg_size, 0))
             return -1;
-        //  Store message header
         s_batch_store (self, header, header_size);
-        //  Store message data
         s_batch_store (self, zmq_msg_data (msg), msg_size);
     }
     else {
-        //  Check sufficient space and prepare to write
-        if (s_batch_ready (self, header_size))
+        //  Store header in VSM batch, then message as reference
+        if (s_batch_ready (self, header_size, 1)
+        ||  s_codec_charge (self, self->footprint + msg_size))
             return -1;
-        //  We will need a batch entry for the message reference
-        if (BATCH_TABLE_FULL)
-            return -1;
-
-        //  Store message header
         s_batch_store (self, header, header_size);
-        //  Store message reference
-        s_batch_start (self);
-        self->writer->msg = malloc (sizeof (zmq_msg_t));
-        zmq_msg_init (self->writer->msg);
-        zmq_msg_copy (self->writer->msg, msg);
+        batch_t *batch = BATCH_AT (self->batch_tail++);
+        batch->size = msg_size;
+        batch->is_msg = TRUE;
+        zmq_msg_init (&batch->msg);
+        zmq_msg_copy (&batch->msg, msg);
         if (self->debug)
-            printf ("store message=%p\n", self->writer->msg);
+            printf ("store message=%p\n", zmq_msg_data (&batch->msg));
     }
     self->active += header_size + msg_size;
     return 0;
 }
 
 
+//  Store 0MQ message with NOM-2 framing. A small frame joins the last run
+//  if nothing else was stored since, and we haven't started sending the
+//  run; we then patch the run length in place.
+
+static int
+s_nom2_put (vtx_codec_t *self, zmq_msg_t *msg, Bool more)
+{
+    size_t msg_size = zmq_msg_size (msg);
+    if (msg_size < ZMQ_MAX_VSM_SIZE) {
+        Bool join = self->run_open
+                 && BUFFER_USED >= VTX_NOM2_HEADER + self->run_size;
+        size_t header_size = join? 2: VTX_NOM2_HEADER + 2;
+        if (s_batch_ready (self, header_size + msg_size, 0))
+            return -1;
+        byte *run = NULL;
+        if (join)
+            run = self->buffer + ((self->buffer_tail - self->run_size
+                - VTX_NOM2_HEADER) & (self->buffer_limit - 1));
+        header_size = vtx_codec_nom2_header (BUFFER_TAIL, &run, msg_size, more);
+        s_batch_store (self, NULL, header_size);
+        s_batch_store (self, zmq_msg_data (msg), msg_size);
+        self->run_size = (join? self->run_size: 0) + 2 + msg_size;
+        self->run_open = TRUE;
+        self->active += header_size + msg_size;
+    }
+    else {
+        if (s_batch_ready (self, VTX_NOM2_HEADER, 1)
+        ||  s_codec_charge (self, self->footprint + msg_size))
+            return -1;
+        vtx_codec_nom2_header (BUFFER_TAIL, NULL, msg_size, more);
+        s_batch_store (self, NULL, VTX_NOM2_HEADER);
+        batch_t *batch = BATCH_AT (self->batch_tail++);
+        batch->size = msg_size;
+        batch->is_msg = TRUE;
+        zmq_msg_init (&batch->msg);
+        zmq_msg_copy (&batch->msg, msg);
+        self->run_open = FALSE;
+        self->active += VTX_NOM2_HEADER + msg_size;
+    }
+    return 0;
+}
+
+
 //  Encode 0MQ message frame header, return bytes written
 static inline size_t
 s_put_zmq_header (zmq_msg_t *msg, Bool more, byte *header)
@@ -309,69 +609,133 @@ s_put_zmq_header (zmq_msg_t *msg, Bool more, byte *header)
     }
 }
 
-//  Check sufficient space and prepare to write
-//      H=T     HT...............................   empty
-//      H=T     ..........HT.....................   empty
-//      H>T     ******T.............H************   one run
-//      H<T     H********************T...........   one run
-//      H<T     .........H**************T........   two runs
-//      H<T     H*******************************T   full
+//  Check there's space for this much data plus this many message batches.
+//  Data goes onto the last batch if that's a VSM batch, else it needs a
+//  new batch entry. Returns 0 if OK, -1 if the codec is full.
+
+static inline int
+s_batch_ready (vtx_codec_t *self, size_t required, uint batches)
+{
+    if (BATCH_COUNT == 0 || BATCH_LAST->is_msg)
+        batches++;
+    if (s_batch_fits (self, required, batches) == 0)
+        return 0;
+
+    //  Grow rings geometrically until it fits, within our limits
+    uint batch_limit = self->batch_limit? self->batch_limit: VTX_CODEC_BATCH_MIN;
+    while (batch_limit < BATCH_COUNT + batches && batch_limit < self->batch_max)
+        batch_limit <<= 1;
+    size_t buffer_limit = self->buffer_limit? self->buffer_limit: sysconf (_SC_PAGESIZE);
+    while (buffer_limit < BUFFER_USED + required && buffer_limit < self->buffer_max)
+        buffer_limit <<= 1;
+    if (BATCH_COUNT + batches > batch_limit
+    ||  BUFFER_USED + required > buffer_limit)
+        return -1;              //  Codec is at its limits
+    else
+        return s_codec_resize (self, batch_limit, buffer_limit);
+}
 
 static inline int
-s_batch_ready (vtx_codec_t *self, size_t required)
+s_batch_fits (vtx_codec_t *self, size_t required, uint batches)
 {
-    //  Open a writer if necessary
-    if ((self->writer->msg || self->writer->busy)
-    &&  s_batch_start (self))
+    if (BATCH_COUNT + batches > self->batch_limit
+    ||  BUFFER_USED + required > self->buffer_limit)
         return -1;
+    else
+        return 0;
+}
 
-    if (self->buffer_head <= self->buffer_tail) {
-        //  Look for free space at current buffer tail
-        self->free_space = self->buffer_limit - self->buffer_tail;
-        if (self->free_space < required + 1) {
-            //  If not sufficient, look at start of buffer
-            self->free_space = self->buffer_head;
-            if (self->free_space < required + 1)
-                return -1;
-            else {
-                //  Wrap around means starting new writer
-                if (self->writer->size && s_batch_start (self))
-                    return -1;
-                //  All ready, prepare to write at start of buffer
-                self->buffer_tail = 0;
-                self->writer->data = self->buffer;
-            }
-        }
-        else
-        if (self->free_space == required + 1
-        &&  BATCH_TABLE_FULL)
-            //  We'll have to start a new batch after this
-            return -1;
+
+//  Move codec contents to new rings of the specified sizes, which must
+//  be large enough. The contents end up at the start of the new rings.
+
+static int
+s_codec_resize (vtx_codec_t *self, uint batch_limit, size_t buffer_limit)
+{
+    assert (self->scanned == 0);
+    size_t footprint = self->footprint
+        - sizeof (batch_t) * self->batch_limit - self->buffer_limit
+        + sizeof (batch_t) * batch_limit + buffer_limit;
+    size_t old_footprint = self->footprint;
+    if (s_codec_charge (self, footprint))
+        return -1;              //  Budget won't let us grow
+
+    batch_t *batch = (batch_t *) malloc (sizeof (batch_t) * batch_limit);
+    byte *buffer = s_ring_map (buffer_limit);
+    if (!batch || !buffer) {
+        zclock_log ("E: can't grow codec: %s", strerror (errno));
+        free (batch);
+        s_ring_unmap (buffer, buffer_limit);
+        s_codec_charge (self, old_footprint);
+        return -1;
     }
-    else
-    if (self->buffer_head > self->buffer_tail) {
-        self->free_space = self->buffer_head - self->buffer_tail - 1;
-        if (self->free_space < required + 1)
-            return -1;
+    if (self->debug)
+        printf (" -- resize batches=%d buffer=%zd\n", batch_limit, buffer_limit);
+
+    uint count = BATCH_COUNT;
+    uint index;
+    for (index = 0; index < count; index++) {
+        batch_t *source = BATCH_AT (self->batch_head + index);
+        batch [index] = *source;
+        if (source->is_msg) {
+            zmq_msg_init (&batch [index].msg);
+            zmq_msg_move (&batch [index].msg, &source->msg);
+        }
     }
+    size_t used = BUFFER_USED;
+    if (used)
+        memcpy (buffer, BUFFER_HEAD, used);
+
+    free (self->batch);
+    s_ring_unmap (self->buffer, self->buffer_limit);
+    self->batch = batch;
+    self->batch_limit = batch_limit;
+    self->batch_head = 0;
+    self->batch_tail = count;
+    self->buffer = buffer;
+    self->buffer_limit = buffer_limit;
+    self->buffer_head = 0;
+    self->buffer_tail = used;
     return 0;
 }
 
 
-//  Store batch data, update batch length. Does not wrap around, caller
-//  must have called s_batch_ready before, to set things up.
+//  Store batch data, update batch length. If data is null, the caller
+//  has already stored the data at the buffer tail. The caller must have
+//  called s_batch_ready before, to check there is space.
+
 static inline void
 s_batch_store (vtx_codec_t *self, byte *data, size_t size)
 {
     if (self->debug)
-        printf ("store size=%zd at=%d/%d\n",
-            size, self->buffer_tail, self->buffer_limit);
-    assert (!self->writer->msg);
-    self->writer->size += size;
-    memcpy (self->buffer + self->buffer_tail, data, size);
+        printf ("store size=%zd at=%zd/%zd\n", size,
+            self->buffer_tail & (self->buffer_limit - 1), self->buffer_limit);
+    if (BATCH_COUNT == 0 || BATCH_LAST->is_msg) {
+        batch_t *batch = BATCH_AT (self->batch_tail++);
+        batch->size = 0;
+        batch->is_msg = FALSE;
+    }
+    if (data)
+        memcpy (BUFFER_TAIL, data, size);
+    BATCH_LAST->size += size;
     self->buffer_tail += size;
-    if (self->buffer_tail == self->buffer_limit)
-        s_batch_start (self);
+}
+
+
+//  Drop head batch, closing its message if any
+
+static inline void
+s_batch_drop (vtx_codec_t *self)
+{
+    batch_t *batch = BATCH_HEAD;
+    if (batch->is_msg) {
+        zmq_msg_close (&batch->msg);
+        s_codec_charge (self, self->footprint - batch->size);
+    }
+    self->batch_head++;
+    self->extracted = 0;
+    if (self->debug)
+        printf (" -- bump batch head=%d\n", self->batch_head);
 }
 
 
@@ -389,160 +753,246 @@ vtx_codec_msg_get (vtx_codec_t *self, zmq_msg_t *msg, Bool *more_p)
     assert (msg);
     assert (more_p);
 
-    //  Author's note:
-    //  This code is absolutely horrid, because there are so many different
-    //  edge cases. I'll think about a cleaner data structure that makes it
-    //  possible to extract messages in a single step.
-
-    //  Look for new batch to extract, if necessary
-    if (self->extract_size == 0) {
-        if (self->batch_head == self->batch_tail) {
-            if (self->debug)
-                printf ("** extract empty, head=%d tail=%d\n",
-                        self->batch_head, self->batch_tail);
-            return -1;          //  Buffer is empty
-        }
-        self->reader = &self->batch [self->batch_head];
-        if (self->debug)
-            printf ("extract batch at=%d tail=%d reader=%d bufhead=%d\n",
-                    self->batch_head, self->batch_tail,
-                    (int) (self->reader->data - self->buffer),
-                    self->buffer_head);
-        self->reader->busy = TRUE;
-        self->extract_data = self->reader->data;
-        self->extract_size = self->reader->size;
-        assert (self->extract_size);
-    }
-    //  Extract 0MQ message header from data
-    size_t header_size = s_get_zmq_header (self, msg, more_p, self->extract_data);
-    if (header_size == 0)
-        return -1;
-    size_t msg_size = zmq_msg_size (msg);
-    if (self->debug)
-        printf (" -- extract remaining=%zd msgsize=%zd\n", self->extract_size, msg_size);
-    self->extract_data += header_size;
-    self->extract_size -= header_size;
-    self->active -= header_size + msg_size;
-    self->buffer_head = self->extract_data - self->buffer;
-    if (self->debug)
-        printf (" -- bump buffer-head=%d (msg header)\n", self->buffer_head);
-
-    if (self->extract_size || msg_size == 0) {
-        //  Message data is in buffer
-        if (msg_size) {
-            memcpy (zmq_msg_data (msg), self->extract_data, msg_size);
-            self->extract_data += msg_size;
-            self->extract_size -= msg_size;
-            self->buffer_head = self->extract_data - self->buffer;
-            if (self->debug)
-                printf (" -- bump buffer-head=%d (msg body)\n", self->buffer_head);
-        }
-        if (self->extract_size == 0) {
-            self->batch_head = (self->batch_head + 1) % self->batch_limit;
-            if (self->debug)
-                printf (" -- bump batch head=%d (1)\n", self->batch_head);
-        }
+    if (BATCH_COUNT == 0)
+        return -1;              //  Buffer is empty
+
+    //  A frame header is always in a VSM batch, followed by its data in
+    //  the same batch, or by a message reference in the next batch. We
+    //  step into any NOM-2 run we find.
+    batch_t *batch;
+    size_t available;
+    size_t header_size;
+    size_t msg_size;
+    Bool in_run;
+    while (TRUE) {
+        batch = BATCH_HEAD;
+        assert (!batch->is_msg);
+        available = batch->size - self->extracted;
+        in_run = self->inside > 0;
+        Bool run;
+        header_size = s_get_header (self, BUFFER_HEAD, available, in_run,
+                                    &msg_size, more_p, &run);
+        if (header_size == 0)
+            return -1;          //  Header not complete yet
+        if (!run)
+            break;
+        self->inside = msg_size;
+        self->buffer_head += header_size;
+        self->extracted += header_size;
+        self->active -= header_size;
+        if (self->extracted == batch->size)
+            s_batch_drop (self);
+        if (BATCH_COUNT == 0)
+            return -1;
     }
-    else {
-        if (self->debug)
-            printf (" -- message split, at=%d msgsize=%zd\n",
-                (int) (self->extract_data - self->buffer), msg_size);
-
-        //  Batch is done, drop it
-        self->batch_head = (self->batch_head + 1) % self->batch_limit;
-        if (self->debug)
-            printf (" -- bump batch head=%d (2)\n", self->batch_head);
-        if (msg_size) {
-            //  Message may be stored by reference in next batch
-            self->reader = &self->batch [self->batch_head];
-            if (self->debug)
-                printf ("extract batch at=%d tail=%d reader=%d bufhead=%d (split)\n",
-                        self->batch_head, self->batch_tail,
-                        (int) (self->reader->data - self->buffer),
-                        self->buffer_head);
-            if (self->reader->size) {
-                //  Or may be in buffer directly
-                self->reader->busy = TRUE;
-                self->extract_data = self->reader->data;
-                self->extract_size = self->reader->size;
-                if (self->debug)
-                    printf (" -- extract remaining=%zd msgsize=%zd (split)\n",
-                            self->extract_size, msg_size);
-
-                memcpy (zmq_msg_data (msg), self->extract_data, msg_size);
-                self->extract_data += msg_size;
-                self->extract_size -= msg_size;
-                self->buffer_head = self->extract_data - self->buffer;
-                if (self->debug)
-                    printf (" -- bump buffer-head=%d (msg body, spilt)\n",
-                            self->buffer_head);
-                if (self->extract_size == 0) {
-                    self->batch_head = (self->batch_head + 1) % self->batch_limit;
-                    if (self->debug)
-                        printf (" -- bump batch head=%d (3)\n", self->batch_head);
-                }
-            }
-            else {
-                assert (self->reader->msg);
-                zmq_msg_copy (msg, self->reader->msg);
-                zmq_msg_close (self->reader->msg);
-                free (self->reader->msg);
-            }
+    if (in_run) {
+        if (header_size + msg_size > self->inside) {
+            self->invalid = TRUE;
+            return -1;          //  Frame overruns its run
         }
+        if (available < header_size + msg_size)
+            return -1;          //  Message data not complete yet
+        self->inside -= header_size + msg_size;
+    }
+    if (available >= header_size + msg_size) {
+        //  Message data is in buffer, and never wraps
+        zmq_msg_init_size (msg, msg_size);
+        memcpy (zmq_msg_data (msg), BUFFER_HEAD + header_size, msg_size);
+        self->buffer_head += header_size + msg_size;
+        self->extracted += header_size + msg_size;
+        if (self->extracted == batch->size)
+            s_batch_drop (self);
     }
+    else
+    if (available == header_size
+    &&  BATCH_COUNT > 1 && BATCH_AT (self->batch_head + 1)->is_msg) {
+        //  Message is stored by reference in next batch
+        self->buffer_head += header_size;
+        s_batch_drop (self);
+        batch = BATCH_HEAD;
+        assert (zmq_msg_size (&batch->msg) == msg_size);
+        //  Hand our reference to the caller rather than copying it
+        zmq_msg_init (msg);
+        zmq_msg_move (msg, &batch->msg);
+        s_batch_drop (self);
+    }
+    else
+        return -1;              //  Message data not complete yet
+
+    if (self->debug)
+        printf (" -- extract msgsize=%zd\n", msg_size);
+    self->active -= header_size + msg_size;
     return 0;
 }
 
-static void
-s_dump (vtx_codec_t *self)
+
+//  Decode 0MQ message frame header from available data. Returns header
+//  size, and sets frame size and more indicator. Returns zero if there
+//  is not yet enough data for a full header.
+
+static inline size_t
+s_get_zmq_header (byte *header, size_t size, size_t *frame_size, Bool *more)
 {
-    printf ("DUMP\n");
-    printf ("  batch  head=%d tail=%d\n", self->batch_head, self->batch_tail);
-    printf ("  buffer head=%d tail=%d size=%d\n",
-            self->buffer_head, self->buffer_tail, self->buffer_limit);
-    printf ("  extract data=%d size=%zd\n",
-            (int) (self->extract_data - self->buffer), self->extract_size);
-    puts ("");
+    if (size < 2)
+        return 0;
+    if (header [0] < 0xFF) {
+        *frame_size = header [0];
+        *more = (header [1] == 1);
+        return 2;
+    }
+    if (size < 10)
+        return 0;
+    *frame_size = ((int64_t) (header [1]) << 56)
+                + ((int64_t) (header [2]) << 48)
+                + ((int64_t) (header [3]) << 40)
+                + ((int64_t) (header [4]) << 32)
+                + ((int64_t) (header [5]) << 24)
+                + ((int64_t) (header [6]) << 16)
+                + ((int64_t) (header [7]) << 8)
+                + ((int64_t) (header [8]));
+    *more = (header [9] == 1);
+    return 10;
 }
 
-//  Decode 0MQ message frame header, return bytes scanned.
-//  If there is sufficient active data, initializes message to
-//  appropriate size. If there is insufficient active data, returns
-//  zero,
+
+//  Decode NOM-2 frame header from available data. Returns header size,
+//  and sets body size, more indicator, and whether the frame is a run of
+//  small frames. Inside a run, headers are those of small frames. Returns
+//  zero if there is not yet enough data for a full header.
+
 static inline size_t
-s_get_zmq_header (vtx_codec_t *self, zmq_msg_t *msg, Bool *more, byte *header)
+s_get_nom2_header (byte *header, size_t size, Bool in_run,
+                   size_t *body_size, Bool *more, Bool *run)
 {
-    size_t frame_size = header [0];
-    if (frame_size < 0xFF) {
-        if (frame_size == 0) {
-            s_dump (self);
-            int i;
-            for (i = 0; i < 10; i++)
-                printf ("%02x ", header [i]);
-            puts ("");
-        }
-        assert (frame_size > 0);
-        *more = (header [1] == 1);
-        if (self->active < frame_size)
+    if (in_run) {
+        if (size < 2)
             return 0;
-        zmq_msg_init_size (msg, frame_size - 1);
+        *more = (header [0] & VTX_NOM2_MORE) != 0;
+        *run = FALSE;
+        *body_size = header [1];
         return 2;
     }
+    if (size < VTX_NOM2_HEADER)
+        return 0;
+    *more = (header [0] & VTX_NOM2_MORE) != 0;
+    *run = (header [0] & VTX_NOM2_RUN) != 0;
+    *body_size = ((uint64_t) (header [1]) << 48)
+               + ((uint64_t) (header [2]) << 40)
+               + ((uint64_t) (header [3]) << 32)
+               + ((uint64_t) (header [4]) << 24)
+               + ((uint64_t) (header [5]) << 16)
+               + ((uint64_t) (header [6]) << 8)
+               + ((uint64_t) (header [7]));
+    return VTX_NOM2_HEADER;
+}
+
+
+//  Decode frame header in codec's framing, giving size of frame body.
+//  A header we can't accept marks the codec invalid and reads as if it
+//  were incomplete, so the frame never comes out.
+
+static inline size_t
+s_get_header (vtx_codec_t *self, byte *header, size_t size, Bool in_run,
+              size_t *body_size, Bool *more, Bool *run)
+{
+    size_t header_size;
+    if (self->nom2)
+        header_size = s_get_nom2_header (header, size, in_run,
+                                         body_size, more, run);
     else {
-        frame_size = ((int64_t) (header [1]) << 56)
-                   + ((int64_t) (header [2]) << 48)
-                   + ((int64_t) (header [3]) << 40)
-                   + ((int64_t) (header [4]) << 32)
-                   + ((int64_t) (header [5]) << 24)
-                   + ((int64_t) (header [6]) << 16)
-                   + ((int64_t) (header [7]) << 8)
-                   + ((int64_t) (header [8]));
-        assert (frame_size > 0);
-        *more = (header [9] == 1);
-        if (self->active < frame_size)
-            return 0;
-        zmq_msg_init_size (msg, frame_size - 1);
-        return 10;
+        size_t frame_size;
+        header_size = s_get_zmq_header (header, size, &frame_size, more);
+        if (header_size && frame_size == 0)
+            self->invalid = TRUE;
+        else
+        if (header_size) {
+            *body_size = frame_size - 1;
+            *run = FALSE;
+        }
+    }
+    if (header_size && *body_size > VTX_CODEC_FRAME_MAX)
+        self->invalid = TRUE;
+    return self->invalid? 0: header_size;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Decode a run of complete frames from the head VSM batch. Since the
+//  data ring is mirrored, the batch is one contiguous block and we can
+//  walk it with a single pointer, and update codec state only once for
+//  the whole run. A frame's position depends on the previous frame's
+//  length, so this is a serial scan, not something we can vectorize.
+
+static uint
+vtx_codec_slices_get (vtx_codec_t *self, vtx_slice_t *slices, uint limit)
+{
+    assert (self);
+    assert (slices);
+    assert (self->scanned == 0);
+
+    if (BATCH_COUNT == 0 || BATCH_HEAD->is_msg)
+        return 0;
+
+    byte *start = BUFFER_HEAD;
+    byte *scan = start;
+    byte *end = start + BATCH_HEAD->size - self->extracted;
+    size_t inside = self->inside;
+    uint count = 0;
+    while (count < limit) {
+        size_t body_size;
+        Bool more, run;
+        Bool in_run = inside > 0;
+        size_t header_size = s_get_header (self, scan, end - scan, in_run,
+                                           &body_size, &more, &run);
+        if (header_size == 0)
+            break;              //  Header not complete yet
+        if (run) {
+            //  Step into NOM-2 run of small frames
+            scan += header_size;
+            inside = body_size;
+            continue;
+        }
+        if (in_run && header_size + body_size > inside) {
+            self->invalid = TRUE;
+            break;              //  Frame overruns its run
+        }
+        if ((size_t) (end - scan) < header_size + body_size)
+            break;              //  Frame not complete yet
+        if (in_run)
+            inside -= header_size + body_size;
+        slices [count].data = scan + header_size;
+        slices [count].size = body_size;
+        slices [count].more = more;
+        scan += header_size + body_size;
+        count++;
+    }
+    self->scanned = scan - start;
+    self->scan_inside = inside;
+    if (self->debug)
+        printf (" -- sliced frames=%d size=%zd\n", count, self->scanned);
+    //  If we only stepped into a run, there's nothing for caller to drop
+    if (count == 0)
+        vtx_codec_slices_drop (self);
+    return count;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Remove frames returned by the last vtx_codec_slices_get() call
+
+static void
+vtx_codec_slices_drop (vtx_codec_t *self)
+{
+    assert (self);
+    if (self->scanned) {
+        batch_t *batch = BATCH_HEAD;
+        self->inside = self->scan_inside;
+        self->buffer_head += self->scanned;
+        self->extracted += self->scanned;
+        self->active -= self->scanned;
+        self->scanned = 0;
+        if (self->extracted == batch->size)
+            s_batch_drop (self);
     }
 }
 
@@ -553,23 +1003,28 @@ s_get_zmq_header (vtx_codec_t *self, zmq_msg_t *msg, Bool *more, byte *header)
 static int
 vtx_codec_bin_put (vtx_codec_t *self, byte *data, size_t size)
 {
-    if (s_batch_ready (self, size) == 0) {
-        if (self->debug)
-            printf ("bin put size=%zd at=%d/%d\n",
-                size, self->buffer_tail, self->buffer_limit);
-        s_batch_store (self, data, size);
-        self->active += size;
-        return 0;
+    assert (self);
+    if (self->debug)
+        printf ("bin put size=%zd\n", size);
+    while (size) {
+        byte *space;
+        size_t chunk = vtx_codec_bin_reserve (self, &space);
+        if (chunk == 0)
+            return -1;
+        if (chunk > size)
+            chunk = size;
+        memcpy (space, data, chunk);
+        vtx_codec_bin_commit (self, chunk);
+        data += chunk;
+        size -= chunk;
     }
-    else
-        return -1;
+    return 0;
 }
 
 
 //  -------------------------------------------------------------------------
-//  Fetch serialized data from codec. You can process the serialized data
-//  in chunks, each time calling bin_tick() with the actual amount processed,
-//  and then bin_get() again to get a new pointer.
+//  Fetch serialized data from codec. Returns size of data block and sets
+//  data_p to point to it. Returns 0 if there's no data to fetch.
 
 static size_t
 vtx_codec_bin_get (vtx_codec_t *self, byte **data_p)
@@ -577,26 +1032,18 @@ vtx_codec_bin_get (vtx_codec_t *self, byte **data_p)
     assert (self);
     assert (data_p);
 
-    //  Look for new batch to extract, if necessary
-    if (self->extract_size == 0
-    &&  self->batch_head != self->batch_tail) {
-        self->reader = &self->batch [self->batch_head];
-        if (self->reader->msg) {
-            self->reader->busy = TRUE;
-            self->extract_data = zmq_msg_data (self->reader->msg);
-            self->extract_size = zmq_msg_size (self->reader->msg);
-        }
+    size_t size = 0;
+    if (BATCH_COUNT) {
+        batch_t *batch = BATCH_HEAD;
+        size = batch->size - self->extracted;
+        if (batch->is_msg)
+            *data_p = (byte *) zmq_msg_data (&batch->msg) + self->extracted;
         else
-        if (self->reader->size) {
-            self->reader->busy = TRUE;
-            self->extract_data = self->reader->data;
-            self->extract_size = self->reader->size;
-        }
+            *data_p = BUFFER_HEAD;
     }
-    *data_p = self->extract_data;
     if (self->debug)
-        printf ("get bin size=%zd\n", self->extract_size);
-    return self->extract_size;
+        printf ("get bin size=%zd\n", size);
+    return size;
 }
 
 
@@ -607,28 +1054,121 @@ static void
 vtx_codec_bin_tick (vtx_codec_t *self, size_t size)
 {
     assert (self);
-    assert (size <= self->extract_size);
-
     if (size) {
-        self->extract_size -= size;
-        self->extract_data += size;
-        if (self->extract_size == 0) {
-            if (self->debug)
-                printf (" -- bump batch head=%d (4)\n", self->batch_head);
-            self->batch_head = (self->batch_head + 1) % self->batch_limit;
-            if (self->reader->msg) {
-                zmq_msg_close (self->reader->msg);
-                free (self->reader->msg);
-            }
-            else
-                self->buffer_head = (self->buffer_head + self->reader->size)
-                                   % self->buffer_limit;
-        }
+        batch_t *batch = BATCH_HEAD;
+        assert (size <= batch->size - self->extracted);
+        if (!batch->is_msg)
+            self->buffer_head += size;
+        self->extracted += size;
+        if (self->extracted == batch->size)
+            s_batch_drop (self);
         self->active -= size;
     }
 }
 
 
+//  -------------------------------------------------------------------------
+//  Return free space for serialized data and point data_p to it. Thanks
+//  to the mirrored mapping, all free space is one contiguous block.
+
+static size_t
+vtx_codec_bin_reserve (vtx_codec_t *self, byte **data_p)
+{
+    assert (self);
+    assert (data_p);
+    if (self->invalid)
+        return 0;               //  Take nothing more from this peer
+    if (!self->direct_size)
+        s_direct_start (self);
+    if (self->direct_size) {
+        *data_p = (byte *) zmq_msg_data (&self->direct) + self->direct_filled;
+        return self->direct_size - self->direct_filled;
+    }
+    //  Grow codec if it's full, or not yet allocated
+    size_t space = vtx_codec_bin_space (self);
+    if (space == 0
+    &&  s_batch_ready (self, self->buffer_limit - BUFFER_USED + 1, 0) == 0)
+        space = vtx_codec_bin_space (self);
+    *data_p = BUFFER_TAIL;
+    return space;
+}
+
+
+//  If all that's left in the codec is the start of a large frame, move
+//  the part of the body we have into a new message and take it out of
+//  the buffer. It's at the buffer tail, so that's just a rewind.
+
+static void
+s_direct_start (vtx_codec_t *self)
+{
+    if (BATCH_COUNT != 1 || BATCH_HEAD->is_msg || self->scanned
+    ||  self->batch_limit < 2)
+        return;
+
+    size_t available = BATCH_HEAD->size - self->extracted;
+    size_t msg_size;
+    Bool more, run;
+    size_t header_size = s_get_header (self, BUFFER_HEAD, available,
+        self->inside > 0, &msg_size, &more, &run);
+    if (header_size == 0
+    ||  run || self->inside
+    ||  available >= header_size + msg_size
+    ||  (msg_size < VTX_CODEC_DIRECT_MIN
+    &&   header_size + msg_size <= self->buffer_max))
+        return;
+
+    size_t footprint = self->footprint;
+    if (s_codec_charge (self, footprint + msg_size))
+        return;                 //  Budget won't let us take message
+    if (zmq_msg_init_size (&self->direct, msg_size)) {
+        s_codec_charge (self, footprint);
+        return;                 //  No memory, so frame stays in buffer
+    }
+    size_t partial = available - header_size;
+    memcpy (zmq_msg_data (&self->direct), BUFFER_HEAD + header_size, partial);
+    self->direct_size = msg_size;
+    self->direct_filled = partial;
+    self->buffer_tail -= partial;
+    BATCH_HEAD->size -= partial;
+    self->active -= partial;
+    if (self->debug)
+        printf (" -- direct receive msgsize=%zd partial=%zd\n", msg_size, partial);
+}
+
+
+//  -------------------------------------------------------------------------
+//  Update codec with actual amount of data stored into reserved space
+
+static void
+vtx_codec_bin_commit (vtx_codec_t *self, size_t size)
+{
+    assert (self);
+    if (self->debug)
+        printf ("bin commit size=%zd\n", size);
+    if (self->direct_size) {
+        //  Store message as batch when it's complete
+        assert (size <= self->direct_size - self->direct_filled);
+        self->direct_filled += size;
+        if (self->direct_filled == self->direct_size) {
+            batch_t *batch = BATCH_AT (self->batch_tail++);
+            batch->size = self->direct_size;
+            batch->is_msg = TRUE;
+            zmq_msg_init (&batch->msg);
+            zmq_msg_move (&batch->msg, &self->direct);
+            zmq_msg_close (&self->direct);
+            self->active += self->direct_size;
+            self->direct_size = 0;
+        }
+    }
+    else
+    if (size) {
+        assert (size <= vtx_codec_bin_space (self));
+        s_batch_store (self, NULL, size);
+        self->active += size;
+    }
+}
+
+
 //  -------------------------------------------------------------------------
 //  Return capacity for new input data, 0 means full
 
@@ -636,11 +1176,22 @@ static size_t
 vtx_codec_bin_space (vtx_codec_t *self)
 {
     assert (self);
-
-    if (s_batch_ready (self, 1) == 0)
-        return self->free_space;
+    uint batches = (BATCH_COUNT == 0 || BATCH_LAST->is_msg)? 1: 0;
+    if (s_batch_fits (self, 0, batches))
+        return 0;               //  Batch table full
     else
-        return 0;
+        return self->buffer_limit - BUFFER_USED;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Return TRUE if peer sent a frame the codec can't take
+
+static Bool
+vtx_codec_invalid (vtx_codec_t *self)
+{
+    assert (self);
+    return self->invalid;
 }
 
 
@@ -655,6 +1206,50 @@ vtx_codec_active (vtx_codec_t *self)
 }
 
 
+//  -------------------------------------------------------------------------
+//  Return memory held by codec: buffers and referenced messages
+
+static size_t
+vtx_codec_footprint (vtx_codec_t *self)
+{
+    assert (self);
+    return self->footprint;
+}
+
+
+//  Set codec footprint, charging the difference to our budget and every
+//  budget it's part of. Returns -1 if a budget refuses an increase.
+
+static int
+s_codec_charge (vtx_codec_t *self, size_t footprint)
+{
+    vtx_budget_t *budget;
+    if (footprint > self->footprint) {
+        for (budget = self->budget; budget; budget = budget->parent) {
+            if (budget->limit == 0)
+                continue;
+            size_t used = budget->used - self->footprint + footprint;
+            uint holders = budget->holders + (self->footprint? 0: 1);
+            if (used > budget->limit)
+                return -1;      //  Budget exhausted
+            if (used > budget->limit / 2
+            &&  footprint > budget->limit / (holders + 1))
+                return -1;      //  Over our fair share of a busy budget
+        }
+    }
+    for (budget = self->budget; budget; budget = budget->parent) {
+        budget->used = budget->used - self->footprint + footprint;
+        if (self->footprint == 0 && footprint)
+            budget->holders++;
+        else
+        if (self->footprint && footprint == 0)
+            budget->holders--;
+    }
+    self->footprint = footprint;
+    return 0;
+}
+
+
 //  -------------------------------------------------------------------------
 //  Consistency check of codec, asserts if there's a fault
 
@@ -663,23 +1258,334 @@ vtx_codec_check (vtx_codec_t *self, char *text)
 {
     assert (self);
 
-    uint head = self->batch_head;
-    while (head != self->batch_tail) {
-        batch_t *batch = &self->batch [head];
-        if (batch->size > 0 && batch->msg == NULL && batch->data [0] == 0
-            && batch->data > self->buffer) {
-            printf ("(%s) %p - ", text, batch->data);
-            int i;
-            for (i = 0; i < batch->size && i < 40; i++)
-                printf ("%02x ", batch->data [i]);
-            puts ("");
-            printf ("Invalid zero data, at=%d size=%d this=%d head=%d tail=%d\n",
-                    (int) (batch->data - self->buffer),
-                    batch->size, head, self->batch_head, self->batch_tail);
-            assert (0);
+    //  VSM batches must account for all data in buffer, and all batches
+    //  together for all active data
+    size_t buffered = 0;
+    size_t active = 0;
+    uint index;
+    for (index = self->batch_head; index != self->batch_tail; index++) {
+        batch_t *batch = BATCH_AT (index);
+        size_t size = batch->size;
+        if (index == self->batch_head)
+            size -= self->extracted;
+        if (!batch->is_msg)
+            buffered += size;
+        active += size;
+    }
+    if (BATCH_COUNT > self->batch_limit
+    ||  BUFFER_USED > self->buffer_limit
+    ||  buffered != BUFFER_USED
+    ||  active != self->active) {
+        printf ("(%s) batches=%d buffered=%zd/%zd active=%zd/%zd\n", text,
+            BATCH_COUNT, buffered, BUFFER_USED, active, self->active);
+        assert (0);
+    }
+}
+
+
+//  -------------------------------------------------------------------------
+//  Map a ring of the specified size twice, back to back, so that data
+//  wrapping past the end of the ring can be read or written as a single
+//  block. The size must be a multiple of the page size. Returns NULL if
+//  the system won't let us, and counts the failure.
+
+static uint
+    s_ring_map_failures = 0;
+
+static byte *
+s_ring_map (size_t size)
+{
+#if defined (MFD_CLOEXEC)
+    int handle = memfd_create ("vtx_codec", MFD_CLOEXEC);
+#else
+    char name [64];
+    snprintf (name, sizeof (name), "/vtx_codec.%d.%p", getpid (), (void *) name);
+    int handle = shm_open (name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (handle != -1)
+        shm_unlink (name);
+#endif
+    //  Reserve address space for both copies, then map the same pages
+    //  over each half
+    byte *ring = NULL;
+    if (handle != -1 && ftruncate (handle, size) == 0) {
+        ring = (byte *) mmap (NULL, 2 * size, PROT_NONE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring == MAP_FAILED)
+            ring = NULL;
+        else
+        if (mmap (ring, size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_FIXED, handle, 0) == MAP_FAILED
+        ||  mmap (ring + size, size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_FIXED, handle, 0) == MAP_FAILED) {
+            munmap (ring, 2 * size);
+            ring = NULL;
         }
-        head = (head + 1) % self->batch_limit;
     }
+    if (handle != -1)
+        close (handle);
+    if (!ring)
+        __atomic_add_fetch (&s_ring_map_failures, 1, __ATOMIC_RELAXED);
+    return ring;
+}
+
+static void
+s_ring_unmap (byte *ring, size_t size)
+{
+    if (ring)
+        munmap (ring, 2 * size);
+}
+
+
+//  -------------------------------------------------------------------------
+//  Encode NOM-2 frame header. This is the one encoder for NOM-2 framing,
+//  used by the codec and by drivers that encode into flat buffers.
+
+static void
+s_nom2_put_header (byte *header, byte flags, uint64_t length)
+{
+    header [0] = flags;
+    header [1] = (byte) (length >> 48);
+    header [2] = (byte) (length >> 40);
+    header [3] = (byte) (length >> 32);
+    header [4] = (byte) (length >> 24);
+    header [5] = (byte) (length >> 16);
+    header [6] = (byte) (length >> 8);
+    header [7] = (byte) (length);
+}
+
+static size_t
+vtx_codec_nom2_header (byte *target, byte **run_p, size_t size, Bool more)
+{
+    byte flags = more? VTX_NOM2_MORE: 0;
+    if (run_p && size <= VTX_NOM2_SMALL) {
+        size_t header_size = 2;
+        if (*run_p == NULL) {
+            *run_p = target;
+            s_nom2_put_header (target, VTX_NOM2_RUN, 0);
+            target += VTX_NOM2_HEADER;
+            header_size += VTX_NOM2_HEADER;
+        }
+        target [0] = flags;
+        target [1] = (byte) size;
+        //  Add small frame to run length
+        byte *run = *run_p;
+        size_t length = 0;
+        uint index;
+        for (index = 1; index < VTX_NOM2_HEADER; index++)
+            length = (length << 8) + run [index];
+        s_nom2_put_header (run, VTX_NOM2_RUN, length + 2 + size);
+        return header_size;
+    }
+    s_nom2_put_header (target, flags, size);
+    if (run_p)
+        *run_p = NULL;
+    return VTX_NOM2_HEADER;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Encode message into flat buffer with NOM-2 framing
+
+static size_t
+vtx_codec_nom2_encode (zmsg_t *msg, byte *buffer, size_t limit)
+{
+    byte *run = NULL;
+    size_t size = 0;
+    zframe_t *frame = zmsg_first (msg);
+    while (frame) {
+        zframe_t *next = zmsg_next (msg);
+        size_t frame_size = zframe_size (frame);
+        //  Check against largest header we might write
+        if (size + VTX_NOM2_HEADER + 2 + frame_size > limit)
+            return limit + 1;
+        size += vtx_codec_nom2_header (buffer + size, &run,
+                                       frame_size, next != NULL);
+        memcpy (buffer + size, zframe_data (frame), frame_size);
+        size += frame_size;
+        frame = next;
+    }
+    return size;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Decode message from flat buffer with NOM-2 framing. We check every
+//  size, since the data comes off the network.
+
+static zmsg_t *
+vtx_codec_nom2_decode (byte *data, size_t size)
+{
+    zmsg_t *msg = zmsg_new ();
+    byte *end = data + size;
+    size_t inside = 0;
+    while (data < end) {
+        size_t body_size;
+        Bool more, run;
+        Bool in_run = inside > 0;
+        size_t header_size = s_get_nom2_header (data, end - data, in_run,
+                                                &body_size, &more, &run);
+        if (header_size == 0
+        ||  body_size > (size_t) (end - data) - header_size
+        || (in_run && header_size + body_size > inside))
+            break;
+        data += header_size;
+        if (run)
+            inside = body_size;
+        else {
+            zmsg_add (msg, zframe_new (data, body_size));
+            data += body_size;
+            if (in_run)
+                inside -= header_size + body_size;
+        }
+    }
+    if (data < end || inside) {
+        zmsg_destroy (&msg);
+        return NULL;
+    }
+    return msg;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Return number of data rings we could not map
+
+static uint
+vtx_codec_map_failures (void)
+{
+    return __atomic_load_n (&s_ring_map_failures, __ATOMIC_RELAXED);
+}
+
+
+//  -------------------------------------------------------------------------
+//  Return codec algorithm by number
+
+static vtx_codec_algo_t *
+vtx_codec_algo (int number)
+{
+    if (number >= 0
+    &&  number < sizeof (s_codec_algos) / sizeof (s_codec_algos [0]))
+        return &s_codec_algos [number];
+    else
+        return NULL;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Take serialized data from the codec and pack it into a block. We gather
+//  data across batches into the block body, so runs of small messages and
+//  message headers pack together, and then pack the body in place. If the
+//  algorithm can't make the data smaller, we send it as stored.
+
+static size_t
+vtx_codec_block_get (vtx_codec_t *self, vtx_codec_algo_t *algo,
+                     void *state, byte *block)
+{
+    assert (self);
+    byte *body = block + VTX_CODEC_BLOCK_HEADER;
+    size_t size = 0;
+    while (size < VTX_CODEC_BLOCK) {
+        byte *data;
+        size_t available = vtx_codec_bin_get (self, &data);
+        if (available == 0)
+            break;
+        if (available > VTX_CODEC_BLOCK - size)
+            available = VTX_CODEC_BLOCK - size;
+        memcpy (body + size, data, available);
+        vtx_codec_bin_tick (self, available);
+        size += available;
+    }
+    if (size == 0)
+        return 0;
+
+    size_t packed = algo->pack_fn?
+        algo->pack_fn (state, body, size, body, size - 1): 0;
+    if (packed)
+        block [0] = 1;
+    else {
+        block [0] = 0;
+        packed = size;
+    }
+    block [1] = (byte) ((size - 1) >> 8);
+    block [2] = (byte)  (size - 1);
+    block [3] = (byte) ((packed - 1) >> 8);
+    block [4] = (byte)  (packed - 1);
+    return VTX_CODEC_BLOCK_HEADER + packed;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Return full size of block, or 0 if header is incomplete
+
+static size_t
+vtx_codec_block_size (byte *data, size_t size)
+{
+    if (size < VTX_CODEC_BLOCK_HEADER)
+        return 0;
+    return VTX_CODEC_BLOCK_HEADER + 1 + ((data [3] << 8) | data [4]);
+}
+
+
+//  -------------------------------------------------------------------------
+//  Unpack complete block. Stored blocks need no work; we check everything
+//  else, since the block comes off the network.
+
+static ssize_t
+vtx_codec_block_unpack (vtx_codec_algo_t *algo, void *state,
+                        byte *block, byte **data_p)
+{
+    size_t raw_size = 1 + ((block [1] << 8) | block [2]);
+    size_t packed_size = 1 + ((block [3] << 8) | block [4]);
+    byte *body = block + VTX_CODEC_BLOCK_HEADER;
+    if (raw_size > VTX_CODEC_BLOCK)
+        return -1;
+    if (block [0] == 0) {
+        if (packed_size != raw_size)
+            return -1;
+        *data_p = body;
+    }
+    else
+    if (block [0] != 1
+    ||  algo->unpack_fn == NULL
+    ||  algo->unpack_fn (state, body, packed_size, raw_size, data_p))
+        return -1;
+    return raw_size;
+}
+
+
+//  -------------------------------------------------------------------------
+//  LZ algorithm, without and with the built-in dictionary
+
+static void *
+s_lz_new (void)
+{
+    return vtx_lz_new (NULL, 0);
+}
+
+static void *
+s_lz_dict_new (void)
+{
+    size_t dict_size;
+    byte *dict = vtx_lz_dictionary (&dict_size);
+    return vtx_lz_new (dict, dict_size);
+}
+
+static void
+s_lz_destroy (void **state_p)
+{
+    vtx_lz_destroy ((vtx_lz_t **) state_p);
+}
+
+static size_t
+s_lz_pack (void *state, byte *data, size_t size, byte *dest, size_t limit)
+{
+    return vtx_lz_compress ((vtx_lz_t *) state, data, size, dest, limit);
+}
+
+static int
+s_lz_unpack (void *state, byte *data, size_t size,
+             size_t expected, byte **data_p)
+{
+    return vtx_lz_expand ((vtx_lz_t *) state, data, size, expected, data_p);
 }
 
 
@@ -689,65 +1595,382 @@ vtx_codec_check (vtx_codec_t *self, char *text)
 static void
 vtx_codec_selftest (void)
 {
+    //  Check large messages come back out as the same reference
+    vtx_codec_t *codec = vtx_codec_new (2, NULL);
+    assert (codec);
+    assert (codec->buffer == NULL);
+    zmq_msg_t msg;
+    Bool more;
+    zmq_msg_init_size (&msg, 1000);
+    byte *content = (byte *) zmq_msg_data (&msg);
+    assert (vtx_codec_msg_put (codec, &msg, TRUE) == 0);
+    zmq_msg_close (&msg);
+    assert (vtx_codec_msg_get (codec, &msg, &more) == 0);
+    assert (zmq_msg_data (&msg) == content);
+    assert (more);
+    zmq_msg_close (&msg);
+    assert (vtx_codec_active (codec) == 0);
+
+    //  Check the data ring really is mirrored
+    assert (codec->buffer);
+    assert (vtx_codec_map_failures () == 0);
+    codec->buffer [0] = 'A';
+    assert (codec->buffer [codec->buffer_limit] == 'A');
+    codec->buffer [2 * codec->buffer_limit - 1] = 'Z';
+    assert (codec->buffer [codec->buffer_limit - 1] == 'Z');
+
+    //  Check an empty codec releases its buffers
+    assert (vtx_codec_release (codec) == 0);
+    assert (codec->buffer == NULL);
+    vtx_codec_destroy (&codec);
+    assert (codec == NULL);
+
+    //  Check a frame larger than the data buffer is received directly
+    //  into its message, and arrives complete
+    vtx_codec_t *sender = vtx_codec_new (2, NULL);
+    vtx_codec_t *receiver = vtx_codec_new (2, NULL);
+    zmq_msg_init_size (&msg, 100000);
+    content = (byte *) zmq_msg_data (&msg);
+    size_t index;
+    for (index = 0; index < 100000; index++)
+        content [index] = (byte) index;
+    assert (vtx_codec_msg_put (sender, &msg, FALSE) == 0);
+    zmq_msg_close (&msg);
+    while (TRUE) {
+        byte *data;
+        size_t size = vtx_codec_bin_get (sender, &data);
+        if (size == 0)
+            break;
+        if (size > 1000)
+            size = 1000;
+        assert (vtx_codec_bin_put (receiver, data, size) == 0);
+        vtx_codec_bin_tick (sender, size);
+        vtx_codec_check (receiver, "direct");
+    }
+    assert (vtx_codec_msg_get (receiver, &msg, &more) == 0);
+    assert (zmq_msg_size (&msg) == 100000);
+    content = (byte *) zmq_msg_data (&msg);
+    for (index = 0; index < 100000; index++)
+        assert (content [index] == (byte) index);
+    zmq_msg_close (&msg);
+    assert (vtx_codec_active (receiver) == 0);
+
+    //  Check a header for a frame over the limit stops input, and the
+    //  codec doesn't try to allocate the frame
+    byte huge [10] = { 0xFF, 0x7F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0 };
+    assert (vtx_codec_bin_put (receiver, huge, sizeof (huge)) == 0);
+    assert (vtx_codec_msg_get (receiver, &msg, &more) == -1);
+    assert (vtx_codec_invalid (receiver));
+    assert (vtx_codec_bin_put (receiver, huge, sizeof (huge)) == -1);
+    byte *data;
+    assert (vtx_codec_bin_reserve (receiver, &data) == 0);
+    vtx_codec_destroy (&sender);
+    vtx_codec_destroy (&receiver);
+
+    //  Check a NOM-2 run holding a frame longer than the run stops
+    //  input, whether we take frames one at a time or as slices
+    byte corrupt [14] = { VTX_NOM2_RUN, 0, 0, 0, 0, 0, 0, 4, 0, 4, 1, 2, 3, 4 };
+    receiver = vtx_codec_new (2, NULL);
+    vtx_codec_nom2 (receiver, TRUE);
+    assert (vtx_codec_bin_put (receiver, corrupt, sizeof (corrupt)) == 0);
+    assert (vtx_codec_msg_get (receiver, &msg, &more) == -1);
+    assert (vtx_codec_invalid (receiver));
+    vtx_codec_destroy (&receiver);
+    receiver = vtx_codec_new (2, NULL);
+    vtx_codec_nom2 (receiver, TRUE);
+    assert (vtx_codec_bin_put (receiver, corrupt, sizeof (corrupt)) == 0);
+    vtx_slice_t slices [4];
+    assert (vtx_codec_slices_get (receiver, slices, 4) == 0);
+    assert (vtx_codec_invalid (receiver));
+    vtx_codec_destroy (&receiver);
+
+    //  Check codecs stay within their budget, and a greedy codec can't
+    //  starve a newcomer
+    vtx_budget_t budget = { 256 * 1024, 0, 0, NULL };
+    vtx_codec_t *greedy = vtx_codec_new (100000, &budget);
+    zmq_msg_init_size (&msg, 10);
+    while (vtx_codec_msg_put (greedy, &msg, FALSE) == 0)
+        assert (budget.used <= budget.limit);
+    zmq_msg_close (&msg);
+    zmq_msg_init_size (&msg, 10000);
+    assert (vtx_codec_msg_put (greedy, &msg, FALSE) == -1);
+    assert (vtx_codec_footprint (greedy) <= budget.limit / 2);
+    vtx_codec_t *newcomer = vtx_codec_new (100000, &budget);
+    assert (vtx_codec_msg_put (newcomer, &msg, FALSE) == 0);
+    assert (budget.holders == 2);
+    zmq_msg_close (&msg);
+    vtx_codec_destroy (&greedy);
+    vtx_codec_destroy (&newcomer);
+    assert (budget.used == 0 && budget.holders == 0);
+
     //  Run randomized inserts/extracts for 1 second.
     //  This is NOT fast, if you want to run a performance test then
-    //  remove the codec_store calls
+    //  remove the codec_check calls
 
-    vtx_codec_t *codec1 = vtx_codec_new (100);
-    vtx_codec_t *codec2 = vtx_codec_new (10000);
+    vtx_codec_t *codec1 = vtx_codec_new (100, NULL);
+    vtx_codec_t *codec2 = vtx_codec_new (10000, NULL);
     codec1->debug = FALSE;
     codec2->debug = FALSE;
     int msg_count = 0;
     int64_t start = zclock_time ();
 
     while (TRUE) {
-        //  Insert a bunch of messages
+        //  Insert a bunch of messages, each filled with its own size
         int insert = s_random (1000);
         while (insert--) {
             //  80% smaller, 20% larger messages
             size_t size = s_random (s_random (10) < 8? ZMQ_MAX_VSM_SIZE: 5000);
             zmq_msg_t msg;
             zmq_msg_init_size (&msg, size);
+            memset (zmq_msg_data (&msg), (byte) size, size);
             int rc = vtx_codec_msg_put (codec1, &msg, FALSE);
             vtx_codec_check (codec1, "msg put");
-            msg_count++;
             zmq_msg_close (&msg);
             if (rc)
                 break;          //  If store full, stop inserting
+            msg_count++;
         }
-        //  Recycle a bunch of messages as binary data
+        //  Recycle messages as binary data, in random pieces so that
+        //  codec2 sees partial frames, and extract what's complete
         while (TRUE) {
             byte *data;
             size_t size = vtx_codec_bin_get (codec1, &data);
             if (size == 0)
                 break;          //  If store empty, stop recycling
-            int rc = vtx_codec_bin_put (codec2, data, size);
-            assert (rc == 0);
+            if (size > 1)
+                size = 1 + s_random (size - 1);
+            assert (vtx_codec_bin_put (codec2, data, size) == 0);
             vtx_codec_bin_tick (codec1, size);
             vtx_codec_check (codec1, "recycle1");
             vtx_codec_check (codec2, "recycle2");
-        }
-        assert (vtx_codec_active (codec1) == 0);
 
-        //  Now extract a bunch of messages
-        while (TRUE) {
-            zmq_msg_t msg;
-            Bool more;
-            int rc = vtx_codec_msg_get (codec2, &msg, &more);
-            vtx_codec_check (codec2, "msg get");
-            zmq_msg_close (&msg);
-            if (rc)
-                break;          //  If store empty, stop extracting
+            if (s_random (2)) {
+                zmq_msg_t msg;
+                Bool more;
+                while (vtx_codec_msg_get (codec2, &msg, &more) == 0) {
+                    vtx_codec_check (codec2, "msg get");
+                    byte *content = (byte *) zmq_msg_data (&msg);
+                    size_t index;
+                    for (index = 0; index < zmq_msg_size (&msg); index++)
+                        assert (content [index] == (byte) zmq_msg_size (&msg));
+                    zmq_msg_close (&msg);
+                }
+            }
+            else {
+                //  Large frames we received directly come out as
+                //  messages, everything else as slices
+                vtx_slice_t slices [16];
+                zmq_msg_t msg;
+                Bool more;
+                while (TRUE) {
+                    Bool is_msg = FALSE;
+                    uint count = vtx_codec_slices_get (codec2, slices, 16);
+                    if (count == 0) {
+                        if (vtx_codec_msg_get (codec2, &msg, &more))
+                            break;
+                        is_msg = TRUE;
+                        slices [0].data = (byte *) zmq_msg_data (&msg);
+                        slices [0].size = zmq_msg_size (&msg);
+                        count = 1;
+                    }
+                    uint slice;
+                    for (slice = 0; slice < count; slice++) {
+                        size_t index;
+                        for (index = 0; index < slices [slice].size; index++)
+                            assert (slices [slice].data [index]
+                                == (byte) slices [slice].size);
+                    }
+                    vtx_codec_slices_drop (codec2);
+                    vtx_codec_check (codec2, "slices get");
+                    if (is_msg)
+                        zmq_msg_close (&msg);
+                }
+            }
         }
+        assert (vtx_codec_active (codec1) == 0);
         assert (vtx_codec_active (codec2) == 0);
 
         //  Stop after 1 second of work
         if (zclock_time () - start > 999)
             break;
     }
+    //  Codecs grew as needed, within their limits
+    assert (codec1->batch_limit <= codec1->batch_max);
+    assert (codec2->buffer_limit <= codec2->buffer_max);
+    assert (vtx_codec_release (codec2) == 0);
     vtx_codec_destroy (&codec1);
     vtx_codec_destroy (&codec2);
     printf ("%d messages stored & extracted\n", msg_count);
+
+    //  NOM-2 framing puts runs of small frames behind one header
+    codec1 = vtx_codec_new (1000, NULL);
+    codec2 = vtx_codec_new (1000, NULL);
+    vtx_codec_nom2 (codec1, TRUE);
+    vtx_codec_nom2 (codec2, TRUE);
+    for (msg_count = 0; msg_count < 10; msg_count++) {
+        zmq_msg_init_size (&msg, 5);
+        memset (zmq_msg_data (&msg), msg_count, 5);
+        assert (vtx_codec_msg_put (codec1, &msg, msg_count < 9) == 0);
+        zmq_msg_close (&msg);
+    }
+    assert (vtx_codec_active (codec1) == VTX_NOM2_HEADER + 10 * (2 + 5));
+
+    //  Mix in large frames, and pass data across in odd-sized pieces so
+    //  headers and runs split between reads
+    int received = 0;
+    for (msg_count = 0; msg_count < 2000; msg_count++) {
+        size_t size = msg_count % 7? msg_count % 31: 1000 + msg_count;
+        zmq_msg_init_size (&msg, size);
+        memset (zmq_msg_data (&msg), (byte) size, size);
+        assert (vtx_codec_msg_put (codec1, &msg, msg_count % 3 == 0) == 0);
+        zmq_msg_close (&msg);
+        if (msg_count % 50 && msg_count < 1999)
+            continue;
+        while (TRUE) {
+            byte *data;
+            size = vtx_codec_bin_get (codec1, &data);
+            if (size == 0)
+                break;
+            if (size > 13)
+                size = 13;
+            assert (vtx_codec_bin_put (codec2, data, size) == 0);
+            vtx_codec_bin_tick (codec1, size);
+
+            vtx_slice_t slices [16];
+            Bool more;
+            uint count = vtx_codec_slices_get (codec2, slices, 16);
+            if (count) {
+                uint index;
+                for (index = 0; index < count; index++) {
+                    byte expect = received < 10? received: (byte) slices [index].size;
+                    if (received < 10) {
+                        assert (slices [index].size == 5);
+                        assert (slices [index].more == (received < 9));
+                    }
+                    else
+                        assert (slices [index].more == ((received - 10) % 3 == 0));
+                    size_t offset;
+                    for (offset = 0; offset < slices [index].size; offset++)
+                        assert (slices [index].data [offset] == expect);
+                    received++;
+                }
+                vtx_codec_slices_drop (codec2);
+            }
+            else
+            if (vtx_codec_msg_get (codec2, &msg, &more) == 0) {
+                assert (more == ((received - 10) % 3 == 0));
+                zmq_msg_close (&msg);
+                received++;
+            }
+        }
+    }
+    //  Take any frames left after the last piece
+    while (TRUE) {
+        Bool more;
+        if (vtx_codec_msg_get (codec2, &msg, &more))
+            break;
+        zmq_msg_close (&msg);
+        received++;
+    }
+    assert (received == 2010);
+    assert (vtx_codec_active (codec2) == 0);
+    vtx_codec_destroy (&codec1);
+    vtx_codec_destroy (&codec2);
+
+    //  Drivers share the same encoder for flat buffers
+    zmsg_t *zmsg = zmsg_new ();
+    zmsg_add (zmsg, zframe_new ("", 0));
+    zmsg_add (zmsg, zframe_new ("Hello", 5));
+    byte large [300];
+    memset (large, 'L', sizeof (large));
+    zmsg_add (zmsg, zframe_new (large, sizeof (large)));
+    zmsg_add (zmsg, zframe_new ("World", 5));
+    byte flat [512];
+    size_t flat_size = vtx_codec_nom2_encode (zmsg, flat, sizeof (flat));
+    assert (flat_size == 3 * VTX_NOM2_HEADER + 2 + 7 + 300 + 7);
+    assert (vtx_codec_nom2_encode (zmsg, flat, 100) == 101);
+    zmsg_t *decoded = vtx_codec_nom2_decode (flat, flat_size);
+    assert (decoded);
+    assert (zmsg_size (decoded) == 4);
+    zframe_t *frame = zmsg_first (decoded);
+    assert (zframe_size (frame) == 0);
+    frame = zmsg_next (decoded);
+    assert (zframe_size (frame) == 5 && memcmp (zframe_data (frame), "Hello", 5) == 0);
+    frame = zmsg_next (decoded);
+    assert (zframe_size (frame) == 300 && zframe_data (frame) [299] == 'L');
+    frame = zmsg_next (decoded);
+    assert (zframe_size (frame) == 5 && memcmp (zframe_data (frame), "World", 5) == 0);
+    zmsg_destroy (&decoded);
+    assert (vtx_codec_nom2_decode (flat, flat_size - 1) == NULL);
+    flat [VTX_NOM2_HEADER + 1] = 200;   //  Small frame overruns its run
+    assert (vtx_codec_nom2_decode (flat, flat_size) == NULL);
+    zmsg_destroy (&zmsg);
+
+    //  Pass serialized messages through each algorithm as blocks
+    assert (vtx_codec_algo (3) == NULL);
+    int number;
+    for (number = 0; vtx_codec_algo (number); number++) {
+        vtx_codec_algo_t *algo = vtx_codec_algo (number);
+        void *packer = algo->new_fn? algo->new_fn (): NULL;
+        void *unpacker = algo->new_fn? algo->new_fn (): NULL;
+        codec1 = vtx_codec_new (1000, NULL);
+        codec2 = vtx_codec_new (1000, NULL);
+        byte *block = (byte *) malloc (VTX_CODEC_BLOCK_MAX);
+        size_t wire_size = 0;
+        for (msg_count = 0; msg_count < 500; msg_count++) {
+            char body [64];
+            snprintf (body, sizeof (body),
+                "{\"id\":%d,\"type\":\"tick\",\"value\":%d}",
+                msg_count, msg_count * 7);
+            zmq_msg_init_size (&msg, strlen (body));
+            memcpy (zmq_msg_data (&msg), body, strlen (body));
+            assert (vtx_codec_msg_put (codec1, &msg, FALSE) == 0);
+            zmq_msg_close (&msg);
+        }
+        size_t raw_size = vtx_codec_active (codec1);
+        while (TRUE) {
+            size_t block_size = vtx_codec_block_get (codec1, algo,
+                                                     packer, block);
+            if (block_size == 0)
+                break;
+            assert (vtx_codec_block_size (block, 4) == 0);
+            assert (vtx_codec_block_size (block, block_size) == block_size);
+            wire_size += block_size;
+            byte *data;
+            ssize_t size = vtx_codec_block_unpack (algo, unpacker,
+                                                   block, &data);
+            assert (size > 0);
+            assert (vtx_codec_bin_put (codec2, data, size) == 0);
+        }
+        for (msg_count = 0; msg_count < 500; msg_count++) {
+            Bool more;
+            char body [64];
+            snprintf (body, sizeof (body),
+                "{\"id\":%d,\"type\":\"tick\",\"value\":%d}",
+                msg_count, msg_count * 7);
+            assert (vtx_codec_msg_get (codec2, &msg, &more) == 0);
+            assert (zmq_msg_size (&msg) == strlen (body));
+            assert (memcmp (zmq_msg_data (&msg), body, strlen (body)) == 0);
+            zmq_msg_close (&msg);
+        }
+        assert (vtx_codec_active (codec2) == 0);
+        if (algo->pack_fn)
+            assert (wire_size < raw_size / 2);
+        printf ("%s: %zd bytes sent as %zd\n", algo->name, raw_size, wire_size);
+
+        //  Corrupt blocks are refused
+        block [0] = 2;
+        byte *data;
+        assert (vtx_codec_block_unpack (algo, unpacker, block, &data) == -1);
+
+        free (block);
+        if (algo->destroy_fn) {
+            algo->destroy_fn (&packer);
+            algo->destroy_fn (&unpacker);
+        }
+        vtx_codec_destroy (&codec1);
+        vtx_codec_destroy (&codec2);
+    }
 }
 
 //  Fast pseudo-random number generator
@@ -0,0 +1,287 @@
+/*  =====================================================================
+    vtx_hashring - 0MQ virtual transport interface - consistent hashing
+
+    This implements a consistent-hash ring that maps arbitrary keys (e.g.
+    a message frame) onto a set of items (e.g. live peerings). Each item
+    is placed on the ring at a number of pseudo-random points (virtual
+    nodes) derived from its name, so keys spread evenly and only the keys
+    owned by an item move when that item is added or removed.
+
+    ---------------------------------------------------------------------
+    Copyright (c) 1991-2011 iMatix Corporation <www.imatix.com>
+    Copyright other contributors as noted in the AUTHORS file.
+
+    This file is part of VTX, the 0MQ virtual transport interface:
+    http://vtx.zeromq.org.
+
+    This is free software; you can redistribute it and/or modify it under
+    the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or (at
+    your option) any later version.
+
+    This software is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this program. If not, see
+    <http://www.gnu.org/licenses/>.
+    =====================================================================
+*/
+
+#ifndef __VTX_HASHRING_INCLUDED__
+#define __VTX_HASHRING_INCLUDED__
+
+#include "czmq.h"
+
+typedef struct _vtx_hashring_t vtx_hashring_t;
+
+//  This is a single point on the ring
+typedef struct {
+    uint32_t hash;              //  Position on ring
+    void *item;                 //  Item that owns this point
+} vtx_hashring_point_t;
+
+//  The ring is an array of points kept sorted by hash, so that lookup is
+//  a binary search for the first point at or after the key hash.
+struct _vtx_hashring_t {
+    vtx_hashring_point_t *points;   //  Sorted array of points
+    uint replicas;              //  Virtual nodes per item
+    uint limit;                 //  Allocated size of points array
+    uint size;                  //  Number of points in use
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Create new hash ring, with this many virtual nodes per item
+static vtx_hashring_t *
+    vtx_hashring_new (uint replicas);
+
+//  Destroy hash ring; does not touch the items it refers to
+static void
+    vtx_hashring_destroy (vtx_hashring_t **self_p);
+
+//  Add item to ring, using name to place its virtual nodes
+static void
+    vtx_hashring_insert (vtx_hashring_t *self, char *name, void *item);
+
+//  Remove item and all its virtual nodes from ring
+static void
+    vtx_hashring_delete (vtx_hashring_t *self, void *item);
+
+//  Return item that owns the specified key, or NULL if ring is empty
+static void *
+    vtx_hashring_lookup (vtx_hashring_t *self, byte *key, size_t size);
+
+//  Return number of items on ring
+static size_t
+    vtx_hashring_size (vtx_hashring_t *self);
+
+//  Selftest of hash ring class
+static void
+    vtx_hashring_selftest (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+//  Helper functions
+static inline uint32_t
+    s_hashring_hash (byte *data, size_t size, uint32_t seed);
+
+
+//  -------------------------------------------------------------------------
+//  Create new hash ring
+
+static vtx_hashring_t *
+vtx_hashring_new (uint replicas)
+{
+    vtx_hashring_t *self = (vtx_hashring_t *) zmalloc (sizeof (vtx_hashring_t));
+    assert (replicas);
+    self->replicas = replicas;
+    return self;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Destroy hash ring
+
+static void
+vtx_hashring_destroy (vtx_hashring_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        vtx_hashring_t *self = *self_p;
+        free (self->points);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  -------------------------------------------------------------------------
+//  Add item to ring. Virtual node N is placed at hash (name, N), so the
+//  same name always lands on the same points, whichever driver or
+//  process computes them.
+
+static void
+vtx_hashring_insert (vtx_hashring_t *self, char *name, void *item)
+{
+    assert (self);
+    assert (name);
+
+    if (self->size + self->replicas > self->limit) {
+        self->limit = (self->size + self->replicas) * 2;
+        self->points = realloc (self->points,
+            self->limit * sizeof (vtx_hashring_point_t));
+        assert (self->points);
+    }
+    uint replica;
+    for (replica = 0; replica < self->replicas; replica++) {
+        uint32_t hash = s_hashring_hash ((byte *) name, strlen (name), replica);
+        //  Insertion sort keeps points ordered; rings are rebuilt only
+        //  when peerings come or go, so this is not on the hot path.
+        uint index = self->size;
+        while (index > 0 && self->points [index - 1].hash > hash) {
+            self->points [index] = self->points [index - 1];
+            index--;
+        }
+        self->points [index].hash = hash;
+        self->points [index].item = item;
+        self->size++;
+    }
+}
+
+
+//  -------------------------------------------------------------------------
+//  Remove item and all its virtual nodes from ring
+
+static void
+vtx_hashring_delete (vtx_hashring_t *self, void *item)
+{
+    assert (self);
+    uint source, target = 0;
+    for (source = 0; source < self->size; source++)
+        if (self->points [source].item != item)
+            self->points [target++] = self->points [source];
+    self->size = target;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Return item that owns the specified key. This is the first point at or
+//  after the key's hash, wrapping around at the end of the ring.
+
+static void *
+vtx_hashring_lookup (vtx_hashring_t *self, byte *key, size_t size)
+{
+    assert (self);
+    if (self->size == 0)
+        return NULL;
+
+    uint32_t hash = s_hashring_hash (key, size, 0);
+    uint low = 0;
+    uint high = self->size;
+    while (low < high) {
+        uint middle = low + (high - low) / 2;
+        if (self->points [middle].hash < hash)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    if (low == self->size)
+        low = 0;                //  Wrap around to start of ring
+    return self->points [low].item;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Return number of items on ring
+
+static size_t
+vtx_hashring_size (vtx_hashring_t *self)
+{
+    assert (self);
+    return self->size / self->replicas;
+}
+
+
+//  -------------------------------------------------------------------------
+//  FNV-1a over the data, seeded, followed by a murmur3 finalizer so that
+//  short and similar keys (addresses, sequence numbers) spread well.
+
+static inline uint32_t
+s_hashring_hash (byte *data, size_t size, uint32_t seed)
+{
+    uint32_t hash = 2166136261u ^ (seed * 0x9e3779b9);
+    size_t index;
+    for (index = 0; index < size; index++) {
+        hash ^= data [index];
+        hash *= 16777619;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Selftest of hash ring class
+
+static void
+vtx_hashring_selftest (void)
+{
+    vtx_hashring_t *ring = vtx_hashring_new (100);
+    assert (vtx_hashring_lookup (ring, (byte *) "key", 3) == NULL);
+
+    //  Use addresses of a table as items, names as node names
+    char *names [] = { "10.0.0.1:5555", "10.0.0.2:5555",
+                       "10.0.0.3:5555", "10.0.0.4:5555" };
+    int items [4];
+    int index;
+    for (index = 0; index < 4; index++)
+        vtx_hashring_insert (ring, names [index], &items [index]);
+    assert (vtx_hashring_size (ring) == 4);
+
+    //  Map a set of keys, check every item gets a fair share
+    #define KEYS 10000
+    void **owner = malloc (KEYS * sizeof (void *));
+    int count [4] = { 0, 0, 0, 0 };
+    int key;
+    for (key = 0; key < KEYS; key++) {
+        owner [key] = vtx_hashring_lookup (ring, (byte *) &key, sizeof (key));
+        assert (owner [key]);
+        count [(int *) owner [key] - items]++;
+    }
+    for (index = 0; index < 4; index++)
+        assert (count [index] > KEYS / 8);
+
+    //  Remove one item; only its keys may move
+    vtx_hashring_delete (ring, &items [2]);
+    assert (vtx_hashring_size (ring) == 3);
+    for (key = 0; key < KEYS; key++) {
+        void *item = vtx_hashring_lookup (ring, (byte *) &key, sizeof (key));
+        assert (item != &items [2]);
+        if (owner [key] != &items [2])
+            assert (item == owner [key]);
+    }
+    //  Put it back; we must get exactly the original mapping
+    vtx_hashring_insert (ring, names [2], &items [2]);
+    for (key = 0; key < KEYS; key++)
+        assert (vtx_hashring_lookup (ring, (byte *) &key, sizeof (key))
+                == owner [key]);
+
+    free (owner);
+    vtx_hashring_destroy (&ring);
+    assert (ring == NULL);
+    printf ("%d keys mapped consistently\n", KEYS);
+    #undef KEYS
+}
+
+#endif
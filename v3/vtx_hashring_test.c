@@ -0,0 +1,7 @@
+#include "vtx_hashring.c"
+
+int main (void)
+{
+    vtx_hashring_selftest ();
+    return 0;
+}
\ No newline at end of file
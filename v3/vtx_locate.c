@@ -20,10 +20,13 @@ int main (void)
     //  Create DEALER socket and do broadcast connect to server
     void *client = vtx_socket (vtx, ZMQ_DEALER);
     assert (client);
+    //  Each reply tells us who sent it
+    rc = vtx_setopt (vtx, client, VTX_OPT_METADATA, 1);
+    assert (rc == 0);
     rc = vtx_connect (vtx, client, "udp://*:%d", 32000);
     assert (rc == 0);
 
-    char *server = "not found";
+    char *server = NULL;
     //  Ping server with messages until it responds, or we timeout
     uint64_t expiry = zclock_time () + 1000;
     while (zclock_time () < expiry) {
@@ -35,15 +38,16 @@ int main (void)
             break;              //  Context has been shut down
 
         if (items [0].revents & ZMQ_POLLIN) {
-            char *input = zstr_recv (client);
-            if (input) {
-                free (input);
-                server = vtx_getmeta (vtx, client, "sender");
+            zmsg_t *reply = zmsg_recv (client);
+            if (reply) {
+                vtx_popmeta (reply, &server, NULL);
+                zmsg_destroy (&reply);
             }
             break;
         }
     }
-    zclock_log ("I: server address: %s", server);
+    zclock_log ("I: server address: %s", server? server: "not found");
+    free (server);
     vtx_destroy (&vtx);
     zctx_destroy (&ctx);
     return 0;
@@ -0,0 +1,483 @@
+/*  =====================================================================
+    vtx_loop - 0MQ virtual transport interface - driver reactor
+
+    Runs the pollers and timers of one or more drivers. This works like
+    zloop, and a driver that runs in its own thread uses it the same
+    way, via vtx_loop_start. An embedded driver shares the reactor of
+    its application, which runs it one pass at a time with
+    vtx_loop_process, or waits on the reactor's poll set in its own event
+    loop. Unlike zloop, running the reactor doesn't reset its timers, so
+    they still fire when the caller runs many short passes.
+
+    ---------------------------------------------------------------------
+    Copyright (c) 1991-2011 iMatix Corporation <www.imatix.com>
+    Copyright other contributors as noted in the AUTHORS file.
+
+    This file is part of VTX, the 0MQ virtual transport interface:
+    http://vtx.zeromq.org.
+
+    This is free software; you can redistribute it and/or modify it under
+    the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or (at
+    your option) any later version.
+
+    This software is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this program. If not, see
+    <http://www.gnu.org/licenses/>.
+    =====================================================================
+*/
+
+#ifndef __VTX_LOOP_INCLUDED__
+#define __VTX_LOOP_INCLUDED__
+
+#include "czmq.h"
+
+typedef struct _vtx_loop_t vtx_loop_t;
+
+//  Callback for poller and timer events, returns -1 to stop reactor
+typedef int (vtx_loop_fn) (vtx_loop_t *loop, zmq_pollitem_t *item, void *arg);
+
+//  Pollers and timers that are ended while we're dispatching events are
+//  marked dead, and removed at the start of the next pass
+typedef struct {
+    zmq_pollitem_t item;        //  Socket or handle to poll
+    vtx_loop_fn *handler;       //  Function to call when ready
+    void *arg;                  //  Application argument
+    Bool dead;                  //  Poller was ended
+} s_poller_t;
+
+typedef struct {
+    int64_t when;               //  Clock time when timer fires next
+    size_t delay;               //  Interval in msecs
+    size_t times;               //  Times left to fire, 0 = forever
+    vtx_loop_fn *handler;       //  Function to call when timer fires
+    void *arg;                  //  Application argument
+    Bool dead;                  //  Timer was ended, or has expired
+} s_timer_t;
+
+//  This is the structure of our object
+struct _vtx_loop_t {
+    s_poller_t *pollers;        //  Registered pollers
+    uint poller_count;          //  Pollers in use, including dead ones
+    uint poller_limit;          //  Allocated size of pollers array
+    zmq_pollitem_t *pollset;    //  Poll set, rebuilt when dirty
+    uint pollset_size;          //  Items in poll set
+    Bool dirty;                 //  Pollers changed since last pass
+    zlist_t *timers;            //  Registered timers
+    Bool verbose;               //  Trace activity?
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Create new reactor
+static vtx_loop_t *
+    vtx_loop_new (void);
+
+//  Destroy reactor
+static void
+    vtx_loop_destroy (vtx_loop_t **self_p);
+
+//  Register socket or handle with reactor, 0MQ sockets are matched
+//  first, then handles
+static int
+    vtx_loop_poller (vtx_loop_t *self, zmq_pollitem_t *item,
+                     vtx_loop_fn handler, void *arg);
+
+//  End all pollers for socket or handle
+static void
+    vtx_loop_poller_end (vtx_loop_t *self, zmq_pollitem_t *item);
+
+//  Register timer that fires after delay msecs, the given number of
+//  times, or forever if times is zero
+static int
+    vtx_loop_timer (vtx_loop_t *self, size_t delay, size_t times,
+                    vtx_loop_fn handler, void *arg);
+
+//  End all timers with the given argument
+static int
+    vtx_loop_timer_end (vtx_loop_t *self, void *arg);
+
+//  Set verbose tracing of reactor on/off
+static void
+    vtx_loop_set_verbose (vtx_loop_t *self, Bool verbose);
+
+//  Run reactor until a handler returns -1, or we're interrupted
+static int
+    vtx_loop_start (vtx_loop_t *self);
+
+//  Run one pass of reactor, waiting up to timeout msecs for events, or
+//  forever if timeout is -1. Returns 0, or -1 if a handler returned -1
+//  or we were interrupted.
+static int
+    vtx_loop_process (vtx_loop_t *self, int timeout);
+
+//  Return poll set of reactor, and the msecs until the next timer is
+//  due, or -1 if there are no timers
+static zmq_pollitem_t *
+    vtx_loop_pollset (vtx_loop_t *self, uint *size_p, int *timeout_p);
+
+//  Selftest of reactor class
+static void
+    vtx_loop_selftest (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+//  -------------------------------------------------------------------------
+//  Create new reactor
+
+static vtx_loop_t *
+vtx_loop_new (void)
+{
+    vtx_loop_t *self = (vtx_loop_t *) zmalloc (sizeof (vtx_loop_t));
+    self->timers = zlist_new ();
+    return self;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Destroy reactor
+
+static void
+vtx_loop_destroy (vtx_loop_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        vtx_loop_t *self = *self_p;
+        while (zlist_size (self->timers))
+            free (zlist_pop (self->timers));
+        zlist_destroy (&self->timers);
+        free (self->pollers);
+        free (self->pollset);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  -------------------------------------------------------------------------
+//  Register socket or handle with reactor
+
+static int
+vtx_loop_poller (vtx_loop_t *self, zmq_pollitem_t *item,
+                 vtx_loop_fn handler, void *arg)
+{
+    assert (self);
+    if (self->poller_count == self->poller_limit) {
+        self->poller_limit = self->poller_limit? self->poller_limit * 2: 16;
+        self->pollers = (s_poller_t *) realloc (self->pollers,
+            self->poller_limit * sizeof (s_poller_t));
+        assert (self->pollers);
+    }
+    s_poller_t *poller = &self->pollers [self->poller_count++];
+    poller->item = *item;
+    poller->handler = handler;
+    poller->arg = arg;
+    poller->dead = FALSE;
+    self->dirty = TRUE;
+    if (self->verbose)
+        zclock_log ("I: vtx_loop: register %s poller (%p, %d)",
+            item->socket? "0MQ": "FD", item->socket, item->fd);
+    return 0;
+}
+
+
+//  -------------------------------------------------------------------------
+//  End all pollers for socket or handle
+
+static void
+vtx_loop_poller_end (vtx_loop_t *self, zmq_pollitem_t *item)
+{
+    assert (self);
+    uint index;
+    for (index = 0; index < self->poller_count; index++) {
+        s_poller_t *poller = &self->pollers [index];
+        if ((item->socket && item->socket == poller->item.socket)
+        ||  (item->fd && item->fd == poller->item.fd)) {
+            poller->dead = TRUE;
+            self->dirty = TRUE;
+        }
+    }
+    if (self->verbose)
+        zclock_log ("I: vtx_loop: cancel %s poller (%p, %d)",
+            item->socket? "0MQ": "FD", item->socket, item->fd);
+}
+
+
+//  -------------------------------------------------------------------------
+//  Register timer
+
+static int
+vtx_loop_timer (vtx_loop_t *self, size_t delay, size_t times,
+                vtx_loop_fn handler, void *arg)
+{
+    assert (self);
+    s_timer_t *timer = (s_timer_t *) zmalloc (sizeof (s_timer_t));
+    timer->when = zclock_time () + delay;
+    timer->delay = delay;
+    timer->times = times;
+    timer->handler = handler;
+    timer->arg = arg;
+    zlist_append (self->timers, timer);
+    if (self->verbose)
+        zclock_log ("I: vtx_loop: register timer delay=%zd times=%zd",
+            delay, times);
+    return 0;
+}
+
+
+//  -------------------------------------------------------------------------
+//  End all timers with the given argument
+
+static int
+vtx_loop_timer_end (vtx_loop_t *self, void *arg)
+{
+    assert (self);
+    s_timer_t *timer = (s_timer_t *) zlist_first (self->timers);
+    while (timer) {
+        if (timer->arg == arg)
+            timer->dead = TRUE;
+        timer = (s_timer_t *) zlist_next (self->timers);
+    }
+    if (self->verbose)
+        zclock_log ("I: vtx_loop: cancel timer");
+    return 0;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Set verbose tracing of reactor on/off
+
+static void
+vtx_loop_set_verbose (vtx_loop_t *self, Bool verbose)
+{
+    assert (self);
+    self->verbose = verbose;
+}
+
+
+//  Remove dead pollers and timers, and rebuild poll set if needed
+
+static void
+s_loop_tidy (vtx_loop_t *self)
+{
+    s_timer_t *timer = (s_timer_t *) zlist_first (self->timers);
+    while (timer) {
+        s_timer_t *next = (s_timer_t *) zlist_next (self->timers);
+        if (timer->dead) {
+            zlist_remove (self->timers, timer);
+            free (timer);
+        }
+        timer = next;
+    }
+    if (self->dirty) {
+        uint index, live = 0;
+        for (index = 0; index < self->poller_count; index++)
+            if (!self->pollers [index].dead)
+                self->pollers [live++] = self->pollers [index];
+        self->poller_count = live;
+        free (self->pollset);
+        self->pollset = (zmq_pollitem_t *) zmalloc (
+            (live? live: 1) * sizeof (zmq_pollitem_t));
+        for (index = 0; index < live; index++)
+            self->pollset [index] = self->pollers [index].item;
+        self->pollset_size = live;
+        self->dirty = FALSE;
+    }
+}
+
+//  Return msecs until next timer is due, or -1 if there are no timers
+
+static int
+s_loop_next_timer (vtx_loop_t *self)
+{
+    int64_t next = -1;
+    s_timer_t *timer = (s_timer_t *) zlist_first (self->timers);
+    while (timer) {
+        if (!timer->dead && (next == -1 || timer->when < next))
+            next = timer->when;
+        timer = (s_timer_t *) zlist_next (self->timers);
+    }
+    if (next == -1)
+        return -1;
+    int64_t now = zclock_time ();
+    return next > now? (int) (next - now): 0;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Run reactor until a handler returns -1, or we're interrupted
+
+static int
+vtx_loop_start (vtx_loop_t *self)
+{
+    assert (self);
+    while (!zctx_interrupted)
+        if (vtx_loop_process (self, -1) == -1)
+            break;
+    return 0;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Run one pass of reactor. Pollers are dispatched in the order they were
+//  registered; pollers registered during the pass wait for the next one.
+
+static int
+vtx_loop_process (vtx_loop_t *self, int timeout)
+{
+    assert (self);
+    s_loop_tidy (self);
+    int wait = s_loop_next_timer (self);
+    if (wait == -1 || (timeout != -1 && timeout < wait))
+        wait = timeout;
+
+    int rc = zmq_poll (self->pollset, self->pollset_size,
+                       wait == -1? -1: wait * ZMQ_POLL_MSEC);
+    if (rc == -1 || zctx_interrupted)
+        return -1;              //  Context has been shut down
+
+    //  Handle any timers that have now expired; we collect them first,
+    //  since handlers may add and end timers
+    rc = 0;
+    int64_t now = zclock_time ();
+    zlist_t *expired = zlist_new ();
+    s_timer_t *timer = (s_timer_t *) zlist_first (self->timers);
+    while (timer) {
+        if (!timer->dead && now >= timer->when)
+            zlist_append (expired, timer);
+        timer = (s_timer_t *) zlist_next (self->timers);
+    }
+    while (zlist_size (expired)) {
+        timer = (s_timer_t *) zlist_pop (expired);
+        if (timer->dead || rc)
+            continue;           //  Ended by earlier handler
+        if (timer->times && --timer->times == 0)
+            timer->dead = TRUE;
+        else
+            timer->when = now + timer->delay;
+        rc = timer->handler (self, NULL, timer->arg);
+    }
+    zlist_destroy (&expired);
+    //  Handle any pollers that are ready; the poll set matches the
+    //  pollers array up to its size, since we only append during a pass
+    uint index;
+    for (index = 0; index < self->pollset_size && rc == 0; index++) {
+        s_poller_t *poller = &self->pollers [index];
+        if (self->pollset [index].revents && !poller->dead) {
+            zmq_pollitem_t item = self->pollset [index];
+            rc = poller->handler (self, &item, poller->arg);
+        }
+    }
+    return rc;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Return poll set of reactor, for callers that wait in their own loop
+
+static zmq_pollitem_t *
+vtx_loop_pollset (vtx_loop_t *self, uint *size_p, int *timeout_p)
+{
+    assert (self);
+    s_loop_tidy (self);
+    if (size_p)
+        *size_p = self->pollset_size;
+    if (timeout_p)
+        *timeout_p = s_loop_next_timer (self);
+    return self->pollset;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Selftest of reactor class
+
+static int
+s_test_input (vtx_loop_t *loop, zmq_pollitem_t *item, void *arg)
+{
+    char buffer [16];
+    int *count = (int *) arg;
+    if (read (item->fd, buffer, sizeof (buffer)) > 0)
+        (*count)++;
+    //  Handler can end its own poller
+    if (*count == 2)
+        vtx_loop_poller_end (loop, item);
+    return 0;
+}
+
+static int
+s_test_timer (vtx_loop_t *loop, zmq_pollitem_t *item, void *arg)
+{
+    int *count = (int *) arg;
+    (*count)++;
+    return *count == 3? -1: 0;
+}
+
+static void
+vtx_loop_selftest (void)
+{
+    vtx_loop_t *loop = vtx_loop_new ();
+    int pipes [2];
+    int rc = pipe (pipes);
+    assert (rc == 0);
+
+    //  Poller fires when handle is ready, and not after it's ended
+    int inputs = 0;
+    zmq_pollitem_t item = { NULL, pipes [0], ZMQ_POLLIN, 0 };
+    vtx_loop_poller (loop, &item, s_test_input, &inputs);
+    uint size;
+    int timeout;
+    zmq_pollitem_t *pollset = vtx_loop_pollset (loop, &size, &timeout);
+    assert (size == 1 && pollset [0].fd == pipes [0]);
+    assert (timeout == -1);
+
+    assert (vtx_loop_process (loop, 0) == 0);
+    assert (inputs == 0);
+    rc = write (pipes [1], "a", 1);
+    assert (vtx_loop_process (loop, 0) == 0);
+    assert (inputs == 1);
+    rc = write (pipes [1], "b", 1);
+    assert (vtx_loop_process (loop, 10) == 0);
+    assert (inputs == 2);
+    rc = write (pipes [1], "c", 1);
+    assert (vtx_loop_process (loop, 0) == 0);
+    assert (inputs == 2);
+    vtx_loop_pollset (loop, &size, NULL);
+    assert (size == 0);
+
+    //  Short passes don't hold back timers
+    int ticks = 0;
+    int64_t start = zclock_time ();
+    vtx_loop_timer (loop, 20, 0, s_test_timer, &ticks);
+    while (ticks == 0)
+        assert (vtx_loop_process (loop, 1) == 0);
+    assert (zclock_time () - start >= 20);
+    vtx_loop_pollset (loop, NULL, &timeout);
+    assert (timeout > 0 && timeout <= 20);
+
+    //  Reactor runs until handler returns -1
+    vtx_loop_start (loop);
+    assert (ticks == 3);
+
+    //  Ended timers don't fire
+    vtx_loop_timer_end (loop, &ticks);
+    assert (vtx_loop_process (loop, 30) == 0);
+    assert (ticks == 3);
+
+    close (pipes [0]);
+    close (pipes [1]);
+    vtx_loop_destroy (&loop);
+    assert (loop == NULL);
+    printf ("OK\n");
+}
+
+#endif
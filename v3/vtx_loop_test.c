@@ -0,0 +1,7 @@
+#include "vtx_loop.c"
+
+int main (void)
+{
+    vtx_loop_selftest ();
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,453 @@
+/*  =====================================================================
+    vtx_lz - 0MQ virtual transport interface - block compression
+
+    A small LZ77 compressor for blocks of serialized message data, in the
+    style of LZ4: a greedy match finder over a hash table, emitting runs
+    of literals and back-references of up to 64KB. Each block is coded on
+    its own, but may refer back into an optional dictionary, which acts as
+    history that precedes every block. A dictionary seeded with typical
+    content lets even small messages compress well.
+
+        block       = *sequence last
+        sequence    = token *length-byte literals offset *length-byte
+        last        = token *length-byte literals
+        token       = OCTET     ; literals in high nibble, match-4 in low
+        offset      = 2OCTET    ; back-reference distance, little-endian
+
+    A nibble of 15 means more length bytes follow, each adding up to 255.
+
+    ---------------------------------------------------------------------
+    Copyright (c) 1991-2011 iMatix Corporation <www.imatix.com>
+    Copyright other contributors as noted in the AUTHORS file.
+
+    This file is part of VTX, the 0MQ virtual transport interface:
+    http://vtx.zeromq.org.
+
+    This is free software; you can redistribute it and/or modify it under
+    the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or (at
+    your option) any later version.
+
+    This software is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this program. If not, see
+    <http://www.gnu.org/licenses/>.
+    =====================================================================
+*/
+
+#ifndef __VTX_LZ_INCLUDED__
+#define __VTX_LZ_INCLUDED__
+
+#include "czmq.h"
+
+#define VTX_LZ_BLOCK        16384   //  Largest block we code at once
+#define VTX_LZ_DICT_MAX     4096    //  Largest dictionary we accept
+#define VTX_LZ_HASH_BITS    12      //  Hash table has 4096 entries
+#define VTX_LZ_MIN_MATCH    4       //  Shorter matches aren't worth it
+#define VTX_LZ_LAST_LITERALS 5      //  Block always ends with literals
+
+typedef struct _vtx_lz_t vtx_lz_t;
+
+//  This is the structure of our object. The window holds the dictionary
+//  followed by the current block, so matches can reach into either.
+struct _vtx_lz_t {
+    byte *window;               //  Dictionary, then block data
+    size_t dict_size;           //  Size of dictionary at start of window
+    uint32_t *table;            //  Hash of 4 bytes -> window position + 1
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Create new compressor, with optional dictionary
+static vtx_lz_t *
+    vtx_lz_new (byte *dict, size_t dict_size);
+
+//  Destroy compressor
+static void
+    vtx_lz_destroy (vtx_lz_t **self_p);
+
+//  Compress block of data; returns compressed size, or 0 if the result
+//  would not fit within limit, in which case caller should store it raw
+static size_t
+    vtx_lz_compress (vtx_lz_t *self, byte *data, size_t size,
+                     byte *dest, size_t limit);
+
+//  Expand block of compressed data, which must produce exactly expected
+//  bytes. Returns 0 and sets data_p to the result, which stays valid until
+//  the next call, or returns -1 if the block is corrupt.
+static int
+    vtx_lz_expand (vtx_lz_t *self, byte *data, size_t size,
+                   size_t expected, byte **data_p);
+
+//  Return built-in dictionary, tuned for text and JSON payloads
+static byte *
+    vtx_lz_dictionary (size_t *size_p);
+
+//  Selftest of compressor class
+static void
+    vtx_lz_selftest (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+//  -------------------------------------------------------------------------
+//  Create new compressor, with optional dictionary
+
+static vtx_lz_t *
+vtx_lz_new (byte *dict, size_t dict_size)
+{
+    vtx_lz_t *self = (vtx_lz_t *) zmalloc (sizeof (vtx_lz_t));
+    if (dict_size > VTX_LZ_DICT_MAX) {
+        //  Keep the tail, which is closest to the data
+        dict += dict_size - VTX_LZ_DICT_MAX;
+        dict_size = VTX_LZ_DICT_MAX;
+    }
+    self->window = (byte *) malloc (dict_size + VTX_LZ_BLOCK);
+    assert (self->window);
+    if (dict_size)
+        memcpy (self->window, dict, dict_size);
+    self->dict_size = dict_size;
+    return self;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Destroy compressor
+
+static void
+vtx_lz_destroy (vtx_lz_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        vtx_lz_t *self = *self_p;
+        free (self->window);
+        free (self->table);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  -------------------------------------------------------------------------
+//  Hash four bytes at position in window
+
+static inline uint32_t
+s_lz_read32 (byte *data)
+{
+    uint32_t value;
+    memcpy (&value, data, 4);
+    return value;
+}
+
+static inline uint
+s_lz_hash (byte *data)
+{
+    return (s_lz_read32 (data) * 2654435761u) >> (32 - VTX_LZ_HASH_BITS);
+}
+
+//  Encode length beyond the 15 held in a token nibble; returns new output
+//  position, or NULL if it would pass the limit
+
+static byte *
+s_lz_put_length (byte *output, byte *limit, size_t length)
+{
+    while (length >= 255) {
+        if (output == limit)
+            return NULL;
+        *output++ = 255;
+        length -= 255;
+    }
+    if (output == limit)
+        return NULL;
+    *output++ = (byte) length;
+    return output;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Compress block of data. We copy the block into the window after the
+//  dictionary, prime the hash table with dictionary positions, and then
+//  walk the block greedily, taking the first match the hash table offers.
+
+static size_t
+vtx_lz_compress (vtx_lz_t *self, byte *data, size_t size,
+                 byte *dest, size_t limit)
+{
+    assert (self);
+    assert (size <= VTX_LZ_BLOCK);
+    if (!self->table) {
+        self->table = (uint32_t *) malloc (
+            sizeof (uint32_t) << VTX_LZ_HASH_BITS);
+        assert (self->table);
+    }
+    memset (self->table, 0, sizeof (uint32_t) << VTX_LZ_HASH_BITS);
+    byte *window = self->window;
+    memcpy (window + self->dict_size, data, size);
+
+    size_t position;
+    for (position = 0; position + VTX_LZ_MIN_MATCH <= self->dict_size; position++)
+        self->table [s_lz_hash (window + position)] = position + 1;
+
+    byte *output = dest;
+    byte *output_limit = dest + limit;
+    size_t end = self->dict_size + size;
+    size_t anchor = self->dict_size;
+    position = self->dict_size;
+    while (position + VTX_LZ_MIN_MATCH + VTX_LZ_LAST_LITERALS <= end) {
+        uint hash = s_lz_hash (window + position);
+        size_t candidate = self->table [hash];
+        self->table [hash] = position + 1;
+        if (candidate == 0
+        ||  position - (candidate - 1) > 65535
+        ||  s_lz_read32 (window + candidate - 1)
+         != s_lz_read32 (window + position)) {
+            position++;
+            continue;
+        }
+        size_t match = candidate - 1;
+        size_t length = VTX_LZ_MIN_MATCH;
+        while (position + length + VTX_LZ_LAST_LITERALS < end
+        &&     window [match + length] == window [position + length])
+            length++;
+
+        //  Emit token, literals, offset, and match length
+        size_t literals = position - anchor;
+        if (output == output_limit)
+            return 0;
+        byte *token = output++;
+        *token = (literals < 15? literals: 15) << 4;
+        if (literals >= 15
+        && (output = s_lz_put_length (output, output_limit, literals - 15)) == NULL)
+            return 0;
+        if (output + literals + 2 > output_limit)
+            return 0;
+        memcpy (output, window + anchor, literals);
+        output += literals;
+        size_t offset = position - match;
+        *output++ = (byte) offset;
+        *output++ = (byte) (offset >> 8);
+        size_t extra = length - VTX_LZ_MIN_MATCH;
+        *token |= extra < 15? extra: 15;
+        if (extra >= 15
+        && (output = s_lz_put_length (output, output_limit, extra - 15)) == NULL)
+            return 0;
+
+        position += length;
+        anchor = position;
+    }
+    //  Last literals, with no match
+    size_t literals = end - anchor;
+    if (output == output_limit)
+        return 0;
+    byte *token = output++;
+    *token = (literals < 15? literals: 15) << 4;
+    if (literals >= 15
+    && (output = s_lz_put_length (output, output_limit, literals - 15)) == NULL)
+        return 0;
+    if (output + literals > output_limit)
+        return 0;
+    memcpy (output, window + anchor, literals);
+    output += literals;
+    return output - dest;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Decode length beyond the 15 held in a token nibble; returns -1 if the
+//  input runs out first
+
+static int
+s_lz_get_length (byte **input_p, byte *limit, size_t *length_p)
+{
+    byte *input = *input_p;
+    byte value;
+    do {
+        if (input == limit)
+            return -1;
+        value = *input++;
+        *length_p += value;
+    } while (value == 255);
+    *input_p = input;
+    return 0;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Expand block of compressed data into the window after the dictionary.
+//  We check every length and offset, since the data comes off the wire.
+
+static int
+vtx_lz_expand (vtx_lz_t *self, byte *data, size_t size,
+               size_t expected, byte **data_p)
+{
+    assert (self);
+    if (expected > VTX_LZ_BLOCK)
+        return -1;
+    byte *input = data;
+    byte *input_limit = data + size;
+    byte *output = self->window + self->dict_size;
+    byte *output_limit = output + expected;
+
+    while (input < input_limit) {
+        byte token = *input++;
+        size_t literals = token >> 4;
+        if (literals == 15
+        &&  s_lz_get_length (&input, input_limit, &literals))
+            return -1;
+        if (literals > (size_t) (input_limit - input)
+        ||  literals > (size_t) (output_limit - output))
+            return -1;
+        memcpy (output, input, literals);
+        input += literals;
+        output += literals;
+        if (input == input_limit)
+            break;              //  Last sequence has no match
+
+        if (input_limit - input < 2)
+            return -1;
+        size_t offset = input [0] | (input [1] << 8);
+        input += 2;
+        size_t length = token & 15;
+        if (length == 15
+        &&  s_lz_get_length (&input, input_limit, &length))
+            return -1;
+        length += VTX_LZ_MIN_MATCH;
+        if (offset == 0
+        ||  offset > (size_t) (output - self->window)
+        ||  length > (size_t) (output_limit - output))
+            return -1;
+        //  Copy byte by byte, since the match may overlap its own output
+        byte *match = output - offset;
+        while (length--)
+            *output++ = *match++;
+    }
+    if (output != output_limit)
+        return -1;
+    *data_p = self->window + self->dict_size;
+    return 0;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Return built-in dictionary. This holds fragments that recur in text
+//  and JSON payloads; the most common go last, where offsets are shortest.
+
+static char
+    s_lz_dictionary [] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+    "Content-Type: application/json; charset=utf-8\r\n"
+    "HTTP/1.1 200 OK\r\n"
+    "0123456789abcdef"
+    "\"description\":\"" "\"created_at\":\"" "\"updated_at\":\""
+    "\"timestamp\":" "\"version\":" "\"message\":\"" "\"result\":"
+    "\"request\":" "\"response\":" "\"payload\":" "\"headers\":"
+    "\"params\":" "\"method\":\"" "\"error\":null" "\"error\":\""
+    "\"count\":" "\"total\":" "\"price\":" "\"amount\":"
+    "\"user\":" "\"email\":\"" "\"key\":\"" "\"tags\":[\""
+    "\"items\":[{" "\"data\":{" "\"status\":\"ok\"" "\"status\":"
+    "\"type\":\"" "\"name\":\"" "\"value\":" "\"id\":"
+    "\"},{\"" "\"}," "\"]," "]}" "}]" "}}" "},"
+    ":false," ":true," ":null," ":0," ":1,"
+    "\",\"" "\":\"" "\":{\"" "\":[\"" "\":";
+
+static byte *
+vtx_lz_dictionary (size_t *size_p)
+{
+    *size_p = strlen (s_lz_dictionary);
+    return (byte *) s_lz_dictionary;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Selftest of compressor class
+
+static void
+vtx_lz_selftest (void)
+{
+    vtx_lz_t *packer = vtx_lz_new (NULL, 0);
+    vtx_lz_t *unpacker = vtx_lz_new (NULL, 0);
+    byte *data = (byte *) malloc (VTX_LZ_BLOCK);
+    byte *packed = (byte *) malloc (VTX_LZ_BLOCK);
+    byte *result;
+
+    //  Repetitive text compresses well and comes back intact
+    size_t size = 0;
+    while (size + 40 <= VTX_LZ_BLOCK)
+        size += sprintf ((char *) data + size,
+            "{\"id\":%05d,\"status\":\"ok\"},", (int) size % 99999);
+    size_t packed_size = vtx_lz_compress (packer, data, size,
+                                          packed, VTX_LZ_BLOCK);
+    assert (packed_size > 0 && packed_size < size / 3);
+    int rc = vtx_lz_expand (unpacker, packed, packed_size, size, &result);
+    assert (rc == 0);
+    assert (memcmp (result, data, size) == 0);
+
+    //  Long runs use extended lengths and overlapping matches
+    memset (data, 'A', VTX_LZ_BLOCK);
+    packed_size = vtx_lz_compress (packer, data, VTX_LZ_BLOCK,
+                                   packed, VTX_LZ_BLOCK);
+    assert (packed_size > 0 && packed_size < 100);
+    rc = vtx_lz_expand (unpacker, packed, packed_size, VTX_LZ_BLOCK, &result);
+    assert (rc == 0);
+    assert (memcmp (result, data, VTX_LZ_BLOCK) == 0);
+
+    //  Random data doesn't fit within its own size, and tiny blocks work
+    uint index;
+    for (index = 0; index < VTX_LZ_BLOCK; index++)
+        data [index] = (byte) random ();
+    assert (vtx_lz_compress (packer, data, VTX_LZ_BLOCK,
+                             packed, VTX_LZ_BLOCK) == 0);
+    for (size = 0; size < 12; size++) {
+        packed_size = vtx_lz_compress (packer, data, size, packed, VTX_LZ_BLOCK);
+        assert (packed_size == size + 1);
+        rc = vtx_lz_expand (unpacker, packed, packed_size, size, &result);
+        assert (rc == 0);
+        assert (memcmp (result, data, size) == 0);
+    }
+    //  Corrupt blocks are refused, not expanded
+    packed [0] = 0xF0;
+    assert (vtx_lz_expand (unpacker, packed, 1, 15, &result) == -1);
+    packed [0] = 0x10;
+    packed [1] = 'x';
+    packed [2] = 200;
+    packed [3] = 0;
+    assert (vtx_lz_expand (unpacker, packed, 4, 5, &result) == -1);
+    vtx_lz_destroy (&packer);
+    vtx_lz_destroy (&unpacker);
+
+    //  A dictionary helps small messages that share its content
+    size_t dict_size;
+    byte *dict = vtx_lz_dictionary (&dict_size);
+    packer = vtx_lz_new (dict, dict_size);
+    unpacker = vtx_lz_new (dict, dict_size);
+    vtx_lz_t *plain = vtx_lz_new (NULL, 0);
+    char *message = "{\"id\":17,\"type\":\"order\",\"status\":\"ok\","
+                    "\"data\":{\"price\":10,\"amount\":2}}";
+    size = strlen (message);
+    packed_size = vtx_lz_compress (packer, (byte *) message, size,
+                                   packed, VTX_LZ_BLOCK);
+    assert (packed_size > 0 && packed_size < size * 2 / 3);
+    assert (vtx_lz_compress (plain, (byte *) message, size,
+                             data, VTX_LZ_BLOCK) > packed_size);
+    rc = vtx_lz_expand (unpacker, packed, packed_size, size, &result);
+    assert (rc == 0);
+    assert (memcmp (result, message, size) == 0);
+    printf ("%zd byte message packed to %zd bytes with dictionary\n",
+        size, packed_size);
+
+    vtx_lz_destroy (&packer);
+    vtx_lz_destroy (&unpacker);
+    vtx_lz_destroy (&plain);
+    free (data);
+    free (packed);
+}
+
+#endif
@@ -0,0 +1,7 @@
+#include "vtx_lz.c"
+
+int main (void)
+{
+    vtx_lz_selftest ();
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,589 @@
+/*  =====================================================================
+    vtx_match - 0MQ virtual transport interface - subscription matching
+
+    Publishers filter messages at source, so each published message must
+    be matched against every subscription of every subscriber. This class
+    holds those subscriptions and returns the subscribers that match a
+    message topic (the first message frame).
+
+    Matching is done by an engine, which is a set of methods that the
+    class calls through a table, so we can add other matching algorithms
+    later. The first engine does prefix matching, using a compressed
+    prefix trie (a radix tree). A match walks one path down the trie and
+    so costs the same for ten subscriptions as for a million; it depends
+    only on the topic length and the number of matching subscribers.
+
+    ---------------------------------------------------------------------
+    Copyright (c) 1991-2011 iMatix Corporation <www.imatix.com>
+    Copyright other contributors as noted in the AUTHORS file.
+
+    This file is part of VTX, the 0MQ virtual transport interface:
+    http://vtx.zeromq.org.
+
+    This is free software; you can redistribute it and/or modify it under
+    the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or (at
+    your option) any later version.
+
+    This software is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this program. If not, see
+    <http://www.gnu.org/licenses/>.
+    =====================================================================
+*/
+
+#ifndef __VTX_MATCH_INCLUDED__
+#define __VTX_MATCH_INCLUDED__
+
+#include "czmq.h"
+#include "vtx.h"
+#if defined (__SSE2__)
+#   include <emmintrin.h>
+#endif
+
+typedef struct _vtx_match_t vtx_match_t;
+
+//  Called once for each subscription that matches a topic; a subscriber
+//  with several matching subscriptions is reported once for each.
+typedef void (vtx_match_fn) (void *item, void *arg);
+
+//  This is the interface that each matching engine implements
+typedef struct {
+    int type;                   //  VTX_MATCH_xxx
+    void *(*new) (void);
+    void (*destroy) (void **state_p);
+    int (*insert) (void *state, byte *topic, size_t size, void *item);
+    int (*delete) (void *state, byte *topic, size_t size, void *item);
+    void (*match) (void *state, byte *topic, size_t size,
+                   vtx_match_fn *handler, void *arg);
+} vtx_match_engine_t;
+
+struct _vtx_match_t {
+    vtx_match_engine_t *engine; //  Engine methods
+    void *state;                //  Engine instance
+    size_t size;                //  Number of subscriptions held
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Create new matcher using specified engine, VTX_MATCH_xxx. Returns
+//  NULL if there is no such engine.
+static vtx_match_t *
+    vtx_match_new (int type);
+
+//  Destroy matcher; does not touch the items it refers to
+static void
+    vtx_match_destroy (vtx_match_t **self_p);
+
+//  Add subscription for item. Returns 0 if OK, -1 if the item already
+//  has this subscription.
+static int
+    vtx_match_insert (vtx_match_t *self, byte *topic, size_t size, void *item);
+
+//  Remove subscription for item. Returns 0 if OK, -1 if the item did not
+//  have this subscription.
+static int
+    vtx_match_delete (vtx_match_t *self, byte *topic, size_t size, void *item);
+
+//  Call handler for each subscription that matches the topic
+static void
+    vtx_match_run (vtx_match_t *self, byte *topic, size_t size,
+                   vtx_match_fn *handler, void *arg);
+
+//  Return number of subscriptions held
+static size_t
+    vtx_match_size (vtx_match_t *self);
+
+//  Selftest of matcher class
+static void
+    vtx_match_selftest (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+//  ---------------------------------------------------------------------
+//  Prefix matching engine
+
+//  Each trie node holds the part of the topic that leads to it from its
+//  parent, and the items that subscribed to the topic ending at the node.
+//  Children are found by their first byte, which we keep in a separate
+//  array so that a memchr over it finds the child.
+
+typedef struct _trie_node_t trie_node_t;
+
+struct _trie_node_t {
+    byte *label;                //  Topic bytes from parent to this node
+    size_t label_size;          //  Size of label
+    byte *keys;                 //  First byte of each child's label
+    trie_node_t **children;     //  Child nodes, matching keys
+    uint child_count;           //  Number of children
+    uint child_limit;           //  Allocated size of children
+    void **items;               //  Items subscribed at this node
+    uint item_count;            //  Number of items
+    uint item_limit;            //  Allocated size of items
+};
+
+static trie_node_t *
+    s_trie_node_new (byte *label, size_t size);
+static void
+    s_trie_node_destroy (trie_node_t **self_p);
+static trie_node_t *
+    s_trie_node_child (trie_node_t *self, byte key);
+static void
+    s_trie_node_attach (trie_node_t *self, trie_node_t *child);
+static void
+    s_trie_node_detach (trie_node_t *self, trie_node_t *child);
+static int
+    s_trie_node_delete (trie_node_t *self, byte *topic, size_t size,
+                        void *item);
+static inline size_t
+    s_common_prefix (byte *left, byte *right, size_t size);
+
+
+static void *
+s_trie_new (void)
+{
+    return s_trie_node_new (NULL, 0);
+}
+
+static void
+s_trie_destroy (void **state_p)
+{
+    s_trie_node_destroy ((trie_node_t **) state_p);
+}
+
+//  Walk down trie as far as topic matches, splitting a node if the topic
+//  ends or diverges in the middle of its label, then hang the rest of the
+//  topic off the last node we reached.
+
+static int
+s_trie_insert (void *state, byte *topic, size_t size, void *item)
+{
+    trie_node_t *node = (trie_node_t *) state;
+    while (size) {
+        trie_node_t *child = s_trie_node_child (node, *topic);
+        if (!child) {
+            child = s_trie_node_new (topic, size);
+            s_trie_node_attach (node, child);
+            node = child;
+            break;
+        }
+        size_t common = s_common_prefix (child->label, topic,
+            child->label_size < size? child->label_size: size);
+        if (common < child->label_size) {
+            //  Split child into a node for the common part and the rest
+            trie_node_t *split = s_trie_node_new (child->label, common);
+            s_trie_node_detach (node, child);
+            child->label_size -= common;
+            memmove (child->label, child->label + common, child->label_size);
+            s_trie_node_attach (split, child);
+            s_trie_node_attach (node, split);
+            child = split;
+        }
+        node = child;
+        topic += common;
+        size -= common;
+    }
+    uint index;
+    for (index = 0; index < node->item_count; index++)
+        if (node->items [index] == item)
+            return -1;          //  Already subscribed
+
+    if (node->item_count == node->item_limit) {
+        node->item_limit = node->item_limit? node->item_limit * 2: 4;
+        node->items = realloc (node->items, node->item_limit * sizeof (void *));
+        assert (node->items);
+    }
+    node->items [node->item_count++] = item;
+    return 0;
+}
+
+static int
+s_trie_delete (void *state, byte *topic, size_t size, void *item)
+{
+    return s_trie_node_delete ((trie_node_t *) state, topic, size, item);
+}
+
+//  Report items at each node along the topic's path; an item at a node
+//  subscribed to a prefix of the topic.
+
+static void
+s_trie_match (void *state, byte *topic, size_t size,
+              vtx_match_fn *handler, void *arg)
+{
+    trie_node_t *node = (trie_node_t *) state;
+    while (TRUE) {
+        uint index;
+        for (index = 0; index < node->item_count; index++)
+            (handler) (node->items [index], arg);
+        if (size == 0)
+            break;
+        node = s_trie_node_child (node, *topic);
+        if (!node
+        ||  node->label_size > size
+        ||  s_common_prefix (node->label, topic, node->label_size)
+            < node->label_size)
+            break;
+        topic += node->label_size;
+        size -= node->label_size;
+    }
+}
+
+static vtx_match_engine_t
+s_trie_engine = {
+    VTX_MATCH_PREFIX,
+    s_trie_new, s_trie_destroy,
+    s_trie_insert, s_trie_delete, s_trie_match
+};
+
+static trie_node_t *
+s_trie_node_new (byte *label, size_t size)
+{
+    trie_node_t *self = (trie_node_t *) zmalloc (sizeof (trie_node_t));
+    if (size) {
+        self->label = (byte *) malloc (size);
+        memcpy (self->label, label, size);
+        self->label_size = size;
+    }
+    return self;
+}
+
+static void
+s_trie_node_destroy (trie_node_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        trie_node_t *self = *self_p;
+        uint index;
+        for (index = 0; index < self->child_count; index++)
+            s_trie_node_destroy (&self->children [index]);
+        free (self->label);
+        free (self->keys);
+        free (self->children);
+        free (self->items);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+static trie_node_t *
+s_trie_node_child (trie_node_t *self, byte key)
+{
+    if (self->child_count == 0)
+        return NULL;
+    byte *found = (byte *) memchr (self->keys, key, self->child_count);
+    return found? self->children [found - self->keys]: NULL;
+}
+
+static void
+s_trie_node_attach (trie_node_t *self, trie_node_t *child)
+{
+    assert (child->label_size);
+    if (self->child_count == self->child_limit) {
+        self->child_limit = self->child_limit? self->child_limit * 2: 2;
+        if (self->child_limit > 256)
+            self->child_limit = 256;
+        self->keys = realloc (self->keys, self->child_limit);
+        self->children = realloc (self->children,
+            self->child_limit * sizeof (trie_node_t *));
+        assert (self->keys && self->children);
+    }
+    self->keys [self->child_count] = child->label [0];
+    self->children [self->child_count++] = child;
+}
+
+static void
+s_trie_node_detach (trie_node_t *self, trie_node_t *child)
+{
+    byte *found = (byte *) memchr (self->keys, child->label [0],
+                                   self->child_count);
+    assert (found);
+    uint index = found - self->keys;
+    self->child_count--;
+    self->keys [index] = self->keys [self->child_count];
+    self->children [index] = self->children [self->child_count];
+}
+
+//  Remove item from node for topic, then prune nodes that are no longer
+//  needed on the way back up: empty leaves are dropped, and a node with
+//  no items and a single child is merged into that child.
+
+static int
+s_trie_node_delete (trie_node_t *self, byte *topic, size_t size, void *item)
+{
+    if (size == 0) {
+        uint index;
+        for (index = 0; index < self->item_count; index++)
+            if (self->items [index] == item) {
+                self->items [index] = self->items [--self->item_count];
+                return 0;
+            }
+        return -1;
+    }
+    trie_node_t *child = s_trie_node_child (self, *topic);
+    if (!child
+    ||  child->label_size > size
+    ||  s_common_prefix (child->label, topic, child->label_size)
+        < child->label_size)
+        return -1;
+
+    int rc = s_trie_node_delete (child,
+        topic + child->label_size, size - child->label_size, item);
+    if (rc == 0 && child->item_count == 0) {
+        if (child->child_count == 0) {
+            s_trie_node_detach (self, child);
+            s_trie_node_destroy (&child);
+        }
+        else
+        if (child->child_count == 1) {
+            trie_node_t *grandchild = child->children [0];
+            size_t merged = child->label_size + grandchild->label_size;
+            byte *label = (byte *) malloc (merged);
+            memcpy (label, child->label, child->label_size);
+            memcpy (label + child->label_size,
+                    grandchild->label, grandchild->label_size);
+            free (grandchild->label);
+            grandchild->label = label;
+            grandchild->label_size = merged;
+            s_trie_node_detach (self, child);
+            child->child_count = 0;
+            s_trie_node_destroy (&child);
+            s_trie_node_attach (self, grandchild);
+        }
+    }
+    return rc;
+}
+
+//  Return number of leading bytes that are the same in both buffers,
+//  comparing 16 bytes at a time where we can.
+
+static inline size_t
+s_common_prefix (byte *left, byte *right, size_t size)
+{
+    size_t offset = 0;
+#if defined (__SSE2__)
+    while (offset + 16 <= size) {
+        __m128i chunk_left = _mm_loadu_si128 ((__m128i *) (left + offset));
+        __m128i chunk_right = _mm_loadu_si128 ((__m128i *) (right + offset));
+        uint mask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (chunk_left, chunk_right));
+        if (mask != 0xFFFF)
+            return offset + __builtin_ctz (~mask);
+        offset += 16;
+    }
+#else
+    while (offset + sizeof (size_t) <= size
+    &&     memcmp (left + offset, right + offset, sizeof (size_t)) == 0)
+        offset += sizeof (size_t);
+#endif
+    while (offset < size && left [offset] == right [offset])
+        offset++;
+    return offset;
+}
+
+
+//  ---------------------------------------------------------------------
+//  Table of all known matching engines
+
+static vtx_match_engine_t *
+s_match_engines [] = {
+    &s_trie_engine
+};
+
+
+//  ---------------------------------------------------------------------
+//  Create new matcher
+
+static vtx_match_t *
+vtx_match_new (int type)
+{
+    uint index;
+    for (index = 0; index < tblsize (s_match_engines); index++)
+        if (s_match_engines [index]->type == type)
+            break;
+    if (index == tblsize (s_match_engines))
+        return NULL;
+
+    vtx_match_t *self = (vtx_match_t *) zmalloc (sizeof (vtx_match_t));
+    self->engine = s_match_engines [index];
+    self->state = (self->engine->new) ();
+    return self;
+}
+
+
+//  ---------------------------------------------------------------------
+//  Destroy matcher
+
+static void
+vtx_match_destroy (vtx_match_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        vtx_match_t *self = *self_p;
+        (self->engine->destroy) (&self->state);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  ---------------------------------------------------------------------
+//  Add subscription for item
+
+static int
+vtx_match_insert (vtx_match_t *self, byte *topic, size_t size, void *item)
+{
+    assert (self);
+    int rc = (self->engine->insert) (self->state, topic, size, item);
+    if (rc == 0)
+        self->size++;
+    return rc;
+}
+
+
+//  ---------------------------------------------------------------------
+//  Remove subscription for item
+
+static int
+vtx_match_delete (vtx_match_t *self, byte *topic, size_t size, void *item)
+{
+    assert (self);
+    int rc = (self->engine->delete) (self->state, topic, size, item);
+    if (rc == 0)
+        self->size--;
+    return rc;
+}
+
+
+//  ---------------------------------------------------------------------
+//  Call handler for each subscription that matches the topic
+
+static void
+vtx_match_run (vtx_match_t *self, byte *topic, size_t size,
+               vtx_match_fn *handler, void *arg)
+{
+    assert (self);
+    assert (handler);
+    (self->engine->match) (self->state, topic, size, handler, arg);
+}
+
+
+//  ---------------------------------------------------------------------
+//  Return number of subscriptions held
+
+static size_t
+vtx_match_size (vtx_match_t *self)
+{
+    assert (self);
+    return self->size;
+}
+
+
+//  ---------------------------------------------------------------------
+//  Selftest of matcher class
+
+//  Items are entries in this table, handler counts how often each one
+//  matched
+static int s_match_items [8];
+
+static void
+s_match_count (void *item, void *arg)
+{
+    ((int *) arg) [(int *) item - s_match_items]++;
+}
+
+static void
+vtx_match_selftest (void)
+{
+    assert (vtx_match_new (0) == NULL);
+    vtx_match_t *matcher = vtx_match_new (VTX_MATCH_PREFIX);
+    assert (matcher);
+
+    int *item = s_match_items;
+    int count [8];
+
+    //  Overlapping prefixes force node splits
+    assert (vtx_match_insert (matcher, (byte *) "ABCDEF", 6, item + 1) == 0);
+    assert (vtx_match_insert (matcher, (byte *) "ABC", 3, item + 2) == 0);
+    assert (vtx_match_insert (matcher, (byte *) "ABX", 3, item + 3) == 0);
+    assert (vtx_match_insert (matcher, (byte *) "", 0, item + 4) == 0);
+    assert (vtx_match_insert (matcher, (byte *) "ABC", 3, item + 5) == 0);
+    assert (vtx_match_insert (matcher, (byte *) "ABC", 3, item + 2) == -1);
+    assert (vtx_match_size (matcher) == 5);
+
+    memset (count, 0, sizeof (count));
+    vtx_match_run (matcher, (byte *) "ABCDEFG", 7, s_match_count, count);
+    assert (count [1] == 1 && count [2] == 1 && count [3] == 0
+         && count [4] == 1 && count [5] == 1);
+
+    memset (count, 0, sizeof (count));
+    vtx_match_run (matcher, (byte *) "ABCD", 4, s_match_count, count);
+    assert (count [1] == 0 && count [2] == 1 && count [4] == 1);
+
+    memset (count, 0, sizeof (count));
+    vtx_match_run (matcher, (byte *) "AB", 2, s_match_count, count);
+    assert (count [2] == 0 && count [3] == 0 && count [4] == 1);
+
+    //  Deleting merges nodes back, matches must stay the same
+    assert (vtx_match_delete (matcher, (byte *) "ABX", 3, item + 3) == 0);
+    assert (vtx_match_delete (matcher, (byte *) "ABX", 3, item + 3) == -1);
+    assert (vtx_match_delete (matcher, (byte *) "ABC", 3, item + 2) == 0);
+    assert (vtx_match_delete (matcher, (byte *) "ABC", 3, item + 5) == 0);
+    memset (count, 0, sizeof (count));
+    vtx_match_run (matcher, (byte *) "ABCDEFG", 7, s_match_count, count);
+    assert (count [1] == 1 && count [2] == 0 && count [4] == 1);
+    assert (vtx_match_size (matcher) == 2);
+    vtx_match_destroy (&matcher);
+    assert (matcher == NULL);
+
+    //  Check long topics, which use the wide prefix compare, against a
+    //  brute force match over a larger set of subscriptions. A repeated
+    //  topic for the same item is refused, so we only expect the ones
+    //  that went in.
+    #define TOPICS 10000
+    matcher = vtx_match_new (VTX_MATCH_PREFIX);
+    char (*topics) [40] = malloc (TOPICS * 40);
+    Bool *inserted = malloc (TOPICS * sizeof (Bool));
+    assert (topics && inserted);
+    int index;
+    for (index = 0; index < TOPICS; index++) {
+        sprintf (topics [index], "market.data.equities.%d", randof (1000));
+        inserted [index] = vtx_match_insert (matcher, (byte *) topics [index],
+            strlen (topics [index]), item + (index % 8)) == 0;
+    }
+    int probe;
+    for (probe = 0; probe < 100; probe++) {
+        char topic [40];
+        sprintf (topic, "market.data.equities.%d", randof (10000));
+        int expect [8];
+        memset (expect, 0, sizeof (expect));
+        for (index = 0; index < TOPICS; index++)
+            if (inserted [index]
+            &&  strncmp (topics [index], topic, strlen (topics [index])) == 0)
+                expect [index % 8]++;
+        memset (count, 0, sizeof (count));
+        vtx_match_run (matcher, (byte *) topic, strlen (topic),
+            s_match_count, count);
+        for (index = 0; index < 8; index++)
+            assert (count [index] == expect [index]);
+    }
+    for (index = 0; index < TOPICS; index++)
+        if (inserted [index])
+            assert (vtx_match_delete (matcher, (byte *) topics [index],
+                strlen (topics [index]), item + (index % 8)) == 0);
+    assert (vtx_match_size (matcher) == 0);
+    free (topics);
+    free (inserted);
+    vtx_match_destroy (&matcher);
+    printf ("%d subscriptions matched correctly\n", TOPICS);
+    #undef TOPICS
+}
+
+#endif
@@ -0,0 +1,7 @@
+#include "vtx_match.c"
+
+int main (void)
+{
+    vtx_match_selftest ();
+    return 0;
+}
\ No newline at end of file
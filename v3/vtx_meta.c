@@ -0,0 +1,145 @@
+/*  =====================================================================
+    vtx_meta - 0MQ virtual transport interface - message metadata
+
+    Encodes and decodes the metadata frame that drivers put in front of
+    each message when the application sets VTX_OPT_METADATA. The format
+    is described in vtx.h; drivers encode the frame, and vtx_popmeta
+    decodes it, so both sides share this one definition.
+
+    ---------------------------------------------------------------------
+    Copyright (c) 1991-2011 iMatix Corporation <www.imatix.com>
+    Copyright other contributors as noted in the AUTHORS file.
+
+    This file is part of VTX, the 0MQ virtual transport interface:
+    http://vtx.zeromq.org.
+
+    This is free software; you can redistribute it and/or modify it under
+    the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or (at
+    your option) any later version.
+
+    This software is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this program. If not, see
+    <http://www.gnu.org/licenses/>.
+    =====================================================================
+*/
+
+#ifndef __VTX_META_INCLUDED__
+#define __VTX_META_INCLUDED__
+
+#include "czmq.h"
+#include "vtx.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Encode metadata frame for a message from address, received now, into
+//  buffer of at least VTX_META_MAX bytes. We pass the host without its
+//  port, as the "sender" meta does. Returns size of frame.
+static size_t
+    vtx_meta_encode (byte *buffer, char *address);
+
+//  Decode metadata frame, giving the sender address, which the caller
+//  should free, and the receive time. Either pointer may be null.
+//  Returns -1 if this is not a metadata frame.
+static int
+    vtx_meta_decode (byte *data, size_t size, char **sender_p, int64_t *time_p);
+
+//  Selftest of metadata encoding
+static void
+    vtx_meta_selftest (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+//  -------------------------------------------------------------------------
+//  Encode metadata frame
+
+static size_t
+vtx_meta_encode (byte *buffer, char *address)
+{
+    assert (buffer);
+    assert (address);
+    int64_t now = zclock_time ();
+    buffer [0] = VTX_META_VERSION;
+    int index;
+    for (index = VTX_META_HEADER - 1; index > 0; index--) {
+        buffer [index] = (byte) now;
+        now >>= 8;
+    }
+    size_t size = strcspn (address, ":");
+    if (size > VTX_META_MAX - VTX_META_HEADER)
+        size = VTX_META_MAX - VTX_META_HEADER;
+    memcpy (buffer + VTX_META_HEADER, address, size);
+    return VTX_META_HEADER + size;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Decode metadata frame
+
+static int
+vtx_meta_decode (byte *data, size_t size, char **sender_p, int64_t *time_p)
+{
+    assert (data);
+    if (size < VTX_META_HEADER
+    ||  size > VTX_META_MAX
+    ||  data [0] != VTX_META_VERSION)
+        return -1;
+
+    if (time_p) {
+        int64_t time = 0;
+        int index;
+        for (index = 1; index < VTX_META_HEADER; index++)
+            time = (time << 8) + data [index];
+        *time_p = time;
+    }
+    if (sender_p) {
+        size -= VTX_META_HEADER;
+        *sender_p = (char *) malloc (size + 1);
+        memcpy (*sender_p, data + VTX_META_HEADER, size);
+        (*sender_p) [size] = 0;
+    }
+    return 0;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Selftest of metadata encoding
+
+static void
+vtx_meta_selftest (void)
+{
+    //  Check a frame decodes to what we encoded, without the port
+    byte meta [VTX_META_MAX];
+    int64_t before = zclock_time ();
+    size_t size = vtx_meta_encode (meta, "10.0.0.1:5555");
+    assert (size == VTX_META_HEADER + 8);
+    char *sender;
+    int64_t time;
+    int rc = vtx_meta_decode (meta, size, &sender, &time);
+    assert (rc == 0);
+    assert (streq (sender, "10.0.0.1"));
+    assert (time >= before && time <= zclock_time ());
+    free (sender);
+    rc = vtx_meta_decode (meta, size, NULL, NULL);
+    assert (rc == 0);
+
+    //  Check we refuse anything that isn't a metadata frame
+    rc = vtx_meta_decode (meta, VTX_META_HEADER - 1, NULL, NULL);
+    assert (rc == -1);
+    meta [0] = VTX_META_VERSION + 1;
+    rc = vtx_meta_decode (meta, size, NULL, NULL);
+    assert (rc == -1);
+    printf ("metadata encoded and decoded\n");
+}
+
+#endif
@@ -0,0 +1,7 @@
+#include "vtx_meta.c"
+
+int main (void)
+{
+    vtx_meta_selftest ();
+    return 0;
+}
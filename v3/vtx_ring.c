@@ -0,0 +1,380 @@
+/*  =====================================================================
+    vtx_ring - 0MQ virtual transport interface - message pointer ring
+
+    Passes zmsg_t pointers from one thread to another without copying
+    or locking. There must be exactly one producer thread and one
+    consumer thread. The ring has a file handle that the consumer can
+    poll; the producer only signals it when the ring goes from empty to
+    not empty, and the handle stays readable until the consumer finds
+    the ring empty again. The strategy on full ring is to refuse the
+    message, so the producer decides whether to wait or drop. Batch
+    calls move many messages for the cost of one.
+
+    ---------------------------------------------------------------------
+    Copyright (c) 1991-2011 iMatix Corporation <www.imatix.com>
+    Copyright other contributors as noted in the AUTHORS file.
+
+    This file is part of VTX, the 0MQ virtual transport interface:
+    http://vtx.zeromq.org.
+
+    This is free software; you can redistribute it and/or modify it under
+    the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or (at
+    your option) any later version.
+
+    This software is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this program. If not, see
+    <http://www.gnu.org/licenses/>.
+    =====================================================================
+*/
+
+#ifndef __VTX_RING_INCLUDED__
+#define __VTX_RING_INCLUDED__
+
+#include "czmq.h"
+#include <poll.h>
+#if defined (__linux__)
+#   include <sys/eventfd.h>
+#endif
+
+//  Most messages we move in one batch call, for callers that batch
+//  into an array on the stack
+#define VTX_RING_BATCH  64
+
+typedef struct _vtx_ring_t vtx_ring_t;
+
+//  Head and tail are free-running counters, masked to index the ring.
+//  Each is written by one thread only, and they sit on separate cache
+//  lines so the two threads don't fight over them.
+struct _vtx_ring_t {
+    zmsg_t **slots;             //  Ring of message pointers
+    uint limit;                 //  Size of ring, a power of two
+    int handle;                 //  Wakeup handle, polled by consumer
+    int signal;                 //  Handle we write to, may be same
+    byte pad1 [64];
+    volatile uint head;         //  Consumer takes messages from here
+    byte pad2 [64];
+    volatile uint tail;         //  Producer adds messages here
+    byte pad3 [64];
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Create new ring, limit is rounded up to a power of two
+static vtx_ring_t *
+    vtx_ring_new (uint limit);
+
+//  Destroy ring and all messages it holds
+static void
+    vtx_ring_destroy (vtx_ring_t **self_p);
+
+//  Producer: add message to ring, returns 0 if OK, -1 if the ring is
+//  full, in which case the caller still owns the message
+static int
+    vtx_ring_push (vtx_ring_t *self, zmsg_t *msg);
+
+//  Consumer: take oldest message off ring, or NULL if ring is empty
+static zmsg_t *
+    vtx_ring_pop (vtx_ring_t *self);
+
+//  Producer: add up to count messages to ring, in order, returns number
+//  of messages added; the caller still owns the rest
+static uint
+    vtx_ring_push_batch (vtx_ring_t *self, zmsg_t **msgs, uint count);
+
+//  Consumer: take up to limit oldest messages off ring, returns number
+//  of messages taken
+static uint
+    vtx_ring_pop_batch (vtx_ring_t *self, zmsg_t **msgs, uint limit);
+
+//  Consumer: wait until ring is not empty, up to timeout msecs, or
+//  forever if timeout is -1. Returns 0 if ring has messages, else -1.
+static int
+    vtx_ring_wait (vtx_ring_t *self, int timeout);
+
+//  Return handle that is readable whenever ring may hold messages
+static int
+    vtx_ring_handle (vtx_ring_t *self);
+
+//  Selftest of ring class
+static void
+    vtx_ring_selftest (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+//  -------------------------------------------------------------------------
+//  Create new ring
+
+static vtx_ring_t *
+vtx_ring_new (uint limit)
+{
+    vtx_ring_t *self = (vtx_ring_t *) zmalloc (sizeof (vtx_ring_t));
+    self->limit = 2;
+    while (self->limit < limit)
+        self->limit <<= 1;
+    self->slots = (zmsg_t **) zmalloc (self->limit * sizeof (zmsg_t *));
+#if defined (__linux__)
+    self->handle = eventfd (0, EFD_NONBLOCK);
+    assert (self->handle != -1);
+    self->signal = self->handle;
+#else
+    int pipes [2];
+    int rc = pipe (pipes);
+    assert (rc == 0);
+    fcntl (pipes [0], F_SETFL, O_NONBLOCK);
+    fcntl (pipes [1], F_SETFL, O_NONBLOCK);
+    self->handle = pipes [0];
+    self->signal = pipes [1];
+#endif
+    return self;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Destroy ring and all messages it holds
+
+static void
+vtx_ring_destroy (vtx_ring_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        vtx_ring_t *self = *self_p;
+        zmsg_t *msg;
+        while ((msg = vtx_ring_pop (self)))
+            zmsg_destroy (&msg);
+        close (self->handle);
+        if (self->signal != self->handle)
+            close (self->signal);
+        free (self->slots);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  Make ring handle readable; we don't care if it already was
+
+static void
+s_ring_signal (vtx_ring_t *self)
+{
+    uint64_t one = 1;
+    if (write (self->signal, &one, sizeof (one)) == -1)
+        assert (errno == EAGAIN);
+}
+
+//  Make ring handle unreadable
+static void
+s_ring_unsignal (vtx_ring_t *self)
+{
+    uint64_t count [8];
+    while (read (self->handle, count, sizeof (count)) > 0)
+        ;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Add message to ring
+
+static int
+vtx_ring_push (vtx_ring_t *self, zmsg_t *msg)
+{
+    assert (msg);
+    return vtx_ring_push_batch (self, &msg, 1) == 1? 0: -1;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Take oldest message off ring
+
+static zmsg_t *
+vtx_ring_pop (vtx_ring_t *self)
+{
+    zmsg_t *msg;
+    return vtx_ring_pop_batch (self, &msg, 1) == 1? msg: NULL;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Add messages to ring. We publish the new tail before we look at the
+//  head, and the consumer does the reverse, so at least one of us sees
+//  the other's update and the ring can't go quiet with messages in it.
+
+static uint
+vtx_ring_push_batch (vtx_ring_t *self, zmsg_t **msgs, uint count)
+{
+    assert (self);
+    assert (msgs);
+    uint tail = self->tail;
+    uint space = self->limit
+               - (tail - __atomic_load_n (&self->head, __ATOMIC_ACQUIRE));
+    if (count > space)
+        count = space;          //  Ring is full, or will be
+    if (count == 0)
+        return 0;
+
+    uint index;
+    for (index = 0; index < count; index++) {
+        assert (msgs [index]);
+        self->slots [(tail + index) & (self->limit - 1)] = msgs [index];
+    }
+    __atomic_store_n (&self->tail, tail + count, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&self->head, __ATOMIC_SEQ_CST) == tail)
+        s_ring_signal (self);
+    return count;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Take oldest messages off ring. When we find the ring empty we clear
+//  the handle, then look once more in case the producer just added a
+//  message; if it did, we set the handle again so it stays readable.
+
+static uint
+vtx_ring_pop_batch (vtx_ring_t *self, zmsg_t **msgs, uint limit)
+{
+    assert (self);
+    assert (msgs);
+    uint head = self->head;
+    uint tail = __atomic_load_n (&self->tail, __ATOMIC_SEQ_CST);
+    if (tail == head) {
+        s_ring_unsignal (self);
+        tail = __atomic_load_n (&self->tail, __ATOMIC_SEQ_CST);
+        if (tail == head)
+            return 0;
+        s_ring_signal (self);
+    }
+    uint count = tail - head;
+    if (count > limit)
+        count = limit;
+    uint index;
+    for (index = 0; index < count; index++)
+        msgs [index] = self->slots [(head + index) & (self->limit - 1)];
+    __atomic_store_n (&self->head, head + count, __ATOMIC_SEQ_CST);
+    return count;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Wait until ring is not empty
+
+static int
+vtx_ring_wait (vtx_ring_t *self, int timeout)
+{
+    assert (self);
+    struct pollfd item = { self->handle, POLLIN, 0 };
+    while (__atomic_load_n (&self->tail, __ATOMIC_ACQUIRE) == self->head) {
+        int rc = poll (&item, 1, timeout);
+        if (rc == 0 || (rc == -1 && errno != EINTR))
+            return -1;
+        if (rc == 1 && __atomic_load_n (&self->tail, __ATOMIC_ACQUIRE) == self->head)
+            s_ring_unsignal (self);
+    }
+    return 0;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Return handle that is readable whenever ring may hold messages
+
+static int
+vtx_ring_handle (vtx_ring_t *self)
+{
+    assert (self);
+    return self->handle;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Selftest of ring class
+
+static void
+vtx_ring_selftest (void)
+{
+    vtx_ring_t *ring = vtx_ring_new (5);
+    assert (ring->limit == 8);
+    struct pollfd item = { vtx_ring_handle (ring), POLLIN, 0 };
+
+    //  Empty ring is not readable and has nothing to take
+    assert (poll (&item, 1, 0) == 0);
+    assert (vtx_ring_pop (ring) == NULL);
+    assert (vtx_ring_wait (ring, 0) == -1);
+
+    //  Fill ring, it refuses the message after that
+    zmsg_t *msg;
+    int index;
+    for (index = 0; index < 8; index++) {
+        msg = zmsg_new ();
+        zmsg_addstr (msg, "%d", index);
+        assert (vtx_ring_push (ring, msg) == 0);
+        assert (poll (&item, 1, 0) == 1);
+    }
+    msg = zmsg_new ();
+    assert (vtx_ring_push (ring, msg) == -1);
+    zmsg_destroy (&msg);
+    assert (vtx_ring_wait (ring, 0) == 0);
+
+    //  Messages come out in order, handle stays readable until empty
+    for (index = 0; index < 8; index++) {
+        assert (poll (&item, 1, 0) == 1);
+        msg = vtx_ring_pop (ring);
+        assert (msg);
+        char *string = zmsg_popstr (msg);
+        assert (atoi (string) == index);
+        free (string);
+        zmsg_destroy (&msg);
+    }
+    assert (vtx_ring_pop (ring) == NULL);
+    assert (poll (&item, 1, 0) == 0);
+
+    //  Indices wrap around the ring
+    for (index = 0; index < 100; index++) {
+        assert (vtx_ring_push (ring, zmsg_new ()) == 0);
+        assert (vtx_ring_push (ring, zmsg_new ()) == 0);
+        msg = vtx_ring_pop (ring);
+        zmsg_destroy (&msg);
+        msg = vtx_ring_pop (ring);
+        assert (msg);
+        zmsg_destroy (&msg);
+    }
+    //  Batches stop at the end of the ring, and take messages in order
+    zmsg_t *batch [12];
+    for (index = 0; index < 12; index++) {
+        batch [index] = zmsg_new ();
+        zmsg_addstr (batch [index], "%d", index);
+    }
+    assert (vtx_ring_push_batch (ring, batch, 12) == 8);
+    assert (poll (&item, 1, 0) == 1);
+    assert (vtx_ring_push_batch (ring, batch + 8, 4) == 0);
+    assert (vtx_ring_pop_batch (ring, batch, 3) == 3);
+    assert (vtx_ring_push_batch (ring, batch + 8, 4) == 3);
+    zmsg_destroy (&batch [11]);
+    for (index = 0; index < 3; index++)
+        zmsg_destroy (&batch [index]);
+    assert (vtx_ring_pop_batch (ring, batch, 12) == 8);
+    for (index = 0; index < 8; index++) {
+        char *string = zmsg_popstr (batch [index]);
+        assert (atoi (string) == index + 3);
+        free (string);
+        zmsg_destroy (&batch [index]);
+    }
+    assert (vtx_ring_pop_batch (ring, batch, 12) == 0);
+    assert (poll (&item, 1, 0) == 0);
+
+    //  Destroying ring destroys messages still in it
+    assert (vtx_ring_push (ring, zmsg_new ()) == 0);
+    vtx_ring_destroy (&ring);
+    assert (ring == NULL);
+    printf ("OK\n");
+}
+
+#endif
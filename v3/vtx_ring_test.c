@@ -0,0 +1,7 @@
+#include "vtx_ring.c"
+
+int main (void)
+{
+    vtx_ring_selftest ();
+    return 0;
+}
\ No newline at end of file
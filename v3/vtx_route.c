@@ -0,0 +1,394 @@
+/*  =====================================================================
+    vtx_route - 0MQ virtual transport interface - shared routing layer
+
+    Picks the peering, or peerings, that each outgoing message goes to.
+    Each routing mechanism has its own router, which the vocket looks up
+    once, when it's created or its routing changes, so drivers don't test
+    the routing type for every message. The router says which frame it
+    picks on, and the driver sends the message to the pick in its own way.
+
+    This is a template for drivers rather than a standalone class: the
+    driver includes it after declaring its vocket_t and peering_t, which
+    must have the routing properties used here, and vocket_dispatch.
+    All drivers then share the same routing behaviour.
+
+    ---------------------------------------------------------------------
+    Copyright (c) 1991-2011 iMatix Corporation <www.imatix.com>
+    Copyright other contributors as noted in the AUTHORS file.
+
+    This file is part of VTX, the 0MQ virtual transport interface:
+    http://vtx.zeromq.org.
+
+    This is free software; you can redistribute it and/or modify it under
+    the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or (at
+    your option) any later version.
+
+    This software is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this program. If not, see
+    <http://www.gnu.org/licenses/>.
+    =====================================================================
+*/
+
+#ifndef __VTX_ROUTE_INCLUDED__
+#define __VTX_ROUTE_INCLUDED__
+
+#include "vtx.h"
+
+//  What a reliable transport keeps after sending, so it can resend
+#define VTX_RETAIN_NONE         0       //  Nothing, fire and forget
+#define VTX_RETAIN_REQUEST      1       //  Request, until reply arrives
+#define VTX_RETAIN_REPLY        2       //  Reply, until next request
+
+//  Key frame that is given by the vocket's hashkey property
+#define VTX_ROUTE_HASHKEY       -1
+
+//  Router picks peering for message, given its key frame, or NULL if
+//  the message ended before the key frame
+typedef peering_t *(vtx_route_pick_fn) (
+    vocket_t *vocket, byte *key, size_t size);
+
+//  Router finishes message after the driver has sent its last frame
+typedef void (vtx_route_done_fn) (vocket_t *vocket);
+
+//  This is the structure of a router. Routers with an envelope pick on
+//  the first frame and don't send it; a fanout router puts its picks in
+//  vocket->subscribers rather than returning one peering.
+struct _vtx_route_t {
+    uint routing;               //  Mechanism, VTX_ROUTING_xxx
+    char *name;                 //  Mechanism name, for tracing
+    int key;                    //  Frame to pick on, or VTX_ROUTE_HASHKEY
+    Bool envelope;              //  Key frame is envelope, not sent?
+    Bool fanout;                //  Send to all vocket->subscribers?
+    uint retain;                //  VTX_RETAIN_xxx, for reliable transports
+    vtx_route_pick_fn *pick;    //  Picks peering for message
+    vtx_route_done_fn *done;    //  Finishes message, or NULL
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Return router for routing mechanism; unknown mechanisms get a router
+//  that drops all messages
+static vtx_route_t *
+    vtx_route_find (uint routing);
+
+//  Return index of frame that router picks on, for this vocket
+static uint
+    vtx_route_key (vtx_route_t *self, vocket_t *vocket);
+
+//  Self test of this class
+static void
+    vtx_route_selftest (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+//  ---------------------------------------------------------------------
+//  Each router is a pick function, and possibly a done function.
+//  Rejects all messages, on vockets that don't route output
+
+static peering_t *
+s_route_none (vocket_t *vocket, byte *key, size_t size)
+{
+    zclock_log ("W: send() not allowed - dropping");
+    return NULL;
+}
+
+//  Sends each message to the next live peering in turn
+
+static peering_t *
+s_route_round_robin (vocket_t *vocket, byte *key, size_t size)
+{
+    peering_t *peering = (peering_t *) zlist_pop (vocket->live_peerings);
+    if (peering)
+        zlist_append (vocket->live_peerings, peering);
+    return peering;
+}
+
+//  Sends reply to the peering that sent the request we dispatched
+
+static peering_t *
+s_route_reply (vocket_t *vocket, byte *key, size_t size)
+{
+    if (!vocket->dispatched)
+        zclock_log ("E: illegal send() without recv() on REP socket");
+    else
+    if (!vocket->reply_to)
+        zclock_log ("W: requester has gone - dropping reply");
+    return vocket->reply_to;
+}
+
+//  Once reply is sent, pass next waiting request to application
+
+static void
+s_route_reply_done (vocket_t *vocket)
+{
+    if (vocket->dispatched) {
+        vocket->dispatched = FALSE;
+        vocket->reply_to = NULL;
+        vocket_dispatch (vocket);
+    }
+}
+
+//  Hashes key frame onto ring of live peerings
+
+static peering_t *
+s_route_hash (vocket_t *vocket, byte *key, size_t size)
+{
+    return (peering_t *) vtx_hashring_lookup (vocket->hashring, key, size);
+}
+
+//  Finds peering for ROUTER identity. If the application passed the
+//  identity back as the driver delivered it, its route handle gives us
+//  the peering directly; otherwise we parse the schemed address and look
+//  that up.
+
+static peering_t *
+s_route_router (vocket_t *vocket, byte *key, size_t size)
+{
+    peering_t *peering = NULL;
+    if (size > VTX_ROUTE_HANDLE && key [size - VTX_ROUTE_HANDLE] == 0) {
+        byte *handle = key + size - VTX_ROUTE_HANDLE + 1;
+        uint route = (handle [0] << 8) + handle [1];
+        uint route_tag = (handle [2] << 8) + handle [3];
+        if (route < VTX_MAX_PEERINGS && vocket->routes)
+            peering = vocket->routes [route];
+        if (peering && peering->route_tag == route_tag) {
+            if (!peering->alive)
+                zclock_log ("W: no route to '%s' - dropping", (char *) key);
+            return peering;
+        }
+        //  Stale handle, so route by address alone
+        size -= VTX_ROUTE_HANDLE;
+        peering = NULL;
+    }
+    char address [256];
+    if (size >= sizeof (address)) {
+        zclock_log ("E: bad address - dropping");
+        return NULL;
+    }
+    if (size)
+        memcpy (address, key, size);
+    address [size] = 0;
+
+    char *scheme = vocket->driver->scheme;
+    int scheme_size = strlen (scheme);
+    if (memcmp (address, scheme, scheme_size) == 0
+    &&  memcmp (address + scheme_size, "://", 3) == 0) {
+        peering = (peering_t *) zhash_lookup (
+            vocket->peering_hash, address + scheme_size + 3);
+        if (!peering || !peering->alive)
+            zclock_log ("W: no route to '%s' - dropping", address);
+    }
+    else
+        zclock_log ("E: bad address '%s' - dropping", address);
+    return peering;
+}
+
+//  Matching engine calls this for each subscription that matches the
+//  current message; collect each live peering just once per message
+
+static void
+s_route_subscriber (void *item, void *arg)
+{
+    peering_t *peering = (peering_t *) item;
+    vocket_t *vocket = peering->vocket;
+    if (peering->alive && peering->match_epoch != vocket->match_epoch) {
+        peering->match_epoch = vocket->match_epoch;
+        zlist_append (vocket->subscribers, peering);
+    }
+}
+
+//  First frame is the topic; picks all subscribers that match it
+
+static peering_t *
+s_route_publish (vocket_t *vocket, byte *key, size_t size)
+{
+    while (zlist_size (vocket->subscribers))
+        zlist_pop (vocket->subscribers);
+    vocket->match_epoch++;
+    vtx_match_run (vocket->matcher, key, size, s_route_subscriber, NULL);
+    return NULL;
+}
+
+//  Sends to the one live peering we allow
+
+static peering_t *
+s_route_single (vocket_t *vocket, byte *key, size_t size)
+{
+    return (peering_t *) zlist_first (vocket->live_peerings);
+}
+
+//  Routers, one per routing mechanism
+
+static vtx_route_t
+s_routers [] = {
+    { VTX_ROUTING_NONE,    "none",    0, FALSE, FALSE, VTX_RETAIN_NONE,
+      s_route_none, NULL },
+    { VTX_ROUTING_REQUEST, "request", 0, FALSE, FALSE, VTX_RETAIN_REQUEST,
+      s_route_round_robin, NULL },
+    { VTX_ROUTING_REPLY,   "reply",   0, FALSE, FALSE, VTX_RETAIN_REPLY,
+      s_route_reply, s_route_reply_done },
+    { VTX_ROUTING_DEALER,  "dealer",  0, FALSE, FALSE, VTX_RETAIN_REPLY,
+      s_route_round_robin, NULL },
+    { VTX_ROUTING_ROUTER,  "router",  0, TRUE,  FALSE, VTX_RETAIN_REPLY,
+      s_route_router, NULL },
+    { VTX_ROUTING_PUBLISH, "publish", 0, FALSE, TRUE,  VTX_RETAIN_NONE,
+      s_route_publish, NULL },
+    { VTX_ROUTING_SINGLE,  "single",  0, FALSE, FALSE, VTX_RETAIN_NONE,
+      s_route_single, NULL },
+    { VTX_ROUTING_HASH,    "hash",    VTX_ROUTE_HASHKEY,
+                                         FALSE, FALSE, VTX_RETAIN_REPLY,
+      s_route_hash, NULL }
+};
+
+
+//  ---------------------------------------------------------------------
+//  Return router for routing mechanism
+
+static vtx_route_t *
+vtx_route_find (uint routing)
+{
+    uint index;
+    for (index = 0; index < tblsize (s_routers); index++)
+        if (s_routers [index].routing == routing)
+            return &s_routers [index];
+
+    zclock_log ("E: unknown routing mechanism %d", routing);
+    return &s_routers [0];
+}
+
+
+//  ---------------------------------------------------------------------
+//  Return index of frame that router picks on, for this vocket
+
+static uint
+vtx_route_key (vtx_route_t *self, vocket_t *vocket)
+{
+    return self->key == VTX_ROUTE_HASHKEY? vocket->hashkey: (uint) self->key;
+}
+
+
+//  ---------------------------------------------------------------------
+//  Selftest; runs against the including driver's vocket and peering types
+
+static void
+vtx_route_selftest (void)
+{
+    driver_t driver = { 0 };
+    driver.scheme = "tcp";
+    vocket_t vocket = { 0 };
+    vocket.driver = &driver;
+    vocket.live_peerings = zlist_new ();
+    vocket.subscribers = zlist_new ();
+    vocket.requests = zlist_new ();
+    vocket.peering_hash = zhash_new ();
+    vocket.routes = (peering_t **) zmalloc (
+        VTX_MAX_PEERINGS * sizeof (peering_t *));
+
+    peering_t peerings [3];
+    memset (peerings, 0, sizeof (peerings));
+    char *addresses [] = { "10.0.0.1:5555", "10.0.0.2:5555", "10.0.0.3:5555" };
+    uint index;
+    for (index = 0; index < 3; index++) {
+        peerings [index].vocket = &vocket;
+        peerings [index].alive = TRUE;
+        peerings [index].address = addresses [index];
+        zlist_append (vocket.live_peerings, &peerings [index]);
+        zhash_insert (vocket.peering_hash, addresses [index], &peerings [index]);
+    }
+    //  Each mechanism has its router, and others get the dropping router
+    vtx_route_t *route = vtx_route_find (VTX_ROUTING_DEALER);
+    assert (route->routing == VTX_ROUTING_DEALER);
+    assert (vtx_route_key (route, &vocket) == 0);
+    route = vtx_route_find (99);
+    assert (route->routing == VTX_ROUTING_NONE);
+    assert (route->pick (&vocket, NULL, 0) == NULL);
+
+    //  Round robin takes each live peering in turn
+    route = vtx_route_find (VTX_ROUTING_REQUEST);
+    assert (route->pick (&vocket, NULL, 0) == &peerings [0]);
+    assert (route->pick (&vocket, NULL, 0) == &peerings [1]);
+    assert (route->pick (&vocket, NULL, 0) == &peerings [2]);
+    assert (route->pick (&vocket, NULL, 0) == &peerings [0]);
+
+    //  Reply goes only to the requester, then dispatches next request
+    route = vtx_route_find (VTX_ROUTING_REPLY);
+    assert (route->pick (&vocket, NULL, 0) == NULL);
+    vocket.dispatched = TRUE;
+    vocket.reply_to = &peerings [2];
+    assert (route->pick (&vocket, NULL, 0) == &peerings [2]);
+    route->done (&vocket);
+    assert (!vocket.dispatched);
+    assert (vocket.reply_to == NULL);
+
+    //  Hash router picks on the vocket's key frame, the same way each time
+    route = vtx_route_find (VTX_ROUTING_HASH);
+    vocket.hashkey = 2;
+    assert (vtx_route_key (route, &vocket) == 2);
+    vocket.hashring = vtx_hashring_new (VTX_HASH_REPLICAS);
+    for (index = 0; index < 3; index++)
+        vtx_hashring_insert (vocket.hashring, addresses [index], &peerings [index]);
+    peering_t *peering = route->pick (&vocket, (byte *) "key", 3);
+    assert (peering);
+    assert (route->pick (&vocket, (byte *) "key", 3) == peering);
+    assert (route->pick (&vocket, NULL, 0));
+    vtx_hashring_destroy (&vocket.hashring);
+
+    //  Router takes identity as envelope, routed by handle or address
+    route = vtx_route_find (VTX_ROUTING_ROUTER);
+    assert (route->envelope);
+    byte identity [] = "tcp://10.0.0.2:5555\0\0\0\0\0";
+    size_t size = sizeof (identity) - 1;
+    assert (route->pick (&vocket, identity, size - VTX_ROUTE_HANDLE) == &peerings [1]);
+    identity [size - 4] = 0;            //  Route 7, tag 300
+    identity [size - 3] = 7;
+    identity [size - 2] = 1;
+    identity [size - 1] = 44;
+    vocket.routes [7] = &peerings [2];
+    peerings [2].route_tag = 300;
+    assert (route->pick (&vocket, identity, size) == &peerings [2]);
+    //  Stale handle falls back to address
+    peerings [2].route_tag = 301;
+    assert (route->pick (&vocket, identity, size) == &peerings [1]);
+    assert (route->pick (&vocket, (byte *) "udp://10.0.0.2:5555", 19) == NULL);
+    assert (route->pick (&vocket, (byte *) "tcp://10.0.0.9:5555", 19) == NULL);
+    assert (route->pick (&vocket, NULL, 0) == NULL);
+
+    //  Publisher picks all peerings with matching subscriptions, once
+    route = vtx_route_find (VTX_ROUTING_PUBLISH);
+    assert (route->fanout);
+    vocket.matcher = vtx_match_new (VTX_MATCH_PREFIX);
+    vtx_match_insert (vocket.matcher, (byte *) "A", 1, &peerings [0]);
+    vtx_match_insert (vocket.matcher, (byte *) "AB", 2, &peerings [0]);
+    vtx_match_insert (vocket.matcher, (byte *) "AB", 2, &peerings [2]);
+    assert (route->pick (&vocket, (byte *) "ABC", 3) == NULL);
+    assert (zlist_size (vocket.subscribers) == 2);
+    route->pick (&vocket, (byte *) "AX", 2);
+    assert (zlist_size (vocket.subscribers) == 1);
+    assert (zlist_first (vocket.subscribers) == &peerings [0]);
+    route->pick (&vocket, (byte *) "X", 1);
+    assert (zlist_size (vocket.subscribers) == 0);
+    vtx_match_destroy (&vocket.matcher);
+
+    route = vtx_route_find (VTX_ROUTING_SINGLE);
+    assert (route->pick (&vocket, NULL, 0) == zlist_first (vocket.live_peerings));
+
+    free (vocket.routes);
+    zhash_destroy (&vocket.peering_hash);
+    zlist_destroy (&vocket.subscribers);
+    zlist_destroy (&vocket.requests);
+    zlist_destroy (&vocket.live_peerings);
+    printf ("%d routers checked\n", (int) tblsize (s_routers));
+}
+
+#endif
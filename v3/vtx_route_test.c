@@ -0,0 +1,10 @@
+//  The routing layer works on driver objects, so we test it against the
+//  TCP driver's vocket and peering types
+#include "vtx.c"
+#include "vtx_tcp.c"
+
+int main (void)
+{
+    vtx_route_selftest ();
+    return 0;
+}
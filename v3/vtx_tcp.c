@@ -29,6 +29,15 @@
 
         neutral     = message
 
+    A SUB peer sends its subscriptions to the PUB peer as single-frame
+    messages, after its greeting, and the PUB peer only sends messages
+    whose first frame matches a subscription:
+
+        subscription = length final ( unsubscribe / subscribe ) topic
+        unsubscribe = %x00
+        subscribe   = %x01
+        topic       = *OCTET
+
     ---------------------------------------------------------------------
     Copyright (c) 1991-2011 iMatix Corporation <www.imatix.com>
     Copyright other contributors as noted in the AUTHORS file.
@@ -51,6 +60,15 @@
 
 #include "vtx_tcp.h"
 #include "vtx_codec.c"
+#include "vtx_hashring.c"
+#include "vtx_match.c"
+#include "vtx_arena.c"
+#include "vtx_ring.c"
+#include "vtx_loop.c"
+#include "vtx_meta.c"
+#if defined (__linux__)
+#   include <linux/filter.h>
+#endif
 
 //  Report a fatal error and exit the program without cleaning up
 //  Use of derp() should be gradually reduced to real failures.
@@ -67,21 +85,29 @@ typedef struct _driver_t driver_t;
 typedef struct _vocket_t vocket_t;
 typedef struct _binding_t binding_t;
 typedef struct _peering_t peering_t;
+typedef struct _vtx_route_t vtx_route_t;
 
 
 //  ---------------------------------------------------------------------
 //  A driver_t holds the context for one driver thread, which matches
 //  one registered driver. We create a driver by calling vtx_tcp_driver,
-//  and the thread runs until the process is interrupted. A driver works
-//  with a list of vockets, which are virtual 0MQ sockets.
+//  and the thread runs until the process is interrupted. An embedded
+//  driver has no thread; it adds itself to the application's reactor
+//  and runs whenever the application runs that. A driver works with a
+//  list of vockets, which are virtual 0MQ sockets.
 
 struct _driver_t {
     zctx_t *ctx;                //  Own context
     char *scheme;               //  Driver scheme
-    zloop_t *loop;              //  zloop reactor for socket I/O
+    vtx_loop_t *loop;           //  Reactor for socket I/O
+    Bool embedded;              //  Loop belongs to application?
+    int cpu;                    //  CPU our thread is pinned to, -1 = none
     zlist_t *vockets;           //  List of vockets per driver
+    zhash_t *vocket_hash;       //  Vockets, indexed by vtxname
     void *pipe;                 //  Control pipe to/from VTX frontend
     Bool verbose;               //  Trace activity?
+    vtx_arena_t *arena;         //  Driver objects and their strings
+    vtx_budget_t budget;        //  Memory for all codecs in driver
 };
 
 //  A vocket_t holds the context for one virtual socket, which implements
@@ -96,25 +122,61 @@ struct _vocket_t {
     driver_t *driver;           //  Parent driver object
     char *vtxname;              //  Message pipe VTX address
     void *msgpipe;              //  Message pipe (0MQ socket)
+    vtx_ring_t *outring;        //  Messages from application, or NULL
+    vtx_ring_t *lanes [VTX_MAX_LANES];
+    uint lane_count;            //  Extra rings from sending threads
+    vtx_ring_t *inring;         //  Messages to application, or NULL
+    zmsg_t *inbatch [VTX_RING_BATCH];
+    uint inbatch_size;          //  Messages waiting to go onto inring
+    zlist_t *inbacklog;         //  Messages behind inbatch, ring is full
+    Bool backlogged;            //  Ring full, so peering input stopped
+    zmsg_t *inmsg;              //  Message being collected for inring
     zhash_t *binding_hash;      //  Bindings, indexed by address
     zhash_t *peering_hash;      //  Peerings, indexed by address
     zlist_t *peering_list;      //  Peerings, in simple list
     zlist_t *live_peerings;     //  Peerings that are alive
     Bool more;                  //  More parts of message expected
     peering_t *current_peering; //  Peering that is receiving message
+    zlist_t *requests;          //  REP peerings with waiting requests
+    Bool dispatched;            //  REP request is with application
+    peering_t *reply_to;        //  For reply routing, NULL if gone
     uint peerings;              //  Current number of peerings
+    peering_t **routes;         //  ROUTER peerings, by route slot
+    uint route_tag;             //  Tag of last route handed out
     //  Vocket metadata, available via getmeta call
     char sender [16];           //  Address of last message sender
+    Bool metadata;              //  Metadata frame on each message?
     //  These properties control the vocket routing semantics
     uint routing;               //  Routing mechanism
+    vtx_route_t *route;         //  Router for outgoing messages
     Bool nomnom;                //  Accepts incoming messages
     uint min_peerings;          //  Minimum peerings for routing
     uint max_peerings;          //  Maximum allowed peerings
+    vtx_hashring_t *hashring;   //  Live peerings, for hash routing
+    //  Held frames follow a pointer so libzmq finds them aligned
+    zmq_msg_t hold [VTX_HASH_MAXKEY];
+    uint hashkey;               //  Frame to hash on, for hash routing
+    uint frame;                 //  Frame number within current message
+    uint held;                  //  Frames held until key frame arrives
+    zlist_t *subscriptions;     //  SUB topics, as strings
+    uint shards;                //  Bindings sharing each address
+    int steering;               //  How input is spread over shards
+    int shard;                  //  Our index in shard group, -1 = none
+    vtx_match_t *matcher;       //  PUB subscriptions of all peerings
+    zlist_t *subscribers;       //  PUB peerings for current message
+    uint match_epoch;           //  Counts messages matched
     //  hwm strategy
     //  filter on input messages
     //  ZMTP specific properties
     uint inbuf_max;             //  Input codec buffer limit
     uint outbuf_max;            //  Output codec buffer limit
+    int backlog;                //  Listen backlog for new bindings
+    int sndbuf;                 //  Kernel send buffer, 0 = default
+    int rcvbuf;                 //  Kernel receive buffer, 0 = default
+    int profile;                //  Latency or throughput tuning
+    vtx_budget_t budget;        //  Memory for codecs of our peerings
+    int algo;                   //  Codec algorithm we offer peers
+    int framing;                //  Message framing we offer peers
     //  Statistics and reporting
     int socktype;               //  0MQ socket type
     uint outgoing;              //  Messages sent
@@ -143,6 +205,10 @@ static struct {
     { ZMQ_PAIR,   VTX_ROUTING_SINGLE,  TRUE,  1, 1 }
 };
 
+//  Names of message framings, as offered in greetings
+static char *
+    s_framing_name [] = { "zmtp", "nom2" };
+
 
 //  A binding_t holds the context for a single binding.
 //  For ZMTP, this is includes the native TCP socket handle.
@@ -175,20 +241,71 @@ struct _peering_t {
     int handle;                 //  Handle for input/output
     int interval;               //  Current reconnect interval
     int events;                 //  Current poll events
+    int polled;                 //  Events registered with reactor
     struct sockaddr_in addr;    //  Peer address as sockaddr_in
+    int64_t active_at;          //  Time of last traffic on peering
+    Bool greeted;               //  Peer greeting received?
+    Bool offered;               //  We offered algorithm or framing?
+    size_t hold;                //  Output to send before packing starts
+    vtx_codec_algo_t *algo;     //  Codec algorithm agreed with peer
+    void *packer;               //  Algorithm state for output
+    void *unpacker;             //  Algorithm state for input
+    byte *block_out;            //  Packed block being sent
+    size_t block_out_size;      //  Size of packed block
+    size_t block_out_sent;      //  Amount of block already sent
+    byte *block_in;             //  Packed blocks being received
+    size_t block_in_size;       //  Amount of block data received
+    Bool more;                  //  More input frames expected
+    zmsg_t *partial;            //  Request being received, for REP
+    zmsg_t *pending;            //  Request waiting for REP dispatch
+    zlist_t *subscriptions;     //  Topics peer subscribed to, as frames
+    uint match_epoch;           //  Message last matched for peering
+    Bool routed;                //  Has route slot and identity?
+    uint route;                 //  Route slot in vocket
+    uint route_tag;             //  Tag that makes route handle unique
+    zmq_msg_t identity;         //  ROUTER identity frame, prebuilt
+    uint64_t bytes_out;         //  Bytes sent since last idle sweep
+    uint64_t sndbuf;            //  Send buffer we grew to, 0 = not yet
 };
 
 //  Basic methods for each of our object types (it's not really a clean
 //  abstraction since objects are not opaque, but it works pretty well.)
 //
 static driver_t *
-    driver_new (zctx_t *ctx, void *pipe);
+    driver_new (zctx_t *ctx, void *pipe, vtx_loop_t *loop);
 static void
     driver_destroy (driver_t **self_p);
+static void
+    driver_pin (driver_t *self, int cpu);
 static vocket_t *
     vocket_new (driver_t *driver, int socktype, char *vtxname);
 static void
     vocket_destroy (vocket_t **self_p);
+static int
+    vocket_setopt (vocket_t *self, int option, int value);
+static int
+    vocket_getopt (vocket_t *self, int option, int *value_p);
+static int
+    vocket_subscribe (vocket_t *self, char *topic, Bool add);
+static void
+    vocket_dispatch (vocket_t *self);
+static void
+    vocket_set_sender (vocket_t *self, char *address);
+static void
+    vocket_deliver (vocket_t *self, zmsg_t **msg_p);
+static void
+    vocket_flush (vocket_t *self);
+static void
+    vocket_backlog (vocket_t *self, Bool backlogged);
+static void
+    vocket_deliver_frame (vocket_t *self, byte *data, size_t size,
+                          zmq_msg_t *msg, Bool more);
+static void
+    vocket_poll_input (vocket_t *self, Bool active);
+static vtx_ring_t *
+    vocket_lane (vocket_t *self, int handle);
+static void
+    vocket_tune (vocket_t *self, int handle, Bool connected);
 static binding_t *
     binding_require (vocket_t *vocket, char *address);
 static void
@@ -199,32 +316,74 @@ static void
     peering_destroy (peering_t **self_p);
 static void
     peering_delete (void *argument);
+static void
+    peering_route (peering_t *self);
+static void
+    peering_unroute (peering_t *self);
 static void
     peering_raise (peering_t *self);
+static void
+    peering_ready (peering_t *self);
 static void
     peering_lower (peering_t *self);
 static void
     peering_poller (peering_t *self, int events);
+static void
+    peering_agree (peering_t *self, byte *data, size_t size);
+static void
+    peering_algo_end (peering_t *self);
+static void
+    peering_icanhaz (peering_t *self, char *topic, Bool add);
+static void
+    peering_subscribe (peering_t *self, byte *topic, size_t size, Bool add);
+static void
+    peering_unsubscribe_all (peering_t *self);
+static void
+    peering_measure (peering_t *self);
 
 //  Reactor handlers
 static int
-    s_driver_control (zloop_t *loop, zmq_pollitem_t *item, void *arg);
+    s_driver_control (vtx_loop_t *loop, zmq_pollitem_t *item, void *arg);
+static int
+    s_vocket_input (vtx_loop_t *loop, zmq_pollitem_t *item, void *arg);
+static int
+    s_vocket_ring_input (vtx_loop_t *loop, zmq_pollitem_t *item, void *arg);
 static int
-    s_vocket_input (zloop_t *loop, zmq_pollitem_t *item, void *arg);
+    s_vocket_retry (vtx_loop_t *loop, zmq_pollitem_t *item, void *arg);
 static int
-    s_binding_input (zloop_t *loop, zmq_pollitem_t *item, void *arg);
+    s_binding_input (vtx_loop_t *loop, zmq_pollitem_t *item, void *arg);
 static int
-    s_peering_activity (zloop_t *loop, zmq_pollitem_t *item, void *arg);
+    s_peering_activity (vtx_loop_t *loop, zmq_pollitem_t *item, void *arg);
 static int
-    s_peering_monitor (zloop_t *loop, zmq_pollitem_t *item, void *arg);
+    s_peering_monitor (vtx_loop_t *loop, zmq_pollitem_t *item, void *arg);
+static int
+    s_idle_sweep (vtx_loop_t *loop, zmq_pollitem_t *item, void *arg);
 
 //  Utility functions
+static void
+    s_vocket_route (vocket_t *vocket, zmq_msg_t *msg, Bool more);
+static void
+    s_route_output (vocket_t *vocket, zmq_msg_t *msg, Bool more);
+static void
+    s_frame_free (void *data, void *hint);
+static void
+    s_msg_free (void *data, void *arg);
+static zframe_t *
+    s_frame_new (byte *data, size_t size, zmq_msg_t *msg);
 static void
     s_queue_output (peering_t *self, zmq_msg_t *msg, Bool more);
 static void
     s_send_wire (peering_t *self);
 static ssize_t
     s_recv_wire (peering_t *self);
+static ssize_t
+    s_recv_blocks (peering_t *self);
+static size_t
+    s_greeting_need (peering_t *self);
+static void
+    s_recv_drain (peering_t *self);
+static void
+    s_recv_frame (peering_t *self, vtx_slice_t *slice, zmq_msg_t *msg);
 static char *
     s_sin_addr_to_str (struct sockaddr_in *addr);
 static int
@@ -235,20 +394,38 @@ static void
     s_close_handle (int handle, driver_t *driver);
 static int
     s_handle_io_error (char *reason);
+static int
+    s_set_reuseport (int handle);
+static int
+    s_set_steering (int handle, uint shards);
+static int
+    s_set_affinity (uint cpu);
+static void
+    s_set_bufsize (int handle, int sndbuf, int rcvbuf);
+static void
+    s_set_cork (int handle, Bool cork);
+
+//  Routing layer shared by all drivers, works on the objects above
+#include "vtx_route.c"
 
 //  ---------------------------------------------------------------------
-//  Main driver thread is minimal, all work is done by reactor
+//  Main driver thread is minimal, all work is done by reactor. If the
+//  caller passes a reactor, the driver is embedded: it adds itself to
+//  that reactor and returns at once.
 
 void vtx_tcp_driver (void *args, zctx_t *ctx, void *pipe)
 {
     //  Create driver instance
-    driver_t *driver = driver_new (ctx, pipe);
+    driver_t *driver = driver_new (ctx, pipe, (vtx_loop_t *) args);
     char *verbose = zstr_recv (pipe);
     driver->verbose = atoi (verbose);
     free (verbose);
-    zloop_set_verbose (driver->loop, driver->verbose);
+    if (driver->embedded)
+        return;                 //  Application runs the reactor
+
+    vtx_loop_set_verbose (driver->loop, driver->verbose);
     //  Run reactor until we exit from failure or interrupt
-    zloop_start (driver->loop);
+    vtx_loop_start (driver->loop);
     //  Destroy driver instance
     driver_destroy (&driver);
 }
@@ -266,18 +443,24 @@ int vtx_tcp_load (vtx_t *vtx, Bool verbose)
 //  Constructor and destructor for driver
 
 static driver_t *
-driver_new (zctx_t *ctx, void *pipe)
+driver_new (zctx_t *ctx, void *pipe, vtx_loop_t *loop)
 {
     driver_t *self = (driver_t *) zmalloc (sizeof (driver_t));
     self->ctx = ctx;
     self->pipe = pipe;
     self->vockets = zlist_new ();
-    self->loop = zloop_new ();
+    self->vocket_hash = zhash_new ();
+    self->loop = loop? loop: vtx_loop_new ();
+    self->embedded = (loop != NULL);
+    self->cpu = -1;
+    self->arena = vtx_arena_new ();
     self->scheme = VTX_TCP_SCHEME;
 
     //  Reactor starts by monitoring the driver control pipe
     zmq_pollitem_t item = { self->pipe, 0, ZMQ_POLLIN };
-    zloop_poller (self->loop, &item, s_driver_control, self);
+    vtx_loop_poller (self->loop, &item, s_driver_control, self);
+    //  Release codec buffers of peerings that have gone idle
+    vtx_loop_timer (self->loop, VTX_TCP_IDLE_IVL, 0, s_idle_sweep, self);
     return self;
 }
 
@@ -294,12 +477,42 @@ driver_destroy (driver_t **self_p)
             vocket_destroy (&vocket);
         }
         zlist_destroy (&self->vockets);
-        zloop_destroy (&self->loop);
+        zhash_destroy (&self->vocket_hash);
+        if (self->embedded) {
+            //  Take our pollers and timers off the application's reactor
+            zmq_pollitem_t item = { self->pipe, 0, ZMQ_POLLIN };
+            vtx_loop_poller_end (self->loop, &item);
+            vtx_loop_timer_end (self->loop, self);
+            zsocket_destroy (self->ctx, self->pipe);
+        }
+        else
+            vtx_loop_destroy (&self->loop);
+        vtx_arena_destroy (&self->arena);
         free (self);
         *self_p = NULL;
     }
 }
 
+//  Pin driver thread to one CPU. We only pin a thread of our own, and
+//  only once, since all vockets on the driver share that thread.
+
+static void
+driver_pin (driver_t *self, int cpu)
+{
+    if (self->embedded)
+        zclock_log ("W: embedded driver - not pinning application to CPU %d",
+            cpu);
+    else
+    if (self->cpu >= 0 && self->cpu != cpu)
+        zclock_log ("W: driver pinned to CPU %d - not moving to CPU %d",
+            self->cpu, cpu);
+    else
+    if (s_set_affinity ((uint) cpu))
+        zclock_log ("W: CPU affinity failed: '%s'", strerror (errno));
+    else
+        self->cpu = cpu;
+}
+
 
 //  ---------------------------------------------------------------------
 //  Constructor and destructor for vocket
@@ -308,14 +521,18 @@ static vocket_t *
 vocket_new (driver_t *driver, int socktype, char *vtxname)
 {
     assert (driver);
-    vocket_t *self = (vocket_t *) zmalloc (sizeof (vocket_t));
+    vocket_t *self = (vocket_t *) vtx_arena_alloc (driver->arena, sizeof (vocket_t));
 
     self->driver = driver;
-    self->vtxname = strdup (vtxname);
+    self->vtxname = vtx_arena_strdup (driver->arena, vtxname);
     self->binding_hash = zhash_new ();
     self->peering_hash = zhash_new ();
     self->peering_list = zlist_new ();
     self->live_peerings = zlist_new ();
+    self->subscriptions = zlist_new ();
+    self->subscribers = zlist_new ();
+    self->requests = zlist_new ();
+    self->inbacklog = zlist_new ();
     self->socktype = socktype;
 
     uint index;
@@ -328,6 +545,9 @@ vocket_new (driver_t *driver, int socktype, char *vtxname)
         self->nomnom = s_vocket_config [index].nomnom;
         self->min_peerings = s_vocket_config [index].min_peerings;
         self->max_peerings = s_vocket_config [index].max_peerings;
+        self->route = vtx_route_find (self->routing);
+        if (self->routing == VTX_ROUTING_PUBLISH)
+            self->matcher = vtx_match_new (VTX_MATCH_PREFIX);
     }
     else {
         zclock_log ("E: invalid vocket type %d", socktype);
@@ -339,18 +559,19 @@ vocket_new (driver_t *driver, int socktype, char *vtxname)
     zsocket_connect (self->msgpipe, "inproc://%s", vtxname);
 
     //  If we drop on no peerings, start routing input now
-    if (self->min_peerings == 0) {
-        //  Ask reactor to start monitoring vocket's msgpipe pipe
-        zmq_pollitem_t item = { self->msgpipe, 0, ZMQ_POLLIN, 0 };
-        zloop_poller (driver->loop, &item, s_vocket_input, self);
-    }
+    if (self->min_peerings == 0)
+        vocket_poll_input (self, TRUE);
     //  Store this vocket per driver so that driver can cleanly destroy
     //  all its vockets when it is destroyed.
     zlist_push (driver->vockets, self);
+    zhash_insert (driver->vocket_hash, vtxname, self);
 
     //* Start transport-specific work
     self->inbuf_max = VTX_TCP_INBUF_MAX;
     self->outbuf_max = VTX_TCP_OUTBUF_MAX;
+    self->backlog = VTX_TCP_BACKLOG;
+    self->shard = -1;
+    self->budget.parent = &driver->budget;
     //* End transport-specific work
 
     return self;
@@ -364,25 +585,45 @@ vocket_destroy (vocket_t **self_p)
         vocket_t *self = *self_p;
         driver_t *driver = self->driver;
 
-        if (self->min_peerings == 0) {
-            //  Ask reactor to stop monitoring vocket's msgpipe
-            zmq_pollitem_t item = { self->msgpipe, 0, ZMQ_POLLIN, 0 };
-            zloop_poller_end (driver->loop, &item);
-        }
+        //  Stop reading the msgpipe and rings, whichever peerings are
+        //  up, since the caller frees the rings once we've closed
+        vocket_poll_input (self, FALSE);
 
-        //  Close message msgpipe socket
+        //  Close message msgpipe socket; the rings belong to the caller
         zsocket_destroy (driver->ctx, self->msgpipe);
+        while (self->inbatch_size)
+            zmsg_destroy (&self->inbatch [--self->inbatch_size]);
+        while (zlist_size (self->inbacklog)) {
+            zmsg_t *msg = (zmsg_t *) zlist_pop (self->inbacklog);
+            zmsg_destroy (&msg);
+        }
+        zlist_destroy (&self->inbacklog);
+        zmsg_destroy (&self->inmsg);
+        if (self->backlogged)
+            vtx_loop_timer_end (driver->loop, self);
 
         //  Destroy all bindings for this vocket
         zhash_destroy (&self->binding_hash);
 
         //  Destroy all peerings for this vocket
         zhash_destroy (&self->peering_hash);
+        if (self->routes)
+            vtx_arena_free (self->driver->arena, self->routes);
         zlist_destroy (&self->peering_list);
         zlist_destroy (&self->live_peerings);
-
-        //  Remove vocket from driver list of vockets
+        vtx_hashring_destroy (&self->hashring);
+        while (self->held)
+            zmq_msg_close (&self->hold [--self->held]);
+        while (zlist_size (self->subscriptions))
+            vtx_arena_free (self->driver->arena, zlist_pop (self->subscriptions));
+        zlist_destroy (&self->subscriptions);
+        zlist_destroy (&self->subscribers);
+        vtx_match_destroy (&self->matcher);
+        zlist_destroy (&self->requests);
+
+        //  Remove vocket from driver list and index of vockets
         zlist_remove (driver->vockets, self);
+        zhash_delete (driver->vocket_hash, self->vtxname);
 
 #ifdef VOCKET_STATS
         char *type_name [] = {
@@ -396,12 +637,516 @@ vocket_destroy (vocket_t **self_p)
             self->outpiped, self->inpiped,
             self->dropped);
 #endif
-        free (self->vtxname);
-        free (self);
+        vtx_arena_free (self->driver->arena, self->vtxname);
+        vtx_arena_free (self->driver->arena, self);
         *self_p = NULL;
     }
 }
 
+//  Set vocket option, returns 0 if OK, -1 if the option or value is not
+//  valid for this vocket
+
+static int
+vocket_setopt (vocket_t *self, int option, int value)
+{
+    int rc = 0;
+    if (option == VTX_OPT_ROUTING) {
+        //  Only distributing vockets can switch to or from hash routing
+        if (value == VTX_ROUTING_HASH
+        &&  self->routing == VTX_ROUTING_DEALER) {
+            self->routing = VTX_ROUTING_HASH;
+            self->hashring = vtx_hashring_new (VTX_HASH_REPLICAS);
+            peering_t *peering = (peering_t *) zlist_first (self->live_peerings);
+            while (peering) {
+                vtx_hashring_insert (self->hashring, peering->address, peering);
+                peering = (peering_t *) zlist_next (self->live_peerings);
+            }
+        }
+        else
+        if (value == VTX_ROUTING_DEALER
+        &&  self->routing == VTX_ROUTING_HASH) {
+            self->routing = VTX_ROUTING_DEALER;
+            vtx_hashring_destroy (&self->hashring);
+        }
+        else
+        if (value != self->routing)
+            rc = -1;
+        self->route = vtx_route_find (self->routing);
+    }
+    else
+    if (option == VTX_OPT_HASHKEY) {
+        //  Can't change key while we're holding frames for a message
+        if (value >= 0 && value < VTX_HASH_MAXKEY && !self->more)
+            self->hashkey = value;
+        else
+            rc = -1;
+    }
+    else
+    if (option == VTX_OPT_MATCHING) {
+        //  Move all subscriptions we have to a matcher of the new type
+        vtx_match_t *matcher = NULL;
+        if (self->matcher)
+            matcher = vtx_match_new (value);
+        if (matcher) {
+            peering_t *peering = (peering_t *) zlist_first (self->peering_list);
+            while (peering) {
+                zframe_t *topic = (zframe_t *) zlist_first (peering->subscriptions);
+                while (topic) {
+                    vtx_match_insert (matcher,
+                        zframe_data (topic), zframe_size (topic), peering);
+                    topic = (zframe_t *) zlist_next (peering->subscriptions);
+                }
+                peering = (peering_t *) zlist_next (self->peering_list);
+            }
+            vtx_match_destroy (&self->matcher);
+            self->matcher = matcher;
+        }
+        else
+            rc = -1;
+    }
+    else
+    if (option == VTX_OPT_REUSEPORT) {
+        //  Applies to bindings we make after this
+#if defined (SO_REUSEPORT)
+        if (value >= 0 && value <= VTX_MAX_SHARDS)
+            self->shards = value;
+        else
+#endif
+            rc = -1;
+    }
+    else
+    if (option == VTX_OPT_STEERING) {
+        if (value == VTX_STEER_HASH)
+            self->steering = value;
+#if defined (SO_ATTACH_REUSEPORT_CBPF)
+        else
+        if (value == VTX_STEER_CPU)
+            self->steering = value;
+#endif
+        else
+            rc = -1;
+    }
+    else
+    if (option == VTX_OPT_SHARD) {
+        //  Applies to bindings we make after this
+        if (value >= -1 && value < VTX_MAX_SHARDS)
+            self->shard = value;
+        else
+            rc = -1;
+    }
+    else
+    if (option == VTX_OPT_BUDGET) {
+        //  Applies to new allocations; we don't take back memory
+        if (value >= 0)
+            self->budget.limit = (size_t) value * 1024;
+        else
+            rc = -1;
+    }
+    else
+    if (option == VTX_OPT_DRIVER_BUDGET) {
+        if (value >= 0)
+            self->driver->budget.limit = (size_t) value * 1024;
+        else
+            rc = -1;
+    }
+    else
+    if (option == VTX_OPT_CODEC) {
+        //  Applies to peerings that come up after this
+        if (vtx_codec_algo (value))
+            self->algo = value;
+        else
+            rc = -1;
+    }
+    else
+    if (option == VTX_OPT_FRAMING) {
+        //  Applies to peerings that come up after this
+        if (value == VTX_FRAMING_ZMTP || value == VTX_FRAMING_NOM2)
+            self->framing = value;
+        else
+            rc = -1;
+    }
+    else
+    if (option == VTX_OPT_METADATA) {
+        if (value == 0 || value == 1)
+            self->metadata = value;
+        else
+            rc = -1;
+    }
+    else
+    if (option == VTX_OPT_INBUF_MAX) {
+        //  Applies to peerings that come up after this
+        if (value > 0)
+            self->inbuf_max = value;
+        else
+            rc = -1;
+    }
+    else
+    if (option == VTX_OPT_OUTBUF_MAX) {
+        //  Applies to peerings that come up after this
+        if (value > 0)
+            self->outbuf_max = value;
+        else
+            rc = -1;
+    }
+    else
+    if (option == VTX_OPT_SNDBUF
+    ||  option == VTX_OPT_RCVBUF) {
+        //  Send buffers apply to connections we have now, and ones we
+        //  make after; receive buffers only to ones we make after
+        if (value >= 0) {
+            if (option == VTX_OPT_SNDBUF)
+                self->sndbuf = value;
+            else
+                self->rcvbuf = value;
+            peering_t *peering = (peering_t *) zlist_first (self->peering_list);
+            while (peering) {
+                vocket_tune (self, peering->handle, TRUE);
+                peering = (peering_t *) zlist_next (self->peering_list);
+            }
+        }
+        else
+            rc = -1;
+    }
+    else
+    if (option == VTX_OPT_BACKLOG) {
+        //  Applies to bindings we make after this
+        if (value > 0)
+            self->backlog = value;
+        else
+            rc = -1;
+    }
+    else
+    if (option == VTX_OPT_PROFILE) {
+        //  Applies to connections we have now, and ones we make after,
+        //  except for receive buffers. Kernel buffers we've already set
+        //  stay as they are.
+        if (value >= VTX_PROFILE_DEFAULT && value <= VTX_PROFILE_THROUGHPUT) {
+            self->profile = value;
+            peering_t *peering = (peering_t *) zlist_first (self->peering_list);
+            while (peering) {
+                vocket_tune (self, peering->handle, TRUE);
+                peering = (peering_t *) zlist_next (self->peering_list);
+            }
+        }
+        else
+            rc = -1;
+    }
+    else
+        rc = -1;
+
+    return rc;
+}
+
+//  ---------------------------------------------------------------------
+//  Get vocket option, returns 0 if OK, -1 if the option isn't known
+
+static int
+vocket_getopt (vocket_t *self, int option, int *value_p)
+{
+    int rc = 0;
+    if (option == VTX_OPT_ROUTING)
+        *value_p = self->routing;
+    else
+    if (option == VTX_OPT_HASHKEY)
+        *value_p = self->hashkey;
+    else
+    if (option == VTX_OPT_MATCHING && self->matcher)
+        *value_p = self->matcher->engine->type;
+    else
+    if (option == VTX_OPT_REUSEPORT)
+        *value_p = self->shards;
+    else
+    if (option == VTX_OPT_STEERING)
+        *value_p = self->steering;
+    else
+    if (option == VTX_OPT_SHARD)
+        *value_p = self->shard;
+    else
+    if (option == VTX_OPT_BUDGET)
+        *value_p = (int) (self->budget.limit / 1024);
+    else
+    if (option == VTX_OPT_DRIVER_BUDGET)
+        *value_p = (int) (self->driver->budget.limit / 1024);
+    else
+    if (option == VTX_OPT_CODEC)
+        *value_p = self->algo;
+    else
+    if (option == VTX_OPT_FRAMING)
+        *value_p = self->framing;
+    else
+    if (option == VTX_OPT_METADATA)
+        *value_p = self->metadata;
+    else
+    if (option == VTX_OPT_INBUF_MAX)
+        *value_p = self->inbuf_max;
+    else
+    if (option == VTX_OPT_OUTBUF_MAX)
+        *value_p = self->outbuf_max;
+    else
+    if (option == VTX_OPT_SNDBUF)
+        *value_p = self->sndbuf;
+    else
+    if (option == VTX_OPT_RCVBUF)
+        *value_p = self->rcvbuf;
+    else
+    if (option == VTX_OPT_BACKLOG)
+        *value_p = self->backlog;
+    else
+    if (option == VTX_OPT_PROFILE)
+        *value_p = self->profile;
+    else
+        rc = -1;
+
+    return rc;
+}
+
+//  Add or remove a SUB vocket subscription, and tell all live peerings.
+//  Returns 0 if OK, -1 if this is not a SUB vocket.
+
+static int
+vocket_subscribe (vocket_t *self, char *topic, Bool add)
+{
+    if (self->socktype != ZMQ_SUB)
+        return -1;
+
+    char *existing = (char *) zlist_first (self->subscriptions);
+    while (existing) {
+        if (streq (existing, topic))
+            break;
+        existing = (char *) zlist_next (self->subscriptions);
+    }
+    if (add && !existing)
+        zlist_append (self->subscriptions,
+            vtx_arena_strdup (self->driver->arena, topic));
+    else
+    if (!add && existing) {
+        zlist_remove (self->subscriptions, existing);
+        vtx_arena_free (self->driver->arena, existing);
+    }
+    else
+        return 0;               //  Nothing changed
+
+    peering_t *peering = (peering_t *) zlist_first (self->live_peerings);
+    while (peering) {
+        peering_icanhaz (peering, topic, add);
+        peering = (peering_t *) zlist_next (self->live_peerings);
+    }
+    return 0;
+}
+
+//  Pass oldest waiting request to the application, if it is not already
+//  working on one. A REP socket handles one request at a time, so we
+//  queue requests from all peerings here, and route each reply back to
+//  the peering that sent the request.
+
+static void
+vocket_dispatch (vocket_t *self)
+{
+    if (self->dispatched)
+        return;
+    peering_t *peering = (peering_t *) zlist_pop (self->requests);
+    if (peering) {
+        self->dispatched = TRUE;
+        self->reply_to = peering;
+        vocket_set_sender (self, peering->address);
+        vocket_deliver (self, &peering->pending);
+    }
+}
+
+//  Store host part of peer address as the "sender" meta; we cut at the
+//  port and truncate, since addresses can be longer than we hold
+
+static void
+vocket_set_sender (vocket_t *self, char *address)
+{
+    size_t size = strcspn (address, ":");
+    if (size >= sizeof (self->sender))
+        size = sizeof (self->sender) - 1;
+    memcpy (self->sender, address, size);
+    self->sender [size] = 0;
+}
+
+//  Pass complete message to application, on the ring if we have one,
+//  else on the msgpipe. Messages for the ring wait in a batch until the
+//  driver has handled its input, or the batch is full. If the ring is
+//  full, messages the codecs had already decoded wait in the backlog.
+
+static void
+vocket_deliver (vocket_t *self, zmsg_t **msg_p)
+{
+    if (self->inring) {
+        if (self->inbatch_size < VTX_RING_BATCH
+        &&  zlist_size (self->inbacklog) == 0)
+            self->inbatch [self->inbatch_size++] = *msg_p;
+        else
+            zlist_append (self->inbacklog, *msg_p);
+        *msg_p = NULL;
+        if (self->inbatch_size == VTX_RING_BATCH && !self->backlogged)
+            vocket_flush (self);
+    }
+    else {
+        zmsg_send (msg_p, self->msgpipe);
+        self->inpiped++;
+    }
+}
+
+//  Put waiting messages onto ring, in one batch. The application only
+//  wakes up once for the batch. If the ring is full, we keep the rest
+//  and stop reading from our peerings until the application catches up.
+
+static void
+vocket_flush (vocket_t *self)
+{
+    Bool full = FALSE;
+    while (self->inbatch_size && !full) {
+        uint pushed = vtx_ring_push_batch (self->inring,
+                                           self->inbatch, self->inbatch_size);
+        self->inpiped += pushed;
+        full = pushed < self->inbatch_size;
+        self->inbatch_size -= pushed;
+        memmove (self->inbatch, self->inbatch + pushed,
+                 self->inbatch_size * sizeof (zmsg_t *));
+        while (self->inbatch_size < VTX_RING_BATCH
+        &&     zlist_size (self->inbacklog))
+            self->inbatch [self->inbatch_size++] =
+                (zmsg_t *) zlist_pop (self->inbacklog);
+    }
+    vocket_backlog (self, full);
+}
+
+//  Stop or restart input on all peerings as the receive ring fills up
+//  or drains. The ring doesn't tell us when it has room, so while it's
+//  full we retry the flush on a timer.
+
+static void
+vocket_backlog (vocket_t *self, Bool backlogged)
+{
+    if (self->backlogged == backlogged)
+        return;
+    driver_t *driver = self->driver;
+    self->backlogged = backlogged;
+    if (backlogged)
+        vtx_loop_timer (driver->loop, VTX_TCP_RETRY_IVL, 0,
+                        s_vocket_retry, self);
+    else
+        vtx_loop_timer_end (driver->loop, self);
+    if (driver->verbose)
+        zclock_log ("I: (tcp) receive ring %s", backlogged? "full": "free");
+
+    peering_t *peering = (peering_t *) zlist_first (self->peering_list);
+    while (peering) {
+        peering_poller (peering, peering->events);
+        peering = (peering_t *) zlist_next (self->peering_list);
+    }
+}
+
+//  Pass one frame of message to application. Frames go straight to the
+//  msgpipe; for the ring, we collect them into a message and deliver it
+//  when it's complete. Frame data is either a 0MQ message, or a buffer
+//  if msg is NULL.
+
+static void
+vocket_deliver_frame (vocket_t *self, byte *data, size_t size,
+                      zmq_msg_t *msg, Bool more)
+{
+    if (msg) {
+        data = (byte *) zmq_msg_data (msg);
+        size = zmq_msg_size (msg);
+    }
+    if (self->inring) {
+        if (!self->inmsg)
+            self->inmsg = zmsg_new ();
+        zmsg_add (self->inmsg, s_frame_new (data, size, msg));
+        if (!more)
+            vocket_deliver (self, &self->inmsg);
+    }
+    else {
+        if (msg)
+            zmq_sendmsg (self->msgpipe, msg, more? ZMQ_SNDMORE: 0);
+        else
+            zmq_send (self->msgpipe, data, size, more? ZMQ_SNDMORE: 0);
+        if (!more)
+            self->inpiped++;
+    }
+}
+
+//  Start or stop reading messages from the application, on the ring if
+//  we have one, else on the msgpipe
+
+static void
+vocket_poll_input (vocket_t *self, Bool active)
+{
+    zmq_pollitem_t item = { self->msgpipe, 0, ZMQ_POLLIN, 0 };
+    if (self->outring) {
+        item.socket = NULL;
+        item.fd = vtx_ring_handle (self->outring);
+    }
+    if (active)
+        vtx_loop_poller (self->driver->loop, &item,
+            self->outring? s_vocket_ring_input: s_vocket_input, self);
+    else
+        vtx_loop_poller_end (self->driver->loop, &item);
+
+    //  Each extra lane from a sending thread has its own poller
+    uint index;
+    for (index = 0; index < self->lane_count; index++) {
+        item.fd = vtx_ring_handle (self->lanes [index]);
+        if (active)
+            vtx_loop_poller (self->driver->loop, &item,
+                s_vocket_ring_input, self);
+        else
+            vtx_loop_poller_end (self->driver->loop, &item);
+    }
+}
+
+//  Return the ring, outring or extra lane, whose handle this is
+
+static vtx_ring_t *
+vocket_lane (vocket_t *self, int handle)
+{
+    uint index;
+    for (index = 0; index < self->lane_count; index++)
+        if (vtx_ring_handle (self->lanes [index]) == handle)
+            return self->lanes [index];
+    return self->outring;
+}
+
+//  Tune a TCP handle for the vocket's profile. Latency turns off Nagle
+//  and keeps buffers small so data doesn't queue; throughput starts with
+//  large buffers, and the idle sweep then grows send buffers to the BDP.
+//  Buffer sizes set by the application win over the profile. We set the
+//  receive buffer only before connect or listen, where it decides the
+//  window scale; on a connected handle it would just stop the kernel
+//  autotuning the buffer.
+
+static void
+vocket_tune (vocket_t *self, int handle, Bool connected)
+{
+    if (handle <= 0)
+        return;
+    int sndbuf = self->sndbuf;
+    int rcvbuf = self->rcvbuf;
+    int bufsize = 0;
+    if (self->profile == VTX_PROFILE_LATENCY)
+        bufsize = VTX_TCP_LATENCY_BUF;
+    else
+    if (self->profile == VTX_PROFILE_THROUGHPUT)
+        bufsize = VTX_TCP_BULK_BUF;
+    s_set_bufsize (handle, sndbuf? sndbuf: bufsize,
+                   connected? 0: rcvbuf? rcvbuf: bufsize);
+
+    int nodelay = (self->profile == VTX_PROFILE_LATENCY);
+    setsockopt (handle, IPPROTO_TCP, TCP_NODELAY,
+        (void *) &nodelay, sizeof (nodelay));
+#if defined (SO_BUSY_POLL)
+    //  Raising this above the system limit needs privileges, so we may
+    //  not get it; that costs latency, not correctness
+    int busy_poll = nodelay? VTX_TCP_BUSY_POLL: 0;
+    setsockopt (handle, SOL_SOCKET, SO_BUSY_POLL,
+        (void *) &busy_poll, sizeof (busy_poll));
+#endif
+}
+
 //  ---------------------------------------------------------------------
 //  Constructor and destructor for binding
 //  Bindings are held per vocket, indexed by peer hostname:port
@@ -414,10 +1159,10 @@ binding_require (vocket_t *vocket, char *address)
 
     if (self == NULL) {
         //  Create new binding for this hostname:port address
-        self = (binding_t *) zmalloc (sizeof (binding_t));
+        self = (binding_t *) vtx_arena_alloc (vocket->driver->arena, sizeof (binding_t));
         self->vocket = vocket;
         self->driver = vocket->driver;
-        self->address = strdup (address);
+        self->address = vtx_arena_strdup (vocket->driver->arena, address);
         driver_t *driver = self->driver;
 
         //  Split port number off address
@@ -453,28 +1198,47 @@ binding_require (vocket_t *vocket, char *address)
             setsockopt (self->handle, SOL_SOCKET, SO_REUSEADDR,
                 (void *) &reuse, sizeof (reuse));
 #           endif
+            //  Accepted connections inherit the receive buffer size, which
+            //  sets the window scale, so it must be set before listening
+            vocket_tune (vocket, self->handle, FALSE);
+            if (vocket->shards && s_set_reuseport (self->handle)) {
+                zclock_log ("E: bind failed: can't share '%s'", strerror (errno));
+                self->exception = TRUE;
+            }
+            else
             if (bind (self->handle,
                 (const struct sockaddr *) &addr, IN_ADDR_SIZE) == -1) {
                 zclock_log ("E: bind failed: '%s'", strerror (errno));
                 self->exception = TRUE;
             }
             else
-            if (listen (self->handle, VTX_TCP_BACKLOG)) {
+            if (listen (self->handle, vocket->backlog)) {
                 zclock_log ("E: listen failed: '%s'", strerror (errno));
                 self->exception = TRUE;
             }
+            else
+            if (vocket->shards
+            &&  vocket->steering == VTX_STEER_CPU) {
+                //  Steering sends shard i the connections that CPU i
+                //  received, so we run the shard's driver on CPU i
+                if (s_set_steering (self->handle, vocket->shards))
+                    zclock_log ("W: CPU steering failed: '%s'", strerror (errno));
+                else
+                if (vocket->shard >= 0)
+                    driver_pin (driver, vocket->shard);
+            }
         }
         if (self->exception)
             close (self->handle);
         else {
             //  Ask reactor to start monitoring this binding handle
             zmq_pollitem_t item = { NULL, self->handle, ZMQ_POLLIN, 0 };
-            zloop_poller (driver->loop, &item, s_binding_input, vocket);
+            vtx_loop_poller (driver->loop, &item, s_binding_input, vocket);
         }
         //* End transport-specific work
         if (self->exception) {
-            free (self->address);
-            free (self);
+            vtx_arena_free (self->driver->arena, self->address);
+            vtx_arena_free (self->driver->arena, self);
             self = NULL;
         }
         else {
@@ -501,8 +1265,8 @@ binding_delete (void *argument)
     s_close_handle (self->handle, self->driver);
     //* End transport-specific work
 
-    free (self->address);
-    free (self);
+    vtx_arena_free (self->driver->arena, self->address);
+    vtx_arena_free (self->driver->arena, self);
 }
 
 //  ---------------------------------------------------------------------
@@ -517,11 +1281,12 @@ peering_require (vocket_t *vocket, char *address, Bool outgoing)
 
     if (self == NULL) {
         //  Create new peering for this hostname:port address
-        self = (peering_t *) zmalloc (sizeof (peering_t));
+        self = (peering_t *) vtx_arena_alloc (vocket->driver->arena, sizeof (peering_t));
         self->vocket = vocket;
         self->driver = vocket->driver;
-        self->address = strdup (address);
+        self->address = vtx_arena_strdup (vocket->driver->arena, address);
         self->outgoing = outgoing;
+        self->subscriptions = zlist_new ();
         if (self->driver->verbose)
             zclock_log ("I: (tcp) create peering to %s", address);
 
@@ -530,16 +1295,18 @@ peering_require (vocket_t *vocket, char *address, Bool outgoing)
             self->interval = VTX_TCP_RECONNECT_IVL;
             s_peering_monitor (self->driver->loop, NULL, self);
         }
-        //  Initialize message buffering codecs
-        if (!self->exception) {
-            self->input = vtx_codec_new (vocket->inbuf_max);
-            self->output = vtx_codec_new (vocket->outbuf_max);
-        }
+        //  Codecs allocate their buffers on first traffic, and grow
+        //  up to these limits as needed
+        self->input = vtx_codec_new (vocket->inbuf_max, &vocket->budget);
+        self->output = vtx_codec_new (vocket->outbuf_max, &vocket->budget);
         //* End transport-specific work
 
         if (self->exception) {
-            free (self->address);
-            free (self);
+            vtx_codec_destroy (&self->input);
+            vtx_codec_destroy (&self->output);
+            zlist_destroy (&self->subscriptions);
+            vtx_arena_free (self->driver->arena, self->address);
+            vtx_arena_free (self->driver->arena, self);
             self = NULL;
         }
         else {
@@ -585,14 +1352,75 @@ peering_delete (void *argument)
     vtx_codec_destroy (&self->output);
     if (vocket->current_peering == self)
         vocket->current_peering = NULL;
+    zmsg_destroy (&self->partial);
+    zmsg_destroy (&self->pending);
+    zlist_remove (vocket->requests, self);
+    if (vocket->reply_to == self)
+        vocket->reply_to = NULL;
+    peering_unroute (self);
     peering_lower (self);
+    peering_unsubscribe_all (self);
+    zlist_destroy (&self->subscriptions);
     zlist_remove (vocket->peering_list, self);
-    zloop_timer_end (driver->loop, self);
-    free (self->address);
-    free (self);
+    vtx_loop_timer_end (driver->loop, self);
+    vtx_arena_free (self->driver->arena, self->address);
+    vtx_arena_free (self->driver->arena, self);
     vocket->peerings--;
 }
 
+//  Build identity frame that ROUTER delivers before each message from
+//  the peering, and take a route slot so replies can find the peering
+//  directly. Call again if the peering address changes. If all slots
+//  are taken, the identity carries no handle and routes by address.
+
+static void
+peering_route (peering_t *self)
+{
+    vocket_t *vocket = self->vocket;
+    if (!vocket->routes)
+        vocket->routes = (peering_t **) vtx_arena_alloc (self->driver->arena,
+            VTX_MAX_PEERINGS * sizeof (peering_t *));
+    if (!self->routed) {
+        for (self->route = 0; self->route < VTX_MAX_PEERINGS; self->route++)
+            if (vocket->routes [self->route] == NULL)
+                break;
+        if (self->route < VTX_MAX_PEERINGS) {
+            vocket->routes [self->route] = self;
+            self->route_tag = ++vocket->route_tag & 0xFFFF;
+        }
+    }
+    byte identity [256 + VTX_ROUTE_HANDLE];
+    size_t size = snprintf ((char *) identity, 256, "%s://%s",
+        self->driver->scheme, self->address);
+    if (size > 255)
+        size = 255;
+    if (self->route < VTX_MAX_PEERINGS) {
+        identity [size++] = 0;
+        identity [size++] = (byte) (self->route >> 8);
+        identity [size++] = (byte) (self->route);
+        identity [size++] = (byte) (self->route_tag >> 8);
+        identity [size++] = (byte) (self->route_tag);
+    }
+    if (self->routed)
+        zmq_msg_close (&self->identity);
+    zmq_msg_init_size (&self->identity, size);
+    memcpy (zmq_msg_data (&self->identity), identity, size);
+    self->routed = TRUE;
+}
+
+//  Give up route slot and identity frame
+
+static void
+peering_unroute (peering_t *self)
+{
+    if (self->routed) {
+        if (self->route < VTX_MAX_PEERINGS)
+            self->vocket->routes [self->route] = NULL;
+        zmq_msg_close (&self->identity);
+        self->routed = FALSE;
+    }
+}
+
 //  Peering is now active
 
 static void
@@ -605,19 +1433,66 @@ peering_raise (peering_t *self)
 
     if (!self->alive) {
         self->alive = TRUE;
-        zlist_append (vocket->live_peerings, self);
+        vtx_codec_nom2 (self->input, FALSE);
+        vtx_codec_nom2 (self->output, FALSE);
 
-        //  Send ZMTP handshake, which is an empty message
+        //  Send ZMTP handshake, which is an empty message, unless we
+        //  offer a codec algorithm or framing. Then we hold back other
+        //  output until the peer's greeting tells us whether it agrees.
         zmq_msg_t msg;
-        zmq_msg_init_size (&msg, 0);
+        if (vocket->algo || vocket->framing) {
+            char offer [32];
+            snprintf (offer, sizeof (offer), "%s%s/%s", VTX_TCP_OFFER,
+                vtx_codec_algo (vocket->algo)->name,
+                s_framing_name [vocket->framing]);
+            zmq_msg_init_size (&msg, strlen (offer));
+            memcpy (zmq_msg_data (&msg), offer, strlen (offer));
+            self->offered = TRUE;
+        }
+        else
+            zmq_msg_init_size (&msg, 0);
         s_queue_output (self, &msg, FALSE);
+        zmq_msg_close (&msg);
+        if (self->offered)
+            self->hold = vtx_codec_active (self->output);
+
+        //  Peer will send us its greeting and then its subscriptions
+        self->greeted = FALSE;
+        self->more = FALSE;
+        zmsg_destroy (&self->partial);
+        peering_unsubscribe_all (self);
+
+        //  If we made an offer, the peering carries messages only once
+        //  the peer answers, since its answer decides the framing
+        if (!self->offered)
+            peering_ready (self);
+    }
+}
 
-        //  If we can now route to peerings, start reading from msgpipe
-        if (zlist_size (vocket->live_peerings) == vocket->min_peerings) {
-            //  Ask reactor to start monitoring vocket's msgpipe pipe
-            zmq_pollitem_t item = { vocket->msgpipe, 0, ZMQ_POLLIN, 0 };
-            zloop_poller (driver->loop, &item, s_vocket_input, vocket);
+//  Peering can now carry messages, so route to it
+
+static void
+peering_ready (peering_t *self)
+{
+    vocket_t *vocket = self->vocket;
+    driver_t *driver = self->driver;
+    if (self->alive) {
+        zlist_append (vocket->live_peerings, self);
+        if (vocket->hashring)
+            vtx_hashring_insert (vocket->hashring, self->address, self);
+
+        //  A SUB vocket tells the publisher all its subscriptions
+        if (vocket->socktype == ZMQ_SUB) {
+            char *topic = (char *) zlist_first (vocket->subscriptions);
+            while (topic) {
+                peering_icanhaz (self, topic, TRUE);
+                topic = (char *) zlist_next (vocket->subscriptions);
+            }
         }
+
+        //  If we can now route to peerings, start reading from msgpipe
+        if (zlist_size (vocket->live_peerings) == vocket->min_peerings)
+            vocket_poll_input (vocket, TRUE);
     }
 }
 
@@ -633,107 +1508,400 @@ peering_lower (peering_t *self)
     if (self->alive) {
         self->alive = FALSE;
         zlist_remove (vocket->live_peerings, self);
-        if (zlist_size (vocket->live_peerings) < vocket->min_peerings) {
-            //  Ask reactor to stop monitoring vocket's msgpipe pipe
-            zmq_pollitem_t item = { vocket->msgpipe, 0, ZMQ_POLLIN, 0 };
-            zloop_poller_end (driver->loop, &item);
+        zlist_remove (vocket->subscribers, self);
+        if (vocket->hashring)
+            vtx_hashring_delete (vocket->hashring, self);
+        if (zlist_size (vocket->live_peerings) < vocket->min_peerings)
+            vocket_poll_input (vocket, FALSE);
+    }
+    peering_algo_end (self);
+}
+
+//  Reset poller on peering handle, to specified events. We don't poll
+//  for input while the vocket's receive ring is full.
+
+static void
+peering_poller (peering_t *self, int events)
+{
+    driver_t *driver = self->driver;
+    int polled = events;
+    if (self->vocket->backlogged)
+        polled &= ~ZMQ_POLLIN;
+    if (self->polled != polled) {
+        zmq_pollitem_t item = { NULL, self->handle, polled, 0 };
+        vtx_loop_poller_end (driver->loop, &item);
+        if (polled)
+            vtx_loop_poller (driver->loop, &item, s_peering_activity, self);
+        self->polled = polled;
+    }
+    self->events = events;
+}
+
+//  Check peer's greeting against the codec algorithm and framing we
+//  offered. We use each one only if the peer offered the same. Then the
+//  peering is ready, and we release the output we held back.
+
+static void
+peering_agree (peering_t *self, byte *data, size_t size)
+{
+    vocket_t *vocket = self->vocket;
+    driver_t *driver = self->driver;
+    vtx_codec_algo_t *algo = vtx_codec_algo (vocket->algo);
+    char *framing = s_framing_name [vocket->framing];
+    char *peer_algo = "zmtp";
+    char *peer_framing = "zmtp";
+    char greeting [256];
+    size_t offer_size = strlen (VTX_TCP_OFFER);
+    if (size > offer_size && size < sizeof (greeting)
+    &&  memcmp (data, VTX_TCP_OFFER, offer_size) == 0) {
+        memcpy (greeting, data + offer_size, size - offer_size);
+        greeting [size - offer_size] = 0;
+        peer_algo = greeting;
+        char *slash = strchr (greeting, '/');
+        if (slash) {
+            *slash = 0;
+            peer_framing = slash + 1;
         }
     }
+    if (vocket->framing && streq (peer_framing, framing)) {
+        if (driver->verbose)
+            zclock_log ("I: (tcp) using framing %s with %s",
+                framing, self->address);
+        vtx_codec_nom2 (self->input, TRUE);
+        vtx_codec_nom2 (self->output, TRUE);
+    }
+    if (vocket->algo && streq (peer_algo, algo->name)) {
+        if (driver->verbose)
+            zclock_log ("I: (tcp) using codec %s with %s",
+                algo->name, self->address);
+        self->algo = algo;
+        self->packer = algo->new_fn ();
+        self->unpacker = algo->new_fn ();
+        self->block_out = (byte *) malloc (VTX_CODEC_BLOCK_MAX);
+        self->block_in = (byte *) malloc (VTX_TCP_BLOCKS * VTX_CODEC_BLOCK_MAX);
+        assert (self->block_out && self->block_in);
+    }
+    peering_ready (self);
+    if (vtx_codec_active (self->output))
+        peering_poller (self, ZMQ_POLLIN + ZMQ_POLLOUT);
+}
+
+//  End use of codec algorithm on peering, if any
+
+static void
+peering_algo_end (peering_t *self)
+{
+    if (self->algo) {
+        self->algo->destroy_fn (&self->packer);
+        self->algo->destroy_fn (&self->unpacker);
+        self->algo = NULL;
+    }
+    free (self->block_out);
+    free (self->block_in);
+    self->block_out = NULL;
+    self->block_in = NULL;
+    self->block_out_size = 0;
+    self->block_out_sent = 0;
+    self->block_in_size = 0;
+    self->offered = FALSE;
+    self->hold = 0;
+}
+
+//  Send subscription command to publisher. TCP is reliable, so unlike
+//  the UDP driver we don't need to wait for a confirmation.
+
+static void
+peering_icanhaz (peering_t *self, char *topic, Bool add)
+{
+    size_t size = strlen (topic);
+    zmq_msg_t msg;
+    zmq_msg_init_size (&msg, size + 1);
+    byte *data = (byte *) zmq_msg_data (&msg);
+    data [0] = add? 1: 0;
+    memcpy (data + 1, topic, size);
+    s_queue_output (self, &msg, FALSE);
+    zmq_msg_close (&msg);
+}
+
+//  Add or remove a topic that a subscriber peering wants to receive
+
+static void
+peering_subscribe (peering_t *self, byte *topic, size_t size, Bool add)
+{
+    zframe_t *existing = (zframe_t *) zlist_first (self->subscriptions);
+    while (existing) {
+        if (zframe_size (existing) == size
+        &&  memcmp (zframe_data (existing), topic, size) == 0)
+            break;
+        existing = (zframe_t *) zlist_next (self->subscriptions);
+    }
+    if (add && !existing) {
+        zlist_append (self->subscriptions, zframe_new (topic, size));
+        vtx_match_insert (self->vocket->matcher, topic, size, self);
+    }
+    else
+    if (!add && existing) {
+        zlist_remove (self->subscriptions, existing);
+        zframe_destroy (&existing);
+        vtx_match_delete (self->vocket->matcher, topic, size, self);
+    }
+}
+
+//  Remove all subscriptions for a subscriber peering
+
+static void
+peering_unsubscribe_all (peering_t *self)
+{
+    while (zlist_size (self->subscriptions)) {
+        zframe_t *frame = (zframe_t *) zlist_pop (self->subscriptions);
+        vtx_match_delete (self->vocket->matcher,
+            zframe_data (frame), zframe_size (frame), self);
+        zframe_destroy (&frame);
+    }
 }
 
-//  Reset poller on peering handle, to specified events
+//  Grow the send buffer of a busy throughput peering to twice its
+//  bandwidth-delay product. The congestion window is the kernel's own
+//  estimate of the BDP, and is only meaningful while we're sending, so we
+//  skip peerings that sent nothing since the last idle sweep. We never
+//  shrink the buffer, nor go below what we set at connect: a window that
+//  collapsed after a loss would otherwise squeeze data already queued.
 
 static void
-peering_poller (peering_t *self, int events)
+peering_measure (peering_t *self)
 {
-    driver_t *driver = self->driver;
-    if (self->events != events) {
-        zmq_pollitem_t item = { NULL, self->handle, events, 0 };
-        zloop_poller_end (driver->loop, &item);
-        if (events)
-            zloop_poller (driver->loop, &item, s_peering_activity, self);
-        self->events = events;
+    vocket_t *vocket = self->vocket;
+    Bool busy = self->bytes_out > 0;
+    self->bytes_out = 0;
+    if (!self->alive || !busy
+    ||  vocket->profile != VTX_PROFILE_THROUGHPUT
+    ||  vocket->sndbuf)
+        return;                 //  Not ours to size
+
+#if defined (TCP_INFO)
+    struct tcp_info info;
+    socklen_t info_size = sizeof (info);
+    if (getsockopt (self->handle, IPPROTO_TCP, TCP_INFO,
+        (void *) &info, &info_size) == 0) {
+        uint64_t bdp = (uint64_t) info.tcpi_snd_cwnd * info.tcpi_snd_mss;
+        uint64_t bufsize = bdp * 2;
+        if (bufsize > VTX_TCP_BULK_BUF_MAX)
+            bufsize = VTX_TCP_BULK_BUF_MAX;
+        if (bufsize > VTX_TCP_BULK_BUF && bufsize > self->sndbuf) {
+            s_set_bufsize (self->handle, (int) bufsize, 0);
+            self->sndbuf = bufsize;
+        }
     }
+#endif
 }
 
-
 //  ---------------------------------------------------------------------
 //  Reactor handlers
 
-//  Handle bind/connect from caller:
-//
-//  [command]   BIND, CONNECT, GETMETA, CLOSE, SHUTDOWN
-//  [socktype]  0MQ socket type as ASCII number
-//  [vtxname]   VTX name for the 0MQ socket
-//  [address]   External address to bind/connect to, or meta name
+//  Handle command from caller; see vtx.h for the format of requests and
+//  replies. Commands that take addresses apply each address in turn, and
+//  reply with the number that failed.
 
 static int
-s_driver_control (zloop_t *loop, zmq_pollitem_t *item, void *arg)
+s_driver_control (vtx_loop_t *loop, zmq_pollitem_t *item, void *arg)
 {
     int rc = 0;
-    char *reply = "0";
+    int status = 0;
+    char *value = NULL;         //  Value reply, for GETMETA and GETOPT
+    char meta [32];             //  Formatted value reply
     driver_t *driver = (driver_t *) arg;
     zmsg_t *request = zmsg_recv (item->socket);
+    if (!request)
+        return -1;              //  Interrupted
 
-    char *command  = zmsg_popstr (request);
-    char *socktype = zmsg_popstr (request);
-    char *vtxname  = zmsg_popstr (request);
-    char *address  = zmsg_popstr (request);
-    zmsg_destroy (&request);
+    zframe_t *header = zmsg_pop (request);
+    assert (header && zframe_size (header) == VTX_CMD_HEADER);
+    byte *data = zframe_data (header);
+    int command = data [0];
+    char *vtxname = zmsg_popstr (request);
 
     //  Lookup vocket with this vtxname, create if necessary
     vocket_t *vocket = NULL;
     if (vtxname) {
-        vocket = (vocket_t *) zlist_first (driver->vockets);
-        while (vocket) {
-            if (streq (vocket->vtxname, vtxname))
-                break;
-            vocket = (vocket_t *) zlist_next (driver->vockets);
-        }
+        vocket = (vocket_t *) zhash_lookup (driver->vocket_hash, vtxname);
         if (!vocket)
-            vocket = vocket_new (driver, atoi (socktype), vtxname);
+            vocket = vocket_new (driver, data [1], vtxname);
     }
     //  Multiple binds or connects to same address are idempotent
-    if (streq (command, "BIND")) {
+    char *address;
+    if (command == VTX_CMD_BIND) {
+        assert (vocket);
+        while ((address = zmsg_popstr (request))) {
+            if (!binding_require (vocket, address))
+                status++;
+            free (address);
+        }
+    }
+    else
+    if (command == VTX_CMD_CONNECT) {
+        assert (vocket);
+        while ((address = zmsg_popstr (request))) {
+            if (vocket->peerings < vocket->max_peerings)
+                peering_require (vocket, address, TRUE);
+            else {
+                zclock_log ("E: connect failed: too many peerings");
+                status++;
+            }
+            free (address);
+        }
+    }
+    else
+    if (command == VTX_CMD_SETOPT) {
+        assert (vocket);
+        zframe_t *frame = zmsg_pop (request);
+        assert (frame && zframe_size (frame) == 8);
+        byte *setting = zframe_data (frame);
+        int option = (setting [0] << 24) + (setting [1] << 16)
+                   + (setting [2] << 8)  +  setting [3];
+        int value  = (setting [4] << 24) + (setting [5] << 16)
+                   + (setting [6] << 8)  +  setting [7];
+        if (vocket_setopt (vocket, option, value)) {
+            zclock_log ("E: setopt failed: invalid option '%d=%d'",
+                option, value);
+            status = 1;
+        }
+        zframe_destroy (&frame);
+    }
+    else
+    if (command == VTX_CMD_GETOPT) {
+        assert (vocket);
+        zframe_t *frame = zmsg_pop (request);
+        assert (frame && zframe_size (frame) == 4);
+        byte *setting = zframe_data (frame);
+        int option = (setting [0] << 24) + (setting [1] << 16)
+                   + (setting [2] << 8)  +  setting [3];
+        int optval;
+        if (vocket_getopt (vocket, option, &optval) == 0) {
+            snprintf (meta, sizeof (meta), "%d", optval);
+            value = meta;
+        }
+        else {
+            value = "Unknown option";
+            status = 1;
+        }
+        zframe_destroy (&frame);
+    }
+    else
+    if (command == VTX_CMD_RINGS) {
+        //  Application passes messages on rings instead of msgpipe
         assert (vocket);
-        if (!binding_require (vocket, address))
-            reply = "1";
+        zframe_t *frame = zmsg_pop (request);
+        assert (frame && zframe_size (frame) == 2 * sizeof (vtx_ring_t *));
+        if (vocket->outring) {
+            zclock_log ("E: rings failed: vocket already has rings");
+            status = 1;
+        }
+        else {
+            Bool active = zlist_size (vocket->live_peerings)
+                       >= vocket->min_peerings;
+            if (active)
+                vocket_poll_input (vocket, FALSE);
+            vtx_ring_t *rings [2];
+            memcpy (rings, zframe_data (frame), sizeof (rings));
+            vocket->outring = rings [0];
+            vocket->inring = rings [1];
+            if (active)
+                vocket_poll_input (vocket, TRUE);
+        }
+        zframe_destroy (&frame);
     }
     else
-    if (streq (command, "CONNECT")) {
+    if (command == VTX_CMD_LANE) {
+        //  Application has another thread sending on its own ring
         assert (vocket);
-        if (vocket->peerings < vocket->max_peerings)
-            peering_require (vocket, address, TRUE);
+        zframe_t *frame = zmsg_pop (request);
+        assert (frame && zframe_size (frame) == sizeof (vtx_ring_t *));
+        if (!vocket->outring || vocket->lane_count == VTX_MAX_LANES) {
+            zclock_log ("E: lane failed: no rings, or too many lanes");
+            status = 1;
+        }
         else {
-            zclock_log ("E: connect failed: too many peerings");
-            reply = "1";
+            Bool active = zlist_size (vocket->live_peerings)
+                       >= vocket->min_peerings;
+            if (active)
+                vocket_poll_input (vocket, FALSE);
+            memcpy (&vocket->lanes [vocket->lane_count++],
+                    zframe_data (frame), sizeof (vtx_ring_t *));
+            if (active)
+                vocket_poll_input (vocket, TRUE);
+        }
+        zframe_destroy (&frame);
+    }
+    else
+    if (command == VTX_CMD_SUBSCRIBE
+    ||  command == VTX_CMD_UNSUBSCRIBE) {
+        assert (vocket);
+        char *topic = zmsg_popstr (request);
+        assert (topic);
+        if (vocket_subscribe (vocket, topic, command == VTX_CMD_SUBSCRIBE)) {
+            zclock_log ("E: subscribe failed: not a SUB socket");
+            status = 1;
         }
+        free (topic);
     }
     else
-    if (streq (command, "GETMETA")) {
+    if (command == VTX_CMD_GETMETA) {
         assert (vocket);
-        if (streq (address, "sender"))
-            reply = vocket->sender;
+        char *name = zmsg_popstr (request);
+        assert (name);
+        if (streq (name, "sender"))
+            value = vocket->sender;
         else
-            reply = "Unknown name";
+        if (streq (name, "memory")) {
+            snprintf (meta, sizeof (meta), "%zd", vocket->budget.used);
+            value = meta;
+        }
+        else
+        if (streq (name, "driver-memory")) {
+            snprintf (meta, sizeof (meta), "%zd", vocket->driver->budget.used);
+            value = meta;
+        }
+        else {
+            value = "Unknown name";
+            status = 1;
+        }
+        free (name);
     }
     else
-    if (streq (command, "CLOSE")) {
+    if (command == VTX_CMD_CLOSE) {
         assert (vocket);
         vocket_destroy (&vocket);
     }
     else
-    if (streq (command, "SHUTDOWN"))
+    if (command == VTX_CMD_SHUTDOWN)
         rc = -1;                //  Shutdown driver
     else {
-        zclock_log ("E: invalid command: %s", command);
-        reply = "1";
+        zclock_log ("E: invalid command: %d", command);
+        status = 1;
     }
-    zstr_sendf (item->socket, reply);
-    free (command);
-    free (socktype);
+    //  Reply with the caller's token and our status
+    byte reply [VTX_CMD_REPLY];
+    memcpy (reply, data + 4, 4);
+    reply [4] = (byte) (status >> 24);
+    reply [5] = (byte) (status >> 16);
+    reply [6] = (byte) (status >> 8);
+    reply [7] = (byte) (status);
+    zmsg_t *msg = zmsg_new ();
+    zmsg_addmem (msg, reply, VTX_CMD_REPLY);
+    if (value)
+        zmsg_addstr (msg, "%s", value);
+    zmsg_send (&msg, item->socket);
+
+    zframe_destroy (&header);
+    zmsg_destroy (&request);
     free (vtxname);
-    free (address);
+
+    //  An embedded driver can't stop the reactor, which isn't ours, so
+    //  it destroys itself once it has replied
+    if (rc == -1 && command == VTX_CMD_SHUTDOWN && driver->embedded) {
+        driver_destroy (&driver);
+        rc = 0;
+    }
     return rc;
 }
 
@@ -742,10 +1910,9 @@ s_driver_control (zloop_t *loop, zmq_pollitem_t *item, void *arg)
 //  Input message on data pipe from application 0MQ socket
 
 static int
-s_vocket_input (zloop_t *loop, zmq_pollitem_t *item, void *arg)
+s_vocket_input (vtx_loop_t *loop, zmq_pollitem_t *item, void *arg)
 {
     vocket_t *vocket = (vocket_t *) arg;
-    driver_t *driver = vocket->driver;
 
     //  It's remotely possible we just lost a peering, in which case
     //  don't take the message off the pipe, leave it for next time
@@ -756,111 +1923,168 @@ s_vocket_input (zloop_t *loop, zmq_pollitem_t *item, void *arg)
     assert (item->socket == vocket->msgpipe);
     zmq_msg_t msg;
     zmq_msg_init (&msg);
-
-    Bool more = vocket->more;
     int rc = zmq_recvmsg (vocket->msgpipe, &msg, 0);
     while (rc >= 0) {
-        vocket->outpiped++;
-        first = !more;
-        more = zsockopt_rcvmore (vocket->msgpipe);
+        s_vocket_route (vocket, &msg, zsockopt_rcvmore (vocket->msgpipe));
+        zmq_msg_close (&msg);
+        zmq_msg_init (&msg);
+        rc = zmq_recvmsg (vocket->msgpipe, &msg, ZMQ_DONTWAIT);
+    }
+    //  A reply may have let us pass the next request to the application
+    vocket_flush (vocket);
+    return 0;
+}
 
-        //  Route message to active peerings as appropriate
-        if (vocket->routing == VTX_ROUTING_NONE)
-            zclock_log ("W: send() not allowed - dropping");
-        else
-        if (vocket->routing == VTX_ROUTING_REQUEST) {
-            //  First part of message
-            //  Round-robin to next peering
-            if (first) {
-                vocket->current_peering = (peering_t *) zlist_pop (vocket->live_peerings);
-                zlist_append (vocket->live_peerings, vocket->current_peering);
-            }
-            peering_t *peering = vocket->current_peering;
-            if (peering && peering->alive)
-                s_queue_output (peering, &msg, more);
-        }
-        else
-        if (vocket->routing == VTX_ROUTING_REPLY) {
-            peering_t *peering = vocket->current_peering;
-            if (peering && peering->alive)
-                s_queue_output (peering, &msg, more);
-        }
-        else
-        if (vocket->routing == VTX_ROUTING_DEALER) {
-            //  First part of message
-            //  Round-robin to next peering
-            if (first) {
-                vocket->current_peering = (peering_t *) zlist_pop (vocket->live_peerings);
-                zlist_append (vocket->live_peerings, vocket->current_peering);
-            }
-            peering_t *peering = vocket->current_peering;
-            if (peering && peering->alive)
-                s_queue_output (peering, &msg, more);
-        }
-        else
-        if (vocket->routing == VTX_ROUTING_ROUTER) {
-            peering_t *peering = vocket->current_peering;
-            //  Look-up peering using first message part
-            if (first) {
-                //  Parse and check schemed identity
-                size_t size = zmq_msg_size (&msg);
-                char *address = (char *) malloc (size + 1);
-                memcpy (address, zmq_msg_data (&msg), size);
-                address [size] = 0;
-
-                int scheme_size = strlen (driver->scheme);
-                if (memcmp (address, driver->scheme, scheme_size) == 0
-                &&  memcmp (address + scheme_size, "://", 3) == 0) {
-                    peering = (peering_t *) zhash_lookup (
-                        vocket->peering_hash, address + scheme_size + 3);
-                    if (!peering || !peering->alive)
-                        zclock_log ("W: no route to '%s' - dropping", address);
-                    vocket->current_peering = peering;
-                }
-                else
-                    zclock_log ("E: bad address '%s' - dropping", address);
-                free (address);
+
+//  -------------------------------------------------------------------------
+//  Input messages on ring from application, taken off the ring a batch
+//  at a time. With many lanes, we take one batch per lane and let the
+//  reactor come back for more, so all sending threads get their turn.
+//  We hand each frame to 0MQ without copying it, and destroy the frame
+//  when 0MQ is done with it.
+
+static int
+s_vocket_ring_input (vtx_loop_t *loop, zmq_pollitem_t *item, void *arg)
+{
+    vocket_t *vocket = (vocket_t *) arg;
+    vtx_ring_t *ring = vocket_lane (vocket, item->fd);
+    zmsg_t *batch [VTX_RING_BATCH];
+    uint size = 0;
+    while (zlist_size (vocket->live_peerings) >= vocket->min_peerings
+    &&    (size = vtx_ring_pop_batch (ring, batch, VTX_RING_BATCH))) {
+        uint index;
+        for (index = 0; index < size; index++) {
+            zmsg_t *msg = batch [index];
+            zframe_t *frame = zmsg_pop (msg);
+            while (frame) {
+                zframe_t *next = zmsg_pop (msg);
+                zmq_msg_t part;
+                zmq_msg_init_data (&part, zframe_data (frame), zframe_size (frame),
+                                   s_frame_free, frame);
+                s_vocket_route (vocket, &part, next != NULL);
+                zmq_msg_close (&part);
+                frame = next;
             }
-            else
-                if (peering && peering->alive)
-                    s_queue_output (peering, &msg, more);
+            zmsg_destroy (&msg);
         }
-        else
-        if (vocket->routing == VTX_ROUTING_PUBLISH) {
-            if (zlist_size (vocket->live_peerings) > 1) {
-                //  Duplicate frames to all subscribers
-                peering_t * peering = (peering_t *) zlist_first (vocket->live_peerings);
-                while (peering) {
-                    s_queue_output (peering, &msg, more);
-                    peering = (peering_t *) zlist_next (vocket->live_peerings);
-                }
-            }
-            else
-            if (zlist_size (vocket->live_peerings) == 1) {
-                //  Send frames straight through to single subscriber
-                peering_t *peering = (peering_t *) zlist_first (vocket->live_peerings);
-                s_queue_output (peering, &msg, more);
+        if (vocket->lane_count)
+            break;
+    }
+    //  A reply may have let us pass the next request to the application
+    vocket_flush (vocket);
+    return 0;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Retry putting input onto a full receive ring
+
+static int
+s_vocket_retry (vtx_loop_t *loop, zmq_pollitem_t *item, void *arg)
+{
+    vocket_t *vocket = (vocket_t *) arg;
+    vocket_flush (vocket);
+    return 0;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Route one frame of message from application to active peerings as
+//  appropriate
+
+static void
+s_vocket_route (vocket_t *vocket, zmq_msg_t *msg, Bool more)
+{
+    vtx_route_t *route = vocket->route;
+    vocket->outpiped++;
+    if (!vocket->more)
+        vocket->frame = 0;
+    vocket->more = more;
+
+    //  Hold frames before the key frame, then let the router pick on the
+    //  key frame and send everything there. If the message ends before
+    //  the key frame, the router picks on an empty key.
+    uint key = vtx_route_key (route, vocket);
+    if (vocket->frame < key && more) {
+        zmq_msg_init (&vocket->hold [vocket->held]);
+        zmq_msg_move (&vocket->hold [vocket->held++], msg);
+    }
+    else {
+        Bool keyed = (vocket->frame == key);
+        if (vocket->frame <= key) {
+            vocket->current_peering = route->pick (vocket,
+                keyed? (byte *) zmq_msg_data (msg): NULL,
+                keyed? zmq_msg_size (msg): 0);
+            uint index;
+            for (index = 0; index < vocket->held; index++) {
+                s_route_output (vocket, &vocket->hold [index], TRUE);
+                zmq_msg_close (&vocket->hold [index]);
             }
+            vocket->held = 0;
         }
-        else
-        if (vocket->routing == VTX_ROUTING_SINGLE) {
-            if (first)
-                vocket->current_peering = (peering_t *) zlist_first (vocket->live_peerings);
-            peering_t *peering = vocket->current_peering;
-            if (peering && peering->alive)
-                s_queue_output (peering, &msg, more);
-        }
-        else
-            zclock_log ("E: unknown routing mechanism - dropping");
+        //  An envelope is for the router, not for the peering
+        if (!(keyed && route->envelope))
+            s_route_output (vocket, msg, more);
+        if (!more && route->done)
+            route->done (vocket);
+    }
+    vocket->frame++;
+}
 
-        zmq_msg_close (&msg);
-        zmq_msg_init (&msg);
-        rc = zmq_recvmsg (vocket->msgpipe, &msg, ZMQ_DONTWAIT);
+//  Send one frame to the peering, or peerings, that the router picked
+
+static void
+s_route_output (vocket_t *vocket, zmq_msg_t *msg, Bool more)
+{
+    if (vocket->route->fanout) {
+        peering_t *peering = (peering_t *) zlist_first (vocket->subscribers);
+        while (peering) {
+            s_queue_output (peering, msg, more);
+            peering = (peering_t *) zlist_next (vocket->subscribers);
+        }
     }
-    //  Save state
-    vocket->more = more;
+    else {
+        peering_t *peering = vocket->current_peering;
+        if (peering && peering->alive)
+            s_queue_output (peering, msg, more);
+    }
+}
 
-    return 0;
+//  Destroy frame that we lent to 0MQ
+static void
+s_frame_free (void *data, void *hint)
+{
+    zframe_t *frame = (zframe_t *) hint;
+    zframe_destroy (&frame);
+}
+
+//  Close 0MQ message that we lent to a frame
+static void
+s_msg_free (void *data, void *arg)
+{
+    zmq_msg_t *msg = (zmq_msg_t *) arg;
+    zmq_msg_close (msg);
+    free (msg);
+}
+
+//  Create frame holding data. If the data is a large 0MQ message, which
+//  came by reference or straight off the wire, we take the message and
+//  lend its data to the frame rather than copying it. Small frames are
+//  cheaper to copy.
+
+static zframe_t *
+s_frame_new (byte *data, size_t size, zmq_msg_t *msg)
+{
+    if (msg && size > ZMQ_MAX_VSM_SIZE) {
+        zmq_msg_t *lent = (zmq_msg_t *) malloc (sizeof (zmq_msg_t));
+        assert (lent);
+        zmq_msg_init (lent);
+        zmq_msg_move (lent, msg);
+        return zframe_new_zero_copy (zmq_msg_data (lent), size,
+                                     s_msg_free, lent);
+    }
+    else
+        return zframe_new (data, size);
 }
 
 
@@ -873,8 +2097,13 @@ s_queue_output (peering_t *self, zmq_msg_t *msg, Bool more)
 {
     assert (self);
     assert (self->alive);
-    vtx_codec_msg_put (self->output, msg, more);
+    if (vtx_codec_msg_put (self->output, msg, more))
+        zclock_log ("W: output full to %s - dropping", self->address);
     peering_poller (self, ZMQ_POLLIN + ZMQ_POLLOUT);
+    //  For latency, send each message as it completes, rather than on
+    //  the next poll; errors show up on the peering's next activity
+    if (!more && self->vocket->profile == VTX_PROFILE_LATENCY)
+        s_send_wire (self);
 }
 
 
@@ -883,7 +2112,7 @@ s_queue_output (peering_t *self, zmq_msg_t *msg, Bool more)
 //  Creates a new peering, if successful
 
 static int
-s_binding_input (zloop_t *loop, zmq_pollitem_t *item, void *arg)
+s_binding_input (vtx_loop_t *loop, zmq_pollitem_t *item, void *arg)
 {
     vocket_t *vocket = (vocket_t *) arg;
     driver_t *driver = vocket->driver;
@@ -894,6 +2123,7 @@ s_binding_input (zloop_t *loop, zmq_pollitem_t *item, void *arg)
     int handle = accept (item->fd, (struct sockaddr *) &addr, &addr_len);
     if (handle >= 0) {
         s_set_nonblock (handle);
+        vocket_tune (vocket, handle, TRUE);
         if (vocket->peerings < vocket->max_peerings) {
             char *address = s_sin_addr_to_str (&addr);
             peering_t *peering = peering_require (vocket, address, FALSE);
@@ -917,7 +2147,7 @@ s_binding_input (zloop_t *loop, zmq_pollitem_t *item, void *arg)
 //  Activity on peering handle
 
 static int
-s_peering_activity (zloop_t *loop, zmq_pollitem_t *item, void *arg)
+s_peering_activity (vtx_loop_t *loop, zmq_pollitem_t *item, void *arg)
 {
     peering_t *peering = (peering_t *) arg;
     vocket_t *vocket = peering->vocket;
@@ -968,11 +2198,13 @@ s_peering_activity (zloop_t *loop, zmq_pollitem_t *item, void *arg)
             close (peering->handle);
             peering_poller (peering, 0);
             peering->handle = 0;
-            zloop_timer (loop, peering->interval, 1, s_peering_monitor, peering);
+            vtx_loop_timer (loop, peering->interval, 1, s_peering_monitor, peering);
         }
         else
             peering_destroy (&peering);
     }
+    //  Pass messages we got to the application in one batch
+    vocket_flush (vocket);
     return 0;
 }
 
@@ -981,7 +2213,7 @@ s_peering_activity (zloop_t *loop, zmq_pollitem_t *item, void *arg)
 //  Monitor peering for connectivity
 
 static int
-s_peering_monitor (zloop_t *loop, zmq_pollitem_t *item, void *arg)
+s_peering_monitor (vtx_loop_t *loop, zmq_pollitem_t *item, void *arg)
 {
     peering_t *peering = (peering_t *) arg;
     vocket_t *vocket = peering->vocket;
@@ -1002,6 +2234,7 @@ s_peering_monitor (zloop_t *loop, zmq_pollitem_t *item, void *arg)
         goto error;
     }
     s_set_nonblock (peering->handle);
+    vocket_tune (vocket, peering->handle, FALSE);
     if (s_str_to_sin_addr (&peering->addr, peering->address)) {
         zclock_log ("E: connect failed: bad address '%s'", peering->address);
         goto error;
@@ -1021,7 +2254,34 @@ error:
         peering->handle = 0;
     }
     //  Try again later
-    zloop_timer (loop, peering->interval, 1, s_peering_monitor, peering);
+    vtx_loop_timer (loop, peering->interval, 1, s_peering_monitor, peering);
+    return 0;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Release codec buffers for peerings that have been idle for at least one
+//  full interval. Codecs grow at once under traffic but only give memory
+//  back after this delay, so bursty peerings don't thrash.
+
+static int
+s_idle_sweep (vtx_loop_t *loop, zmq_pollitem_t *item, void *arg)
+{
+    driver_t *driver = (driver_t *) arg;
+    int64_t now = zclock_time ();
+    vocket_t *vocket = (vocket_t *) zlist_first (driver->vockets);
+    while (vocket) {
+        peering_t *peering = (peering_t *) zlist_first (vocket->peering_list);
+        while (peering) {
+            peering_measure (peering);
+            if (now - peering->active_at >= VTX_TCP_IDLE_IVL) {
+                vtx_codec_release (peering->input);
+                vtx_codec_release (peering->output);
+            }
+            peering = (peering_t *) zlist_next (vocket->peering_list);
+        }
+        vocket = (vocket_t *) zlist_next (driver->vockets);
+    }
     return 0;
 }
 
@@ -1034,9 +2294,33 @@ s_send_wire (peering_t *self)
     vocket_t *vocket = self->vocket;
     driver_t *driver = self->driver;
 
+    self->active_at = zclock_time ();
+    //  For throughput, cork the handle while we write out the codec, so
+    //  the kernel sends full segments, and uncork to flush the tail
+    Bool cork = (vocket->profile == VTX_PROFILE_THROUGHPUT);
+    if (cork)
+        s_set_cork (self->handle, TRUE);
     while (TRUE) {
         byte *data;
-        size_t size = vtx_codec_bin_get (self->output, &data);
+        size_t size;
+        if (self->packer && self->hold == 0) {
+            //  Pack next block when we've sent the last one
+            if (self->block_out_sent == self->block_out_size) {
+                self->block_out_size = vtx_codec_block_get (self->output,
+                    self->algo, self->packer, self->block_out);
+                self->block_out_sent = 0;
+            }
+            data = self->block_out + self->block_out_sent;
+            size = self->block_out_size - self->block_out_sent;
+        }
+        else {
+            size = vtx_codec_bin_get (self->output, &data);
+            //  If we offered a codec algorithm, send only output from
+            //  before our offer, until the peer agrees or not
+            if (self->offered && (self->packer || !self->greeted)
+            &&  size > self->hold)
+                size = self->hold;
+        }
         if (size == 0) {
             peering_poller (self, ZMQ_POLLIN);
             break;      //  Buffer is empty, stop polling out
@@ -1049,16 +2333,30 @@ s_send_wire (peering_t *self)
             zclock_log ("I: (tcp) actually sent %d bytes", bytes_sent);
 
         if (bytes_sent > 0) {
-            vtx_codec_bin_tick (self->output, bytes_sent);
+            self->bytes_out += bytes_sent;
+            if (self->packer && self->hold == 0)
+                self->block_out_sent += bytes_sent;
+            else {
+                vtx_codec_bin_tick (self->output, bytes_sent);
+                self->hold -= bytes_sent < self->hold? bytes_sent: self->hold;
+            }
             if (bytes_sent < size)
                 break;      //  Wait until network can accept more
         }
         else
+        if (bytes_sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;          //  Network is full, reactor resumes on POLLOUT
+        else
         if (bytes_sent == 0 || s_handle_io_error ("send") == -1) {
             self->exception = TRUE;
             break;          //  Signal error and give up
         }
+        else
+        if (errno != EINTR)
+            break;          //  Passing error, retry when reactor polls out
     }
+    if (cork)
+        s_set_cork (self->handle, FALSE);
 }
 
 
@@ -1070,12 +2368,29 @@ s_recv_wire (peering_t *self)
     vocket_t *vocket = self->vocket;
     driver_t *driver = self->driver;
 
-    //  Read into buffer and dump what we got
-    //  TODO: only read as much as we have space in input queue
-    //  implement exception strategy here
+    if (self->unpacker)
+        return s_recv_blocks (self);
+
+    //  Read straight into free space in input codec, which is always
+    //  contiguous, or into the message for a large frame. We drain
+    //  complete frames after each read, so the codec can't fill up.
+    //  TODO: implement exception strategy here
     //  - drop oldest, drop newest, pushback
-    byte buffer [VTX_TCP_BUFSIZE];
-    ssize_t size = recv (self->handle, buffer, VTX_TCP_BUFSIZE, MSG_DONTWAIT);
+    byte *buffer;
+    size_t space = vtx_codec_bin_reserve (self->input, &buffer);
+    if (space == 0) {
+        zclock_log ("E: (tcp) input overflow from %s", self->address);
+        self->exception = TRUE;
+        return -1;
+    }
+    //  If we offered a codec algorithm, read no further than the end of
+    //  the peer's greeting, since what follows it may be packed
+    if (self->offered && !self->greeted) {
+        size_t need = s_greeting_need (self);
+        if (space > need)
+            space = need;
+    }
+    ssize_t size = recv (self->handle, buffer, space, MSG_DONTWAIT);
     if (size == 0)
         //  Other side closed TCP socket, so our peering is down
         self->exception = TRUE;
@@ -1089,43 +2404,215 @@ s_recv_wire (peering_t *self)
         if (driver->verbose)
             zclock_log ("I: (tcp) recv %zd bytes from %s",
                 size, self->address);
-        int rc = vtx_codec_bin_put (self->input, buffer, size);
-        assert (rc == 0);
-
-        //  store binary data into codec
-        //  if routing = request
-        //      retrieve message, if available
-        //      this is a reply
-        //      check reply is allowed in state
-        //      then send message through to msgpipe
-        //      else discard message
-        //      reset state machine on peering
-        //  if routing = reply
-        //      this is a request
-        //      if state allows incoming request
-        //          retrieve message, if available
-        //          vocket->reply_to = peering
-        //          send message through to msgpipe
-        //  if routing = router
-        //      retrieve message, if available
-        //      send schemed identity to msgpipe
-        //      send message through to msgpipe
-        //  any other routing, nomnom allowed
-        //      retrieve message, if available
-        //      send message through to msgpipe
-#if 0
-        else
-            zclock_log ("W: unexpected message from %s - dropping", address);
-        char *colon = strchr (address, ':');
-        assert (colon);
-        *colon = 0;
-        strcpy (vocket->sender, address);
-#endif
+        vtx_codec_bin_commit (self->input, size);
+        self->active_at = zclock_time ();
+        s_recv_drain (self);
+        if (vtx_codec_invalid (self->input)) {
+            zclock_log ("E: (tcp) bad frame header from %s", self->address);
+            self->exception = TRUE;
+        }
+    }
+    return size;
+}
+
+
+//  Receive packed blocks from peering, unpack each complete block into
+//  the input codec, and process the frames it holds
+
+static ssize_t
+s_recv_blocks (peering_t *self)
+{
+    driver_t *driver = self->driver;
+    size_t space = VTX_TCP_BLOCKS * VTX_CODEC_BLOCK_MAX - self->block_in_size;
+    ssize_t size = recv (self->handle, self->block_in + self->block_in_size,
+                         space, MSG_DONTWAIT);
+    if (size == 0)
+        self->exception = TRUE;
+    else
+    if (size == -1) {
+        if (s_handle_io_error ("recv") == -1)
+            self->exception = TRUE;
+    }
+    else {
+        if (driver->verbose)
+            zclock_log ("I: (tcp) recv %zd packed bytes from %s",
+                size, self->address);
+        self->block_in_size += size;
+        self->active_at = zclock_time ();
+
+        byte *block = self->block_in;
+        size_t left = self->block_in_size;
+        size_t block_size;
+        while ((block_size = vtx_codec_block_size (block, left))
+        &&      block_size <= left) {
+            byte *data;
+            ssize_t raw_size = vtx_codec_block_unpack (self->algo,
+                self->unpacker, block, &data);
+            if (raw_size == -1) {
+                zclock_log ("E: (tcp) bad packed block from %s", self->address);
+                self->exception = TRUE;
+                return -1;
+            }
+            if (vtx_codec_bin_put (self->input, data, raw_size)) {
+                zclock_log ("E: (tcp) input overflow from %s", self->address);
+                self->exception = TRUE;
+                return -1;
+            }
+            s_recv_drain (self);
+            if (vtx_codec_invalid (self->input)) {
+                zclock_log ("E: (tcp) bad frame header from %s", self->address);
+                self->exception = TRUE;
+                return -1;
+            }
+            block += block_size;
+            left -= block_size;
+        }
+        //  Keep partial block for next time
+        memmove (self->block_in, block, left);
+        self->block_in_size = left;
     }
     return size;
 }
 
 
+//  Return how much more of the peer's greeting we need, given what we
+//  have of it so far in the input codec
+
+static size_t
+s_greeting_need (peering_t *self)
+{
+    byte *data;
+    size_t have = vtx_codec_bin_get (self->input, &data);
+    if (have == 0)
+        return 1;
+    if (data [0] < 0xFF)
+        return 1 + data [0] - have;
+    if (have < 9)
+        return 9 - have;
+    uint64_t length = 0;
+    uint index;
+    for (index = 1; index < 9; index++)
+        length = (length << 8) + data [index];
+    return 9 + length - have;
+}
+
+
+//  Slice complete frames out of input codec and process them; large
+//  frames were received directly, and come out as messages
+
+static void
+s_recv_drain (peering_t *self)
+{
+    vtx_slice_t slices [VTX_TCP_SLICES];
+    while (TRUE) {
+        uint count = vtx_codec_slices_get (self->input, slices, VTX_TCP_SLICES);
+        if (count) {
+            uint index;
+            for (index = 0; index < count; index++)
+                s_recv_frame (self, &slices [index], NULL);
+            vtx_codec_slices_drop (self->input);
+        }
+        else {
+            zmq_msg_t msg;
+            if (vtx_codec_msg_get (self->input, &msg, &slices [0].more))
+                break;
+            slices [0].data = (byte *) zmq_msg_data (&msg);
+            slices [0].size = zmq_msg_size (&msg);
+            s_recv_frame (self, &slices [0], &msg);
+            zmq_msg_close (&msg);
+        }
+    }
+}
+
+
+//  Process one frame received from peering. The data is still in the
+//  input codec, so we copy it only where we need to keep it. If the
+//  frame was received directly into a message, we pass that on as-is.
+
+static void
+s_recv_frame (peering_t *self, vtx_slice_t *slice, zmq_msg_t *msg)
+{
+    vocket_t *vocket = self->vocket;
+    byte *data = slice->data;
+    size_t size = slice->size;
+    Bool more = slice->more;
+
+    if (!self->greeted) {
+        self->greeted = TRUE;   //  Skip peer's greeting, unless we
+        if (self->offered)      //  offered a codec algorithm
+            peering_agree (self, data, size);
+    }
+    else
+    if (vocket->routing == VTX_ROUTING_PUBLISH) {
+        //  Subscriber sends us only subscription commands
+        if (size > 0 && !self->more)
+            peering_subscribe (self, data + 1, size - 1, data [0] == 1);
+        else
+            zclock_log ("W: bad subscription from %s - dropping",
+                self->address);
+    }
+    else
+    if (vocket->routing == VTX_ROUTING_REPLY) {
+        //  Collect request, and queue it for dispatch when it's
+        //  complete; requesters send one request at a time
+        if (!self->partial)
+            self->partial = zmsg_new ();
+        zmsg_add (self->partial, s_frame_new (data, size, msg));
+        if (!more) {
+            vocket->incoming++;
+            if (self->pending) {
+                zclock_log ("W: request overrun from %s - dropping",
+                    self->address);
+                zmsg_destroy (&self->partial);
+                vocket->dropped++;
+            }
+            else {
+                self->pending = self->partial;
+                self->partial = NULL;
+                if (vocket->metadata) {
+                    byte meta [VTX_META_MAX];
+                    size_t meta_size = vtx_meta_encode (meta, self->address);
+                    zmsg_push (self->pending, zframe_new (meta, meta_size));
+                }
+                zlist_append (vocket->requests, self);
+                vocket_dispatch (vocket);
+            }
+        }
+    }
+    else
+    if (vocket->nomnom) {
+        if (!self->more) {
+            //  Metadata frame comes first, if the application wants it
+            if (vocket->metadata) {
+                byte meta [VTX_META_MAX];
+                size_t meta_size = vtx_meta_encode (meta, self->address);
+                vocket_deliver_frame (vocket, meta, meta_size, NULL, TRUE);
+            }
+            //  ROUTER gets schemed identity before the message
+            if (vocket->routing == VTX_ROUTING_ROUTER) {
+                if (!self->routed)
+                    peering_route (self);
+                zmq_msg_t identity;
+                zmq_msg_init (&identity);
+                zmq_msg_copy (&identity, &self->identity);
+                vocket_deliver_frame (vocket, NULL, 0, &identity, TRUE);
+                zmq_msg_close (&identity);
+            }
+            vocket_set_sender (vocket, self->address);
+            vocket->incoming++;
+        }
+        vocket_deliver_frame (vocket, data, size, msg, more);
+    }
+    else {
+        if (!self->more)
+            vocket->dropped++;
+        zclock_log ("W: unexpected message from %s - dropping",
+            self->address);
+    }
+    self->more = more;
+}
+
+
 //  Converts a sockaddr_in to a string, returns static result
 
 static char *
@@ -1189,7 +2676,7 @@ s_close_handle (int handle, driver_t *driver)
 {
     if (handle > 0) {
         zmq_pollitem_t item = { 0, handle };
-        zloop_poller_end (driver->loop, &item);
+        vtx_loop_poller_end (driver->loop, &item);
         close (handle);
     }
 }
@@ -1238,3 +2725,96 @@ s_handle_io_error (char *reason)
         return -1;          //  Unexpected error, abandon
     }
 }
+
+
+//  Set kernel buffer sizes on handle; a size of zero leaves the system
+//  default. The kernel may round or cap the sizes we ask for.
+
+static void
+s_set_bufsize (int handle, int sndbuf, int rcvbuf)
+{
+    if (handle > 0 && sndbuf > 0)
+        setsockopt (handle, SOL_SOCKET, SO_SNDBUF,
+            (void *) &sndbuf, sizeof (sndbuf));
+    if (handle > 0 && rcvbuf > 0)
+        setsockopt (handle, SOL_SOCKET, SO_RCVBUF,
+            (void *) &rcvbuf, sizeof (rcvbuf));
+}
+
+//  Hold back partial segments on handle while corked, and send them when
+//  uncorked. Does nothing on systems without TCP_CORK.
+
+static void
+s_set_cork (int handle, Bool cork)
+{
+#if defined (TCP_CORK)
+    int value = cork? 1: 0;
+    if (handle > 0)
+        setsockopt (handle, IPPROTO_TCP, TCP_CORK,
+            (void *) &value, sizeof (value));
+#endif
+}
+
+//  Let handle share its address with the handles of other shards, which
+//  each run in their own driver. Call before binding.
+
+static int
+s_set_reuseport (int handle)
+{
+#if defined (SO_REUSEPORT)
+    int reuse = 1;
+    return setsockopt (handle, SOL_SOCKET, SO_REUSEPORT,
+        (void *) &reuse, sizeof (reuse));
+#else
+    errno = ENOPROTOOPT;
+    return -1;
+#endif
+}
+
+//  Attach a classic BPF program to the shard group that picks shard
+//  (cpu % shards) for the CPU that received the connection. The kernel
+//  numbers shards in the order they bound. If the group has fewer shards
+//  than the program asks for, the kernel falls back to the flow hash.
+
+static int
+s_set_steering (int handle, uint shards)
+{
+#if defined (SO_ATTACH_REUSEPORT_CBPF)
+    struct sock_filter code [] = {
+        { BPF_LD  | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, shards },
+        { BPF_RET | BPF_A, 0, 0, 0 }
+    };
+    struct sock_fprog program = { tblsize (code), code };
+    return setsockopt (handle, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+        (void *) &program, sizeof (program));
+#else
+    errno = ENOPROTOOPT;
+    return -1;
+#endif
+}
+
+//  Pin the calling thread, which must be the driver's own thread, to
+//  one CPU. We never call this for embedded drivers, whose thread
+//  belongs to the application.
+
+static int
+s_set_affinity (uint cpu)
+{
+#if defined (__linux__) && defined (CPU_SET)
+    if (cpu >= CPU_SETSIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+    cpu_set_t cpus;
+    CPU_ZERO (&cpus);
+    CPU_SET (cpu, &cpus);
+    int rc = pthread_setaffinity_np (pthread_self (), sizeof (cpus), &cpus);
+    if (rc)
+        errno = rc;
+    return rc? -1: 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
@@ -34,14 +34,30 @@
 #define VTX_TCP_SCHEME         "tcp"
 //  Listen backlog
 #define VTX_TCP_BACKLOG         100     //  Waiting connections
-//  Input buffer size
-#define VTX_TCP_BUFSIZE         4096
+//  Frames decoded per pass over input codec
+#define VTX_TCP_SLICES          64
 //  Time between connection retries
 #define VTX_TCP_RECONNECT_IVL   1000    //  Msecs
 #define VTX_TCP_RECONNECT_MAX   1000    //  Msecs, limit
 //  Codec buffer sizes
 #define VTX_TCP_INBUF_MAX       1024    //  Messages
 #define VTX_TCP_OUTBUF_MAX      1024    //  Messages
+//  Release codec buffers after peering is idle this long
+#define VTX_TCP_IDLE_IVL        5000    //  Msecs
+//  Interval to retry a full receive ring
+#define VTX_TCP_RETRY_IVL       1       //  Msecs
+//  Greeting that offers a codec algorithm and framing, followed by
+//  their names, as "algorithm/framing"
+#define VTX_TCP_OFFER           "vtx-offer:"
+//  Packed blocks we can receive in one read
+#define VTX_TCP_BLOCKS          4
+//  Latency profile: kernel buffers, and time to busy-poll for input
+#define VTX_TCP_LATENCY_BUF     65536   //  Bytes
+#define VTX_TCP_BUSY_POLL       50      //  Usecs
+//  Throughput profile: kernel buffers before we've measured the BDP,
+//  and the limit we grow send buffers to once we have
+#define VTX_TCP_BULK_BUF        4194304 //  Bytes
+#define VTX_TCP_BULK_BUF_MAX    67108864 //  Bytes
 
 #ifdef __cplusplus
 extern "C" {
@@ -13,12 +13,16 @@ static void test_tcp_req        (void *args, zctx_t *ctx, void *pipe);
 static void test_tcp_rep        (void *args, zctx_t *ctx, void *pipe);
 static void test_tcp_dealer_srv (void *args, zctx_t *ctx, void *pipe);
 static void test_tcp_dealer_cli (void *args, zctx_t *ctx, void *pipe);
+static void test_tcp_hash_cli   (void *args, zctx_t *ctx, void *pipe);
 static void test_tcp_router     (void *args, zctx_t *ctx, void *pipe);
 static void test_tcp_pull       (void *args, zctx_t *ctx, void *pipe);
 static void test_tcp_push       (void *args, zctx_t *ctx, void *pipe);
+static void test_tcp_push_ring  (void *args, zctx_t *ctx, void *pipe);
+static void *test_tcp_push_lane (void *args);
 static void test_tcp_pub        (void *args, zctx_t *ctx, void *pipe);
 static void test_tcp_sub        (void *args, zctx_t *ctx, void *pipe);
 static void test_tcp_pair_srv   (void *args, zctx_t *ctx, void *pipe);
+static void test_tcp_pair_embedded (void *args, zctx_t *ctx, void *pipe);
 static void test_tcp_pair_cli   (void *args, zctx_t *ctx, void *pipe);
 
 int main (void)
@@ -26,17 +30,32 @@ int main (void)
     //  Initialize 0MQ context and virtual transport interface
     zctx_t *ctx = zctx_new ();
     assert (ctx);
-    //  Run request-reply tests
+    //  Check closed sockets don't count against the socket limit
+    {
+        vtx_t *vtx = vtx_new (ctx);
+        int count;
+        for (count = 0; count < VTX_MAX_SOCKETS + 1; count++) {
+            void *socket = vtx_socket (vtx, ZMQ_DEALER);
+            assert (socket);
+            vtx_close (vtx, socket);
+        }
+        vtx_destroy (&vtx);
+    }
+    //  Run request-reply tests, with two concurrent requesters
     {
         zclock_log ("I: testing request-reply over TCP...");
-        void *request = zthread_fork (ctx, test_tcp_req, NULL);
+        void *request1 = zthread_fork (ctx, test_tcp_req, NULL);
+        void *request2 = zthread_fork (ctx, test_tcp_req, NULL);
         void *reply = zthread_fork (ctx, test_tcp_rep, NULL);
         //  Send port number to use to each thread
-        zstr_send (request, "32000");
+        zstr_send (request1, "32000");
+        zstr_send (request2, "32000");
         zstr_send (reply, "32000");
         sleep (1);
-        zstr_send (request, "END");
-        free (zstr_recv (request));
+        zstr_send (request1, "END");
+        free (zstr_recv (request1));
+        zstr_send (request2, "END");
+        free (zstr_recv (request2));
         zstr_send (reply, "END");
         free (zstr_recv (reply));
     }
@@ -82,6 +101,46 @@ int main (void)
         zstr_send (router, "END");
         free (zstr_recv (router));
     }
+    //  Run hash-routed dealer tests
+    {
+        zclock_log ("I: testing hash dealer-router over TCP...");
+        void *dealer = zthread_fork (ctx, test_tcp_hash_cli, NULL);
+        void *router1 = zthread_fork (ctx, test_tcp_router, "hash");
+        void *router2 = zthread_fork (ctx, test_tcp_router, "hash");
+        //  Send port number to use to each thread, client uses both
+        zstr_send (dealer, "32007");
+        zstr_send (router1, "32007");
+        zstr_send (router2, "32008");
+        sleep (1);
+        zstr_send (dealer, "END");
+        free (zstr_recv (dealer));
+        zstr_send (router1, "END");
+        free (zstr_recv (router1));
+        zstr_send (router2, "END");
+        free (zstr_recv (router2));
+    }
+    //  Run sharded request-router tests, two routers share one port
+    {
+        zclock_log ("I: testing sharded request-router over TCP...");
+        void *request1 = zthread_fork (ctx, test_tcp_req, NULL);
+        void *request2 = zthread_fork (ctx, test_tcp_req, NULL);
+        void *router1 = zthread_fork (ctx, test_tcp_router, "shard");
+        void *router2 = zthread_fork (ctx, test_tcp_router, "shard");
+        //  Send port number to use to each thread
+        zstr_send (request1, "32009");
+        zstr_send (request2, "32009");
+        zstr_send (router1, "32009");
+        zstr_send (router2, "32009");
+        sleep (1);
+        zstr_send (request1, "END");
+        free (zstr_recv (request1));
+        zstr_send (request2, "END");
+        free (zstr_recv (request2));
+        zstr_send (router1, "END");
+        free (zstr_recv (router1));
+        zstr_send (router2, "END");
+        free (zstr_recv (router2));
+    }
     //  Run push-pull tests
     {
         zclock_log ("I: testing push-pull over TCP...");
@@ -100,6 +159,24 @@ int main (void)
         zstr_send (pull2, "END");
         free (zstr_recv (pull2));
     }
+    //  Run push-pull tests over rings, packed, with two sending threads
+    {
+        zclock_log ("I: testing push-pull over TCP, two sending threads...");
+        void *pull1 = zthread_fork (ctx, test_tcp_pull, "packed");
+        void *pull2 = zthread_fork (ctx, test_tcp_pull, "packed");
+        void *push = zthread_fork (ctx, test_tcp_push_ring, NULL);
+        //  Send port number to use to each thread
+        zstr_send (pull1, "32010");
+        zstr_send (pull2, "32010");
+        zstr_send (push, "32010");
+        sleep (1);
+        zstr_send (push, "END");
+        free (zstr_recv (push));
+        zstr_send (pull1, "END");
+        free (zstr_recv (pull1));
+        zstr_send (pull2, "END");
+        free (zstr_recv (pull2));
+    }
     //  Run pub-sub tests
     {
         zclock_log ("I: testing pub-sub over TCP...");
@@ -132,6 +209,20 @@ int main (void)
         zstr_send (pair2, "END");
         free (zstr_recv (pair2));
     }
+    //  Run pair tests with the server's driver embedded in its thread
+    {
+        zclock_log ("I: testing pair-pair over TCP, embedded driver...");
+        void *pair1 = zthread_fork (ctx, test_tcp_pair_embedded, NULL);
+        void *pair2 = zthread_fork (ctx, test_tcp_pair_cli, NULL);
+        //  Send port number to use to each thread
+        zstr_send (pair1, "32011");
+        zstr_send (pair2, "32011");
+        sleep (1);
+        zstr_send (pair1, "END");
+        free (zstr_recv (pair1));
+        zstr_send (pair2, "END");
+        free (zstr_recv (pair2));
+    }
     zctx_destroy (&ctx);
     return 0;
 }
@@ -148,6 +239,8 @@ test_tcp_req (void *args, zctx_t *ctx, void *pipe)
 
     void *client = vtx_socket (vtx, ZMQ_REQ);
     assert (client);
+    rc = vtx_setopt (vtx, client, VTX_OPT_METADATA, 1);
+    assert (rc == 0);
     rc = vtx_connect (vtx, client, "tcp://localhost:%s", port);
     assert (rc == 0);
     int sent = 0;
@@ -169,13 +262,24 @@ test_tcp_req (void *args, zctx_t *ctx, void *pipe)
             break;
         }
         if (items [1].revents & ZMQ_POLLIN) {
-            free (zstr_recv (client));
+            //  Reply tells us who sent it, and when
+            zmsg_t *reply = zmsg_recv (client);
+            if (!reply)
+                break;          //  Interrupted
+            char *sender;
+            int64_t time;
+            rc = vtx_popmeta (reply, &sender, &time);
+            assert (rc == 0);
+            assert (*sender && time > 0);
+            free (sender);
+            zmsg_destroy (&reply);
             recd++;
         }
         else {
             //  No response, close socket and start a new one
             vtx_close (vtx, client);
             client = vtx_socket (vtx, ZMQ_REQ);
+            vtx_setopt (vtx, client, VTX_OPT_METADATA, 1);
             rc = vtx_connect (vtx, client, "tcp://localhost:%s", port);
         }
     }
@@ -232,8 +336,36 @@ test_tcp_router (void *args, zctx_t *ctx, void *pipe)
 
     void *router = vtx_socket (vtx, ZMQ_ROUTER);
     assert (router);
+    if (args && streq ((char *) args, "shard")) {
+        //  Share port with other router shards
+        rc = vtx_setopt (vtx, router, VTX_OPT_REUSEPORT, 2);
+        assert (rc == 0);
+    }
     rc = vtx_bind (vtx, router, "tcp://*:%s", port);
     assert (rc == 0);
+    //  Tune socket at runtime, and read back settings
+    rc = vtx_setopt (vtx, router, VTX_OPT_SNDBUF, 256 * 1024);
+    assert (rc == 0);
+    rc = vtx_setopt (vtx, router, VTX_OPT_OUTBUF_MAX, 4096);
+    assert (rc == 0);
+    rc = vtx_setopt (vtx, router, VTX_OPT_BACKLOG, 0);
+    assert (rc != 0);
+    rc = vtx_setopt (vtx, router, VTX_OPT_PROFILE, VTX_PROFILE_THROUGHPUT);
+    assert (rc == 0);
+    rc = vtx_setopt (vtx, router, VTX_OPT_PROFILE, 3);
+    assert (rc != 0);
+    int value;
+    rc = vtx_getopt (vtx, router, VTX_OPT_OUTBUF_MAX, &value);
+    assert (rc == 0);
+    assert (value == 4096);
+    rc = vtx_getopt (vtx, router, VTX_OPT_BACKLOG, &value);
+    assert (rc == 0);
+    assert (value == VTX_TCP_BACKLOG);
+    rc = vtx_getopt (vtx, router, VTX_OPT_PROFILE, &value);
+    assert (rc == 0);
+    assert (value == VTX_PROFILE_THROUGHPUT);
+    rc = vtx_getopt (vtx, router, VTX_OPT_TIMEOUT, &value);
+    assert (rc != 0);
     int sent = 0;
 
     while (!zctx_interrupted) {
@@ -245,11 +377,24 @@ test_tcp_router (void *args, zctx_t *ctx, void *pipe)
         if (rc == -1)
             break;              //  Context has been shut down
         if (items [1].revents & ZMQ_POLLIN) {
-            char *address = zstr_recv (router);
-            free (zstr_recv (router));
-            zstr_sendm (router, address);
-            zstr_send (router, "CHEEZBURGER");
-            free (address);
+            zframe_t *identity = zframe_recv (router);
+            char *request = zstr_recv (router);
+            if (sent % 2) {
+                //  Identity as string, routed by address
+                char *address = zframe_strdup (identity);
+                zstr_sendm (router, address);
+                free (address);
+                zframe_destroy (&identity);
+            }
+            else
+                //  Identity passed back intact, routed by handle
+                zframe_send (&identity, router, ZFRAME_MORE);
+            if (args && streq ((char *) args, "hash"))
+                //  Tell hash client which router got its key
+                zstr_sendf (router, "%s %s", request, port);
+            else
+                zstr_send (router, "CHEEZBURGER");
+            free (request);
             sent++;
         }
         if (items [0].revents & ZMQ_POLLIN) {
@@ -336,6 +481,85 @@ test_tcp_dealer_cli (void *args, zctx_t *ctx, void *pipe)
     vtx_destroy (&vtx);
 }
 
+static void
+test_tcp_hash_cli (void *args, zctx_t *ctx, void *pipe)
+{
+    vtx_t *vtx = vtx_new (ctx);
+    int rc = vtx_tcp_load (vtx, FALSE);
+    assert (rc == 0);
+    char *port = zstr_recv (pipe);
+
+    //  Route on first frame, to two servers
+    void *dealer = vtx_socket (vtx, ZMQ_DEALER);
+    assert (dealer);
+    rc = vtx_setopt (vtx, dealer, VTX_OPT_ROUTING, VTX_ROUTING_HASH);
+    assert (rc == 0);
+    rc = vtx_setopt (vtx, dealer, VTX_OPT_HASHKEY, 0);
+    assert (rc == 0);
+    rc = vtx_setopt (vtx, dealer, VTX_OPT_BUDGET, 1024);
+    assert (rc == 0);
+    //  Connect to both servers in one request
+    char endpoint1 [64], endpoint2 [64];
+    snprintf (endpoint1, sizeof (endpoint1), "tcp://localhost:%s", port);
+    snprintf (endpoint2, sizeof (endpoint2), "tcp://localhost:%d", atoi (port) + 1);
+    char *endpoints [] = { endpoint1, endpoint2 };
+    int token = vtx_connect_bulk (vtx, dealer, endpoints, 2);
+    assert (token > 0);
+    rc = vtx_wait (vtx, token);
+    assert (rc == 0);
+    assert (vtx_wait (vtx, token) == -1);
+    int sent = 0;
+    int recd = 0;
+    //  Routers answer with their port. Keys can move while the hash ring
+    //  is still growing, so we only check messages sent once we've heard
+    //  from both routers; from then on each key must stick to one router.
+    int key_port [10] = { 0 };
+    int ports [2] = { 0, 0 };
+    int steady = -1;
+    int checked = 0;
+
+    while (!zctx_interrupted) {
+        zstr_sendf (dealer, "KEY %d %d", randof (10), sent);
+        sent++;
+        char *reply = zstr_recv_nowait (dealer);
+        if (reply) {
+            int key, seq, port;
+            rc = sscanf (reply, "KEY %d %d %d", &key, &seq, &port);
+            assert (rc == 3);
+            if (ports [0] == 0)
+                ports [0] = port;
+            else
+            if (ports [1] == 0 && port != ports [0]) {
+                ports [1] = port;
+                steady = sent;
+            }
+            if (steady >= 0 && seq >= steady) {
+                if (key_port [key] == 0)
+                    key_port [key] = port;
+                assert (key_port [key] == port);
+                checked++;
+            }
+            recd++;
+            free (reply);
+        }
+        char *end = zstr_recv_nowait (pipe);
+        if (end) {
+            free (end);
+            zstr_send (pipe, "OK");
+            break;
+        }
+    }
+    char *memory = vtx_getmeta (vtx, dealer, "memory");
+    assert (atoi (memory) <= 1024 * 1024);
+    //  Both routers got traffic, and we saw keys stick
+    assert (ports [0] && ports [1]);
+    assert (checked > 0);
+    zclock_log ("I: HASH: sent=%d recd=%d memory=%s", sent, recd, memory);
+    free (memory);
+    free (port);
+    vtx_destroy (&vtx);
+}
+
 //  --------------------------------------------------------------------------
 
 static void
@@ -348,6 +572,13 @@ test_tcp_pull (void *args, zctx_t *ctx, void *pipe)
 
     void *collector = vtx_socket (vtx, ZMQ_PULL);
     assert (collector);
+    if (args) {
+        //  Offer compression and NOM-2 framing to the ventilator
+        rc = vtx_setopt (vtx, collector, VTX_OPT_CODEC, VTX_CODEC_LZDICT);
+        assert (rc == 0);
+        rc = vtx_setopt (vtx, collector, VTX_OPT_FRAMING, VTX_FRAMING_NOM2);
+        assert (rc == 0);
+    }
     rc = vtx_connect (vtx, collector, "tcp://localhost:%s", port);
     assert (rc == 0);
     int recd = 0;
@@ -405,6 +636,83 @@ test_tcp_push (void *args, zctx_t *ctx, void *pipe)
     vtx_destroy (&vtx);
 }
 
+//  Second thread sending on the same socket as test_tcp_push_ring
+typedef struct {
+    vtx_t *vtx;
+    void *socket;
+    volatile Bool stop;
+    int sent;
+} test_lane_t;
+
+static void
+test_tcp_push_ring (void *args, zctx_t *ctx, void *pipe)
+{
+    vtx_t *vtx = vtx_new (ctx);
+    int rc = vtx_set_threadsafe (vtx, TRUE);
+    assert (rc == 0);
+    rc = vtx_tcp_load (vtx, FALSE);
+    assert (rc == 0);
+    char *port = zstr_recv (pipe);
+
+    //  Create ventilator socket and bind to all network interfaces
+    void *ventilator = vtx_socket (vtx, ZMQ_PUSH);
+    assert (ventilator);
+    rc = vtx_setopt (vtx, ventilator, VTX_OPT_CODEC, VTX_CODEC_LZDICT);
+    assert (rc == 0);
+    rc = vtx_setopt (vtx, ventilator, VTX_OPT_FRAMING, VTX_FRAMING_NOM2);
+    assert (rc == 0);
+    rc = vtx_setopt (vtx, ventilator, VTX_OPT_RING, 1024);
+    assert (rc == 0);
+    rc = vtx_bind (vtx, ventilator, "tcp://*:%s", port);
+    assert (rc == 0);
+    int sent = 0;
+
+    //  Another thread sends on its own lane at the same time
+    test_lane_t lane = { vtx, ventilator, FALSE, 0 };
+    pthread_t thread;
+    rc = pthread_create (&thread, NULL, test_tcp_push_lane, &lane);
+    assert (rc == 0);
+
+    while (!zctx_interrupted) {
+        //  Send messages in batches; ring refuses messages while it's full
+        zmsg_t *batch [16];
+        int index;
+        for (index = 0; index < 16; index++) {
+            batch [index] = zmsg_new ();
+            zmsg_addstr (batch [index], "NOM %04x", randof (0x10000));
+        }
+        sent += vtx_send_batch (vtx, ventilator, batch, 16);
+        for (index = 0; index < 16; index++)
+            zmsg_destroy (&batch [index]);
+        char *end = zstr_recv_nowait (pipe);
+        if (end) {
+            free (end);
+            zstr_send (pipe, "OK");
+            break;
+        }
+    }
+    lane.stop = TRUE;
+    pthread_join (thread, NULL);
+    zclock_log ("I: PUSH: sent=%d lane=%d", sent, lane.sent);
+    free (port);
+    vtx_destroy (&vtx);
+}
+
+static void *
+test_tcp_push_lane (void *args)
+{
+    test_lane_t *lane = (test_lane_t *) args;
+    while (!lane->stop && !zctx_interrupted) {
+        zmsg_t *msg = zmsg_new ();
+        zmsg_addstr (msg, "LANE %04x", randof (0x10000));
+        if (vtx_send (lane->vtx, lane->socket, &msg) == 0)
+            lane->sent++;
+        else
+            zmsg_destroy (&msg);
+    }
+    return NULL;
+}
+
 //  --------------------------------------------------------------------------
 
 static void
@@ -447,6 +755,8 @@ test_tcp_sub (void *args, zctx_t *ctx, void *pipe)
 
     void *subscriber = vtx_socket (vtx, ZMQ_SUB);
     assert (subscriber);
+    rc = vtx_subscribe (vtx, subscriber, "NOM");
+    assert (rc == 0);
     rc = vtx_connect (vtx, subscriber, "tcp://localhost:%s", port);
     assert (rc == 0);
     int recd = 0;
@@ -514,6 +824,61 @@ test_tcp_pair_srv (void *args, zctx_t *ctx, void *pipe)
     vtx_destroy (&vtx);
 }
 
+static void
+test_tcp_pair_embedded (void *args, zctx_t *ctx, void *pipe)
+{
+    //  Driver runs embedded in this thread, off our own poll loop
+    vtx_t *vtx = vtx_new (ctx);
+    int rc = vtx_set_embedded (vtx, TRUE);
+    assert (rc == 0);
+    rc = vtx_tcp_load (vtx, FALSE);
+    assert (rc == 0);
+    char *port = zstr_recv (pipe);
+
+    void *pair = vtx_socket (vtx, ZMQ_PAIR);
+    assert (pair);
+    rc = vtx_bind (vtx, pair, "tcp://*:%s", port);
+    assert (rc == 0);
+    int sent = 0;
+
+    while (!zctx_interrupted) {
+        //  Poll our pipe together with the driver's items
+        uint size;
+        int timeout;
+        zmq_pollitem_t *driver_items = vtx_poll (vtx, &size, &timeout);
+        zmq_pollitem_t *items = (zmq_pollitem_t *) zmalloc (
+            (size + 1) * sizeof (zmq_pollitem_t));
+        items [0].socket = pipe;
+        items [0].events = ZMQ_POLLIN;
+        memcpy (items + 1, driver_items, size * sizeof (zmq_pollitem_t));
+        if (timeout == -1 || timeout > 500)
+            timeout = 500;
+        int rc = zmq_poll (items, size + 1, timeout * ZMQ_POLL_MSEC);
+        Bool end = (items [0].revents & ZMQ_POLLIN) != 0;
+        free (items);
+        if (rc == -1 || vtx_process (vtx, 0) == -1)
+            break;              //  Context has been shut down
+
+        zmsg_t *msg;
+        while ((msg = vtx_recv_nowait (vtx, pair))) {
+            zmsg_destroy (&msg);
+            msg = zmsg_new ();
+            zmsg_addstr (msg, "CHEEZBURGER");
+            if (vtx_send (vtx, pair, &msg) == 0)
+                sent++;
+            zmsg_destroy (&msg);
+        }
+        if (end) {
+            free (zstr_recv (pipe));
+            zstr_send (pipe, "OK");
+            break;
+        }
+    }
+    zclock_log ("I: PAIR EMBEDDED: sent=%d", sent);
+    free (port);
+    vtx_destroy (&vtx);
+}
+
 static void
 test_tcp_pair_cli (void *args, zctx_t *ctx, void *pipe)
 {
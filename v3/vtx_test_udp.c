@@ -13,6 +13,7 @@ static void test_udp_req        (void *args, zctx_t *ctx, void *pipe);
 static void test_udp_rep        (void *args, zctx_t *ctx, void *pipe);
 static void test_udp_dealer_srv (void *args, zctx_t *ctx, void *pipe);
 static void test_udp_dealer_cli (void *args, zctx_t *ctx, void *pipe);
+static void test_udp_hash_cli   (void *args, zctx_t *ctx, void *pipe);
 static void test_udp_router     (void *args, zctx_t *ctx, void *pipe);
 static void test_udp_pull       (void *args, zctx_t *ctx, void *pipe);
 static void test_udp_push       (void *args, zctx_t *ctx, void *pipe);
@@ -26,17 +27,21 @@ int main (void)
     //  Initialize 0MQ context and virtual transport interface
     zctx_t *ctx = zctx_new ();
     assert (ctx);
-    //  Run request-reply tests
+    //  Run request-reply tests, with two concurrent requesters
     {
         zclock_log ("I: testing request-reply over UDP...");
-        void *request = zthread_fork (ctx, test_udp_req, NULL);
+        void *request1 = zthread_fork (ctx, test_udp_req, NULL);
+        void *request2 = zthread_fork (ctx, test_udp_req, NULL);
         void *reply = zthread_fork (ctx, test_udp_rep, NULL);
         //  Send port number to use to each thread
-        zstr_send (request, "32000");
+        zstr_send (request1, "32000");
+        zstr_send (request2, "32000");
         zstr_send (reply, "32000");
         sleep (1);
-        zstr_send (request, "END");
-        free (zstr_recv (request));
+        zstr_send (request1, "END");
+        free (zstr_recv (request1));
+        zstr_send (request2, "END");
+        free (zstr_recv (request2));
         zstr_send (reply, "END");
         free (zstr_recv (reply));
     }
@@ -82,6 +87,24 @@ int main (void)
         zstr_send (router, "END");
         free (zstr_recv (router));
     }
+    //  Run hash-routed dealer tests
+    {
+        zclock_log ("I: testing hash dealer-router over UDP...");
+        void *dealer = zthread_fork (ctx, test_udp_hash_cli, NULL);
+        void *router1 = zthread_fork (ctx, test_udp_router, "hash");
+        void *router2 = zthread_fork (ctx, test_udp_router, "hash");
+        //  Send port number to use to each thread, client uses both
+        zstr_send (dealer, "32007");
+        zstr_send (router1, "32007");
+        zstr_send (router2, "32008");
+        sleep (1);
+        zstr_send (dealer, "END");
+        free (zstr_recv (dealer));
+        zstr_send (router1, "END");
+        free (zstr_recv (router1));
+        zstr_send (router2, "END");
+        free (zstr_recv (router2));
+    }
     //  Run push-pull tests
     {
         zclock_log ("I: testing push-pull over UDP...");
@@ -100,6 +123,24 @@ int main (void)
         zstr_send (pull2, "END");
         free (zstr_recv (pull2));
     }
+    //  Run push-pull tests with NOM-2 framing
+    {
+        zclock_log ("I: testing push-pull over UDP, NOM-2 framing...");
+        void *pull1 = zthread_fork (ctx, test_udp_pull, "nom2");
+        void *pull2 = zthread_fork (ctx, test_udp_pull, "nom2");
+        void *push = zthread_fork (ctx, test_udp_push, "nom2");
+        //  Send port number to use to each thread
+        zstr_send (pull1, "32010");
+        zstr_send (pull2, "32010");
+        zstr_send (push, "32010");
+        sleep (1);
+        zstr_send (push, "END");
+        free (zstr_recv (push));
+        zstr_send (pull1, "END");
+        free (zstr_recv (pull1));
+        zstr_send (pull2, "END");
+        free (zstr_recv (pull2));
+    }
     //  Run pub-sub tests
     {
         zclock_log ("I: testing pub-sub over UDP...");
@@ -132,6 +173,20 @@ int main (void)
         zstr_send (pair2, "END");
         free (zstr_recv (pair2));
     }
+    //  Run pair tests with the client connecting asynchronously
+    {
+        zclock_log ("I: testing pair-pair over UDP, async connect...");
+        void *pair1 = zthread_fork (ctx, test_udp_pair_srv, NULL);
+        void *pair2 = zthread_fork (ctx, test_udp_pair_cli, "async");
+        //  Send port number to use to each thread
+        zstr_send (pair1, "32011");
+        zstr_send (pair2, "32011");
+        sleep (1);
+        zstr_send (pair1, "END");
+        free (zstr_recv (pair1));
+        zstr_send (pair2, "END");
+        free (zstr_recv (pair2));
+    }
     zctx_destroy (&ctx);
     return 0;
 }
@@ -234,6 +289,24 @@ test_udp_router (void *args, zctx_t *ctx, void *pipe)
     assert (router);
     rc = vtx_bind (vtx, router, "udp://*:%s", port);
     assert (rc == 0);
+    //  Tune socket at runtime, and read back settings
+    rc = vtx_setopt (vtx, router, VTX_OPT_RCVBUF, 256 * 1024);
+    assert (rc == 0);
+    rc = vtx_setopt (vtx, router, VTX_OPT_TIMEOUT, 5000);
+    assert (rc == 0);
+    rc = vtx_setopt (vtx, router, VTX_OPT_MSGMAX, VTX_UDP_MSGMAX + 1);
+    assert (rc != 0);
+    rc = vtx_setopt (vtx, router, VTX_OPT_STEERING, VTX_STEER_CPU);
+    assert (rc != 0);
+    int value;
+    rc = vtx_getopt (vtx, router, VTX_OPT_TIMEOUT, &value);
+    assert (rc == 0);
+    assert (value == 5000);
+    rc = vtx_getopt (vtx, router, VTX_OPT_MSGMAX, &value);
+    assert (rc == 0);
+    assert (value == VTX_UDP_MSGMAX);
+    rc = vtx_getopt (vtx, router, VTX_OPT_INBUF_MAX, &value);
+    assert (rc != 0);
     int sent = 0;
 
     while (!zctx_interrupted) {
@@ -246,9 +319,14 @@ test_udp_router (void *args, zctx_t *ctx, void *pipe)
             break;              //  Context has been shut down
         if (items [1].revents & ZMQ_POLLIN) {
             char *address = zstr_recv (router);
-            free (zstr_recv (router));
+            char *request = zstr_recv (router);
             zstr_sendm (router, address);
-            zstr_send (router, "CHEEZBURGER");
+            if (args && streq ((char *) args, "hash"))
+                //  Tell hash client which router got its key
+                zstr_sendf (router, "%s %s", request, port);
+            else
+                zstr_send (router, "CHEEZBURGER");
+            free (request);
             free (address);
             sent++;
         }
@@ -336,6 +414,74 @@ test_udp_dealer_cli (void *args, zctx_t *ctx, void *pipe)
     vtx_destroy (&vtx);
 }
 
+static void
+test_udp_hash_cli (void *args, zctx_t *ctx, void *pipe)
+{
+    vtx_t *vtx = vtx_new (ctx);
+    int rc = vtx_udp_load (vtx, FALSE);
+    assert (rc == 0);
+    char *port = zstr_recv (pipe);
+
+    //  Route on first frame, to two servers
+    void *dealer = vtx_socket (vtx, ZMQ_DEALER);
+    assert (dealer);
+    rc = vtx_setopt (vtx, dealer, VTX_OPT_ROUTING, VTX_ROUTING_HASH);
+    assert (rc == 0);
+    rc = vtx_setopt (vtx, dealer, VTX_OPT_HASHKEY, 0);
+    assert (rc == 0);
+    rc = vtx_connect (vtx, dealer, "udp://localhost:%s", port);
+    assert (rc == 0);
+    rc = vtx_connect (vtx, dealer, "udp://localhost:%d", atoi (port) + 1);
+    assert (rc == 0);
+    int sent = 0;
+    int recd = 0;
+    //  Routers answer with their port. Keys can move while the hash ring
+    //  is still growing, so we only check messages sent once we've heard
+    //  from both routers; from then on each key must stick to one router.
+    int key_port [10] = { 0 };
+    int ports [2] = { 0, 0 };
+    int steady = -1;
+    int checked = 0;
+
+    while (!zctx_interrupted) {
+        zstr_sendf (dealer, "KEY %d %d", randof (10), sent);
+        sent++;
+        char *reply = zstr_recv_nowait (dealer);
+        if (reply) {
+            int key, seq, port;
+            rc = sscanf (reply, "KEY %d %d %d", &key, &seq, &port);
+            assert (rc == 3);
+            if (ports [0] == 0)
+                ports [0] = port;
+            else
+            if (ports [1] == 0 && port != ports [0]) {
+                ports [1] = port;
+                steady = sent;
+            }
+            if (steady >= 0 && seq >= steady) {
+                if (key_port [key] == 0)
+                    key_port [key] = port;
+                assert (key_port [key] == port);
+                checked++;
+            }
+            recd++;
+            free (reply);
+        }
+        char *end = zstr_recv_nowait (pipe);
+        if (end) {
+            free (end);
+            zstr_send (pipe, "OK");
+            break;
+        }
+    }
+    //  Both routers got traffic, and we saw keys stick
+    assert (ports [0] && ports [1]);
+    assert (checked > 0);
+    zclock_log ("I: HASH: sent=%d recd=%d", sent, recd);
+    free (port);
+    vtx_destroy (&vtx);
+}
+
 //  --------------------------------------------------------------------------
 
 static void
@@ -348,6 +494,10 @@ test_udp_pull (void *args, zctx_t *ctx, void *pipe)
 
     void *collector = vtx_socket (vtx, ZMQ_PULL);
     assert (collector);
+    if (args) {
+        rc = vtx_setopt (vtx, collector, VTX_OPT_FRAMING, VTX_FRAMING_NOM2);
+        assert (rc == 0);
+    }
     rc = vtx_connect (vtx, collector, "udp://*:%s", port);
     assert (rc == 0);
     int recd = 0;
@@ -386,6 +536,10 @@ test_udp_push (void *args, zctx_t *ctx, void *pipe)
     //  Create ventilator socket and bind to all network interfaces
     void *ventilator = vtx_socket (vtx, ZMQ_PUSH);
     assert (ventilator);
+    if (args) {
+        rc = vtx_setopt (vtx, ventilator, VTX_OPT_FRAMING, VTX_FRAMING_NOM2);
+        assert (rc == 0);
+    }
     rc = vtx_bind (vtx, ventilator, "udp://*:%s", port);
     assert (rc == 0);
     int sent = 0;
@@ -447,6 +601,8 @@ test_udp_sub (void *args, zctx_t *ctx, void *pipe)
 
     void *subscriber = vtx_socket (vtx, ZMQ_SUB);
     assert (subscriber);
+    rc = vtx_subscribe (vtx, subscriber, "NOM");
+    assert (rc == 0);
     rc = vtx_connect (vtx, subscriber, "udp://*:%s", port);
     assert (rc == 0);
     int recd = 0;
@@ -524,8 +680,17 @@ test_udp_pair_cli (void *args, zctx_t *ctx, void *pipe)
 
     void *pair = vtx_socket (vtx, ZMQ_PAIR);
     assert (pair);
-    rc = vtx_connect (vtx, pair, "udp://*:%s", port);
-    assert (rc == 0);
+    if (args) {
+        //  Start connecting, then wait for the driver to finish
+        int token = vtx_connect_async (vtx, pair, "udp://*:%s", port);
+        assert (token > 0);
+        rc = vtx_wait (vtx, token);
+        assert (rc == 0);
+    }
+    else {
+        rc = vtx_connect (vtx, pair, "udp://*:%s", port);
+        assert (rc == 0);
+    }
     int sent = 0;
     int recd = 0;
 
@@ -13,10 +13,12 @@
                         / S:HUGZ C:HUGZ-OK
                         / C:NOM
                         / S:NOM
+                        / C:ICANHAZ S:ICANHAZ-OK
 
         ROTFL           = version flags %b0000 %b0000 reason-text
         version         = %b0001
-        flags           = %b000 resend-flag
+        flags           = %b00 nom2-flag resend-flag
+        nom2-flag       = 1*BIT         ; Offer or use NOM-2 framing
         resend-flag     = 1*BIT
         reason-text     = *VCHAR
 
@@ -35,7 +37,7 @@
         HUGZ            = version flags %b0011 %b0000
         HUGZ-OK         = version flags %b0100 %b0000
 
-        NOM             = version flags %b0111 sequence zmq-payload
+        NOM             = version flags %b0101 sequence zmq-payload
         sequence        = 4BIT          ; Request sequencing
         zmq-payload     = 1*zmq-frame
         zmq-frame       = tiny-frame / short-frame / long-frame
@@ -44,6 +46,23 @@
         long-frame      = %xFF 4OCTET frame-body
         frame-body      = *OCTET
 
+    If both peers set the nom2-flag in OHAI and OHAI-OK, each NOM they
+    send sets it too, and carries frames with NOM-2 framing instead, as
+    described in vtx_codec.
+
+        ICANHAZ         = version flags %b0110 sequence subscription
+        subscription    = ( unsubscribe / subscribe ) topic
+        unsubscribe     = %x00
+        subscribe       = %x01
+        topic           = *OCTET        ; Prefix of first message frame
+
+        ICANHAZ-OK      = version flags %b0111 sequence
+
+    A SUB peer sends each subscription change to its publishers as an
+    ICANHAZ command, one at a time, and repeats it until the publisher
+    confirms with ICANHAZ-OK carrying the same sequence. The publisher
+    only sends a NOM to peers that have a matching subscription.
+
     The UDP driver is not high-speed. Currently it uses a single socket
     for all output (vocket->handle) and blocks when the socket is busy.
     For a faster model, create a handle for each peering, and poll for
@@ -71,6 +90,13 @@
 */
 
 #include "vtx_udp.h"
+#include "vtx_codec.c"
+#include "vtx_hashring.c"
+#include "vtx_match.c"
+#include "vtx_arena.c"
+#include "vtx_ring.c"
+#include "vtx_loop.c"
+#include "vtx_meta.c"
 
 //  Report a fatal error and exit the program without cleaning up
 //  Use of derp() should be gradually reduced to real failures.
@@ -85,7 +111,8 @@ static char *s_command_name [] = {
     "ROTFL",                    //  Command rejected
     "OHAI", "OHAI-OK",          //  Request/acknowledge new peering
     "HUGZ", "HUGZ-OK",          //  Send/receive sign of life
-    "NOM"                       //  Send message asynchronously
+    "NOM",                      //  Send message asynchronously
+    "ICANHAZ", "ICANHAZ-OK"     //  Request/acknowledge subscription
 };
 
 //  ---------------------------------------------------------------------
@@ -95,22 +122,38 @@ typedef struct _driver_t driver_t;
 typedef struct _vocket_t vocket_t;
 typedef struct _binding_t binding_t;
 typedef struct _peering_t peering_t;
+typedef struct _vtx_route_t vtx_route_t;
 
 
 //  ---------------------------------------------------------------------
 //  A driver_t holds the context for one driver thread, which matches
 //  one registered driver. We create a driver by calling vtx_udp_driver,
-//  and the thread runs until the process is interrupted. A driver works
-//  with a list of vockets, which are virtual 0MQ sockets.
+//  and the thread runs until the process is interrupted. An embedded
+//  driver has no thread; it adds itself to the application's reactor
+//  and runs whenever the application runs that. A driver works with a
+//  list of vockets, which are virtual 0MQ sockets.
 
 struct _driver_t {
     zctx_t *ctx;                //  Own context
     char *scheme;               //  Driver scheme
-    zloop_t *loop;              //  zloop reactor for socket I/O
+    vtx_loop_t *loop;           //  Reactor for socket I/O
+    Bool embedded;              //  Loop belongs to application?
     zlist_t *vockets;           //  List of vockets per driver
+    zhash_t *vocket_hash;       //  Vockets, indexed by vtxname
     void *pipe;                 //  Control pipe to/from VTX frontend
     int64_t errors;             //  Number of transport errors
     Bool verbose;               //  Trace activity?
+    vtx_arena_t *arena;         //  Driver objects and their strings
+    //  Hot timing state of all peerings, as parallel arrays indexed by
+    //  peering slot, so the sweep timer streams through them in order
+    peering_t **slot_peering;   //  Peering that owns slot
+    int64_t *slot_due;          //  Peering monitor due at this time
+    int64_t *slot_resend;       //  Resend due at this time
+    int64_t *slot_expiry;       //  Peering expires at this time
+    int64_t *slot_silent;       //  Peering goes silent at this time
+    uint slots;                 //  Number of slots in use
+    uint slot_limit;            //  Allocated size of slot arrays
+    byte scratch [VTX_UDP_MSGMAX];  //  Reused to encode outgoing commands
 };
 
 //  A vocket_t holds the context for one virtual socket, which implements
@@ -125,23 +168,51 @@ struct _vocket_t {
     driver_t *driver;           //  Parent driver object
     char *vtxname;              //  Message pipe VTX address
     void *msgpipe;              //  Message pipe (0MQ socket)
+    vtx_ring_t *outring;        //  Messages from application, or NULL
+    vtx_ring_t *lanes [VTX_MAX_LANES];
+    uint lane_count;            //  Extra rings from sending threads
+    vtx_ring_t *inring;         //  Messages to application, or NULL
+    zmsg_t *inbatch [VTX_RING_BATCH];
+    uint inbatch_size;          //  Messages waiting to go onto inring
+    zlist_t *inbacklog;         //  Messages behind inbatch, ring is full
+    Bool backlogged;            //  Ring full, so handle input stopped
     zhash_t *binding_hash;      //  Bindings, indexed by address
     zhash_t *peering_hash;      //  Peerings, indexed by address
     zlist_t *peering_list;      //  Peerings, in simple list
     zlist_t *live_peerings;     //  Peerings that are alive
-    peering_t *reply_to;        //  For reply routing
+    zlist_t *requests;          //  REP peerings with waiting requests
+    Bool dispatched;            //  REP request is with application
+    peering_t *reply_to;        //  For reply routing, NULL if gone
     uint peerings;              //  Current number of peerings
+    peering_t **routes;         //  ROUTER peerings, by route slot
+    uint route_tag;             //  Tag of last route handed out
     //  Vocket metadata, available via getmeta call
     char sender [16];           //  Address of last message sender
+    Bool metadata;              //  Metadata frame on each message?
     //  These properties control the vocket routing semantics
     uint routing;               //  Routing mechanism
+    vtx_route_t *route;         //  Router for outgoing messages
     Bool nomnom;                //  Accepts incoming messages
     uint min_peerings;          //  Minimum peerings for routing
     uint max_peerings;          //  Maximum allowed peerings
+    vtx_hashring_t *hashring;   //  Live peerings, for hash routing
+    uint hashkey;               //  Frame to hash on, for hash routing
+    zlist_t *subscriptions;     //  SUB topics, as strings
+    uint shards;                //  Bindings sharing each address
+    int steering;               //  How input is spread over shards
+    vtx_match_t *matcher;       //  PUB subscriptions of all peerings
+    zlist_t *subscribers;       //  PUB peerings for current message
+    uint match_epoch;           //  Counts messages matched
     //  hwm strategy
     //  filter on input messages
     //  NOM-1 specific properties
     int handle;                 //  Handle for outgoing commands
+    int framing;                //  Message framing we offer peers
+    uint msgmax;                //  Largest datagram we send
+    uint timeout;               //  Msecs of silence before peer is dead
+    uint resend_ivl;            //  Msecs between resends
+    int sndbuf;                 //  Kernel send buffer, 0 = default
+    int rcvbuf;                 //  Kernel receive buffer, 0 = default
     //  Statistics and reporting
     int socktype;               //  0MQ socket type
     uint outgoing;              //  Messages sent
@@ -197,28 +268,60 @@ struct _peering_t {
     char *address;              //  Peer address as nnn.nnn.nnn.nnn:nnnnn
     Bool exception;             //  Peering could not be initialized
     //  NOM-1 specific properties
-    int64_t expiry;             //  Peering expires at this time
+    uint slot;                  //  Index of our hot state in driver
     Bool broadcast;             //  Is peering connected to BROADCAST?
-    int64_t silent;             //  Peering goes silent at this time
+    Bool nom2;                  //  Both peers offered NOM-2 framing?
     struct sockaddr_in addr;    //  Peer address as sockaddr_in
     struct sockaddr_in bcast;   //  Broadcast address, if any
     zmsg_t *request;            //  Pending request NOM, if any
     zmsg_t *reply;              //  Last reply NOM, if any
+    zmsg_t *pending;            //  Request waiting for REP dispatch
     uint sendseq;               //  Request sequence number
     uint recvseq;               //  Reply sequence number
+    zlist_t *icanhaz;           //  Subscription commands to confirm
+    zlist_t *subscriptions;     //  Topics peer subscribed to, as frames
+    uint match_epoch;           //  Message last matched for peering
+    Bool routed;                //  Has route slot and identity?
+    uint route;                 //  Route slot in vocket
+    uint route_tag;             //  Tag that makes route handle unique
+    zframe_t *identity;         //  ROUTER identity frame, prebuilt
 };
 
+//  Hot state of a peering, held in the driver's slot arrays
+#define PEERING_EXPIRY(p)   ((p)->driver->slot_expiry [(p)->slot])
+#define PEERING_SILENT(p)   ((p)->driver->slot_silent [(p)->slot])
+
 //  Basic methods for each of our object types (it's not really a clean
 //  abstraction since objects are not opaque, but it works pretty well.)
 //
 static driver_t *
-    driver_new (zctx_t *ctx, void *pipe);
+    driver_new (zctx_t *ctx, void *pipe, vtx_loop_t *loop);
 static void
     driver_destroy (driver_t **self_p);
 static vocket_t *
     vocket_new (driver_t *driver, int socktype, char *vtxname);
 static void
     vocket_destroy (vocket_t **self_p);
+static int
+    vocket_setopt (vocket_t *self, int option, int value);
+static int
+    vocket_getopt (vocket_t *self, int option, int *value_p);
+static int
+    vocket_subscribe (vocket_t *self, char *topic, Bool add);
+static void
+    vocket_dispatch (vocket_t *self);
+static void
+    vocket_set_sender (vocket_t *self, char *address);
+static void
+    vocket_deliver (vocket_t *self, zmsg_t **msg_p);
+static void
+    vocket_flush (vocket_t *self);
+static void
+    vocket_backlog (vocket_t *self, Bool backlogged);
+static void
+    vocket_poll_input (vocket_t *self, Bool active);
+static vtx_ring_t *
+    vocket_lane (vocket_t *self, int handle);
 static binding_t *
     binding_require (vocket_t *vocket, char *address);
 static void
@@ -231,26 +334,53 @@ static void
     peering_delete (void *argument);
 static int
     peering_send_msg (peering_t *self, zmsg_t *msg, int flags);
+static void
+    peering_send_routed (peering_t *self, zmsg_t **msg_p, uint retain);
 static int
     peering_send (peering_t *self, int command, byte *data, size_t size, int flags);
+static void
+    peering_attach (peering_t *self);
+static void
+    peering_detach (peering_t *self);
+static int
+    peering_monitor (peering_t *self);
+static void
+    peering_route (peering_t *self);
+static void
+    peering_unroute (peering_t *self);
 static void
     peering_raise (peering_t *self);
 static void
     peering_lower (peering_t *self);
+static void
+    peering_icanhaz (peering_t *self, char *topic, Bool add);
+static void
+    peering_send_icanhaz (peering_t *self);
+static void
+    peering_subscribe (peering_t *self, byte *topic, size_t size, Bool add);
+static void
+    peering_unsubscribe_all (peering_t *self);
 
 //  Reactor handlers
 static int
-    s_driver_control (zloop_t *loop, zmq_pollitem_t *item, void *arg);
+    s_driver_control (vtx_loop_t *loop, zmq_pollitem_t *item, void *arg);
+static int
+    s_vocket_input (vtx_loop_t *loop, zmq_pollitem_t *item, void *arg);
 static int
-    s_vocket_input (zloop_t *loop, zmq_pollitem_t *item, void *arg);
+    s_vocket_ring_input (vtx_loop_t *loop, zmq_pollitem_t *item, void *arg);
 static int
-    s_binding_input (zloop_t *loop, zmq_pollitem_t *item, void *arg);
+    s_binding_input (vtx_loop_t *loop, zmq_pollitem_t *item, void *arg);
 static int
-    s_peering_monitor (zloop_t *loop, zmq_pollitem_t *item, void *arg);
+    s_vocket_retry (vtx_loop_t *loop, zmq_pollitem_t *item, void *arg);
+static void
+    s_binding_datagram (vocket_t *vocket, byte *buffer, ssize_t size,
+                        struct sockaddr_in *addr);
 static int
-    s_resend_timer (zloop_t *loop, zmq_pollitem_t *item, void *arg);
+    s_driver_sweep (vtx_loop_t *loop, zmq_pollitem_t *item, void *arg);
 
 //  Utility functions
+static void
+    s_vocket_route (vocket_t *vocket, zmsg_t *msg);
 static uint32_t
     s_broadcast_addr (void);
 static char *
@@ -261,18 +391,36 @@ static void
     s_close_handle (int handle, driver_t *driver);
 static int
     s_handle_io_error (char *reason);
+static int
+    s_set_reuseport (int handle);
+static void
+    s_set_bufsize (int handle, int sndbuf, int rcvbuf);
+static int
+    s_binding_bufsize (char *key, void *item, void *argument);
+static void
+    s_handle_poll (int handle, vocket_t *vocket);
+static int
+    s_binding_poll (char *key, void *item, void *argument);
+
+//  Routing layer shared by all drivers, works on the objects above
+#include "vtx_route.c"
 
 //  ---------------------------------------------------------------------
-//  Main driver thread is minimal, all work is done by reactor
+//  Main driver thread is minimal, all work is done by reactor. If the
+//  caller passes a reactor, the driver is embedded: it adds itself to
+//  that reactor and returns at once.
 
 void vtx_udp_driver (void *args, zctx_t *ctx, void *pipe)
 {
     //  Create driver instance
-    driver_t *driver = driver_new (ctx, pipe);
+    driver_t *driver = driver_new (ctx, pipe, (vtx_loop_t *) args);
     driver->verbose = atoi (zstr_recv (pipe));
-    zloop_set_verbose (driver->loop, driver->verbose);
+    if (driver->embedded)
+        return;                 //  Application runs the reactor
+
+    vtx_loop_set_verbose (driver->loop, driver->verbose);
     //  Run reactor until we exit from failure or interrupt
-    zloop_start (driver->loop);
+    vtx_loop_start (driver->loop);
     //  Destroy driver instance
     driver_destroy (&driver);
 }
@@ -290,18 +438,23 @@ int vtx_udp_load (vtx_t *vtx, Bool verbose)
 //  Constructor and destructor for driver
 
 static driver_t *
-driver_new (zctx_t *ctx, void *pipe)
+driver_new (zctx_t *ctx, void *pipe, vtx_loop_t *loop)
 {
     driver_t *self = (driver_t *) zmalloc (sizeof (driver_t));
     self->ctx = ctx;
     self->pipe = pipe;
     self->vockets = zlist_new ();
-    self->loop = zloop_new ();
+    self->vocket_hash = zhash_new ();
+    self->loop = loop? loop: vtx_loop_new ();
+    self->embedded = (loop != NULL);
+    self->arena = vtx_arena_new ();
     self->scheme = VTX_UDP_SCHEME;
 
     //  Reactor starts by monitoring the driver control pipe
     zmq_pollitem_t item = { self->pipe, 0, ZMQ_POLLIN };
-    zloop_poller (self->loop, &item, s_driver_control, self);
+    vtx_loop_poller (self->loop, &item, s_driver_control, self);
+    //  One timer monitors all peerings, rather than one timer each
+    vtx_loop_timer (self->loop, VTX_UDP_SWEEP_IVL, 0, s_driver_sweep, self);
     return self;
 }
 
@@ -318,7 +471,22 @@ driver_destroy (driver_t **self_p)
             vocket_destroy (&vocket);
         }
         zlist_destroy (&self->vockets);
-        zloop_destroy (&self->loop);
+        zhash_destroy (&self->vocket_hash);
+        if (self->embedded) {
+            //  Take our pollers and timers off the application's reactor
+            zmq_pollitem_t item = { self->pipe, 0, ZMQ_POLLIN };
+            vtx_loop_poller_end (self->loop, &item);
+            vtx_loop_timer_end (self->loop, self);
+            zsocket_destroy (self->ctx, self->pipe);
+        }
+        else
+            vtx_loop_destroy (&self->loop);
+        vtx_arena_destroy (&self->arena);
+        free (self->slot_peering);
+        free (self->slot_due);
+        free (self->slot_resend);
+        free (self->slot_expiry);
+        free (self->slot_silent);
         free (self);
         *self_p = NULL;
     }
@@ -331,14 +499,18 @@ static vocket_t *
 vocket_new (driver_t *driver, int socktype, char *vtxname)
 {
     assert (driver);
-    vocket_t *self = (vocket_t *) zmalloc (sizeof (vocket_t));
+    vocket_t *self = (vocket_t *) vtx_arena_alloc (driver->arena, sizeof (vocket_t));
 
     self->driver = driver;
-    self->vtxname = strdup (vtxname);
+    self->vtxname = vtx_arena_strdup (driver->arena, vtxname);
     self->binding_hash = zhash_new ();
     self->peering_hash = zhash_new ();
     self->peering_list = zlist_new ();
     self->live_peerings = zlist_new ();
+    self->inbacklog = zlist_new ();
+    self->subscriptions = zlist_new ();
+    self->subscribers = zlist_new ();
+    self->requests = zlist_new ();
     self->socktype = socktype;
 
     uint index;
@@ -351,6 +523,9 @@ vocket_new (driver_t *driver, int socktype, char *vtxname)
         self->nomnom = s_vocket_config [index].nomnom;
         self->min_peerings = s_vocket_config [index].min_peerings;
         self->max_peerings = s_vocket_config [index].max_peerings;
+        self->route = vtx_route_find (self->routing);
+        if (self->routing == VTX_ROUTING_PUBLISH)
+            self->matcher = vtx_match_new (VTX_MATCH_PREFIX);
     }
     else {
         zclock_log ("E: invalid vocket type %d", socktype);
@@ -362,16 +537,18 @@ vocket_new (driver_t *driver, int socktype, char *vtxname)
     zsocket_connect (self->msgpipe, "inproc://%s", vtxname);
 
     //  If we drop on no peerings, start routing input now
-    if (self->min_peerings == 0) {
-        //  Ask reactor to start monitoring vocket's msgpipe pipe
-        zmq_pollitem_t item = { self->msgpipe, 0, ZMQ_POLLIN, 0 };
-        zloop_poller (driver->loop, &item, s_vocket_input, self);
-    }
+    if (self->min_peerings == 0)
+        vocket_poll_input (self, TRUE);
     //  Store this vocket per driver so that driver can cleanly destroy
     //  all its vockets when it is destroyed.
     zlist_push (driver->vockets, self);
+    zhash_insert (driver->vocket_hash, vtxname, self);
 
     //* Start transport-specific work
+    self->msgmax = VTX_UDP_MSGMAX;
+    self->timeout = VTX_UDP_TIMEOUT;
+    self->resend_ivl = VTX_UDP_RESEND_IVL;
+
     //  Create UDP socket handle, used for outbound connections
     self->handle = socket (AF_INET, SOCK_DGRAM, IPPROTO_UDP);
     if (self->handle == -1)
@@ -385,7 +562,7 @@ vocket_new (driver_t *driver, int socktype, char *vtxname)
 
     //  Catch input on handle
     zmq_pollitem_t item = { NULL, self->handle, ZMQ_POLLIN, 0 };
-    zloop_poller (driver->loop, &item, s_binding_input, self);
+    vtx_loop_poller (driver->loop, &item, s_binding_input, self);
     //* End transport-specific work
 
     return self;
@@ -403,19 +580,42 @@ vocket_destroy (vocket_t **self_p)
         s_close_handle (self->handle, driver);
         //* End transport-specific work
 
-        //  Close message msgpipe socket
+        //  Stop reading the msgpipe and rings, whichever peerings are
+        //  up, since the caller frees the rings once we've closed
+        vocket_poll_input (self, FALSE);
+
+        //  Close message msgpipe socket; the rings belong to the caller
         zsocket_destroy (driver->ctx, self->msgpipe);
+        while (self->inbatch_size)
+            zmsg_destroy (&self->inbatch [--self->inbatch_size]);
+        while (zlist_size (self->inbacklog)) {
+            zmsg_t *msg = (zmsg_t *) zlist_pop (self->inbacklog);
+            zmsg_destroy (&msg);
+        }
+        zlist_destroy (&self->inbacklog);
+        if (self->backlogged)
+            vtx_loop_timer_end (driver->loop, self);
 
         //  Destroy all bindings for this vocket
         zhash_destroy (&self->binding_hash);
 
         //  Destroy all peerings for this vocket
         zhash_destroy (&self->peering_hash);
+        if (self->routes)
+            vtx_arena_free (self->driver->arena, self->routes);
         zlist_destroy (&self->peering_list);
         zlist_destroy (&self->live_peerings);
-
-        //  Remove vocket from driver list of vockets
+        vtx_hashring_destroy (&self->hashring);
+        while (zlist_size (self->subscriptions))
+            vtx_arena_free (self->driver->arena, zlist_pop (self->subscriptions));
+        zlist_destroy (&self->subscriptions);
+        zlist_destroy (&self->subscribers);
+        vtx_match_destroy (&self->matcher);
+        zlist_destroy (&self->requests);
+
+        //  Remove vocket from driver list and index of vockets
         zlist_remove (driver->vockets, self);
+        zhash_delete (driver->vocket_hash, self->vtxname);
 
 #ifdef VOCKET_STATS
         char *type_name [] = {
@@ -429,12 +629,376 @@ vocket_destroy (vocket_t **self_p)
             self->outpiped, self->inpiped,
             self->dropped);
 #endif
-        free (self->vtxname);
-        free (self);
+        vtx_arena_free (self->driver->arena, self->vtxname);
+        vtx_arena_free (self->driver->arena, self);
         *self_p = NULL;
     }
 }
 
+//  Set vocket option, returns 0 if OK, -1 if the option or value is not
+//  valid for this vocket
+
+static int
+vocket_setopt (vocket_t *self, int option, int value)
+{
+    int rc = 0;
+    if (option == VTX_OPT_ROUTING) {
+        //  Only distributing vockets can switch to or from hash routing
+        if (value == VTX_ROUTING_HASH
+        &&  self->routing == VTX_ROUTING_DEALER) {
+            self->routing = VTX_ROUTING_HASH;
+            self->hashring = vtx_hashring_new (VTX_HASH_REPLICAS);
+            peering_t *peering = (peering_t *) zlist_first (self->live_peerings);
+            while (peering) {
+                vtx_hashring_insert (self->hashring, peering->address, peering);
+                peering = (peering_t *) zlist_next (self->live_peerings);
+            }
+        }
+        else
+        if (value == VTX_ROUTING_DEALER
+        &&  self->routing == VTX_ROUTING_HASH) {
+            self->routing = VTX_ROUTING_DEALER;
+            vtx_hashring_destroy (&self->hashring);
+        }
+        else
+        if (value != self->routing)
+            rc = -1;
+        self->route = vtx_route_find (self->routing);
+    }
+    else
+    if (option == VTX_OPT_HASHKEY) {
+        if (value >= 0 && value < VTX_HASH_MAXKEY)
+            self->hashkey = value;
+        else
+            rc = -1;
+    }
+    else
+    if (option == VTX_OPT_MATCHING) {
+        //  Move all subscriptions we have to a matcher of the new type
+        vtx_match_t *matcher = NULL;
+        if (self->matcher)
+            matcher = vtx_match_new (value);
+        if (matcher) {
+            peering_t *peering = (peering_t *) zlist_first (self->peering_list);
+            while (peering) {
+                zframe_t *topic = (zframe_t *) zlist_first (peering->subscriptions);
+                while (topic) {
+                    vtx_match_insert (matcher,
+                        zframe_data (topic), zframe_size (topic), peering);
+                    topic = (zframe_t *) zlist_next (peering->subscriptions);
+                }
+                peering = (peering_t *) zlist_next (self->peering_list);
+            }
+            vtx_match_destroy (&self->matcher);
+            self->matcher = matcher;
+        }
+        else
+            rc = -1;
+    }
+    else
+    if (option == VTX_OPT_FRAMING) {
+        //  Applies to peerings that come up after this
+        if (value == VTX_FRAMING_ZMTP || value == VTX_FRAMING_NOM2)
+            self->framing = value;
+        else
+            rc = -1;
+    }
+    else
+    if (option == VTX_OPT_METADATA) {
+        if (value == 0 || value == 1)
+            self->metadata = value;
+        else
+            rc = -1;
+    }
+    else
+    if (option == VTX_OPT_REUSEPORT) {
+        //  Applies to bindings we make after this
+#if defined (SO_REUSEPORT)
+        if (value >= 0 && value <= VTX_MAX_SHARDS)
+            self->shards = value;
+        else
+#endif
+            rc = -1;
+    }
+    else
+    if (option == VTX_OPT_STEERING) {
+        //  NOM-1 peering state lives in one shard, so a peer's datagrams
+        //  must all go to that shard, which only the flow hash does
+        if (value == VTX_STEER_HASH)
+            self->steering = value;
+        else
+            rc = -1;
+    }
+    else
+    if (option == VTX_OPT_MSGMAX) {
+        //  Peers still accept datagrams up to VTX_UDP_MSGMAX
+        if (value > VTX_UDP_HEADER && value <= VTX_UDP_MSGMAX)
+            self->msgmax = value;
+        else
+            rc = -1;
+    }
+    else
+    if (option == VTX_OPT_TIMEOUT) {
+        if (value > 0)
+            self->timeout = value;
+        else
+            rc = -1;
+    }
+    else
+    if (option == VTX_OPT_RESEND_IVL) {
+        if (value > 0)
+            self->resend_ivl = value;
+        else
+            rc = -1;
+    }
+    else
+    if (option == VTX_OPT_SNDBUF
+    ||  option == VTX_OPT_RCVBUF) {
+        //  Applies to handles we have now, and bindings we make after
+        if (value >= 0) {
+            if (option == VTX_OPT_SNDBUF)
+                self->sndbuf = value;
+            else
+                self->rcvbuf = value;
+            s_set_bufsize (self->handle, self->sndbuf, self->rcvbuf);
+            zhash_foreach (self->binding_hash, s_binding_bufsize, self);
+        }
+        else
+            rc = -1;
+    }
+    else
+        rc = -1;
+
+    return rc;
+}
+
+//  ---------------------------------------------------------------------
+//  Get vocket option, returns 0 if OK, -1 if the option isn't known
+
+static int
+vocket_getopt (vocket_t *self, int option, int *value_p)
+{
+    int rc = 0;
+    if (option == VTX_OPT_ROUTING)
+        *value_p = self->routing;
+    else
+    if (option == VTX_OPT_HASHKEY)
+        *value_p = self->hashkey;
+    else
+    if (option == VTX_OPT_MATCHING && self->matcher)
+        *value_p = self->matcher->engine->type;
+    else
+    if (option == VTX_OPT_REUSEPORT)
+        *value_p = self->shards;
+    else
+    if (option == VTX_OPT_STEERING)
+        *value_p = self->steering;
+    else
+    if (option == VTX_OPT_FRAMING)
+        *value_p = self->framing;
+    else
+    if (option == VTX_OPT_METADATA)
+        *value_p = self->metadata;
+    else
+    if (option == VTX_OPT_MSGMAX)
+        *value_p = self->msgmax;
+    else
+    if (option == VTX_OPT_TIMEOUT)
+        *value_p = self->timeout;
+    else
+    if (option == VTX_OPT_RESEND_IVL)
+        *value_p = self->resend_ivl;
+    else
+    if (option == VTX_OPT_SNDBUF)
+        *value_p = self->sndbuf;
+    else
+    if (option == VTX_OPT_RCVBUF)
+        *value_p = self->rcvbuf;
+    else
+        rc = -1;
+
+    return rc;
+}
+
+//  Add or remove a SUB vocket subscription, and tell all live peerings.
+//  Returns 0 if OK, -1 if this is not a SUB vocket.
+
+static int
+vocket_subscribe (vocket_t *self, char *topic, Bool add)
+{
+    if (self->socktype != ZMQ_SUB)
+        return -1;
+
+    char *existing = (char *) zlist_first (self->subscriptions);
+    while (existing) {
+        if (streq (existing, topic))
+            break;
+        existing = (char *) zlist_next (self->subscriptions);
+    }
+    if (add && !existing)
+        zlist_append (self->subscriptions,
+            vtx_arena_strdup (self->driver->arena, topic));
+    else
+    if (!add && existing) {
+        zlist_remove (self->subscriptions, existing);
+        vtx_arena_free (self->driver->arena, existing);
+    }
+    else
+        return 0;               //  Nothing changed
+
+    peering_t *peering = (peering_t *) zlist_first (self->live_peerings);
+    while (peering) {
+        peering_icanhaz (peering, topic, add);
+        peering = (peering_t *) zlist_next (self->live_peerings);
+    }
+    return 0;
+}
+
+//  Pass oldest waiting request to the application, if it is not already
+//  working on one. A REP socket handles one request at a time, so we
+//  queue requests from all peerings here, and route each reply back to
+//  the peering that sent the request.
+
+static void
+vocket_dispatch (vocket_t *self)
+{
+    if (self->dispatched)
+        return;
+    peering_t *peering = (peering_t *) zlist_pop (self->requests);
+    if (peering) {
+        self->dispatched = TRUE;
+        self->reply_to = peering;
+        vocket_set_sender (self, peering->address);
+        vocket_deliver (self, &peering->pending);
+    }
+}
+
+//  Store host part of peer address as the "sender" meta; we cut at the
+//  port and truncate, since addresses can be longer than we hold
+
+static void
+vocket_set_sender (vocket_t *self, char *address)
+{
+    size_t size = strcspn (address, ":");
+    if (size >= sizeof (self->sender))
+        size = sizeof (self->sender) - 1;
+    memcpy (self->sender, address, size);
+    self->sender [size] = 0;
+}
+
+//  Pass message to application, on the ring if we have one, else on
+//  the msgpipe. Messages for the ring wait in a batch until the driver
+//  has handled its input, or the batch is full. If the ring is full,
+//  messages wait in the backlog.
+
+static void
+vocket_deliver (vocket_t *self, zmsg_t **msg_p)
+{
+    if (self->inring) {
+        if (self->inbatch_size < VTX_RING_BATCH
+        &&  zlist_size (self->inbacklog) == 0)
+            self->inbatch [self->inbatch_size++] = *msg_p;
+        else
+            zlist_append (self->inbacklog, *msg_p);
+        *msg_p = NULL;
+        if (self->inbatch_size == VTX_RING_BATCH && !self->backlogged)
+            vocket_flush (self);
+    }
+    else {
+        zmsg_send (msg_p, self->msgpipe);
+        self->inpiped++;
+    }
+}
+
+//  Put waiting messages onto ring, in one batch. The application only
+//  wakes up once for the batch. If the ring is full, we keep the rest
+//  and stop reading datagrams until the application catches up; the
+//  kernel buffers what it can, then drops.
+
+static void
+vocket_flush (vocket_t *self)
+{
+    Bool full = FALSE;
+    while (self->inbatch_size && !full) {
+        uint pushed = vtx_ring_push_batch (self->inring,
+                                           self->inbatch, self->inbatch_size);
+        self->inpiped += pushed;
+        full = pushed < self->inbatch_size;
+        self->inbatch_size -= pushed;
+        memmove (self->inbatch, self->inbatch + pushed,
+                 self->inbatch_size * sizeof (zmsg_t *));
+        while (self->inbatch_size < VTX_RING_BATCH
+        &&     zlist_size (self->inbacklog))
+            self->inbatch [self->inbatch_size++] =
+                (zmsg_t *) zlist_pop (self->inbacklog);
+    }
+    vocket_backlog (self, full);
+}
+
+//  Stop or restart input on the vocket and binding handles as the
+//  receive ring fills up or drains. The ring doesn't tell us when it
+//  has room, so while it's full we retry the flush on a timer.
+
+static void
+vocket_backlog (vocket_t *self, Bool backlogged)
+{
+    if (self->backlogged == backlogged)
+        return;
+    driver_t *driver = self->driver;
+    self->backlogged = backlogged;
+    if (backlogged)
+        vtx_loop_timer (driver->loop, VTX_UDP_RETRY_IVL, 0,
+                        s_vocket_retry, self);
+    else
+        vtx_loop_timer_end (driver->loop, self);
+    if (driver->verbose)
+        zclock_log ("I: (udp) receive ring %s", backlogged? "full": "free");
+
+    s_handle_poll (self->handle, self);
+    zhash_foreach (self->binding_hash, s_binding_poll, self);
+}
+
+//  Start or stop reading messages from the application, on the ring if
+//  we have one, else on the msgpipe
+
+static void
+vocket_poll_input (vocket_t *self, Bool active)
+{
+    zmq_pollitem_t item = { self->msgpipe, 0, ZMQ_POLLIN, 0 };
+    if (self->outring) {
+        item.socket = NULL;
+        item.fd = vtx_ring_handle (self->outring);
+    }
+    if (active)
+        vtx_loop_poller (self->driver->loop, &item,
+            self->outring? s_vocket_ring_input: s_vocket_input, self);
+    else
+        vtx_loop_poller_end (self->driver->loop, &item);
+
+    //  Each extra lane from a sending thread has its own poller
+    uint index;
+    for (index = 0; index < self->lane_count; index++) {
+        item.fd = vtx_ring_handle (self->lanes [index]);
+        if (active)
+            vtx_loop_poller (self->driver->loop, &item,
+                s_vocket_ring_input, self);
+        else
+            vtx_loop_poller_end (self->driver->loop, &item);
+    }
+}
+
+//  Return the ring, outring or extra lane, whose handle this is
+
+static vtx_ring_t *
+vocket_lane (vocket_t *self, int handle)
+{
+    uint index;
+    for (index = 0; index < self->lane_count; index++)
+        if (vtx_ring_handle (self->lanes [index]) == handle)
+            return self->lanes [index];
+    return self->outring;
+}
+
 //  ---------------------------------------------------------------------
 //  Constructor and destructor for binding
 //  Bindings are held per vocket, indexed by peer hostname:port
@@ -447,10 +1011,10 @@ binding_require (vocket_t *vocket, char *address)
 
     if (self == NULL) {
         //  Create new binding for this hostname:port address
-        self = (binding_t *) zmalloc (sizeof (binding_t));
+        self = (binding_t *) vtx_arena_alloc (vocket->driver->arena, sizeof (binding_t));
         self->vocket = vocket;
         self->driver = vocket->driver;
-        self->address = strdup (address);
+        self->address = vtx_arena_strdup (vocket->driver->arena, address);
 
         //  Split port number off address
         char *port = strchr (address, ':');
@@ -476,6 +1040,13 @@ binding_require (vocket_t *vocket, char *address)
             zclock_log ("E: bind failed: invalid address '%s'", address);
             self->exception = TRUE;
         }
+        if (!self->exception)
+            s_set_bufsize (self->handle, vocket->sndbuf, vocket->rcvbuf);
+        if (!self->exception && vocket->shards
+        &&  s_set_reuseport (self->handle)) {
+            zclock_log ("E: bind failed: can't share '%s'", strerror (errno));
+            self->exception = TRUE;
+        }
         if (!self->exception) {
             if (bind (self->handle,
                 (const struct sockaddr *) &addr, IN_ADDR_SIZE) == -1) {
@@ -483,15 +1054,15 @@ binding_require (vocket_t *vocket, char *address)
                 self->exception = TRUE;
             }
         }
-        if (!self->exception) {
-            //  Catch input on handle
+        if (!self->exception && !vocket->backlogged) {
+            //  Catch input on handle, unless the receive ring is full
             zmq_pollitem_t item = { NULL, self->handle, ZMQ_POLLIN, 0 };
-            zloop_poller (self->driver->loop, &item, s_binding_input, vocket);
+            vtx_loop_poller (self->driver->loop, &item, s_binding_input, vocket);
         }
         //* End transport-specific work
         if (self->exception) {
-            free (self->address);
-            free (self);
+            vtx_arena_free (self->driver->arena, self->address);
+            vtx_arena_free (self->driver->arena, self);
         }
         else {
             //  Store new binding in vocket containers
@@ -517,8 +1088,8 @@ binding_delete (void *argument)
     s_close_handle (self->handle, self->driver);
     //* End transport-specific work
 
-    free (self->address);
-    free (self);
+    vtx_arena_free (self->driver->arena, self->address);
+    vtx_arena_free (self->driver->arena, self);
 }
 
 //  ---------------------------------------------------------------------
@@ -533,11 +1104,13 @@ peering_require (vocket_t *vocket, char *address, Bool outgoing)
 
     if (self == NULL) {
         //  Create new peering for this hostname:port address
-        self = (peering_t *) zmalloc (sizeof (peering_t));
+        self = (peering_t *) vtx_arena_alloc (vocket->driver->arena, sizeof (peering_t));
         self->vocket = vocket;
         self->driver = vocket->driver;
-        self->address = strdup (address);
+        self->address = vtx_arena_strdup (vocket->driver->arena, address);
         self->outgoing = outgoing;
+        self->icanhaz = zlist_new ();
+        self->subscriptions = zlist_new ();
         if (self->driver->verbose)
             zclock_log ("I: (udp) create peering to %s", address);
 
@@ -553,17 +1126,18 @@ peering_require (vocket_t *vocket, char *address, Bool outgoing)
                 self->broadcast = TRUE;
                 self->bcast = self->addr;
             }
-            //  Start peering monitor (reactor timer)
-            s_peering_monitor (self->driver->loop, NULL, self);
-            //  Start resend timer for this peering
-            zloop_timer (self->driver->loop, VTX_UDP_RESEND_IVL,
-                         0, s_resend_timer, self);
+            //  Take slot in driver's sweep arrays, and start monitoring
+            peering_attach (self);
+            peering_monitor (self);
         }
         //* End transport-specific work
 
         if (self->exception) {
-            free (self->address);
-            free (self);
+            zlist_destroy (&self->icanhaz);
+            zlist_destroy (&self->subscriptions);
+            vtx_arena_free (self->driver->arena, self->address);
+            vtx_arena_free (self->driver->arena, self);
+            self = NULL;
         }
         else {
             //  Store new peering in vocket containers
@@ -603,33 +1177,157 @@ peering_delete (void *argument)
     //* Start transport-specific work
     zmsg_destroy (&self->request);
     zmsg_destroy (&self->reply);
+    zmsg_destroy (&self->pending);
+    zlist_remove (vocket->requests, self);
+    if (vocket->reply_to == self)
+        vocket->reply_to = NULL;
+    while (zlist_size (self->icanhaz)) {
+        zframe_t *frame = (zframe_t *) zlist_pop (self->icanhaz);
+        zframe_destroy (&frame);
+    }
+    zlist_destroy (&self->icanhaz);
+    peering_unsubscribe_all (self);
+    zlist_destroy (&self->subscriptions);
     //* End transport-specific work
 
+    peering_unroute (self);
     peering_lower (self);
     zlist_remove (vocket->peering_list, self);
-    zloop_timer_end (driver->loop, self);
-    free (self->address);
-    free (self);
+    peering_detach (self);
+    vtx_arena_free (self->driver->arena, self->address);
+    vtx_arena_free (self->driver->arena, self);
     vocket->peerings--;
 }
 
+//  Build identity frame that ROUTER delivers before each message from
+//  the peering, and take a route slot so replies can find the peering
+//  directly. Call again if the peering address changes. If all slots
+//  are taken, the identity carries no handle and routes by address.
+
+static void
+peering_route (peering_t *self)
+{
+    vocket_t *vocket = self->vocket;
+    if (!vocket->routes)
+        vocket->routes = (peering_t **) vtx_arena_alloc (self->driver->arena,
+            VTX_MAX_PEERINGS * sizeof (peering_t *));
+    if (!self->routed) {
+        for (self->route = 0; self->route < VTX_MAX_PEERINGS; self->route++)
+            if (vocket->routes [self->route] == NULL)
+                break;
+        if (self->route < VTX_MAX_PEERINGS) {
+            vocket->routes [self->route] = self;
+            self->route_tag = ++vocket->route_tag & 0xFFFF;
+        }
+    }
+    byte identity [256 + VTX_ROUTE_HANDLE];
+    size_t size = snprintf ((char *) identity, 256, "%s://%s",
+        self->driver->scheme, self->address);
+    if (size > 255)
+        size = 255;
+    if (self->route < VTX_MAX_PEERINGS) {
+        identity [size++] = 0;
+        identity [size++] = (byte) (self->route >> 8);
+        identity [size++] = (byte) (self->route);
+        identity [size++] = (byte) (self->route_tag >> 8);
+        identity [size++] = (byte) (self->route_tag);
+    }
+    zframe_destroy (&self->identity);
+    self->identity = zframe_new (identity, size);
+    self->routed = TRUE;
+}
+
+//  Give up route slot and identity frame
+
+static void
+peering_unroute (peering_t *self)
+{
+    if (self->routed) {
+        if (self->route < VTX_MAX_PEERINGS)
+            self->vocket->routes [self->route] = NULL;
+        zframe_destroy (&self->identity);
+        self->routed = FALSE;
+    }
+}
+
 //  Send frame data to peering as formatted command. If there was a
-//  network error, destroys the peering and returns -1.
+//  network error, destroys the peering and returns -1. We encode frames
+//  as zmsg_encode does, or with NOM-2 framing if the peer agreed to it,
+//  but straight into the driver's scratch buffer, so sending does no
+//  heap allocation.
 
 static int
 peering_send_msg (peering_t *self, zmsg_t *msg, int flags)
 {
     assert (self);
-    byte *data;
-    size_t size = zmsg_encode (msg, &data);
-    int rc = peering_send (self, VTX_UDP_NOM, data, size, flags);
+    byte *body = self->driver->scratch + VTX_UDP_HEADER;
+    size_t limit = self->vocket->msgmax - VTX_UDP_HEADER;
+    size_t size = 0;
+    if (self->nom2) {
+        size = vtx_codec_nom2_encode (msg, body, limit);
+        int rc = peering_send (self, VTX_UDP_NOM, body, size,
+                               flags | VTX_UDP_NOM2);
+        self->vocket->outgoing++;
+        return rc;
+    }
+    zframe_t *frame = zmsg_first (msg);
+    while (frame && size <= limit) {
+        size_t frame_size = zframe_size (frame);
+        size_t needed = frame_size + (frame_size < 255? 1: 5);
+        if (size + needed <= limit) {
+            byte *target = body + size;
+            if (frame_size < 255)
+                *target++ = (byte) frame_size;
+            else {
+                *target++ = 0xFF;
+                *target++ = (byte) ((frame_size >> 24) & 255);
+                *target++ = (byte) ((frame_size >> 16) & 255);
+                *target++ = (byte) ((frame_size >>  8) & 255);
+                *target++ = (byte) ((frame_size)       & 255);
+            }
+            memcpy (target, zframe_data (frame), frame_size);
+        }
+        size += needed;
+        frame = zmsg_next (msg);
+    }
+    //  If it didn't fit, peering_send reports it as over-long
+    int rc = peering_send (self, VTX_UDP_NOM, body, size, flags);
     self->vocket->outgoing++;
-    free (data);
     return rc;
 }
 
+//  Send message that the application routed to this peering, keeping it
+//  as request or reply if we may need to resend it. The peering takes the
+//  message if it keeps it.
+
+static void
+peering_send_routed (peering_t *self, zmsg_t **msg_p, uint retain)
+{
+    if (retain == VTX_RETAIN_REQUEST) {
+        if (self->request == NULL) {
+            self->sendseq++;
+            self->request = *msg_p;
+            *msg_p = NULL;          //  Peering now owns message
+            peering_send_msg (self, self->request, 0);
+        }
+        else
+            zclock_log ("E: illegal send() without recv() from REQ socket");
+    }
+    else
+    if (retain == VTX_RETAIN_REPLY) {
+        zmsg_destroy (&self->reply);
+        self->reply = *msg_p;
+        *msg_p = NULL;              //  Peering now owns message
+        self->sendseq = self->recvseq;
+        peering_send_msg (self, self->reply, 0);
+    }
+    else
+        peering_send_msg (self, *msg_p, 0);
+}
+
 //  Send a buffer of data to peering, prefixed by command header. If there
-//  was a network error, destroys the peering and returns -1.
+//  was a network error, destroys the peering and returns -1. The data may
+//  already be in the driver's scratch buffer, just after the header.
 
 static int
 peering_send (peering_t *self, int command, byte *data, size_t size, int flags)
@@ -644,18 +1342,18 @@ peering_send (peering_t *self, int command, byte *data, size_t size, int flags)
         free (address);
     }
     int rc = 0;
-    if ((size + VTX_UDP_HEADER) <= VTX_UDP_MSGMAX) {
-        byte buffer [size + VTX_UDP_HEADER];
+    if ((size + VTX_UDP_HEADER) <= self->vocket->msgmax) {
+        byte *buffer = driver->scratch;
         buffer [0] = (VTX_UDP_VERSION << 4) + (flags & 15);
         buffer [1] = (command << 4) + (self->sendseq & 15);
-        if (size)
-            memcpy (buffer + VTX_UDP_HEADER, data, size);
+        if (size && data != buffer + VTX_UDP_HEADER)
+            memmove (buffer + VTX_UDP_HEADER, data, size);
         rc = sendto (vocket->handle,
             buffer, size + VTX_UDP_HEADER, 0,
             (const struct sockaddr *) &self->addr, IN_ADDR_SIZE);
         if (rc > 0) {
             //  Calculate when we'd need to start sending HUGZ
-            self->silent = zclock_time () + VTX_UDP_TIMEOUT / 3;
+            PEERING_SILENT (self) = zclock_time () + self->vocket->timeout / 3;
             rc = 0;
         }
         else
@@ -669,6 +1367,116 @@ peering_send (peering_t *self, int command, byte *data, size_t size, int flags)
     return rc;
 }
 
+//  Take a slot in the driver's sweep arrays, growing them if needed
+
+static void
+peering_attach (peering_t *self)
+{
+    driver_t *driver = self->driver;
+    if (driver->slots == driver->slot_limit) {
+        uint limit = driver->slot_limit? driver->slot_limit * 2: 16;
+        driver->slot_peering = (peering_t **) realloc (driver->slot_peering,
+            limit * sizeof (peering_t *));
+        driver->slot_due = (int64_t *) realloc (driver->slot_due,
+            limit * sizeof (int64_t));
+        driver->slot_resend = (int64_t *) realloc (driver->slot_resend,
+            limit * sizeof (int64_t));
+        driver->slot_expiry = (int64_t *) realloc (driver->slot_expiry,
+            limit * sizeof (int64_t));
+        driver->slot_silent = (int64_t *) realloc (driver->slot_silent,
+            limit * sizeof (int64_t));
+        assert (driver->slot_peering && driver->slot_due && driver->slot_resend
+            &&  driver->slot_expiry  && driver->slot_silent);
+        driver->slot_limit = limit;
+    }
+    self->slot = driver->slots++;
+    driver->slot_peering [self->slot] = self;
+    driver->slot_due [self->slot] = 0;
+    driver->slot_resend [self->slot] = zclock_time () + self->vocket->resend_ivl;
+    driver->slot_expiry [self->slot] = 0;
+    driver->slot_silent [self->slot] = 0;
+}
+
+//  Give up our slot; the last slot moves down to fill the hole
+
+static void
+peering_detach (peering_t *self)
+{
+    driver_t *driver = self->driver;
+    assert (self->slot < driver->slots);
+    assert (driver->slot_peering [self->slot] == self);
+    uint last = --driver->slots;
+    if (self->slot != last) {
+        peering_t *moved = driver->slot_peering [last];
+        driver->slot_peering [self->slot] = moved;
+        driver->slot_due     [self->slot] = driver->slot_due     [last];
+        driver->slot_resend  [self->slot] = driver->slot_resend  [last];
+        driver->slot_expiry  [self->slot] = driver->slot_expiry  [last];
+        driver->slot_silent  [self->slot] = driver->slot_silent  [last];
+        moved->slot = self->slot;
+    }
+}
+
+//  Monitor peering for connectivity and send OHAIs and HUGZ as needed,
+//  then set the time the monitor is next due. Returns -1 if the peering
+//  was destroyed, else 0.
+
+static int
+peering_monitor (peering_t *self)
+{
+    vocket_t *vocket = self->vocket;
+    driver_t *driver = self->driver;
+    uint slot = self->slot;
+
+    int interval = VTX_UDP_OHAI_IVL;
+    if (self->alive) {
+        int64_t time_now = zclock_time ();
+        if (time_now > PEERING_EXPIRY (self)) {
+            peering_lower (self);
+            //  If this was a broadcast peering, reset it to BROADCAST
+            if (self->broadcast) {
+                char *address = s_sin_addr_to_str (&self->bcast);
+                if (driver->verbose)
+                    zclock_log ("I: (udp) unfocus peering from %s to %s",
+                        self->address, address);
+                int rc = zhash_rename (vocket->peering_hash, self->address, address);
+                assert (rc == 0);
+                vtx_arena_free (driver->arena, self->address);
+                self->addr = self->bcast;
+                self->address = vtx_arena_strdup (driver->arena, address);
+                if (self->routed)
+                    peering_route (self);
+                free (address);
+            }
+            else
+            if (!self->outgoing) {
+                peering_destroy (&self);
+                return -1;
+            }
+        }
+        else
+        if (time_now > PEERING_SILENT (self)) {
+            if (peering_send (self, VTX_UDP_HUGZ, NULL, 0, 0) == 0) {
+                interval = vocket->timeout / 3;
+                PEERING_SILENT (self) = zclock_time () + interval;
+            }
+        }
+    }
+    else
+    if (self->outgoing)
+        peering_send (self, VTX_UDP_OHAI,
+            (byte *) self->address, strlen (self->address),
+            vocket->framing == VTX_FRAMING_NOM2? VTX_UDP_NOM2: 0);
+
+    //  Sending can fail and destroy the peering, in which case another
+    //  peering (or none) now holds our slot
+    if (slot < driver->slots && driver->slot_peering [slot] == self) {
+        driver->slot_due [slot] = zclock_time () + interval;
+        return 0;
+    }
+    return -1;
+}
+
 //  Peering is now active
 
 static void
@@ -680,14 +1488,28 @@ peering_raise (peering_t *self)
         if (self->driver->verbose)
             zclock_log ("I: (udp) bring up peering to %s", self->address);
         self->alive = TRUE;
-        self->expiry = zclock_time () + VTX_UDP_TIMEOUT;
-        self->silent = zclock_time () + VTX_UDP_TIMEOUT / 3;
+        PEERING_EXPIRY (self) = zclock_time () + vocket->timeout;
+        PEERING_SILENT (self) = zclock_time () + vocket->timeout / 3;
         zlist_append (vocket->live_peerings, self);
-        if (zlist_size (vocket->live_peerings) == vocket->min_peerings) {
-            //  Ask reactor to start monitoring vocket's msgpipe pipe
-            zmq_pollitem_t item = { vocket->msgpipe, 0, ZMQ_POLLIN, 0 };
-            zloop_poller (driver->loop, &item, s_vocket_input, vocket);
+        if (vocket->hashring)
+            vtx_hashring_insert (vocket->hashring, self->address, self);
+
+        //  A SUB vocket tells the publisher all its subscriptions, from
+        //  scratch, each time the peering comes up
+        if (vocket->socktype == ZMQ_SUB) {
+            while (zlist_size (self->icanhaz)) {
+                zframe_t *frame = (zframe_t *) zlist_pop (self->icanhaz);
+                zframe_destroy (&frame);
+            }
+            self->sendseq = 0;
+            char *topic = (char *) zlist_first (vocket->subscriptions);
+            while (topic) {
+                peering_icanhaz (self, topic, TRUE);
+                topic = (char *) zlist_next (vocket->subscriptions);
+            }
         }
+        if (zlist_size (vocket->live_peerings) == vocket->min_peerings)
+            vocket_poll_input (vocket, TRUE);
     }
 }
 
@@ -703,91 +1525,276 @@ peering_lower (peering_t *self)
             zclock_log ("I: (udp) take down peering to %s", self->address);
         self->alive = FALSE;
         zlist_remove (vocket->live_peerings, self);
-        if (zlist_size (vocket->live_peerings) < vocket->min_peerings) {
-            //  Ask reactor to stop monitoring vocket's msgpipe pipe
-            zmq_pollitem_t item = { vocket->msgpipe, 0, ZMQ_POLLIN, 0 };
-            zloop_poller_end (driver->loop, &item);
-        }
+        zlist_remove (vocket->subscribers, self);
+        if (vocket->hashring)
+            vtx_hashring_delete (vocket->hashring, self);
+        if (zlist_size (vocket->live_peerings) < vocket->min_peerings)
+            vocket_poll_input (vocket, FALSE);
+    }
+}
+
+//  Queue subscription command for publisher, send it if it's the only
+//  one; we send one at a time and wait for each to be confirmed.
+
+static void
+peering_icanhaz (peering_t *self, char *topic, Bool add)
+{
+    size_t size = strlen (topic);
+    byte body [size + 1];
+    body [0] = add? 1: 0;
+    memcpy (body + 1, topic, size);
+    zlist_append (self->icanhaz, zframe_new (body, size + 1));
+    if (zlist_size (self->icanhaz) == 1) {
+        self->sendseq++;
+        peering_send_icanhaz (self);
+    }
+}
+
+//  Send oldest unconfirmed subscription command, if any
+
+static void
+peering_send_icanhaz (peering_t *self)
+{
+    zframe_t *frame = (zframe_t *) zlist_first (self->icanhaz);
+    if (frame)
+        peering_send (self, VTX_UDP_ICANHAZ,
+            zframe_data (frame), zframe_size (frame), 0);
+}
+
+//  Add or remove a topic that a subscriber peering wants to receive
+
+static void
+peering_subscribe (peering_t *self, byte *topic, size_t size, Bool add)
+{
+    zframe_t *existing = (zframe_t *) zlist_first (self->subscriptions);
+    while (existing) {
+        if (zframe_size (existing) == size
+        &&  memcmp (zframe_data (existing), topic, size) == 0)
+            break;
+        existing = (zframe_t *) zlist_next (self->subscriptions);
+    }
+    if (add && !existing) {
+        zlist_append (self->subscriptions, zframe_new (topic, size));
+        vtx_match_insert (self->vocket->matcher, topic, size, self);
+    }
+    else
+    if (!add && existing) {
+        zlist_remove (self->subscriptions, existing);
+        zframe_destroy (&existing);
+        vtx_match_delete (self->vocket->matcher, topic, size, self);
+    }
+}
+
+//  Remove all subscriptions for a subscriber peering
+
+static void
+peering_unsubscribe_all (peering_t *self)
+{
+    while (zlist_size (self->subscriptions)) {
+        zframe_t *frame = (zframe_t *) zlist_pop (self->subscriptions);
+        vtx_match_delete (self->vocket->matcher,
+            zframe_data (frame), zframe_size (frame), self);
+        zframe_destroy (&frame);
     }
 }
 
 //  ---------------------------------------------------------------------
 //  Reactor handlers
 
-//  Handle bind/connect from caller:
-//
-//  [command]   BIND, CONNECT, GETMETA, CLOSE, SHUTDOWN
-//  [socktype]  0MQ socket type as ASCII number
-//  [vtxname]   VTX name for the 0MQ socket
-//  [address]   External address to bind/connect to, or meta name
+//  Handle command from caller; see vtx.h for the format of requests and
+//  replies. Commands that take addresses apply each address in turn, and
+//  reply with the number that failed.
 
 static int
-s_driver_control (zloop_t *loop, zmq_pollitem_t *item, void *arg)
+s_driver_control (vtx_loop_t *loop, zmq_pollitem_t *item, void *arg)
 {
     int rc = 0;
-    char *reply = "0";
+    int status = 0;
+    char *value = NULL;         //  Value reply, for GETMETA and GETOPT
+    char optval [32];           //  Formatted option value
     driver_t *driver = (driver_t *) arg;
     zmsg_t *request = zmsg_recv (item->socket);
+    if (!request)
+        return -1;              //  Interrupted
 
-    char *command  = zmsg_popstr (request);
-    char *socktype = zmsg_popstr (request);
-    char *vtxname  = zmsg_popstr (request);
-    char *address  = zmsg_popstr (request);
-    zmsg_destroy (&request);
+    zframe_t *header = zmsg_pop (request);
+    assert (header && zframe_size (header) == VTX_CMD_HEADER);
+    byte *data = zframe_data (header);
+    int command = data [0];
+    char *vtxname = zmsg_popstr (request);
 
     //  Lookup vocket with this vtxname, create if necessary
     vocket_t *vocket = NULL;
     if (vtxname) {
-        vocket = (vocket_t *) zlist_first (driver->vockets);
-        while (vocket) {
-            if (streq (vocket->vtxname, vtxname))
-                break;
-            vocket = (vocket_t *) zlist_next (driver->vockets);
-        }
+        vocket = (vocket_t *) zhash_lookup (driver->vocket_hash, vtxname);
         if (!vocket)
-            vocket = vocket_new (driver, atoi (socktype), vtxname);
+            vocket = vocket_new (driver, data [1], vtxname);
     }
     //  Multiple binds or connects to same address are idempotent
-    if (streq (command, "BIND")) {
+    char *address;
+    if (command == VTX_CMD_BIND) {
+        assert (vocket);
+        while ((address = zmsg_popstr (request))) {
+            if (!binding_require (vocket, address))
+                status++;
+            free (address);
+        }
+    }
+    else
+    if (command == VTX_CMD_CONNECT) {
+        assert (vocket);
+        while ((address = zmsg_popstr (request))) {
+            if (vocket->peerings < vocket->max_peerings)
+                peering_require (vocket, address, TRUE);
+            else {
+                zclock_log ("E: connect failed: too many peerings");
+                status++;
+            }
+            free (address);
+        }
+    }
+    else
+    if (command == VTX_CMD_SETOPT) {
+        assert (vocket);
+        zframe_t *frame = zmsg_pop (request);
+        assert (frame && zframe_size (frame) == 8);
+        byte *setting = zframe_data (frame);
+        int option = (setting [0] << 24) + (setting [1] << 16)
+                   + (setting [2] << 8)  +  setting [3];
+        int value  = (setting [4] << 24) + (setting [5] << 16)
+                   + (setting [6] << 8)  +  setting [7];
+        if (vocket_setopt (vocket, option, value)) {
+            zclock_log ("E: setopt failed: invalid option '%d=%d'",
+                option, value);
+            status = 1;
+        }
+        zframe_destroy (&frame);
+    }
+    else
+    if (command == VTX_CMD_GETOPT) {
         assert (vocket);
-        if (!binding_require (vocket, address))
-            reply = "1";
+        zframe_t *frame = zmsg_pop (request);
+        assert (frame && zframe_size (frame) == 4);
+        byte *setting = zframe_data (frame);
+        int option = (setting [0] << 24) + (setting [1] << 16)
+                   + (setting [2] << 8)  +  setting [3];
+        int number;
+        if (vocket_getopt (vocket, option, &number) == 0) {
+            snprintf (optval, sizeof (optval), "%d", number);
+            value = optval;
+        }
+        else {
+            value = "Unknown option";
+            status = 1;
+        }
+        zframe_destroy (&frame);
     }
     else
-    if (streq (command, "CONNECT")) {
+    if (command == VTX_CMD_RINGS) {
+        //  Application passes messages on rings instead of msgpipe
         assert (vocket);
-        if (vocket->peerings < vocket->max_peerings)
-            peering_require (vocket, address, TRUE);
+        zframe_t *frame = zmsg_pop (request);
+        assert (frame && zframe_size (frame) == 2 * sizeof (vtx_ring_t *));
+        if (vocket->outring) {
+            zclock_log ("E: rings failed: vocket already has rings");
+            status = 1;
+        }
         else {
-            zclock_log ("E: connect failed: too many peerings");
-            reply = "1";
+            Bool active = zlist_size (vocket->live_peerings)
+                       >= vocket->min_peerings;
+            if (active)
+                vocket_poll_input (vocket, FALSE);
+            vtx_ring_t *rings [2];
+            memcpy (rings, zframe_data (frame), sizeof (rings));
+            vocket->outring = rings [0];
+            vocket->inring = rings [1];
+            if (active)
+                vocket_poll_input (vocket, TRUE);
         }
+        zframe_destroy (&frame);
     }
     else
-    if (streq (command, "GETMETA")) {
+    if (command == VTX_CMD_LANE) {
+        //  Application has another thread sending on its own ring
         assert (vocket);
-        if (streq (address, "sender"))
-            reply = vocket->sender;
-        else
-            reply = "Unknown name";
+        zframe_t *frame = zmsg_pop (request);
+        assert (frame && zframe_size (frame) == sizeof (vtx_ring_t *));
+        if (!vocket->outring || vocket->lane_count == VTX_MAX_LANES) {
+            zclock_log ("E: lane failed: no rings, or too many lanes");
+            status = 1;
+        }
+        else {
+            Bool active = zlist_size (vocket->live_peerings)
+                       >= vocket->min_peerings;
+            if (active)
+                vocket_poll_input (vocket, FALSE);
+            memcpy (&vocket->lanes [vocket->lane_count++],
+                    zframe_data (frame), sizeof (vtx_ring_t *));
+            if (active)
+                vocket_poll_input (vocket, TRUE);
+        }
+        zframe_destroy (&frame);
+    }
+    else
+    if (command == VTX_CMD_SUBSCRIBE
+    ||  command == VTX_CMD_UNSUBSCRIBE) {
+        assert (vocket);
+        char *topic = zmsg_popstr (request);
+        assert (topic);
+        if (vocket_subscribe (vocket, topic, command == VTX_CMD_SUBSCRIBE)) {
+            zclock_log ("E: subscribe failed: not a SUB socket");
+            status = 1;
+        }
+        free (topic);
     }
     else
-    if (streq (command, "CLOSE")) {
+    if (command == VTX_CMD_GETMETA) {
+        assert (vocket);
+        char *name = zmsg_popstr (request);
+        assert (name);
+        if (streq (name, "sender"))
+            value = vocket->sender;
+        else {
+            value = "Unknown name";
+            status = 1;
+        }
+        free (name);
+    }
+    else
+    if (command == VTX_CMD_CLOSE) {
         assert (vocket);
         vocket_destroy (&vocket);
     }
     else
-    if (streq (command, "SHUTDOWN"))
+    if (command == VTX_CMD_SHUTDOWN)
         rc = -1;                //  Shutdown driver
     else {
-        zclock_log ("E: invalid command: %s", command);
-        reply = "1";
+        zclock_log ("E: invalid command: %d", command);
+        status = 1;
     }
-    zstr_sendf (item->socket, reply);
-    free (command);
-    free (socktype);
+    //  Reply with the caller's token and our status
+    byte reply [VTX_CMD_REPLY];
+    memcpy (reply, data + 4, 4);
+    reply [4] = (byte) (status >> 24);
+    reply [5] = (byte) (status >> 16);
+    reply [6] = (byte) (status >> 8);
+    reply [7] = (byte) (status);
+    zmsg_t *msg = zmsg_new ();
+    zmsg_addmem (msg, reply, VTX_CMD_REPLY);
+    if (value)
+        zmsg_addstr (msg, "%s", value);
+    zmsg_send (&msg, item->socket);
+
+    zframe_destroy (&header);
+    zmsg_destroy (&request);
     free (vtxname);
-    free (address);
+
+    //  An embedded driver can't stop the reactor, which isn't ours, so
+    //  it destroys itself once it has replied
+    if (rc == -1 && command == VTX_CMD_SHUTDOWN && driver->embedded) {
+        driver_destroy (&driver);
+        rc = 0;
+    }
     return rc;
 }
 
@@ -795,136 +1802,157 @@ s_driver_control (zloop_t *loop, zmq_pollitem_t *item, void *arg)
 //  Input message on data pipe from application 0MQ socket
 
 static int
-s_vocket_input (zloop_t *loop, zmq_pollitem_t *item, void *arg)
+s_vocket_input (vtx_loop_t *loop, zmq_pollitem_t *item, void *arg)
 {
     vocket_t *vocket = (vocket_t *) arg;
-    driver_t *driver = vocket->driver;
 
     //  It's remotely possible we just lost a peering, in which case
     //  don't take the message off the pipe, leave it for next time
     if (zlist_size (vocket->live_peerings) < vocket->min_peerings)
         return 0;
 
-    //  Pull message frames off socket
+    //  Pull message frames off socket, and then any other messages that
+    //  are waiting, up to one batch
     assert (item->socket == vocket->msgpipe);
+    int count = 0;
     zmsg_t *msg = zmsg_recv (vocket->msgpipe);
-    if (!msg)
-        return 0;               //  Interrupted
-    vocket->outpiped++;
-
-    //  Route message to active peerings as appropriate
-    if (vocket->routing == VTX_ROUTING_NONE)
-        zclock_log ("W: send() not allowed - dropping");
-    else
-    if (vocket->routing == VTX_ROUTING_REQUEST) {
-        //  Find next live peering if any
-        //  TODO: make this code generic to all drivers
-        peering_t *peering = (peering_t *) zlist_pop (vocket->live_peerings);
-        assert (peering);
-        if (peering->request == NULL) {
-            peering->sendseq++;
-            peering->request = msg;
-            peering_send_msg (peering, peering->request, 0);
-            msg = NULL;         //  Peering now owns message
-        }
-        else
-            zclock_log ("E: illegal send() without recv() from REQ socket");
-        zlist_append (vocket->live_peerings, peering);
+    while (msg) {
+        s_vocket_route (vocket, msg);
+        msg = NULL;
+        if (++count < VTX_RING_BATCH
+        &&  zlist_size (vocket->live_peerings) >= vocket->min_peerings
+        &&  (zsockopt_events (vocket->msgpipe) & ZMQ_POLLIN))
+            msg = zmsg_recv (vocket->msgpipe);
     }
-    else
-    if (vocket->routing == VTX_ROUTING_REPLY) {
-        //  TODO: make this code generic to all drivers
-        peering_t *peering = vocket->reply_to;
-        if (peering) {
-            zmsg_destroy (&peering->reply);
-            peering->reply = msg;
-            msg = NULL;         //  Peering now owns message
-            peering->sendseq = peering->recvseq;
-            peering_send_msg (peering, peering->reply, 0);
-            vocket->reply_to = NULL;
-        }
-        else
-            zclock_log ("E: illegal send() without recv() on REP socket");
-    }
-    else
-    if (vocket->routing == VTX_ROUTING_DEALER) {
-        peering_t *peering = (peering_t *) zlist_pop (vocket->live_peerings);
-        peering->sendseq = peering->recvseq;
-        zmsg_destroy (&peering->reply);
-        peering->reply = msg;
-        msg = NULL;         //  Peering now owns message
-        peering_send_msg (peering, peering->reply, 0);
-        zlist_append (vocket->live_peerings, peering);
+    //  A reply may have let us pass the next request to the application
+    vocket_flush (vocket);
+    return 0;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Input messages on ring from application; we take all waiting messages,
+//  a batch at a time, as long as we have enough peerings to route them to.
+//  With many lanes, we take one batch per lane and let the reactor come
+//  back for more, so all sending threads get their turn.
+
+static int
+s_vocket_ring_input (vtx_loop_t *loop, zmq_pollitem_t *item, void *arg)
+{
+    vocket_t *vocket = (vocket_t *) arg;
+    vtx_ring_t *ring = vocket_lane (vocket, item->fd);
+    zmsg_t *batch [VTX_RING_BATCH];
+    uint size = 0;
+    while (zlist_size (vocket->live_peerings) >= vocket->min_peerings
+    &&    (size = vtx_ring_pop_batch (ring, batch, VTX_RING_BATCH))) {
+        uint index;
+        for (index = 0; index < size; index++)
+            s_vocket_route (vocket, batch [index]);
+        if (vocket->lane_count)
+            break;
     }
-    else
-    if (vocket->routing == VTX_ROUTING_ROUTER) {
-        //  First frame is address of peering
-        char *address = zmsg_popstr (msg);
-        //  Parse and check scheme
-        int scheme_size = strlen (driver->scheme);
-        if (memcmp (address, driver->scheme, scheme_size) == 0
-        &&  memcmp (address + scheme_size, "://", 3) == 0) {
-            peering_t *peering = (peering_t *)
-                zhash_lookup (vocket->peering_hash, address + scheme_size + 3);
-            if (peering && peering->alive) {
-                zmsg_destroy (&peering->reply);
-                peering->reply = msg;
-                msg = NULL;         //  Peering now owns message
-                peering->sendseq = peering->recvseq;
-                peering_send_msg (peering, peering->reply, 0);
-            }
-            else
-                zclock_log ("W: no route to '%s' - dropping", address);
-        }
-        else
-            zclock_log ("E: invalid address '%s' - dropping", address);
-        free (address);
+    //  A reply may have let us pass the next request to the application
+    vocket_flush (vocket);
+    return 0;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Route message from application to active peerings as appropriate, and
+//  destroy it if no peering took it
+
+static void
+s_vocket_route (vocket_t *vocket, zmsg_t *msg)
+{
+    vtx_route_t *route = vocket->route;
+    vocket->outpiped++;
+
+    //  Let the router pick on the key frame; if the message is too short
+    //  to have a key frame, the router picks on an empty key
+    uint key = vtx_route_key (route, vocket);
+    zframe_t *frame = zmsg_first (msg);
+    uint index;
+    for (index = 0; frame && index < key; index++)
+        frame = zmsg_next (msg);
+    peering_t *peering = route->pick (vocket,
+        frame? zframe_data (frame): NULL,
+        frame? zframe_size (frame): 0);
+
+    //  An envelope is for the router, not for the peering
+    if (route->envelope) {
+        frame = zmsg_pop (msg);
+        zframe_destroy (&frame);
     }
-    else
-    if (vocket->routing == VTX_ROUTING_PUBLISH) {
-        peering_t *peering = (peering_t *) zlist_first (vocket->live_peerings);
-        while (peering) {
+    if (route->fanout) {
+        while (zlist_size (vocket->subscribers)) {
+            peering = (peering_t *) zlist_pop (vocket->subscribers);
             peering_send_msg (peering, msg, 0);
-            peering = (peering_t *) zlist_next (vocket->live_peerings);
         }
     }
     else
-    if (vocket->routing == VTX_ROUTING_SINGLE) {
-        //  We expect a single live peering and we should not have read
-        //  a message otherwise...
-        peering_t *peering = (peering_t *) zlist_first (vocket->live_peerings);
-        peering_send_msg (peering, msg, 0);
-    }
-    else
-        zclock_log ("E: unknown routing mechanism - dropping");
+    if (peering && peering->alive)
+        peering_send_routed (peering, &msg, route->retain);
 
+    if (route->done)
+        route->done (vocket);
     zmsg_destroy (&msg);
-    return 0;
 }
 
 
 //  -------------------------------------------------------------------------
-//  Input message on binding handle
-//  This implements the receiver side of the UDP protocol-without-a-name
-//  I'd like to implement this as a neat little finite-state machine.
+//  Input on binding handle. We read all waiting datagrams, up to one
+//  batch, and pass the messages they carry to the application together.
 
 static int
-s_binding_input (zloop_t *loop, zmq_pollitem_t *item, void *arg)
+s_binding_input (vtx_loop_t *loop, zmq_pollitem_t *item, void *arg)
 {
     vocket_t *vocket = (vocket_t *) arg;
-    driver_t *driver = vocket->driver;
 
     //  Buffer can hold longest valid message plus terminating null in
     //  case it's a string and we want to make it printable.
     byte buffer [VTX_UDP_MSGMAX + 1];
-    struct sockaddr_in addr;
-    socklen_t addr_len = IN_ADDR_SIZE;
-    ssize_t size = recvfrom (item->fd, buffer, VTX_UDP_MSGMAX, 0,
-                            (struct sockaddr *) &addr, &addr_len);
-    if (size == -1) {
-        s_handle_io_error ("recvfrom");
-        return 0;
+    int count;
+    for (count = 0; count < VTX_RING_BATCH && !vocket->backlogged; count++) {
+        struct sockaddr_in addr;
+        socklen_t addr_len = IN_ADDR_SIZE;
+        ssize_t size = recvfrom (item->fd, buffer, VTX_UDP_MSGMAX,
+                                 count? MSG_DONTWAIT: 0,
+                                 (struct sockaddr *) &addr, &addr_len);
+        if (size == -1) {
+            if (count == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                s_handle_io_error ("recvfrom");
+            break;
+        }
+        s_binding_datagram (vocket, buffer, size, &addr);
     }
+    vocket_flush (vocket);
+    return 0;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Retry putting input onto a full receive ring
+
+static int
+s_vocket_retry (vtx_loop_t *loop, zmq_pollitem_t *item, void *arg)
+{
+    vocket_t *vocket = (vocket_t *) arg;
+    vocket_flush (vocket);
+    return 0;
+}
+
+
+//  -------------------------------------------------------------------------
+//  Handle one datagram on binding handle
+//  This implements the receiver side of the UDP protocol-without-a-name
+//  I'd like to implement this as a neat little finite-state machine.
+
+static void
+s_binding_datagram (vocket_t *vocket, byte *buffer, ssize_t size,
+                    struct sockaddr_in *addr)
+{
+    driver_t *driver = vocket->driver;
+
     //  Parse incoming protocol command
     int version = buffer [0] >> 4;
     int flags   = buffer [0] & 0xf;
@@ -937,20 +1965,20 @@ s_binding_input (zloop_t *loop, zmq_pollitem_t *item, void *arg)
 
     if (version != VTX_UDP_VERSION) {
         zclock_log ("W: garbage version '%d' - dropping", version);
-        return 0;
+        return;
     }
     if (command >= VTX_UDP_CMDLIMIT) {
         zclock_log ("W: garbage command '%d' - dropping", command);
-        return 0;
+        return;
     }
-    char *address = s_sin_addr_to_str (&addr);
+    char *address = s_sin_addr_to_str (addr);
     if (driver->verbose)
         zclock_log ("I: (udp) recv [%s:%x] - %zd bytes from %s",
             s_command_name [command], recvseq & 15, body_size, address);
     if (randof (5) == 9) {
         if (driver->verbose)
             zclock_log ("I: (udp) simulating UDP breakage - dropping");
-        return 0;
+        return;
     }
 
     //  First pass to try to resolve or create peering if needed
@@ -970,7 +1998,7 @@ s_binding_input (zloop_t *loop, zmq_pollitem_t *item, void *arg)
                     (byte *) reason, strlen (reason), 0);
                 peering_destroy (&peering);
                 free (address);
-                return 0;
+                return;
             }
         }
     }
@@ -978,18 +2006,25 @@ s_binding_input (zloop_t *loop, zmq_pollitem_t *item, void *arg)
     //  At this stage we need an active peering to continue
     if (peering)
         //  Any input at all from a peer counts as activity
-        peering->expiry = zclock_time () + VTX_UDP_TIMEOUT;
+        PEERING_EXPIRY (peering) = zclock_time () + vocket->timeout;
     else {
         if (driver->verbose)
             zclock_log ("W: %s from unknown peer %s - dropping",
                 s_command_name [command], address);
         free (address);
-        return 0;
+        return;
     }
 
     //  Now do command-specific work
     if (command == VTX_UDP_OHAI) {
-        if (peering_send (peering, VTX_UDP_OHAI_OK, body, body_size, 0) == 0)
+        //  Subscriber is (re)starting its peering, and will send us all
+        //  its subscriptions again, starting from sequence 1
+        peering_unsubscribe_all (peering);
+        peering->recvseq = 0;
+        //  Use NOM-2 framing if we both offer it
+        int offer = vocket->framing == VTX_FRAMING_NOM2? VTX_UDP_NOM2: 0;
+        peering->nom2 = (flags & offer) != 0;
+        if (peering_send (peering, VTX_UDP_OHAI_OK, body, body_size, offer) == 0)
             peering_raise (peering);
     }
     else
@@ -1000,10 +2035,14 @@ s_binding_input (zloop_t *loop, zmq_pollitem_t *item, void *arg)
                     (char *) body, address);
             int rc = zhash_rename (vocket->peering_hash, (char *) body, address);
             assert (rc == 0);
-            peering->addr = addr;
-            free (peering->address);
-            peering->address = strdup (address);
+            peering->addr = *addr;
+            vtx_arena_free (driver->arena, peering->address);
+            peering->address = vtx_arena_strdup (driver->arena, address);
+            if (peering->routed)
+                peering_route (peering);
         }
+        peering->nom2 = vocket->framing == VTX_FRAMING_NOM2
+                     && (flags & VTX_UDP_NOM2);
         peering_raise (peering);
     }
     else
@@ -1011,11 +2050,13 @@ s_binding_input (zloop_t *loop, zmq_pollitem_t *item, void *arg)
         peering_send (peering, VTX_UDP_HUGZ_OK, NULL, 0, 0);
     else
     if (command == VTX_UDP_NOM) {
-        zmsg_t *msg = zmsg_decode (body, body_size);
+        zmsg_t *msg = flags & VTX_UDP_NOM2?
+            vtx_codec_nom2_decode (body, body_size):
+            zmsg_decode (body, body_size);
         if (!msg) {
             zclock_log ("W: corrupt message from %s", address);
             free (address);
-            return 0;
+            return;
         }
         vocket->incoming++;
         if (vocket->routing == VTX_ROUTING_REQUEST) {
@@ -1032,25 +2073,36 @@ s_binding_input (zloop_t *loop, zmq_pollitem_t *item, void *arg)
         }
         else
         if (vocket->routing == VTX_ROUTING_REPLY) {
-            //  If we got a duplicate request, resend last reply
-            if (flags && VTX_UDP_RESEND
+            //  If we got a duplicate request, resend last reply if we
+            //  have it, else the request is still queued or in progress
+            if (flags & VTX_UDP_RESEND
             &&  recvseq == peering->recvseq) {
-                assert (peering->reply);
-                peering_send_msg (peering, peering->reply, 0);
+                if (peering->reply && peering->sendseq == recvseq)
+                    peering_send_msg (peering, peering->reply, 0);
                 zmsg_destroy (&msg);    //  Don't pass to application
                 vocket->dropped++;
             }
             else {
-                //  TODO: this won't work when multiple peers send
-                //  requests concurrently...
-                //  Track peering for eventual reply routing
-                vocket->reply_to = peering;
+                //  Queue request, and dispatch it when the application
+                //  is ready; requesters send one request at a time
+                if (peering->pending)
+                    zmsg_destroy (&peering->pending);
+                else
+                    zlist_append (vocket->requests, peering);
+                if (vocket->metadata) {
+                    byte meta [VTX_META_MAX];
+                    size_t meta_size = vtx_meta_encode (meta, address);
+                    zmsg_push (msg, zframe_new (meta, meta_size));
+                }
+                peering->pending = msg;
+                msg = NULL;             //  Peering now owns message
                 peering->recvseq = recvseq;
+                vocket_dispatch (vocket);
             }
         }
         else
         if (vocket->routing == VTX_ROUTING_ROUTER) {
-            if (flags && VTX_UDP_RESEND
+            if (flags & VTX_UDP_RESEND
             &&  recvseq == peering->recvseq) {
                 assert (peering->reply);
                 peering_send_msg (peering, peering->reply, 0);
@@ -1058,14 +2110,17 @@ s_binding_input (zloop_t *loop, zmq_pollitem_t *item, void *arg)
                 vocket->dropped++;
             }
             else {
-                //  Send schemed identity envelope
-                zmsg_pushstr (msg, "%s://%s", driver->scheme, address);
+                //  Send identity envelope, prebuilt for the peering
+                if (!peering->routed)
+                    peering_route (peering);
+                zmsg_push (msg, zframe_dup (peering->identity));
                 peering->recvseq = recvseq;
             }
         }
         else
-        if (vocket->routing == VTX_ROUTING_DEALER) {
-            if (flags && VTX_UDP_RESEND
+        if (vocket->routing == VTX_ROUTING_DEALER
+        ||  vocket->routing == VTX_ROUTING_HASH) {
+            if (flags & VTX_UDP_RESEND
             &&  recvseq == peering->recvseq) {
                 assert (peering->reply);
                 peering_send_msg (peering, peering->reply, 0);
@@ -1084,82 +2139,86 @@ s_binding_input (zloop_t *loop, zmq_pollitem_t *item, void *arg)
                     puts (address);
                 assert (colon);
                 *colon = 0;
-                strcpy (vocket->sender, address);
-                zmsg_send (&msg, vocket->msgpipe);
-                vocket->inpiped++;
+                vocket_set_sender (vocket, address);
+                if (vocket->metadata) {
+                    byte meta [VTX_META_MAX];
+                    size_t meta_size = vtx_meta_encode (meta, address);
+                    zmsg_push (msg, zframe_new (meta, meta_size));
+                }
+                vocket_deliver (vocket, &msg);
             }
         }
         else
             zclock_log ("W: unexpected NOM from %s - dropping", address);
     }
     else
-    if (command == VTX_UDP_ROTFL)
-        zclock_log ("W: got ROTFL: %s", body);
-
-    free (address);
-    return 0;
-}
-
-
-//  -------------------------------------------------------------------------
-//  Monitor peering for connectivity and send OHAIs and HUGZ as needed
-
-static int
-s_peering_monitor (zloop_t *loop, zmq_pollitem_t *item, void *arg)
-{
-    peering_t *peering = (peering_t *) arg;
-    vocket_t *vocket = peering->vocket;
-
-    int interval = VTX_UDP_OHAI_IVL;
-    if (peering->alive) {
-        int64_t time_now = zclock_time ();
-        if (time_now > peering->expiry) {
-            peering_lower (peering);
-            //  If this was a broadcast peering, reset it to BROADCAST
-            if (peering->broadcast) {
-                char *address = s_sin_addr_to_str (&peering->bcast);
-                if (vocket->driver->verbose)
-                    zclock_log ("I: (udp) unfocus peering from %s to %s",
-                        peering->address, address);
-                int rc = zhash_rename (vocket->peering_hash, peering->address, address);
-                assert (rc == 0);
-                free (peering->address);
-                peering->addr = peering->bcast;
-                peering->address = address;
-            }
-            else
-            if (!peering->outgoing) {
-                peering_destroy (&peering);
-                interval = 0;           //  Don't reset timer
+    if (command == VTX_UDP_ICANHAZ) {
+        if (vocket->routing == VTX_ROUTING_PUBLISH && body_size > 0) {
+            //  Apply each subscription command once, but confirm every
+            //  copy, since our ICANHAZ-OK may have been lost
+            if (recvseq != peering->recvseq) {
+                peering->recvseq = recvseq;
+                peering_subscribe (peering,
+                    body + 1, body_size - 1, body [0] == 1);
             }
+            peering->sendseq = recvseq;
+            peering_send (peering, VTX_UDP_ICANHAZ_OK, NULL, 0, 0);
         }
         else
-        if (time_now > peering->silent) {
-            if (peering_send (peering, VTX_UDP_HUGZ, NULL, 0, 0) == 0) {
-                interval = VTX_UDP_TIMEOUT / 3;
-                peering->silent = zclock_time () + interval;
+            zclock_log ("W: unexpected ICANHAZ from %s - dropping", address);
+    }
+    else
+    if (command == VTX_UDP_ICANHAZ_OK) {
+        //  Drop confirmed command and send the next one, if any
+        if (zlist_size (peering->icanhaz)
+        &&  recvseq == (peering->sendseq & 15)) {
+            zframe_t *frame = (zframe_t *) zlist_pop (peering->icanhaz);
+            zframe_destroy (&frame);
+            if (zlist_size (peering->icanhaz)) {
+                peering->sendseq++;
+                peering_send_icanhaz (peering);
             }
         }
     }
     else
-    if (peering->outgoing)
-        peering_send (peering, VTX_UDP_OHAI,
-            (byte *) peering->address, strlen (peering->address), 0);
+    if (command == VTX_UDP_ROTFL)
+        zclock_log ("W: got ROTFL: %s", body);
 
-    if (interval)
-        zloop_timer (loop, interval, 1, s_peering_monitor, peering);
-    return 0;
+    free (address);
 }
 
 
-//  Resend request NOM if peering is alive and no response received
+//  -------------------------------------------------------------------------
+//  Sweep all peerings, running the monitor and resending unconfirmed
+//  requests as each falls due. We walk the slot arrays in order; when a
+//  peering is destroyed its slot is refilled from the end, so we look at
+//  the same slot again.
 
 static int
-s_resend_timer (zloop_t *loop, zmq_pollitem_t *item, void *arg)
+s_driver_sweep (vtx_loop_t *loop, zmq_pollitem_t *item, void *arg)
 {
-    peering_t *peering = (peering_t *) arg;
-    if (peering->request && peering->alive)
-        peering_send_msg (peering, peering->request, VTX_UDP_RESEND);
+    driver_t *driver = (driver_t *) arg;
+    int64_t time_now = zclock_time ();
+    uint slot = 0;
+    while (slot < driver->slots) {
+        peering_t *peering = driver->slot_peering [slot];
+        if (driver->slot_resend [slot] <= time_now) {
+            driver->slot_resend [slot] = time_now + peering->vocket->resend_ivl;
+            //  Resend request NOM or subscription command if peering is
+            //  alive and no response received
+            if (peering->request && peering->alive)
+                peering_send_msg (peering, peering->request, VTX_UDP_RESEND);
+            if (slot < driver->slots && driver->slot_peering [slot] == peering
+            &&  zlist_size (peering->icanhaz) && peering->alive)
+                peering_send_icanhaz (peering);
+            if (slot >= driver->slots || driver->slot_peering [slot] != peering)
+                continue;       //  Peering was destroyed
+        }
+        if (driver->slot_due [slot] <= time_now
+        &&  peering_monitor (peering) == -1)
+            continue;           //  Peering was destroyed
+        slot++;
+    }
     return 0;
 }
 
@@ -1245,7 +2304,7 @@ s_close_handle (int handle, driver_t *driver)
 {
     if (handle > 0) {
         zmq_pollitem_t item = { 0, handle };
-        zloop_poller_end (driver->loop, &item);
+        vtx_loop_poller_end (driver->loop, &item);
         close (handle);
     }
 }
@@ -1291,3 +2350,66 @@ s_handle_io_error (char *reason)
         return -1;          //  Unexpected error, abandon
     }
 }
+
+
+//  Set kernel buffer sizes on handle; a size of zero leaves the system
+//  default. The kernel may round or cap the sizes we ask for.
+
+static void
+s_set_bufsize (int handle, int sndbuf, int rcvbuf)
+{
+    if (handle > 0 && sndbuf > 0)
+        setsockopt (handle, SOL_SOCKET, SO_SNDBUF,
+            (void *) &sndbuf, sizeof (sndbuf));
+    if (handle > 0 && rcvbuf > 0)
+        setsockopt (handle, SOL_SOCKET, SO_RCVBUF,
+            (void *) &rcvbuf, sizeof (rcvbuf));
+}
+
+//  Set vocket's kernel buffer sizes on existing binding
+
+static int
+s_binding_bufsize (char *key, void *item, void *argument)
+{
+    binding_t *binding = (binding_t *) item;
+    vocket_t *vocket = (vocket_t *) argument;
+    s_set_bufsize (binding->handle, vocket->sndbuf, vocket->rcvbuf);
+    return 0;
+}
+
+//  Start or stop reading from one of the vocket's handles, as the
+//  vocket's receive ring drains or fills up
+
+static void
+s_handle_poll (int handle, vocket_t *vocket)
+{
+    zmq_pollitem_t item = { NULL, handle, ZMQ_POLLIN, 0 };
+    if (vocket->backlogged)
+        vtx_loop_poller_end (vocket->driver->loop, &item);
+    else
+        vtx_loop_poller (vocket->driver->loop, &item, s_binding_input, vocket);
+}
+
+static int
+s_binding_poll (char *key, void *item, void *argument)
+{
+    binding_t *binding = (binding_t *) item;
+    s_handle_poll (binding->handle, (vocket_t *) argument);
+    return 0;
+}
+
+//  Let handle share its address with the handles of other shards, which
+//  each run in their own driver. Call before binding.
+
+static int
+s_set_reuseport (int handle)
+{
+#if defined (SO_REUSEPORT)
+    int reuse = 1;
+    return setsockopt (handle, SOL_SOCKET, SO_REUSEPORT,
+        (void *) &reuse, sizeof (reuse));
+#else
+    errno = ENOPROTOOPT;
+    return -1;
+#endif
+}
@@ -41,6 +41,10 @@
 //  Time between NOM request retry attempts
 //  Reduce to improve request-reply throughput
 #define VTX_UDP_RESEND_IVL      200    //  Msecs
+//  Time between sweeps over all peerings; timer granularity
+#define VTX_UDP_SWEEP_IVL       50      //  Msecs
+//  Interval to retry a full receive ring
+#define VTX_UDP_RETRY_IVL       1       //  Msecs
 
 //  ID and version number for our UDP protocol
 #define VTX_UDP_VERSION         0x01
@@ -52,10 +56,13 @@
 #define VTX_UDP_HUGZ            0x03
 #define VTX_UDP_HUGZ_OK         0x04
 #define VTX_UDP_NOM             0x05
-#define VTX_UDP_CMDLIMIT        0x06
+#define VTX_UDP_ICANHAZ         0x06
+#define VTX_UDP_ICANHAZ_OK      0x07
+#define VTX_UDP_CMDLIMIT        0x08
 
 //  ZDTP message flags
 #define VTX_UDP_RESEND          0x01
+#define VTX_UDP_NOM2            0x02    //  NOM-2 framing offered or used
 
 //  Size of VTX_UDP header in bytes
 #define VTX_UDP_HEADER          2